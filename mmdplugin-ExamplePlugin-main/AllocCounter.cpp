@@ -0,0 +1,59 @@
+﻿#include "AllocCounter.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#ifdef AUTOBACKUP_COUNT_ALLOCATIONS
+namespace {
+    std::atomic<uint64_t> g_allocations(0);
+
+    void* allocate(size_t size) {
+        g_allocations.fetch_add(1, std::memory_order_relaxed);
+        if (size == 0) size = 1;
+        for (;;) {
+            if (void* p = malloc(size)) return p;
+            std::new_handler handler = std::get_new_handler();
+            if (!handler) throw std::bad_alloc();
+            handler();
+        }
+    }
+
+    void* allocateNoThrow(size_t size) noexcept {
+        try {
+            return allocate(size);
+        }
+        catch (...) {
+            return nullptr;
+        }
+    }
+}
+
+void* operator new(size_t size) { return allocate(size); }
+void* operator new[](size_t size) { return allocate(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return allocateNoThrow(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return allocateNoThrow(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { free(p); }
+#endif
+
+namespace alloccount {
+    bool Enabled() {
+#ifdef AUTOBACKUP_COUNT_ALLOCATIONS
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    uint64_t Count() {
+#ifdef AUTOBACKUP_COUNT_ALLOCATIONS
+        return g_allocations.load(std::memory_order_relaxed);
+#else
+        return 0;
+#endif
+    }
+}
@@ -0,0 +1,16 @@
+﻿#pragma once
+#include <cstdint>
+
+// テスト用のヒープ確保の回数
+//
+// AUTOBACKUP_COUNT_ALLOCATIONS を定義して作ったときだけ、AllocCounter.cpp が operator new / delete を
+// 置き換えて数える（BackupTool の CMake では -DAUTOBACKUP_COUNT_ALLOCATIONS=ON）。
+// BackupTool alloccheck が、温まった後のバックアップ1回でヒープを確保しないことを確かめるのに使う。
+// malloc を直接呼ぶもの（C ライブラリや OS の内部）は数えない。プラグイン本体には入れない。
+
+namespace alloccount {
+    // 数えるように作ったか
+    bool Enabled();
+    // プロセス全体でのこれまでの operator new の回数
+    uint64_t Count();
+}
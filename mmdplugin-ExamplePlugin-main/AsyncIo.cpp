@@ -0,0 +1,737 @@
+﻿#include "AsyncIo.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+// 1回分の読み書き。完了するまで AsyncIo が持つ
+struct AsyncIo::Op {
+#ifdef _WIN32
+    OVERLAPPED ov;          // 完了ポートから返った OVERLAPPED* から Op に戻す
+    HANDLE handle;
+#else
+    int fd;
+    iovec iov;
+#endif
+    uint64_t offset;
+    void* data;
+    size_t size;
+    bool write;
+    int64_t result;
+    Completion done;
+    std::thread::id owner;  // 出したスレッド。完了はこのスレッドの wait() で渡す
+    bool busy = false;
+    bool finished = false;  // OS から受け取ったが、まだ持ち主に渡していない
+};
+
+// 読み書きを OS に渡し、終わったものを返す。
+// submit() は AsyncIo のロックの中から、complete() は一度に1つのスレッドだけがロックの外から呼ぶ
+class AsyncIo::Queue {
+public:
+    virtual ~Queue() {}
+    virtual void submit(Op* op) = 0;
+    // 終わったものを1つ返す（終わるまで待つ）
+    virtual Op* complete() = 0;
+};
+
+namespace {
+#ifdef _WIN32
+    class IocpQueue : public AsyncIo::Queue {
+    public:
+        IocpQueue() {
+            m_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+        }
+        ~IocpQueue() override {
+            if (m_port) CloseHandle(m_port);
+        }
+        bool valid() const { return m_port != NULL; }
+
+        bool attach(HANDLE file) {
+            return CreateIoCompletionPort(file, m_port, 0, 0) == m_port;
+        }
+
+        void submit(AsyncIo::Op* op) override {
+            memset(&op->ov, 0, sizeof(op->ov));
+            op->ov.Offset = static_cast<DWORD>(op->offset);
+            op->ov.OffsetHigh = static_cast<DWORD>(op->offset >> 32);
+            BOOL ok = op->write
+                ? WriteFile(op->handle, op->data, static_cast<DWORD>(op->size), NULL, &op->ov)
+                : ReadFile(op->handle, op->data, static_cast<DWORD>(op->size), NULL, &op->ov);
+            if (ok) return;
+            DWORD error = GetLastError();
+            if (error == ERROR_IO_PENDING) return;
+            // すぐに失敗したものは完了ポートに届かないので、自分で積む（他のスレッドが待っていても起きる）
+            op->result = error == ERROR_HANDLE_EOF ? 0 : -1;
+            PostQueuedCompletionStatus(m_port, 0, FailedKey, &op->ov);
+        }
+
+        AsyncIo::Op* complete() override {
+            for (;;) {
+                DWORD bytes = 0;
+                ULONG_PTR key = 0;
+                OVERLAPPED* ov = nullptr;
+                BOOL ok = GetQueuedCompletionStatus(m_port, &bytes, &key, &ov, INFINITE);
+                if (!ov) continue;
+                AsyncIo::Op* op = CONTAINING_RECORD(ov, AsyncIo::Op, ov);
+                if (key == FailedKey) return op;
+                if (ok) op->result = static_cast<int64_t>(bytes);
+                else op->result = GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+                return op;
+            }
+        }
+
+    private:
+        static const ULONG_PTR FailedKey = 1;   // ファイルは 0 で関連付ける
+        HANDLE m_port;
+    };
+#else
+    // 途中で切れても size まで読み書きを続ける
+    int64_t transferAll(AsyncIo::Op* op) {
+        size_t done = 0;
+        char* p = static_cast<char*>(op->data);
+        while (done < op->size) {
+            off_t at = static_cast<off_t>(op->offset + done);
+            ssize_t n = op->write ? pwrite(op->fd, p + done, op->size - done, at) : pread(op->fd, p + done, op->size - done, at);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            if (n == 0) break;
+            done += static_cast<size_t>(n);
+        }
+        return static_cast<int64_t>(done);
+    }
+
+    // io_uring。liburing を使わずに、リングを mmap して直接読み書きする
+    class UringQueue : public AsyncIo::Queue {
+    public:
+        explicit UringQueue(unsigned depth) {
+            io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            m_fd = static_cast<int>(syscall(__NR_io_uring_setup, depth, &params));
+            if (m_fd < 0) return;
+
+            m_sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            m_cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+            if (single) m_sqSize = m_cqSize = (std::max)(m_sqSize, m_cqSize);
+            m_sq = mmap(nullptr, m_sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+            if (m_sq == MAP_FAILED) {
+                m_sq = nullptr;
+                return;
+            }
+            if (single) m_cq = m_sq;
+            else {
+                m_cq = mmap(nullptr, m_cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+                if (m_cq == MAP_FAILED) {
+                    m_cq = nullptr;
+                    return;
+                }
+            }
+            m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+            void* sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+            if (sqes == MAP_FAILED) return;
+            m_sqes = static_cast<io_uring_sqe*>(sqes);
+
+            char* sq = static_cast<char*>(m_sq);
+            m_sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+            m_sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+            m_sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+            m_sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+            char* cq = static_cast<char*>(m_cq);
+            m_cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+            m_cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+            m_cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+            m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+            m_rejected.reserve(params.sq_entries);
+            m_ready = true;
+        }
+
+        ~UringQueue() override {
+            if (m_sqes) munmap(m_sqes, m_sqesSize);
+            if (m_cq && m_cq != m_sq) munmap(m_cq, m_cqSize);
+            if (m_sq) munmap(m_sq, m_sqSize);
+            if (m_fd >= 0) close(m_fd);
+        }
+
+        bool valid() const { return m_ready; }
+
+        // 出している数はリングの大きさ以下なので、SQ があふれることはない
+        void submit(AsyncIo::Op* op) override {
+            std::lock_guard<std::mutex> lock(m_sqMutex);
+            unsigned tail = *m_sqTail;
+            unsigned index = tail & m_sqMask;
+            io_uring_sqe* sqe = &m_sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            op->iov.iov_base = op->data;
+            op->iov.iov_len = op->size;
+            sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = op->fd;
+            sqe->off = op->offset;
+            sqe->addr = reinterpret_cast<uint64_t>(&op->iov);
+            sqe->len = 1;
+            sqe->user_data = reinterpret_cast<uint64_t>(op);
+            m_sqArray[index] = index;
+            __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+            m_unsubmitted++;
+        }
+
+        // 積んだ分は待つときにまとめてカーネルに渡す
+        AsyncIo::Op* complete() override {
+            for (;;) {
+                if (!m_rejected.empty()) {
+                    AsyncIo::Op* op = m_rejected.back();
+                    m_rejected.pop_back();
+                    op->result = transferAll(op);
+                    return op;
+                }
+                unsigned head = *m_cqHead;
+                if (head != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+                    const io_uring_cqe& cqe = m_cqes[head & m_cqMask];
+                    AsyncIo::Op* op = reinterpret_cast<AsyncIo::Op*>(cqe.user_data);
+                    op->result = cqe.res;
+                    __atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+                    if (op->result < 0) op->result = -1;
+                    else if (op->result > 0 && static_cast<size_t>(op->result) < op->size) finishShort(op);
+                    return op;
+                }
+                // 待っている間に他のスレッドが積んだ分は、次に入るときに渡す
+                unsigned toSubmit;
+                {
+                    std::lock_guard<std::mutex> lock(m_sqMutex);
+                    toSubmit = m_unsubmitted;
+                }
+                long n = syscall(__NR_io_uring_enter, m_fd, toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+                int error = errno;
+                std::lock_guard<std::mutex> lock(m_sqMutex);
+                if (n < 0) {
+                    if (error == EINTR) continue;
+                    // カーネルが受け取らなかった分は SQ から取り下げて、その場で行う
+                    // （残したままだと次に入ったときにもう一度渡してしまう）
+                    rejectUnsubmitted();
+                    continue;
+                }
+                m_unsubmitted -= (std::min)(m_unsubmitted, static_cast<unsigned>(n));
+            }
+        }
+
+    private:
+        // 読み書きが途中で切れたら残りをその場で行う（ファイルの末尾以外ではまず起きない）
+        void finishShort(AsyncIo::Op* op) {
+            AsyncIo::Op rest = *op;
+            rest.offset += static_cast<uint64_t>(op->result);
+            rest.data = static_cast<char*>(op->data) + op->result;
+            rest.size -= static_cast<size_t>(op->result);
+            int64_t more = transferAll(&rest);
+            if (more < 0) op->result = -1;
+            else op->result += more;
+        }
+
+        // SQ の末尾を、カーネルが読み終えた位置まで戻す。io_uring_enter を呼ぶのは complete() の
+        // 1スレッドだけで、ここはその呼び出しの後なので、カーネルが同時に SQ を読むことはない
+        void rejectUnsubmitted() {
+            unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+            unsigned tail = *m_sqTail;
+            for (unsigned i = head; i != tail; i++) {
+                m_rejected.push_back(reinterpret_cast<AsyncIo::Op*>(m_sqes[m_sqArray[i & m_sqMask]].user_data));
+            }
+            __atomic_store_n(m_sqTail, head, __ATOMIC_RELEASE);
+            m_unsubmitted = 0;
+        }
+
+        int m_fd = -1;
+        bool m_ready = false;
+        void* m_sq = nullptr;
+        void* m_cq = nullptr;
+        size_t m_sqSize = 0;
+        size_t m_cqSize = 0;
+        size_t m_sqesSize = 0;
+        io_uring_sqe* m_sqes = nullptr;
+        unsigned* m_sqHead = nullptr;
+        unsigned* m_sqTail = nullptr;
+        unsigned m_sqMask = 0;
+        unsigned* m_sqArray = nullptr;
+        unsigned* m_cqHead = nullptr;
+        unsigned* m_cqTail = nullptr;
+        unsigned m_cqMask = 0;
+        io_uring_cqe* m_cqes = nullptr;
+        std::mutex m_sqMutex;       // SQ の末尾と m_unsubmitted
+        unsigned m_unsubmitted = 0;
+        std::vector<AsyncIo::Op*> m_rejected;  // SQ から取り下げた分。complete() だけが触る
+    };
+
+    // io_uring が使えないときの代わり。threads 本のスレッドが pread / pwrite を行う
+    class ThreadQueue : public AsyncIo::Queue {
+    public:
+        ThreadQueue(unsigned capacity, unsigned threads) {
+            m_waiting.reserve(capacity);
+            m_done.reserve(capacity);
+            for (unsigned i = 0; i < threads; i++) m_threads.emplace_back(&ThreadQueue::worker, this);
+        }
+        ~ThreadQueue() override {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stopping = true;
+            }
+            m_wake.notify_all();
+            for (auto& t : m_threads) t.join();
+        }
+
+        void submit(AsyncIo::Op* op) override {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_waiting.push_back(op);
+            }
+            m_wake.notify_one();
+        }
+
+        AsyncIo::Op* complete() override {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_finished.wait(lock, [this]() { return !m_done.empty(); });
+            AsyncIo::Op* op = m_done.back();
+            m_done.pop_back();
+            return op;
+        }
+
+    private:
+        void worker() {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            for (;;) {
+                m_wake.wait(lock, [this]() { return m_stopping || !m_waiting.empty(); });
+                if (m_waiting.empty()) return;
+                AsyncIo::Op* op = m_waiting.back();
+                m_waiting.pop_back();
+                lock.unlock();
+                op->result = transferAll(op);
+                lock.lock();
+                m_done.push_back(op);
+                m_finished.notify_one();
+            }
+        }
+
+        std::mutex m_mutex;
+        std::condition_variable m_wake;
+        std::condition_variable m_finished;
+        // 読み書きの順番は問わないので、確保しないよう vector の末尾から取る
+        std::vector<AsyncIo::Op*> m_waiting;
+        std::vector<AsyncIo::Op*> m_done;
+        std::vector<std::thread> m_threads;
+        bool m_stopping = false;
+    };
+#endif
+}
+
+// --- AsyncFile ---
+
+#ifdef _WIN32
+AsyncFile::AsyncFile() : m_handle(INVALID_HANDLE_VALUE) {}
+AsyncFile::~AsyncFile() { close(); }
+
+bool AsyncFile::isOpen() const { return m_handle != INVALID_HANDLE_VALUE; }
+
+uint64_t AsyncFile::size() const {
+    LARGE_INTEGER size;
+    return GetFileSizeEx(m_handle, &size) ? static_cast<uint64_t>(size.QuadPart) : 0;
+}
+
+bool AsyncFile::truncate(uint64_t size) {
+    FILE_END_OF_FILE_INFO info;
+    info.EndOfFile.QuadPart = static_cast<LONGLONG>(size);
+    return SetFileInformationByHandle(m_handle, FileEndOfFileInfo, &info, sizeof(info)) != FALSE;
+}
+
+bool AsyncFile::flush() { return FlushFileBuffers(m_handle) != FALSE; }
+
+bool AsyncFile::copyTimes(const AsyncFile& src) {
+    FILETIME created, accessed, written;
+    if (!GetFileTime(src.m_handle, &created, &accessed, &written)) return false;
+    return SetFileTime(m_handle, &created, &accessed, &written) != FALSE;
+}
+
+void AsyncFile::close() {
+    if (m_handle != INVALID_HANDLE_VALUE) CloseHandle(m_handle);
+    m_handle = INVALID_HANDLE_VALUE;
+}
+#else
+AsyncFile::AsyncFile() : m_fd(-1) {}
+AsyncFile::~AsyncFile() { close(); }
+
+bool AsyncFile::isOpen() const { return m_fd >= 0; }
+
+uint64_t AsyncFile::size() const {
+    struct stat st;
+    return fstat(m_fd, &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+}
+
+bool AsyncFile::truncate(uint64_t size) { return ftruncate(m_fd, static_cast<off_t>(size)) == 0; }
+bool AsyncFile::flush() { return fsync(m_fd) == 0; }
+
+bool AsyncFile::copyTimes(const AsyncFile& src) {
+    struct stat st;
+    if (fstat(src.m_fd, &st) != 0) return false;
+    const timespec times[2] = { st.st_atim, st.st_mtim };
+    bool ok = futimens(m_fd, times) == 0;
+    // 読み取り専用の元からでも、世代整理や復元で消せるように書き込みは残す
+    if (fchmod(m_fd, (st.st_mode & 07777) | S_IWUSR) != 0) ok = false;
+    return ok;
+}
+
+void AsyncFile::close() {
+    if (m_fd >= 0) ::close(m_fd);
+    m_fd = -1;
+}
+#endif
+
+// --- AsyncIo ---
+
+AsyncIo::AsyncIo(unsigned depth, bool kernelQueue, unsigned users)
+    : m_backend(Backend::Threads), m_depth((std::max)(1u, depth)), m_reaping(false), m_inFlight(0) {
+    m_capacity = m_depth * (std::max)(1u, users);
+    m_free.reserve(m_capacity);
+#ifdef _WIN32
+    (void)kernelQueue;
+    m_queue.reset(new IocpQueue());
+    m_backend = Backend::Iocp;
+#else
+    if (kernelQueue) {
+        std::unique_ptr<UringQueue> uring(new UringQueue(m_capacity));
+        if (uring->valid()) {
+            m_queue = std::move(uring);
+            m_backend = Backend::IoUring;
+        }
+    }
+    // 代わりのスレッドは、共有していても 1 スレッド分の2倍までにする
+    if (!m_queue) m_queue.reset(new ThreadQueue(m_capacity, (std::min)(m_capacity, m_depth * 2)));
+#endif
+}
+
+AsyncIo::~AsyncIo() {
+    drain();
+}
+
+const char* AsyncIo::backendName() const {
+    switch (m_backend) {
+    case Backend::Iocp: return "iocp";
+    case Backend::IoUring: return "io_uring";
+    default: return "threads";
+    }
+}
+
+bool AsyncIo::open(const fs::path& path, OpenMode mode, AsyncFile& file, bool unbuffered) {
+    return open(path.c_str(), mode, file, unbuffered);
+}
+
+bool AsyncIo::open(const NativePath::value_type* path, OpenMode mode, AsyncFile& file, bool unbuffered) {
+    file.close();
+#ifdef _WIN32
+    DWORD access = mode == OpenMode::Read ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE;
+    DWORD share = mode == OpenMode::Read ? FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE : FILE_SHARE_READ;
+    DWORD disposition = mode == OpenMode::Read ? OPEN_EXISTING : mode == OpenMode::Write ? CREATE_ALWAYS : OPEN_ALWAYS;
+    DWORD flags = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | (unbuffered ? FILE_FLAG_NO_BUFFERING : 0);
+    HANDLE h = CreateFileW(path, access, share, NULL, disposition, flags, NULL);
+    if (h == INVALID_HANDLE_VALUE) return false;
+    file.m_handle = h;
+    if (!static_cast<IocpQueue*>(m_queue.get())->attach(h)) {
+        file.close();
+        return false;
+    }
+    return true;
+#else
+    int flags = O_CLOEXEC | (unbuffered ? O_DIRECT : 0);
+    if (mode == OpenMode::Read) flags |= O_RDONLY;
+    else if (mode == OpenMode::Write) flags |= O_RDWR | O_CREAT | O_TRUNC;
+    else flags |= O_RDWR | O_CREAT;
+    file.m_fd = ::open(path, flags, 0644);
+    if (file.m_fd >= 0 && mode == OpenMode::Read && !unbuffered) posix_fadvise(file.m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return file.m_fd >= 0;
+#endif
+}
+
+void AsyncIo::read(AsyncFile& file, uint64_t offset, void* data, size_t size, Completion done) {
+    submit(file, offset, data, size, false, std::move(done));
+}
+
+void AsyncIo::write(AsyncFile& file, uint64_t offset, const void* data, size_t size, Completion done) {
+    submit(file, offset, const_cast<void*>(data), size, true, std::move(done));
+}
+
+void AsyncIo::submit(AsyncFile& file, uint64_t offset, void* data, size_t size, bool write, Completion done) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    const std::thread::id self = std::this_thread::get_id();
+    for (;;) {
+        size_t mine = 0;
+        for (const auto& o : m_ops) {
+            if (o->busy && o->owner == self) mine++;
+        }
+        if (mine < m_depth && m_inFlight < m_capacity) break;
+        // 自分の分があればそれを待ち、無ければ他のスレッドの分が空くのを待つ
+        if (mine == 0) m_changed.wait(lock);
+        else waitOwn(lock);
+    }
+    // 終わった Op を使い回す。出している数は全体の上限以下なので、作るのは最初の m_capacity 個だけ
+    Op* op;
+    if (!m_free.empty()) {
+        op = m_free.back();
+        m_free.pop_back();
+    } else {
+        m_ops.emplace_back(new Op());
+        op = m_ops.back().get();
+    }
+#ifdef _WIN32
+    op->handle = file.m_handle;
+#else
+    op->fd = file.m_fd;
+#endif
+    op->offset = offset;
+    op->data = data;
+    op->size = size;
+    op->write = write;
+    op->result = -1;
+    op->done = std::move(done);
+    op->owner = self;
+    op->busy = true;
+    op->finished = false;
+    m_inFlight++;
+    m_queue->submit(op);
+}
+
+bool AsyncIo::wait() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return waitOwn(lock);
+}
+
+bool AsyncIo::waitOwn(std::unique_lock<std::mutex>& lock) {
+    const std::thread::id self = std::this_thread::get_id();
+    for (;;) {
+        Op* ready = nullptr;
+        bool pending = false;
+        for (const auto& o : m_ops) {
+            if (!o->busy || o->owner != self) continue;
+            if (o->finished) {
+                ready = o.get();
+                break;
+            }
+            pending = true;
+        }
+        if (ready) {
+            // コールバックの中から次を出せるよう、先に Op を空きへ戻し、ロックを外して呼ぶ
+            Completion done = std::move(ready->done);
+            ready->done = nullptr;
+            int64_t result = ready->result;
+            ready->busy = false;
+            ready->finished = false;
+            m_free.push_back(ready);
+            m_inFlight--;
+            m_changed.notify_all();
+            lock.unlock();
+            if (done) done(result);
+            lock.lock();
+            return true;
+        }
+        if (!pending) return false;
+        if (m_reaping) {
+            m_changed.wait(lock);
+            continue;
+        }
+        // 誰も OS を待っていなければ自分が待ち、受け取ったものを持ち主へ配る
+        m_reaping = true;
+        lock.unlock();
+        Op* op = m_queue->complete();
+        lock.lock();
+        op->finished = true;
+        m_reaping = false;
+        m_changed.notify_all();
+    }
+}
+
+void AsyncIo::drain() {
+    while (wait()) {}
+}
+
+AsyncIo& SharedAsyncIo() {
+    // 同時に読み書きするのは、保存・複製・TaskExecutor のワーカーくらい
+    static AsyncIo io(AsyncIo::DefaultDepth, true, 8);
+    return io;
+}
+
+// --- AsyncReader ---
+
+AsyncReader::AsyncReader(AsyncIo& io, size_t chunkSize)
+    : m_io(io), m_chunkSize(chunkSize), m_head(0), m_issued(0), m_returned(0), m_pending(0), m_size(0), m_holding(false) {}
+
+AsyncReader::~AsyncReader() {
+    // コールバックがスロットを指しているので、自分の分が終わるまで待つ
+    while (m_pending > 0) m_io.wait();
+}
+
+bool AsyncReader::open(const fs::path& path) {
+    if (!m_io.open(path, AsyncIo::OpenMode::Read, m_file)) return false;
+    m_size = m_file.size();
+    m_slots.resize((std::max)(1u, m_io.depth()));
+    for (auto& slot : m_slots) slot.buffer.resize(m_chunkSize);
+    return true;
+}
+
+void AsyncReader::fill() {
+    size_t chunks = static_cast<size_t>((m_size + m_chunkSize - 1) / m_chunkSize);
+    while (m_issued < chunks && m_issued - m_returned < m_slots.size()) {
+        Slot& slot = m_slots[m_issued % m_slots.size()];
+        uint64_t offset = static_cast<uint64_t>(m_issued) * m_chunkSize;
+        slot.expected = static_cast<size_t>((std::min)(static_cast<uint64_t>(m_chunkSize), m_size - offset));
+        slot.busy = true;
+        slot.done = false;
+        m_pending++;
+        m_issued++;
+        m_io.read(m_file, offset, slot.buffer.data(), slot.expected, [this, &slot](int64_t result) {
+            slot.result = result;
+            slot.done = true;
+            m_pending--;
+        });
+    }
+}
+
+bool AsyncReader::next(const uint8_t*& data, size_t& size) {
+    data = nullptr;
+    size = 0;
+    if (!m_file.isOpen()) return false;
+    if (m_holding) {
+        m_slots[m_head].busy = false;
+        m_head = (m_head + 1) % m_slots.size();
+        m_holding = false;
+    }
+    fill();
+    if (m_returned == m_issued) return true;
+
+    Slot& slot = m_slots[m_head];
+    while (!slot.done) m_io.wait();
+    if (slot.result < 0) return false;
+    m_returned++;
+    m_holding = true;
+    data = slot.buffer.data();
+    size = static_cast<size_t>(slot.result);
+    if (size < slot.expected) {
+        // 読んでいる間に短くなった。ここで終わりにする（先に出した分は空で返る）
+        m_size = static_cast<uint64_t>(m_returned - 1) * m_chunkSize + size;
+        while (m_pending > 0) m_io.wait();
+        m_issued = m_returned;
+    }
+    return true;
+}
+
+// --- CopyFileAsync ---
+
+namespace {
+    const size_t kMaxCopySlots = 32;
+
+    struct CopyJob {
+        AsyncIo* io;
+        AsyncFile in;
+        AsyncFile out;
+        TokenBucket* bucket;
+        uint64_t size;
+        uint64_t next;
+        size_t pending;
+        bool failed;
+    };
+
+    // コールバックはこのスロットへのポインタだけをキャプチャする（std::function が確保しない大きさ）
+    struct CopySlot {
+        CopyJob* job;
+        std::vector<uint8_t>* buffer;
+        uint64_t offset;
+        size_t n;
+    };
+
+#ifdef _WIN32
+    // 隠し・システムなどの属性を写す。読み取り専用は、世代整理や復元で消せるように写さない
+    void CopyAttributes(const NativePath& src, const NativePath& dst) {
+        const DWORD kept = FILE_ATTRIBUTE_ARCHIVE | FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED;
+        DWORD attributes = GetFileAttributesW(src.c_str());
+        if (attributes == INVALID_FILE_ATTRIBUTES) return;
+        SetFileAttributesW(dst.c_str(), (attributes & kept) ? attributes & kept : FILE_ATTRIBUTE_NORMAL);
+    }
+#endif
+
+    // スロットごとに「読む → 同じ位置に書く → 次のかたまりを読む」を繰り返す
+    void IssueCopy(CopySlot& slot) {
+        CopyJob& job = *slot.job;
+        if (job.failed || job.next >= job.size) return;
+        slot.offset = job.next;
+        slot.n = static_cast<size_t>((std::min)(static_cast<uint64_t>(kIoChunkSize), job.size - slot.offset));
+        job.next += slot.n;
+        if (job.bucket) job.bucket->acquire(slot.n);
+        job.pending++;
+        job.io->read(job.in, slot.offset, slot.buffer->data(), slot.n, [&slot](int64_t got) {
+            CopyJob& job = *slot.job;
+            job.pending--;
+            if (got != static_cast<int64_t>(slot.n)) {
+                job.failed = true;
+                return;
+            }
+            job.pending++;
+            job.io->write(job.out, slot.offset, slot.buffer->data(), slot.n, [&slot](int64_t written) {
+                CopyJob& job = *slot.job;
+                job.pending--;
+                if (written != static_cast<int64_t>(slot.n)) {
+                    job.failed = true;
+                    return;
+                }
+                IssueCopy(slot);
+            });
+        });
+    }
+}
+
+bool CopyFileAsync(const fs::path& src, const fs::path& dst, TokenBucket* bucket, AsyncIo& io) {
+    return CopyFileAsync(src.native(), dst.native(), bucket, io);
+}
+
+bool CopyFileAsync(const NativePath& src, const NativePath& dst, TokenBucket* bucket, AsyncIo& io) {
+    CopyJob job;
+    job.io = &io;
+    if (!io.open(src.c_str(), AsyncIo::OpenMode::Read, job.in)) return false;
+    if (!io.open(dst.c_str(), AsyncIo::OpenMode::Write, job.out)) return false;
+    job.bucket = bucket;
+    job.size = job.in.size();
+    job.next = 0;
+    job.pending = 0;
+    job.failed = false;
+
+    // バッファはスレッドごとに持ち続けて使い回す（AsyncIo は他のスレッドと共有している）
+    thread_local std::vector<std::vector<uint8_t>> buffers;
+    CopySlot slots[kMaxCopySlots];
+    size_t count = (std::min)(kMaxCopySlots, static_cast<size_t>((std::max)(1u, io.depth())));
+    if (buffers.size() < count) buffers.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        slots[i].job = &job;
+        slots[i].buffer = &buffers[i];
+        if (slots[i].buffer->size() < kIoChunkSize) slots[i].buffer->resize(kIoChunkSize);
+    }
+    for (size_t i = 0; i < count; i++) IssueCopy(slots[i]);
+    while (job.pending > 0) io.wait();
+
+    // 時刻と属性は写せなくても中身は正しいので、失敗にはしない
+    if (!job.failed) job.out.copyTimes(job.in);
+    job.in.close();
+    job.out.close();
+    if (job.failed) NativeRemove(dst);
+#ifdef _WIN32
+    else CopyAttributes(src, dst);
+#endif
+    return !job.failed;
+}
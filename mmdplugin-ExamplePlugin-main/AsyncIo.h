@@ -0,0 +1,162 @@
+﻿#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <experimental/filesystem>
+#include "BackupIo.h"
+
+namespace fs = std::experimental::filesystem;
+
+// 複数の読み書きを同時に出しておける非同期ファイル I/O
+//
+// 1回ずつ待つ読み書きでは、SSD の並列性（キューの深さ）を使い切れない。AsyncIo は depth 個まで
+// 読み書きを出したままにし、終わったものから完了のコールバックを呼ぶ。
+//   - Windows : オーバーラップ I/O と I/O 完了ポート
+//   - Linux   : io_uring（システムコールを直接使う）。使えないカーネルやコンテナでは
+//               pread / pwrite を行うスレッドで代わりに行う
+// コールバックは、その読み書きを出したスレッドが wait() したときに呼ばれ、その中から次の読み書きを出してもよい。
+// 1つの AsyncIo は複数のスレッドから同時に使ってよい（プロセスで1つの SharedAsyncIo() を使う）。
+// 完了は、待っているスレッドの1つがまとめて OS から受け取り、出したスレッドへ配る。
+// 1つのスレッドが出したままにできるのは depth 個まで、全体では depth * users 個まで。
+// 読み書き1回分の管理領域は使い回すので、温まった後は確保しない
+// （コールバックはポインタ1つ程度をキャプチャする小さいものにすると std::function も確保しない）。
+
+// AsyncIo で読み書きするファイル
+class AsyncFile {
+public:
+    AsyncFile();
+    ~AsyncFile();
+
+    AsyncFile(const AsyncFile&) = delete;
+    AsyncFile& operator=(const AsyncFile&) = delete;
+
+    bool isOpen() const;
+    uint64_t size() const;
+    bool truncate(uint64_t size);
+    bool flush();
+    // src の作成・更新・アクセス時刻をこのファイルに写す（書き終えてから呼ぶ）。
+    // Linux ではパーミッションも写す（書き込みは残す）
+    bool copyTimes(const AsyncFile& src);
+    void close();
+
+private:
+    friend class AsyncIo;
+#ifdef _WIN32
+    void* m_handle;
+#else
+    int m_fd;
+#endif
+};
+
+class AsyncIo {
+public:
+    enum class Backend { Threads, IoUring, Iocp };
+    enum class OpenMode {
+        Read,       // 既存のファイルを読む（書き込み・置き換え中でも開ける）
+        Write,      // 作り直して書く
+        Update,     // 無ければ作り、中身を残したまま書く
+    };
+
+    // 転送したバイト数。失敗なら -1
+    typedef std::function<void(int64_t result)> Completion;
+
+    static const unsigned DefaultDepth = 8;
+
+    // kernelQueue が false なら Linux でも io_uring を使わない（比較用）。
+    // users は同時に使うスレッドの見込みで、全体で出したままにできる数を depth * users にする
+    explicit AsyncIo(unsigned depth = DefaultDepth, bool kernelQueue = true, unsigned users = 1);
+    // 呼び出したスレッドが出したままの読み書きがすべて終わるまで待つ
+    ~AsyncIo();
+
+    AsyncIo(const AsyncIo&) = delete;
+    AsyncIo& operator=(const AsyncIo&) = delete;
+
+    Backend backend() const { return m_backend; }
+    const char* backendName() const;
+    // 1つのスレッドが出したままにできる数
+    unsigned depth() const { return m_depth; }
+
+    // unbuffered なら OS のキャッシュを通さない（O_DIRECT / FILE_FLAG_NO_BUFFERING）。
+    // その場合、位置・サイズ・バッファは 4096 の倍数にそろえること
+    bool open(const fs::path& path, OpenMode mode, AsyncFile& file, bool unbuffered = false);
+    bool open(const NativePath::value_type* path, OpenMode mode, AsyncFile& file, bool unbuffered = false);
+
+    // 読み書きを出す。このスレッドからすでに depth 個出ていたら1つ終わるまで待ち、
+    // 全体が埋まっていたらどれかが空くまで待ってから出す。data は done が呼ばれるまで呼び出し元が持っておく
+    void read(AsyncFile& file, uint64_t offset, void* data, size_t size, Completion done);
+    void write(AsyncFile& file, uint64_t offset, const void* data, size_t size, Completion done);
+
+    // 呼び出したスレッドが出したものが1つ終わるまで待ってコールバックを呼ぶ。出ているものが無ければ false
+    bool wait();
+    void drain();
+
+    struct Op;
+    class Queue;
+
+private:
+    void submit(AsyncFile& file, uint64_t offset, void* data, size_t size, bool write, Completion done);
+    bool waitOwn(std::unique_lock<std::mutex>& lock);
+
+    std::unique_ptr<Queue> m_queue;
+    Backend m_backend;
+    unsigned m_depth;
+    unsigned m_capacity;    // 全体で出したままにできる数
+    std::mutex m_mutex;
+    std::condition_variable m_changed;  // 完了が配られたか、空きができた
+    bool m_reaping;         // どれかのスレッドが OS からの完了を待っている
+    size_t m_inFlight;
+    std::vector<std::unique_ptr<Op>> m_ops;
+    std::vector<Op*> m_free;
+};
+
+// プロセスで共有する AsyncIo（初めて使うときに作る）。
+// スレッドごとに作るとリング（代わりのスレッド）が使ったスレッドの数だけでき、持ち続けてしまう
+AsyncIo& SharedAsyncIo();
+
+// ファイルを先頭から順に読む。depth 個先のかたまりまで読みを出しておき、順番どおりに返す
+class AsyncReader {
+public:
+    explicit AsyncReader(AsyncIo& io, size_t chunkSize = kIoChunkSize);
+    ~AsyncReader();
+
+    AsyncReader(const AsyncReader&) = delete;
+    AsyncReader& operator=(const AsyncReader&) = delete;
+
+    bool open(const fs::path& path);
+    // 開いたときのサイズ（読んでいる間に伸びた分は読まない）
+    uint64_t size() const { return m_size; }
+
+    // 次のかたまり。data は次に next() を呼ぶまで有効。終わりなら size = 0 で true、失敗なら false
+    bool next(const uint8_t*& data, size_t& size);
+
+private:
+    struct Slot {
+        std::vector<uint8_t> buffer;
+        size_t expected = 0;
+        int64_t result = 0;
+        bool busy = false;
+        bool done = false;
+    };
+
+    void fill();
+
+    AsyncIo& m_io;
+    AsyncFile m_file;
+    size_t m_chunkSize;
+    std::vector<Slot> m_slots;
+    size_t m_head;          // 次に返すスロット
+    size_t m_issued;        // 読みを出したかたまりの数
+    size_t m_returned;      // 返したかたまりの数
+    size_t m_pending;
+    uint64_t m_size;
+    bool m_holding;         // 前回返したスロットをまだ使っている
+};
+
+// src を dst へコピーする（上書き）。depth 個のかたまりを同時に読み、読めたものから
+// 同じ位置に書く。bucket があれば読む前に帯域を取る
+bool CopyFileAsync(const fs::path& src, const fs::path& dst, TokenBucket* bucket, AsyncIo& io);
+bool CopyFileAsync(const NativePath& src, const NativePath& dst, TokenBucket* bucket, AsyncIo& io);
@@ -0,0 +1,257 @@
+﻿#include "BackupCatalog.h"
+#include "BackupFormat.h"
+#include "BackupIo.h"
+#include "BackupLease.h"
+#include "BackupPack.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+namespace {
+    const uint32_t kCatalogMagic = 0x43424241;  // "ABBC"（ファイル先頭）
+    const uint32_t kRecordMagic = 0x52434241;   // "ABCR"
+    const uint32_t kCatalogVersion = 1;
+
+    enum CatalogOp : uint8_t {
+        OpAdd = 1,
+        OpRemove = 2,
+    };
+
+    // [magic][本体サイズ u32][本体][本体の CRC32]
+    void writeRecord(std::vector<uint8_t>& out, const std::vector<uint8_t>& body) {
+        ByteWriter w(out);
+        w.u32(kRecordMagic);
+        w.u32(static_cast<uint32_t>(body.size()));
+        w.raw(body.data(), body.size());
+        w.u32(Crc32(body.data(), body.size()));
+    }
+
+    void addRecord(std::vector<uint8_t>& out, const CatalogEntry& e, std::vector<uint8_t>& body) {
+        body.clear();
+        ByteWriter w(body);
+        w.u8(OpAdd);
+        w.str(e.name);
+        w.i64(e.time);
+        w.u8(static_cast<uint8_t>(e.storage));
+        w.str(e.location);
+        w.u64(e.pmmSize);
+        w.u32(e.pmmCrc);
+        w.u64(e.emmSize);
+        e.sketch.write(w);
+        writeRecord(out, body);
+    }
+
+    void removeRecord(std::vector<uint8_t>& out, const std::string& name, std::vector<uint8_t>& body) {
+        body.clear();
+        ByteWriter w(body);
+        w.u8(OpRemove);
+        w.str(name);
+        writeRecord(out, body);
+    }
+}
+
+BackupCatalog::BackupCatalog(const fs::path& backupDir, const std::wstring& stem)
+    : m_dir(backupDir), m_path(backupDir / (stem + L".catalog")), m_recordCount(0), m_validSize(0),
+    m_leases(LeaseTable::open(backupDir)), m_resource(lease::CatalogResource(stem)) {
+    m_tmpPath = m_path.native();
+    m_tmpPath += fs::path(L".tmp").native();
+}
+
+const CatalogEntry* BackupCatalog::find(const std::string& name) const {
+    for (const auto& e : m_entries) {
+        if (e.name == name) return &e;
+    }
+    return nullptr;
+}
+
+bool BackupCatalog::load() {
+    m_entries.clear();
+    m_recordCount = 0;
+    m_validSize = 0;
+    if (!fs::exists(m_path)) return true;
+
+    std::ifstream in(m_path.c_str(), std::ios::binary);
+    if (!in.is_open()) return false;
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    ByteReader r(data.data(), data.size());
+    if (r.u32() != kCatalogMagic || r.u32() != kCatalogVersion) return false;
+
+    m_validSize = r.pos();
+    while (r.remaining() >= 12) {
+        if (r.u32() != kRecordMagic) break;
+        uint32_t size = r.u32();
+        const uint8_t* body = r.skip(size);
+        uint32_t crc = r.u32();
+        if (!r.ok() || Crc32(body, size) != crc) break;
+        m_recordCount++;
+        m_validSize = r.pos();
+
+        ByteReader b(body, size);
+        uint8_t op = b.u8();
+        std::string name = b.str();
+        m_entries.erase(std::remove_if(m_entries.begin(), m_entries.end(), [&](const CatalogEntry& e) {
+            return e.name == name;
+        }), m_entries.end());
+        if (op != OpAdd) continue;
+
+        CatalogEntry e;
+        e.name = name;
+        e.time = b.i64();
+        e.storage = static_cast<CatalogStorage>(b.u8());
+        e.location = b.str();
+        e.pmmSize = b.u64();
+        e.pmmCrc = b.u32();
+        e.emmSize = b.u64();
+        // スケッチを持たない古いレコードはここで終わっている
+        if (b.ok() && b.remaining() > 0) {
+            ByteReader rest = b;
+            if (!e.sketch.read(rest)) e.sketch = SceneSketch();
+        }
+        if (b.ok()) m_entries.push_back(e);
+    }
+
+    std::stable_sort(m_entries.begin(), m_entries.end(), [](const CatalogEntry& a, const CatalogEntry& b) {
+        return a.time < b.time;
+    });
+    return true;
+}
+
+bool BackupCatalog::refresh() {
+    // 最後に読み書きした後で他から追記されていなければ読み直さない
+    uint64_t size = 0;
+    if (m_validSize > 0 && NativeFileSize(m_path.native(), size) && size == m_validSize) return true;
+    return load();
+}
+
+bool BackupCatalog::appendRecords(const std::vector<uint8_t>& records) {
+    uint64_t size = 0;
+    bool created = !NativeFileSize(m_path.native(), size);
+    if (created) {
+        // ヘッダはファイルを作るときに一度だけ書く
+        uint8_t header[8];
+        memcpy(header, &kCatalogMagic, 4);
+        memcpy(header + 4, &kCatalogVersion, 4);
+        if (!NativeWrite(m_path.native(), header, sizeof(header))) return false;
+        m_validSize = sizeof(header);
+    } else if (size > m_validSize) {
+        // 追記中に落ちた書きかけが末尾にあれば、その後ろに足すと読めなくなるので切り詰める
+        std::error_code ec;
+        fs::resize_file(m_path, m_validSize, ec);
+        if (ec) return false;
+    }
+    if (!NativeAppend(m_path.native(), records.data(), records.size())) return false;
+    m_validSize += records.size();
+    return true;
+}
+
+bool BackupCatalog::add(const CatalogEntry& entry) {
+    // 他のプロセスの追記を書きかけとみなして切り詰めないよう、書く間は一覧のリースを持つ
+    Lease held = m_leases->acquire(m_resource, lease::LeaseTtl * 3);
+    if (!held || !refresh()) return false;
+    m_records.clear();
+    addRecord(m_records, entry, m_body);
+    if (!appendRecords(m_records)) return false;
+
+    // 同じ名前の項目か、前に外した項目の領域へ上書きしてから並びの位置へ移す
+    CatalogEntry e;
+    auto same = std::find_if(m_entries.begin(), m_entries.end(), [&](const CatalogEntry& x) {
+        return x.name == entry.name;
+    });
+    if (same != m_entries.end()) {
+        e = std::move(*same);
+        m_entries.erase(same);
+    } else if (!m_spare.empty()) {
+        e = std::move(m_spare.back());
+        m_spare.pop_back();
+    }
+    e = entry;
+    auto pos = std::upper_bound(m_entries.begin(), m_entries.end(), entry.time, [](int64_t t, const CatalogEntry& x) {
+        return t < x.time;
+    });
+    m_entries.insert(pos, std::move(e));
+    m_recordCount++;
+    return true;
+}
+
+bool BackupCatalog::remove(const std::vector<std::string>& names) {
+    return remove(names.data(), names.size());
+}
+
+bool BackupCatalog::remove(const std::string* names, size_t count) {
+    if (count == 0) return true;
+    Lease held = m_leases->acquire(m_resource, lease::LeaseTtl * 3);
+    if (!held || !refresh()) return false;
+    m_records.clear();
+    size_t removed = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!find(names[i])) continue;
+        removeRecord(m_records, names[i], m_body);
+        removed++;
+    }
+    if (removed == 0) return true;
+    if (!appendRecords(m_records)) return false;
+
+    // 外した項目は捨てずに取っておく（remove_if は後ろに残す中身を保証しないので自分で詰める）
+    size_t kept = 0;
+    for (size_t i = 0; i < m_entries.size(); i++) {
+        if (std::find(names, names + count, m_entries[i].name) != names + count) {
+            m_spare.push_back(std::move(m_entries[i]));
+            continue;
+        }
+        if (kept != i) m_entries[kept] = std::move(m_entries[i]);
+        kept++;
+    }
+    while (m_entries.size() > kept) m_entries.pop_back();
+    m_recordCount += removed;
+
+    // 削除レコードが溜まったら、生きているものだけで書き直す
+    if (m_recordCount > m_entries.size() * 2 + 64) return rewrite();
+    return true;
+}
+
+bool BackupCatalog::rewrite() {
+    std::vector<uint8_t>& data = m_records;
+    data.clear();
+    ByteWriter w(data);
+    w.u32(kCatalogMagic);
+    w.u32(kCatalogVersion);
+    for (const auto& e : m_entries) addRecord(data, e, m_body);
+
+    if (!NativeWrite(m_tmpPath, data.data(), data.size())) return false;
+    if (!NativeReplace(m_tmpPath, m_path.native())) return false;
+    m_recordCount = m_entries.size();
+    m_validSize = data.size();
+    return true;
+}
+
+bool BackupCatalog::verify(const CatalogEntry& entry) const {
+    fs::path target = m_dir / Utf8ToWide(entry.location);
+    std::error_code ec;
+    if (entry.storage == CatalogStorage::Loose) {
+        return fs::file_size(target, ec) == entry.pmmSize && !ec;
+    }
+    PackFile pack(target);
+    if (!fs::exists(target, ec) || !pack.load()) return false;
+    const PackEntry* pe = pack.find(entry.name);
+    return pe && pe->pmmRaw == entry.pmmSize;
+}
+
+const CatalogEntry* BackupCatalog::newestValid() const {
+    for (auto it = m_entries.rbegin(); it != m_entries.rend(); ++it) {
+        if (verify(*it)) return &*it;
+    }
+    return nullptr;
+}
+
+std::vector<CatalogMatch> BackupCatalog::rankBySimilarity(const SceneSketch& target) const {
+    std::vector<CatalogMatch> matches;
+    matches.reserve(m_entries.size());
+    for (const auto& e : m_entries) {
+        if (!e.sketch.empty()) matches.push_back(CatalogMatch{ &e, SketchSimilarity(target, e.sketch) });
+    }
+    // 同じ程度なら新しいものを先に
+    std::stable_sort(matches.begin(), matches.end(), [](const CatalogMatch& a, const CatalogMatch& b) {
+        return a.similarity != b.similarity ? a.similarity > b.similarity : a.entry->time > b.entry->time;
+    });
+    return matches;
+}
@@ -0,0 +1,88 @@
+﻿#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <experimental/filesystem>
+#include "BackupIo.h"
+#include "SceneSketch.h"
+
+namespace fs = std::experimental::filesystem;
+
+// バックアップの一覧（Backup/<名前>.catalog）
+//
+// 作成・削除のたびにレコードを1つ追記するだけの形式で、読み込み時に先頭から再生する。
+// 各レコードは CRC を持つので、追記中に落ちた末尾の書きかけは無視される。
+// 本体の後ろに項目を足しても古い読み手は読み飛ばせるようにしてある。
+// 追記・書き直しの間は一覧のリース（BackupLease.h）を持ち、複数の MMD からの書き込みが混ざらないようにする。
+// add / remove はレコードのバッファや外した項目を使い回すので、同じ一覧を持ち続ければ温まった後は確保しない。
+
+class LeaseTable;
+
+enum class CatalogStorage : uint8_t {
+    Loose = 0,  // Backup/<名前>.pmm（と .emm）
+    Pack = 1,   // パックファイル内のレコード
+};
+
+struct CatalogEntry {
+    std::string name;           // バックアップ名（拡張子なし、UTF-8）
+    int64_t time = 0;           // 作成時刻（UNIX秒）
+    CatalogStorage storage = CatalogStorage::Loose;
+    std::string location;       // Backup フォルダからの相対パス（UTF-8）。パックならパックファイル名
+    uint64_t pmmSize = 0;
+    uint32_t pmmCrc = 0;        // 不明なら 0
+    uint64_t emmSize = 0;
+    SceneSketch sketch;         // キーフレームの要約（キーフレームを保存しなかったものは空）
+};
+
+struct CatalogMatch {
+    const CatalogEntry* entry;
+    double similarity;
+};
+
+class BackupCatalog {
+public:
+    BackupCatalog(const fs::path& backupDir, const std::wstring& stem);
+
+    const fs::path& path() const { return m_path; }
+    const fs::path& backupDir() const { return m_dir; }
+
+    // ファイルが無ければ空として true を返す
+    bool load();
+    // 作成時刻順
+    const std::vector<CatalogEntry>& entries() const { return m_entries; }
+    const CatalogEntry* find(const std::string& name) const;
+
+    bool add(const CatalogEntry& entry);
+    bool remove(const std::vector<std::string>& names);
+    bool remove(const std::string* names, size_t count);
+
+    // 他から追記されていれば読み直す
+    bool refresh();
+
+    // 実体が残っている（ファイルやパックのレコードがあり、サイズが一致する）か
+    bool verify(const CatalogEntry& entry) const;
+    // 実体が残っている中で最も新しいもの
+    const CatalogEntry* newestValid() const;
+
+    // スケッチだけで target に似ている順に並べる（スケッチの無いものは除く）
+    std::vector<CatalogMatch> rankBySimilarity(const SceneSketch& target) const;
+
+private:
+    bool appendRecords(const std::vector<uint8_t>& records);
+    bool rewrite();
+
+    fs::path m_dir;
+    fs::path m_path;
+    NativePath m_tmpPath;
+    std::vector<CatalogEntry> m_entries;
+    size_t m_recordCount;   // 削除済みも含めたレコード数（多すぎたら書き直す）
+    uint64_t m_validSize;   // 正しく読めたところまでのサイズ
+
+    // 追記・書き直しのたびに作り直さないもの
+    std::shared_ptr<LeaseTable> m_leases;
+    std::string m_resource;
+    std::vector<uint8_t> m_records;
+    std::vector<uint8_t> m_body;
+    std::vector<CatalogEntry> m_spare;  // 一覧から外した項目（文字列の領域を次の add で使う）
+};
@@ -0,0 +1,71 @@
+﻿#include "BackupCycle.h"
+#include "SceneSketch.h"
+
+bool BackupCycle::run(BackupHost& host, BackupEngine& engine, int64_t now, TokenBucket* bucket, bool keyframes, BackupMetrics& metrics) {
+    m_result = BackupCycleResult();
+
+    // まず現在の状態を保存する
+    uint64_t saveStart = metrics.nowNs();
+    bool requested;
+    {
+        StageTimer timer(metrics, BackupStage::SaveRequest);
+        requested = host.requestSave();
+    }
+    if (!requested) {
+        m_result.error = "cannot save " + WideToUtf8(engine.pmmPath().wstring());
+        return false;
+    }
+    {
+        StageTimer timer(metrics, BackupStage::SaveWait);
+        host.waitSaved();
+    }
+    m_result.saveNs = metrics.nowNs() - saveStart;
+
+    // タイムスタンプ付きの名前で Backup フォルダ（PMMファイルと同じ階層）に格納する
+    const std::wstring& name = engine.snapshotName(now);
+    uint64_t copyStart = metrics.nowNs();
+    if (!engine.store(name, now, bucket, m_entry, m_savedName)) {
+        m_result.error = "backup failed: " + WideToUtf8(name);
+        return false;
+    }
+    metrics.record(BackupStage::Copy, copyStart, metrics.nowNs());
+    m_result.saved = true;
+    m_result.storedBytes = m_entry.pmmSize + m_entry.emmSize;
+    host.stored(engine.backupDir(), name);
+
+    // モデル単位の合成用に、同じ名前の .kfs にキーフレームを保存し、その要約を一覧に載せる
+    if (keyframes) {
+        StageTimer timer(metrics, BackupStage::Keyframes);
+        BuildPath(m_kfsPath, engine.backupDir(), name, L".kfs");
+        m_result.keyframes = saveKeyframes(host, now);
+    }
+
+    engine.catalog(m_entry);
+    engine.releaseName();
+
+    {
+        StageTimer timer(metrics, BackupStage::Retention);
+        m_result.compactionDue = engine.applyRetention();
+    }
+    return true;
+}
+
+bool BackupCycle::saveKeyframes(BackupHost& host, int64_t now) {
+    if (host.captureKeyframes(m_image, now)) {
+        // 要約は書き出したファイルを読み戻さず、手元の image から作る
+        SketchImage(m_image.data(), m_image.size(), m_entry.sketch);
+        // 元より小さければ圧縮したものを使う。展開した結果は読む側が CRC32 で確かめるので、ここでは戻してみない
+        const std::vector<uint8_t>* data = &m_image;
+        if (m_encoder.encode(m_image.data(), m_image.size(), m_encoded) && m_encoded.size() < m_image.size()) {
+            data = &m_encoded;
+        }
+        if (NativeWrite(m_kfsPath, data->data(), data->size())) {
+            m_result.kfsRaw = m_image.size();
+            m_result.kfsBytes = data->size();
+            return true;
+        }
+    }
+    m_entry.sketch.models.clear();
+    NativeRemove(m_kfsPath);
+    return false;
+}
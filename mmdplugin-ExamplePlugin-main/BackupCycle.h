@@ -0,0 +1,66 @@
+﻿#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <experimental/filesystem>
+#include "BackupEngine.h"
+#include "KeyframeCodec.h"
+#include "BackupMetrics.h"
+
+namespace fs = std::experimental::filesystem;
+
+// バックアップ1回分の手順（保存 → 格納 → キーフレーム → 一覧 → 世代整理）
+//
+// CPlugin::triggerSave と、MMD の代わりに HostSimulator を使う BackupTool simulate / replay が
+// 同じ手順・同じ計測を通るように、MMD に依存する部分だけを BackupHost で差し替える。
+// パックの詰め直し・複製・完了の通知は、スレッドの都合が違うので呼び出し側で行う。
+//
+// キーフレームの書き出し・圧縮のバッファと .kfs のパスはメンバに持ち、使い回す
+// （同じ大きさのシーンなら、温まった後は確保しない。BackupTool alloccheck で確かめる）。
+
+class BackupHost {
+public:
+    virtual ~BackupHost() {}
+
+    // 上書き保存を頼む（MMD では Ctrl+S 相当のメッセージ）
+    virtual bool requestSave() = 0;
+    // 頼んだ保存が書き終わるのを待つ
+    virtual void waitSaved() {}
+    // 格納が済んだ。サムネイルなど、同じ名前で後から書くものをここで頼む
+    virtual void stored(const fs::path& /*backupDir*/, const std::wstring& /*name*/) {}
+    // キーフレームを緊急保存と同じ形式でメモリに書き出す
+    virtual bool captureKeyframes(std::vector<uint8_t>& image, int64_t now) = 0;
+};
+
+struct BackupCycleResult {
+    bool saved = false;         // 保存と格納まで済んだ
+    bool keyframes = false;     // .kfs を書いた
+    bool compactionDue = false; // 世代整理でパックに不要領域ができた
+    uint64_t saveNs = 0;        // 保存の依頼と待ち（MMD では UI スレッドを止める）
+    uint64_t storedBytes = 0;   // PMM・EMM の大きさ
+    uint64_t kfsRaw = 0;
+    uint64_t kfsBytes = 0;      // .kfs として書いた量
+    std::string error;
+};
+
+class BackupCycle {
+public:
+    // keyframes が false なら .kfs を作らない。bucket は格納のコピーの帯域（nullptr なら無制限）
+    bool run(BackupHost& host, BackupEngine& engine, int64_t now, TokenBucket* bucket, bool keyframes, BackupMetrics& metrics);
+
+    const BackupCycleResult& result() const { return m_result; }
+    // 直前の run() で一覧に載せた内容と、表示用の名前
+    const CatalogEntry& entry() const { return m_entry; }
+    const std::wstring& savedName() const { return m_savedName; }
+
+private:
+    bool saveKeyframes(BackupHost& host, int64_t now);
+
+    BackupCycleResult m_result;
+    CatalogEntry m_entry;
+    std::wstring m_savedName;
+    NativePath m_kfsPath;
+    std::vector<uint8_t> m_image;
+    kfc::Encoder m_encoder;
+    std::vector<uint8_t> m_encoded;
+};
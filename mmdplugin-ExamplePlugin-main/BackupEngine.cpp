@@ -0,0 +1,194 @@
+﻿#include "BackupEngine.h"
+#include "AsyncIo.h"
+#include "BackupFormat.h"
+#include "BackupPack.h"
+#include <algorithm>
+#include <ctime>
+#include <cwchar>
+
+std::string& NameList::add() {
+    if (m_count == m_items.size()) m_items.emplace_back();
+    return m_items[m_count++];
+}
+
+BackupEngine::BackupEngine(const fs::path& pmmPath, const BackupPolicy& policy)
+    : m_pmmPath(pmmPath), m_backupDir(pmmPath.parent_path() / L"Backup"), m_stem(pmmPath.stem().wstring()), m_policy(policy),
+    m_catalog(m_backupDir, m_stem), m_storedBytes(0) {
+    fs::path emmPath = m_pmmPath;
+    emmPath.replace_extension(L".emm");
+    m_emmPath = emmPath.native();
+    m_stemNative = pmmPath.stem().native();
+}
+
+const std::wstring& BackupEngine::snapshotName(int64_t time) {
+    time_t t = static_cast<time_t>(time);
+    tm local;
+#ifdef _WIN32
+    localtime_s(&local, &t);
+#else
+    localtime_r(&t, &local);
+#endif
+    wchar_t stamp[32];
+    wcsftime(stamp, sizeof(stamp) / sizeof(stamp[0]), L"%Y%m%d_%H%M%S", &local);
+    m_base.assign(m_stem);
+    m_base += L'_';
+    m_base += stamp;
+
+    // 先にリースを取ってから実体を確かめる（確かめた後に他が同じ名前で作り始めることは無い）
+    if (!m_leases) m_leases = LeaseTable::open(m_backupDir);
+    m_nameLease.release();
+    m_name.assign(m_base);
+    for (int n = 2; n < 1000; n++) {
+        m_nameUtf8.clear();
+        AppendUtf8(m_name.data(), m_name.size(), m_nameUtf8);
+        lease::NameResource(m_nameUtf8, m_resource);
+        Lease held = m_leases->tryAcquire(m_resource);
+        if (held && !nameTaken()) {
+            m_nameLease = std::move(held);
+            break;
+        }
+        wchar_t suffix[16];
+        swprintf(suffix, sizeof(suffix) / sizeof(suffix[0]), L"_%d", n);
+        m_name.assign(m_base);
+        m_name += suffix;
+    }
+    return m_name;
+}
+
+bool BackupEngine::nameTaken() {
+    BuildPath(m_path, m_backupDir, m_name, L".pmm");
+    if (NativeExists(m_path)) return true;
+    BuildPath(m_path, m_backupDir, m_name, L".kfs");
+    if (NativeExists(m_path)) return true;
+    return m_catalog.refresh() && m_catalog.find(m_nameUtf8) != nullptr;
+}
+
+bool BackupEngine::store(const std::wstring& name, int64_t time, TokenBucket* bucket, CatalogEntry& entry, std::wstring& savedName) {
+    // バックアップフォルダの作成（PMMファイルと同じ階層）
+    if (!NativeExists(m_backupDir.native())) {
+        std::error_code ec;
+        fs::create_directories(m_backupDir, ec);
+    }
+
+    // entry は呼び出し側が使い回すことがあるので、前回の値を残さない
+    entry.name.clear();
+    AppendUtf8(name.data(), name.size(), entry.name);
+    entry.time = time;
+    entry.pmmSize = 0;
+    entry.pmmCrc = 0;
+    entry.emmSize = 0;
+    entry.sketch.models.clear();
+    m_storedBytes = 0;
+
+    if (m_policy.usePackFiles) {
+        // パックファイルに1レコードとして追記する
+        PackStore store(m_backupDir, m_stem);
+        fs::path packPath;
+        PackEntry packed;
+        bool saved = store.append(entry.name, time, m_pmmPath, fs::path(m_emmPath), bucket, &packPath, &packed);
+        savedName = name + L" (" + packPath.filename().wstring() + L")";
+        entry.storage = CatalogStorage::Pack;
+        entry.location = WideToUtf8(packPath.filename().wstring());
+        entry.pmmSize = packed.pmmRaw;
+        entry.pmmCrc = packed.pmmCrc;
+        entry.emmSize = packed.emmRaw;
+        if (saved) m_storedBytes = packed.pmmStored + packed.emmStored;
+        return saved;
+    }
+
+    BuildPath(m_path, m_backupDir, name, L".pmm");
+    savedName.assign(name);
+    savedName += L".pmm";
+    AsyncIo& io = SharedAsyncIo();
+    bool saved = CopyFileAsync(m_pmmPath.native(), m_path, bucket, io);
+    uint64_t size = 0;
+    // emmファイルもコピー
+    if (saved && NativeExists(m_emmPath)) {
+        BuildPath(m_extraPath, m_backupDir, name, L".emm");
+        if (CopyFileAsync(m_emmPath, m_extraPath, bucket, io) && NativeFileSize(m_extraPath, size)) entry.emmSize = size;
+    }
+    entry.storage = CatalogStorage::Loose;
+    entry.location.assign(entry.name);
+    entry.location += ".pmm";
+    if (saved && NativeFileSize(m_path, size)) entry.pmmSize = size;
+    if (saved) m_storedBytes = entry.pmmSize + entry.emmSize;
+    return saved;
+}
+
+bool BackupEngine::catalog(const CatalogEntry& entry) {
+    return m_catalog.add(entry);
+}
+
+bool BackupEngine::applyRetention() {
+    m_removed.clear();
+    bool compactionDue = false;
+    if (m_policy.usePackFiles) {
+        // パックは索引から外すだけにし、詰め直しは呼び出し側の都合のよいときに行う
+        PackStore store(m_backupDir, m_stem);
+        std::vector<std::string> removedNames;
+        if (m_policy.maxBackupFiles < 9999 && store.applyRetention(m_policy.maxBackupFiles, &removedNames) > 0) {
+            compactionDue = true;
+        }
+        for (const auto& name : removedNames) m_removed.add() = name;
+    }
+    else {
+        cleanupLoose();
+    }
+    if (m_removed.empty()) return compactionDue;
+
+    m_catalog.remove(m_removed.begin(), m_removed.size());
+    for (const auto& name : m_removed) {
+        BuildPath(m_extraPath, m_backupDir, name, L".kfs");
+        NativeRemove(m_extraPath);
+        BuildPath(m_extraPath, m_backupDir, name, L".thumb.bmp");
+        NativeRemove(m_extraPath);
+        BuildPath(m_extraPath, m_backupDir, name, L".pose");
+        NativeRemove(m_extraPath);
+    }
+    return compactionDue;
+}
+
+void BackupEngine::cleanupLoose() {
+    if (m_policy.maxBackupFiles <= 0 || m_policy.maxBackupFiles >= 9999) return;
+
+    // 現在のPMMファイル名のバックアップ（<stem>_YYYYMMDD_HHMMSS[_N].pmm）のみを対象にする。
+    // 名前が前方一致するだけの別のプロジェクト（scene に対する scene2）のものは数えも消しもしない
+    static const NativePath::value_type kPmm[] = { '.', 'p', 'm', 'm' };
+    const size_t extLength = sizeof(kPmm) / sizeof(kPmm[0]);
+    if (!m_listing.read(m_backupDir)) return;
+    m_order.clear();
+    for (size_t i = 0; i < m_listing.size(); i++) {
+        const NativePath& file = m_listing.name(i);
+        if (file.size() > extLength && file.compare(file.size() - extLength, extLength, kPmm, extLength) == 0 &&
+            IsBackupName(file.data(), file.size() - extLength, m_stemNative.data(), m_stemNative.size())) {
+            m_order.push_back(i);
+        }
+    }
+    if (m_order.size() <= static_cast<size_t>(m_policy.maxBackupFiles)) return;
+
+    // ファイル名（タイムスタンプ）でソートし、古いファイルから削除
+    if (!m_leases) m_leases = LeaseTable::open(m_backupDir);
+    std::sort(m_order.begin(), m_order.end(), [this](size_t a, size_t b) {
+        return m_listing.name(a) < m_listing.name(b);
+    });
+    size_t filesToDelete = m_order.size() - m_policy.maxBackupFiles;
+    for (size_t i = 0; i < filesToDelete; i++) {
+        const NativePath& file = m_listing.name(m_order[i]);
+        m_nameUtf8.clear();
+#ifdef _WIN32
+        AppendUtf8(file.data(), file.size() - extLength, m_nameUtf8);
+#else
+        m_nameUtf8.append(file, 0, file.size() - extLength);
+#endif
+        // 作成中（名前のリースが生きている）のものは消さない
+        lease::NameResource(m_nameUtf8, m_resource);
+        if (m_leases->isHeld(m_resource)) continue;
+        BuildPath(m_path, m_backupDir, file);
+        NativeRemove(m_path);
+        m_removed.add() = m_nameUtf8;
+
+        // 対応するemmファイルも削除
+        BuildPath(m_path, m_backupDir, m_nameUtf8, L".emm");
+        NativeRemove(m_path);
+    }
+}
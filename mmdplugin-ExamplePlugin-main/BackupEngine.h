@@ -0,0 +1,105 @@
+﻿#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <experimental/filesystem>
+#include "BackupCatalog.h"
+#include "BackupIo.h"
+#include "BackupLease.h"
+
+namespace fs = std::experimental::filesystem;
+
+// 保存済みの PMM を Backup フォルダへ取り込み、一覧と世代を管理する
+//
+// triggerSave のうち MMD に依存しない部分（コピー・パックへの追記・一覧・世代整理）。
+// プラグインと、MMD の代わりに HostSimulator を使う BackupTool simulate の両方から、BackupCycle を通して使う。
+// 保存の要求や、サムネイル・キーフレームなど MMD から取るものは BackupCycle と BackupHost で行う。
+//
+// 同じフォルダを複数の MMD が使っていても、名前は snapshotName() でリースを取って予約するので
+// 重ならず、予約した名前は releaseName() を呼ぶまで他のプロセスの世代整理でも消されない。
+//
+// 同じプロジェクトの間はエンジンを持ち続けて使い回す。名前・パス・一覧・ディレクトリの読み取り結果は
+// メンバのバッファに組み立て直すだけなので、個別ファイル（Loose）の保存と世代整理は、温まった後は
+// ヒープを確保しない（BackupTool alloccheck で確かめる）。パックへの追記は対象外。
+
+struct BackupPolicy {
+    bool usePackFiles = true;
+    int maxBackupFiles = 50;    // 9999 以上は無制限
+};
+
+// 使い回す文字列の並び。clear() しても文字列の領域は残し、次の add() で上書きする
+class NameList {
+public:
+    NameList() : m_count(0) {}
+
+    size_t size() const { return m_count; }
+    bool empty() const { return m_count == 0; }
+    const std::string& operator[](size_t i) const { return m_items[i]; }
+    const std::string* begin() const { return m_items.data(); }
+    const std::string* end() const { return m_items.data() + m_count; }
+
+    // 末尾に1つ足して返す（中身は前に使ったときのまま）
+    std::string& add();
+    void clear() { m_count = 0; }
+
+private:
+    std::vector<std::string> m_items;
+    size_t m_count;
+};
+
+class BackupEngine {
+public:
+    BackupEngine(const fs::path& pmmPath, const BackupPolicy& policy);
+
+    const fs::path& pmmPath() const { return m_pmmPath; }
+    const BackupPolicy& policy() const { return m_policy; }
+    const fs::path& backupDir() const { return m_backupDir; }
+    const std::wstring& stem() const { return m_stem; }
+
+    // バックアップ名（<元の名前>_YYYYMMDD_HHMMSS、ローカル時刻）を予約する。
+    // 同じ秒の名前が既にあるか他で作成中なら _2, _3... を付ける
+    // 返す参照は次に snapshotName() を呼ぶまで有効
+    const std::wstring& snapshotName(int64_t time);
+
+    // PMM（と EMM）を保存する。entry に一覧用の情報を入れ、savedName に表示用の名前を返す
+    bool store(const std::wstring& name, int64_t time, TokenBucket* bucket, CatalogEntry& entry, std::wstring& savedName);
+    // 直前の store() で実際に書いたバイト数（パックなら圧縮後）
+    uint64_t storedBytes() const { return m_storedBytes; }
+
+    // 一覧に登録する
+    bool catalog(const CatalogEntry& entry);
+    // 予約した名前を手放す（一覧に載せた後なら、他のプロセスが同じ名前を使うことは無い）
+    void releaseName() { m_nameLease.release(); }
+
+    // 上限を超えた古いバックアップを消し、一覧と付随ファイル（.kfs など）からも外す。
+    // パックに詰め直すべき不要領域ができたら true
+    bool applyRetention();
+    // 直前の applyRetention() で消したバックアップ名
+    const NameList& removedNames() const { return m_removed; }
+
+private:
+    void cleanupLoose();
+    bool nameTaken();
+
+    fs::path m_pmmPath;
+    fs::path m_backupDir;
+    std::wstring m_stem;
+    BackupPolicy m_policy;
+    std::shared_ptr<LeaseTable> m_leases;
+    Lease m_nameLease;
+    BackupCatalog m_catalog;
+    uint64_t m_storedBytes;
+
+    // 1回のバックアップの中で組み立て直すバッファ
+    NativePath m_emmPath;
+    NativePath m_stemNative;
+    std::wstring m_base;
+    std::wstring m_name;
+    std::string m_nameUtf8;
+    std::string m_resource;
+    NativePath m_path;
+    NativePath m_extraPath;
+    DirectoryList m_listing;
+    std::vector<size_t> m_order;
+    NameList m_removed;
+};
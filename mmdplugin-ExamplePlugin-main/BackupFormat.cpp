@@ -0,0 +1,206 @@
+﻿#include "BackupFormat.h"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CRC_CLMUL_TARGET
+#else
+#include <cpuid.h>
+#define CRC_CLMUL_TARGET __attribute__((target("pclmul")))
+#endif
+#define CRC_CLMUL 1
+#endif
+
+namespace {
+    // slicing-by-8 用のテーブル
+    struct Crc32Table {
+        uint32_t t[8][256];
+        Crc32Table() {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++) c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+                t[0][i] = c;
+            }
+            for (uint32_t i = 0; i < 256; i++) {
+                for (int s = 1; s < 8; s++) t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xFF];
+            }
+        }
+    };
+
+    const Crc32Table& crcTable() {
+        static const Crc32Table table;
+        return table;
+    }
+}
+
+namespace {
+#ifdef CRC_CLMUL
+    bool hasClmul() {
+        int ecx;
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 1);
+        ecx = info[2];
+#else
+        unsigned a, b, c, d;
+        if (!__get_cpuid(1, &a, &b, &c, &d)) return false;
+        ecx = static_cast<int>(c);
+#endif
+        return (ecx & (1 << 1)) != 0;
+    }
+
+    // x の 128bit を k で 128bit 先へ送り、next に足す
+    CRC_CLMUL_TARGET inline __m128i fold(__m128i x, __m128i k, __m128i next) {
+        __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+        __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+        return _mm_xor_si128(_mm_xor_si128(lo, hi), next);
+    }
+
+    inline __m128i load(const uint8_t* at) {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i*>(at));
+    }
+
+    // 64 バイトずつ4本並べて畳み込み、最後に Barrett 還元で 32bit にする（Intel の
+    // "Fast CRC Computation Using PCLMULQDQ" の手順。定数は反転した多項式 0xEDB88320 用）。
+    // crc は反転済みの途中の値を受け取り、返す。size は 64 以上の 16 の倍数
+    CRC_CLMUL_TARGET uint32_t foldClmul(const uint8_t* p, size_t size, uint32_t crc) {
+        const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596ll, 0x0154442bd4ll);
+        const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009ell, 0x01751997d0ll);
+        const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124ll);
+        const __m128i poly = _mm_set_epi64x(0x01f7011641ll, 0x01db710641ll);
+        const __m128i low32 = _mm_setr_epi32(-1, 0, -1, 0);
+        __m128i x1 = _mm_xor_si128(load(p), _mm_cvtsi32_si128(static_cast<int>(crc)));
+        __m128i x2 = load(p + 16);
+        __m128i x3 = load(p + 32);
+        __m128i x4 = load(p + 48);
+        p += 64;
+        size -= 64;
+        for (; size >= 64; p += 64, size -= 64) {
+            x1 = fold(x1, k1k2, load(p));
+            x2 = fold(x2, k1k2, load(p + 16));
+            x3 = fold(x3, k1k2, load(p + 32));
+            x4 = fold(x4, k1k2, load(p + 48));
+        }
+        x1 = fold(x1, k3k4, x2);
+        x1 = fold(x1, k3k4, x3);
+        x1 = fold(x1, k3k4, x4);
+        for (; size >= 16; p += 16, size -= 16) x1 = fold(x1, k3k4, load(p));
+
+        // 128bit → 64bit
+        __m128i x2b = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+        x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2b);
+        x2b = _mm_srli_si128(x1, 4);
+        x1 = _mm_and_si128(x1, low32);
+        x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5, 0x00), x2b);
+        // Barrett 還元
+        x2b = _mm_and_si128(x1, low32);
+        x2b = _mm_clmulepi64_si128(x2b, poly, 0x10);
+        x2b = _mm_and_si128(x2b, low32);
+        x2b = _mm_clmulepi64_si128(x2b, poly, 0x00);
+        x1 = _mm_xor_si128(x1, x2b);
+        return static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_srli_si128(x1, 4)));
+    }
+
+    const bool g_hasClmul = hasClmul();
+#endif
+}
+
+uint32_t Crc32(const void* data, size_t size, uint32_t crc) {
+#ifdef CRC_CLMUL
+    if (g_hasClmul && size >= 64) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        size_t folded = size & ~static_cast<size_t>(15);
+        crc = ~foldClmul(p, folded, ~crc);
+        return Crc32Scalar(p + folded, size - folded, crc);
+    }
+#endif
+    return Crc32Scalar(data, size, crc);
+}
+
+uint32_t Crc32Scalar(const void* data, size_t size, uint32_t crc) {
+    const Crc32Table& tbl = crcTable();
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+    while (size >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = tbl.t[7][lo & 0xFF] ^ tbl.t[6][(lo >> 8) & 0xFF] ^ tbl.t[5][(lo >> 16) & 0xFF] ^ tbl.t[4][lo >> 24] ^
+            tbl.t[3][hi & 0xFF] ^ tbl.t[2][(hi >> 8) & 0xFF] ^ tbl.t[1][(hi >> 16) & 0xFF] ^ tbl.t[0][hi >> 24];
+        p += 8;
+        size -= 8;
+    }
+    while (size--) crc = tbl.t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+std::string WideToUtf8(const std::wstring& ws) {
+    std::string out;
+    out.reserve(ws.size());
+    AppendUtf8(ws.data(), ws.size(), out);
+    return out;
+}
+
+void AppendUtf8(const wchar_t* ws, size_t size, std::string& out) {
+    for (size_t i = 0; i < size; i++) {
+        uint32_t c = static_cast<uint32_t>(ws[i]);
+        // UTF-16 のサロゲートペア（Windows の wchar_t）
+        if (sizeof(wchar_t) == 2 && c >= 0xD800 && c <= 0xDBFF && i + 1 < size) {
+            uint32_t lo = static_cast<uint32_t>(ws[i + 1]);
+            if (lo >= 0xDC00 && lo <= 0xDFFF) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (lo - 0xDC00);
+                i++;
+            }
+        }
+        if (c < 0x80) {
+            out += static_cast<char>(c);
+        }
+        else if (c < 0x800) {
+            out += static_cast<char>(0xC0 | (c >> 6));
+            out += static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000) {
+            out += static_cast<char>(0xE0 | (c >> 12));
+            out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else {
+            out += static_cast<char>(0xF0 | (c >> 18));
+            out += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (c & 0x3F));
+        }
+    }
+}
+
+std::wstring Utf8ToWide(const std::string& s) {
+    std::wstring out;
+    out.reserve(s.size());
+    AppendWide(s.data(), s.size(), out);
+    return out;
+}
+
+void AppendWide(const char* s, size_t size, std::wstring& out) {
+    for (size_t i = 0; i < size;) {
+        uint8_t b = static_cast<uint8_t>(s[i]);
+        uint32_t c;
+        int extra;
+        if (b < 0x80) { c = b; extra = 0; }
+        else if ((b & 0xE0) == 0xC0) { c = b & 0x1F; extra = 1; }
+        else if ((b & 0xF0) == 0xE0) { c = b & 0x0F; extra = 2; }
+        else { c = b & 0x07; extra = 3; }
+        i++;
+        for (int k = 0; k < extra && i < size; k++, i++) c = (c << 6) | (static_cast<uint8_t>(s[i]) & 0x3F);
+        if (sizeof(wchar_t) == 2 && c >= 0x10000) {
+            c -= 0x10000;
+            out += static_cast<wchar_t>(0xD800 + (c >> 10));
+            out += static_cast<wchar_t>(0xDC00 + (c & 0x3FF));
+        }
+        else {
+            out += static_cast<wchar_t>(c);
+        }
+    }
+}
@@ -0,0 +1,113 @@
+﻿#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// バックアップの各ファイル形式で共通に使う小物
+// 数値はすべてリトルエンディアンで保存する
+
+// x86 で PCLMULQDQ が使えればそれで畳み込む（数 GB/s）。使えなければ表引き
+uint32_t Crc32(const void* data, size_t size, uint32_t crc = 0);
+// Crc32 と同じ結果を表引きだけで出す（BackupTool codeccheck の比較用）
+uint32_t Crc32Scalar(const void* data, size_t size, uint32_t crc = 0);
+
+std::string WideToUtf8(const std::wstring& ws);
+std::wstring Utf8ToWide(const std::string& s);
+// out の末尾に足す（out の容量が足りていれば確保しない）
+void AppendUtf8(const wchar_t* ws, size_t size, std::string& out);
+void AppendWide(const char* s, size_t size, std::wstring& out);
+
+// name[0, length) がプロジェクト stem のバックアップ名 "<stem>_YYYYMMDD_HHMMSS[_N]" か（確保しない）。
+// 先頭が stem と同じだけでは足りない。"scene" に対して "scene2_..." は別のプロジェクトのもの
+template<class Char>
+bool IsBackupName(const Char* name, size_t length, const Char* stem, size_t stemLength) {
+    auto digits = [name](size_t from, size_t to) {
+        for (size_t i = from; i < to; i++) {
+            if (name[i] < Char('0') || name[i] > Char('9')) return false;
+        }
+        return from < to;
+    };
+    if (length < stemLength + 16 || std::char_traits<Char>::compare(name, stem, stemLength) != 0) return false;
+    const size_t t = stemLength;
+    if (name[t] != Char('_') || !digits(t + 1, t + 9) || name[t + 9] != Char('_') || !digits(t + 10, t + 16)) return false;
+    const size_t rest = t + 16;
+    return rest == length || (name[rest] == Char('_') && digits(rest + 1, length));
+}
+
+// 可変長のバイト列へ書き込む
+class ByteWriter {
+public:
+    explicit ByteWriter(std::vector<uint8_t>& out) : m_out(out) {}
+
+    void u8(uint8_t v) { m_out.push_back(v); }
+    void u16(uint16_t v) { raw(&v, sizeof(v)); }
+    void u32(uint32_t v) { raw(&v, sizeof(v)); }
+    void u64(uint64_t v) { raw(&v, sizeof(v)); }
+    void i64(int64_t v) { raw(&v, sizeof(v)); }
+    void f32(float v) { raw(&v, sizeof(v)); }
+    void str(const std::string& s) {
+        u16(static_cast<uint16_t>(s.size()));
+        raw(s.data(), s.size());
+    }
+    void raw(const void* data, size_t size) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        m_out.insert(m_out.end(), p, p + size);
+    }
+    size_t size() const { return m_out.size(); }
+
+private:
+    std::vector<uint8_t>& m_out;
+};
+
+// バイト列から読み出す。範囲外を読もうとすると ok() が false になる
+class ByteReader {
+public:
+    ByteReader(const uint8_t* data, size_t size) : m_data(data), m_size(size), m_pos(0), m_ok(true) {}
+
+    uint8_t u8() { uint8_t v = 0; raw(&v, sizeof(v)); return v; }
+    uint16_t u16() { uint16_t v = 0; raw(&v, sizeof(v)); return v; }
+    uint32_t u32() { uint32_t v = 0; raw(&v, sizeof(v)); return v; }
+    uint64_t u64() { uint64_t v = 0; raw(&v, sizeof(v)); return v; }
+    int64_t i64() { int64_t v = 0; raw(&v, sizeof(v)); return v; }
+    float f32() { float v = 0; raw(&v, sizeof(v)); return v; }
+    std::string str() {
+        uint16_t n = u16();
+        if (!check(n)) return std::string();
+        std::string s(reinterpret_cast<const char*>(m_data + m_pos), n);
+        m_pos += n;
+        return s;
+    }
+    void raw(void* dst, size_t size) {
+        if (!check(size)) {
+            memset(dst, 0, size);
+            return;
+        }
+        memcpy(dst, m_data + m_pos, size);
+        m_pos += size;
+    }
+    const uint8_t* skip(size_t size) {
+        if (!check(size)) return nullptr;
+        const uint8_t* p = m_data + m_pos;
+        m_pos += size;
+        return p;
+    }
+
+    bool ok() const { return m_ok; }
+    size_t pos() const { return m_pos; }
+    size_t remaining() const { return m_size - m_pos; }
+
+private:
+    bool check(size_t size) {
+        if (!m_ok || size > m_size - m_pos) {
+            m_ok = false;
+            return false;
+        }
+        return true;
+    }
+
+    const uint8_t* m_data;
+    size_t m_size;
+    size_t m_pos;
+    bool m_ok;
+};
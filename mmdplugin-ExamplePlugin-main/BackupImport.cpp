@@ -0,0 +1,557 @@
+﻿#include "BackupImport.h"
+#include "BackupCatalog.h"
+#include "BackupFormat.h"
+#include "BackupLease.h"
+#include "BackupPack.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+
+namespace {
+    uint64_t fileSize(const fs::path& path) {
+        std::error_code ec;
+        uint64_t size = fs::file_size(path, ec);
+        return ec ? 0 : size;
+    }
+
+    // 無ければ空として true を返す
+    bool readFile(const fs::path& path, std::vector<uint8_t>& data, bool optional) {
+        data.clear();
+        std::ifstream in(path.c_str(), std::ios::binary);
+        if (!in.is_open()) return optional && !fs::exists(path);
+        in.seekg(0, std::ios::end);
+        std::streamoff size = in.tellg();
+        if (size < 0) return false;
+        data.resize(static_cast<size_t>(size));
+        in.seekg(0);
+        in.read(reinterpret_cast<char*>(data.data()), size);
+        return in.gcount() == size;
+    }
+
+    uint64_t hash64(const std::vector<uint8_t>& data, uint64_t h = 0xCBF29CE484222325ull) {
+        for (uint8_t c : data) h = (h ^ c) * 0x100000001B3ull;
+        return h;
+    }
+
+    fs::path emmPath(const fs::path& pmm) {
+        fs::path emm = pmm;
+        emm.replace_extension(L".emm");
+        return emm;
+    }
+
+    // 中身が同じかを比べるための要約
+    struct Content {
+        uint64_t pmmSize = 0;
+        uint32_t pmmCrc = 0;
+        uint64_t emmSize = 0;
+        uint32_t emmCrc = 0;
+        uint64_t hash = 0;
+
+        bool operator==(const Content& o) const {
+            return pmmSize == o.pmmSize && pmmCrc == o.pmmCrc && emmSize == o.emmSize && emmCrc == o.emmCrc && hash == o.hash;
+        }
+    };
+
+    struct Item {
+        fs::path pmm;
+        std::string name;
+        int64_t time = 0;
+        uint64_t bytes = 0;         // pmm と emm の合計
+        std::string sameAs;         // 重複として記録したものは、同じ内容のバックアップ名
+    };
+
+    // 読み込み・圧縮が済み、書き込みを待っているもの
+    struct Prepared {
+        bool ok = false;
+        std::string problem;
+        bool compressed = false;
+        Content content;
+        std::vector<uint8_t> pmm;   // compressed でなければ、書くときに圧縮する
+        std::vector<uint8_t> emm;
+        PreparedRecord record;
+        Lease lease;
+    };
+
+    struct Project {
+        fs::path backupDir;
+        std::wstring stem;
+        std::vector<Item> ingest;   // 時刻順
+        std::vector<Item> verify;   // パックに入っているか、重複として記録したもの
+        std::shared_ptr<LeaseTable> leases;
+
+        // 書き込み（時刻順に1つずつ）
+        std::mutex mutex;
+        size_t next = 0;
+        std::map<size_t, std::unique_ptr<Prepared>> ready;
+        bool hasLast = false;
+        Content last;
+        std::string lastName;
+        std::unique_ptr<BackupCatalog> catalog;
+
+        // 読み終えた項目の内容（書き込みを待たずに見られるよう別の mutex で守る）
+        std::mutex contentMutex;
+        std::vector<bool> known;
+        std::vector<Content> contents;
+
+        fs::path journalPath() const { return backupDir / (stem + L".import"); }
+    };
+
+    // Backup/<stem>.import: 重複として書かなかったバックアップ名と、同じ内容のバックアップ名を1行ずつ
+    std::map<std::string, std::string> readJournal(const fs::path& path) {
+        std::map<std::string, std::string> same;
+        std::ifstream in(path.c_str(), std::ios::binary);
+        std::string line;
+        while (std::getline(in, line)) {
+            size_t tab = line.find('\t');
+            if (tab == std::string::npos || tab == 0 || tab + 1 >= line.size()) continue;
+            same[line.substr(0, tab)] = line.substr(tab + 1);
+        }
+        return same;
+    }
+
+    bool appendJournal(const fs::path& path, const std::string& name, const std::string& sameAs) {
+        std::ofstream out(path.c_str(), std::ios::binary | std::ios::app);
+        out << name << '\t' << sameAs << '\n';
+        out.flush();
+        return out.good();
+    }
+
+    void findBackupDirs(const fs::path& root, std::vector<fs::path>& dirs) {
+        std::error_code ec;
+        if (root.filename() == L"Backup" && fs::is_directory(root, ec)) {
+            dirs.push_back(root);
+            return;
+        }
+        fs::recursive_directory_iterator it(root, fs::directory_options::skip_permission_denied, ec), end;
+        for (; !ec && it != end; it.increment(ec)) {
+            if (!fs::is_directory(it->status())) continue;
+            if (it->path().filename() != L"Backup") continue;
+            dirs.push_back(it->path());
+            it.disable_recursion_pending();
+        }
+    }
+
+    // Backup フォルダの個別ファイルを、取り込むものと確認するものに分ける
+    void scanBackupDir(const fs::path& backupDir, std::vector<std::unique_ptr<Project>>& projects) {
+        std::map<std::wstring, std::vector<Item>> loose;
+        std::error_code ec;
+        for (fs::directory_iterator it(backupDir, ec), end; !ec && it != end; it.increment(ec)) {
+            const fs::path& p = it->path();
+            std::wstring stem;
+            Item item;
+            if (p.extension() != L".pmm" || !store::SplitBackupName(p.stem().wstring(), stem, item.time)) continue;
+            item.pmm = p;
+            item.name = WideToUtf8(p.stem().wstring());
+            item.bytes = fileSize(p) + fileSize(emmPath(p));
+            loose[stem].push_back(item);
+        }
+        for (auto& it : loose) {
+            std::unique_ptr<Project> project(new Project);
+            project->backupDir = backupDir;
+            project->stem = it.first;
+            std::set<std::string> packed;
+            for (const auto& path : PackStore(backupDir, it.first).packPaths()) {
+                PackFile pack(path);
+                if (!pack.load()) continue;
+                for (const auto& e : pack.entries()) packed.insert(e.name);
+            }
+            std::map<std::string, std::string> same = readJournal(project->journalPath());
+            std::sort(it.second.begin(), it.second.end(), [](const Item& a, const Item& b) {
+                return a.time != b.time ? a.time < b.time : a.name < b.name;
+            });
+            for (auto& item : it.second) {
+                auto dup = same.find(item.name);
+                if (dup != same.end()) item.sameAs = dup->second;
+                if (dup != same.end() || packed.count(item.name)) project->verify.push_back(item);
+                else project->ingest.push_back(item);
+            }
+            projects.push_back(std::move(project));
+        }
+    }
+
+    // 読み込んで内容を要約し、直前と同じ内容とわかっていなければ圧縮まで済ませる
+    std::unique_ptr<Prepared> prepare(Project& project, size_t index, const migrate::Options& options, TaskExecutor& executor,
+        migrate::Progress& progress) {
+        const Item& item = project.ingest[index];
+        std::unique_ptr<Prepared> prepared(new Prepared);
+        // 同じ名前を MMD が作成中・整理中なら今回は触らない
+        prepared->lease = project.leases->tryAcquire(lease::NameResource(item.name));
+        if (!prepared->lease) {
+            prepared->problem = "in use by another process";
+            return prepared;
+        }
+        if (!readFile(item.pmm, prepared->pmm, false) || !readFile(emmPath(item.pmm), prepared->emm, true)) {
+            prepared->problem = "cannot be read";
+            return prepared;
+        }
+        progress.bytesDone += prepared->pmm.size() + prepared->emm.size();
+
+        Content& c = prepared->content;
+        c.pmmSize = prepared->pmm.size();
+        c.pmmCrc = Crc32(prepared->pmm.data(), prepared->pmm.size());
+        c.emmSize = prepared->emm.size();
+        c.emmCrc = Crc32(prepared->emm.data(), prepared->emm.size());
+        c.hash = hash64(prepared->emm, hash64(prepared->pmm));
+        prepared->ok = true;
+
+        // 1つ前と同じ内容なら、書くことはまず無いので圧縮しない（同じなら推移的に最後に書いたものとも同じ）
+        bool samePrevious = false;
+        {
+            std::lock_guard<std::mutex> lock(project.contentMutex);
+            project.known[index] = true;
+            project.contents[index] = c;
+            samePrevious = !options.keepDuplicates && index > 0 && project.known[index - 1] && project.contents[index - 1] == c;
+        }
+        if (!samePrevious) {
+            if (!PrepareRecord(item.name, item.time, prepared->pmm, prepared->emm, options.level, prepared->record, &executor)) {
+                prepared->ok = false;
+                prepared->problem = "cancelled";
+                return prepared;
+            }
+            prepared->compressed = true;
+            prepared->pmm = std::vector<uint8_t>();
+            prepared->emm = std::vector<uint8_t>();
+        }
+        return prepared;
+    }
+}
+
+namespace migrate {
+    Summary Run(const std::vector<fs::path>& roots, const Options& options, TaskExecutor& executor,
+        const std::function<void(const Progress&, double seconds)>& onProgress) {
+        Summary summary;
+        std::mutex summaryMutex;
+        auto issue = [&](const std::string& name, const std::string& problem) {
+            std::lock_guard<std::mutex> lock(summaryMutex);
+            summary.issues.push_back(store::Issue{ name, problem });
+        };
+        auto start = std::chrono::steady_clock::now();
+        auto elapsed = [&]() {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        };
+
+        // 進み具合の報告
+        Progress progress;
+        std::mutex reportMutex;
+        std::condition_variable reportCv;
+        bool finished = false;
+        std::thread reporter([&]() {
+            std::unique_lock<std::mutex> lock(reportMutex);
+            while (!finished) {
+                reportCv.wait_for(lock, std::chrono::seconds(1));
+                if (!finished && onProgress) onProgress(progress, elapsed());
+            }
+        });
+        auto beginPhase = [&](Phase phase, uint64_t files, uint64_t bytes) {
+            progress.phase = static_cast<int>(phase);
+            progress.filesTotal = files;
+            progress.filesDone = 0;
+            progress.bytesTotal = bytes;
+            progress.bytesDone = 0;
+        };
+
+        // 1. 探す
+        std::vector<fs::path> dirs;
+        for (const auto& root : roots) findBackupDirs(root, dirs);
+        summary.backupDirs = dirs.size();
+        std::vector<std::vector<std::unique_ptr<Project>>> found(dirs.size());
+        beginPhase(Phase::Scan, dirs.size(), 0);
+        executor.parallelFor(dirs.size(), TaskPriority::Maintenance, [&](size_t i) {
+            scanBackupDir(dirs[i], found[i]);
+            progress.filesDone++;
+        });
+        std::vector<std::unique_ptr<Project>> projects;
+        for (auto& list : found) {
+            for (auto& p : list) {
+                if (p->ingest.empty() && p->verify.empty()) continue;
+                summary.found += p->ingest.size() + p->verify.size();
+                for (const auto& item : p->ingest) summary.foundBytes += item.bytes;
+                for (const auto& item : p->verify) summary.foundBytes += item.bytes;
+                projects.push_back(std::move(p));
+            }
+        }
+        summary.projects = projects.size();
+
+        if (!options.dryRun) {
+            // 2. 取り込む。プロジェクトを順に混ぜて配り、違うフォルダの読み書きが重なるようにする
+            std::vector<std::pair<size_t, size_t>> order;
+            uint64_t ingestBytes = 0;
+            for (size_t round = 0;; round++) {
+                bool any = false;
+                for (size_t p = 0; p < projects.size(); p++) {
+                    if (round >= projects[p]->ingest.size()) continue;
+                    order.emplace_back(p, round);
+                    ingestBytes += projects[p]->ingest[round].bytes;
+                    any = true;
+                }
+                if (!any) break;
+            }
+            for (auto& p : projects) {
+                p->leases = LeaseTable::open(p->backupDir);
+                p->known.assign(p->ingest.size(), false);
+                p->contents.resize(p->ingest.size());
+                p->catalog.reset(new BackupCatalog(p->backupDir, p->stem));
+                p->catalog->load();
+            }
+            beginPhase(Phase::Ingest, order.size(), ingestBytes);
+
+            // 書き込みは項目の順に、その項目を読み終えたスレッドか、後の項目を読み終えたスレッドが行う
+            auto write = [&](Project& project, size_t index, Prepared& prepared) {
+                const Item& item = project.ingest[index];
+                if (!prepared.ok) {
+                    issue(item.name, prepared.problem);
+                    return;
+                }
+                if (!options.keepDuplicates && project.hasLast && prepared.content == project.last) {
+                    if (!appendJournal(project.journalPath(), item.name, project.lastName)) {
+                        issue(item.name, "cannot write " + WideToUtf8(project.journalPath().filename().wstring()));
+                        return;
+                    }
+                    Item dup = item;
+                    dup.sameAs = project.lastName;
+                    project.verify.push_back(dup);
+                    std::lock_guard<std::mutex> lock(summaryMutex);
+                    summary.duplicates++;
+                    return;
+                }
+                if (!prepared.compressed && !PrepareRecord(item.name, item.time, prepared.pmm, prepared.emm, options.level, prepared.record, &executor)) {
+                    issue(item.name, "cancelled");
+                    return;
+                }
+                fs::path packPath;
+                PackEntry added;
+                if (!PackStore(project.backupDir, project.stem).appendPrepared(prepared.record, &packPath, &added)) {
+                    issue(item.name, "cannot be written to a pack");
+                    return;
+                }
+                CatalogEntry entry;
+                if (const CatalogEntry* old = project.catalog->find(item.name)) entry = *old;
+                entry.name = item.name;
+                entry.time = item.time;
+                entry.storage = CatalogStorage::Pack;
+                entry.location = WideToUtf8(packPath.filename().wstring());
+                entry.pmmSize = added.pmmRaw;
+                entry.pmmCrc = added.pmmCrc;
+                entry.emmSize = added.emmRaw;
+                // 一覧に載らなくても、次回の確認で載せ直す
+                if (!project.catalog->add(entry)) issue(item.name, "cannot be added to the catalog");
+
+                project.hasLast = true;
+                project.last = prepared.content;
+                project.lastName = item.name;
+                project.verify.push_back(item);
+                std::lock_guard<std::mutex> lock(summaryMutex);
+                summary.imported++;
+                summary.bytesStored += added.recordSize();
+            };
+
+            executor.parallelFor(order.size(), TaskPriority::Maintenance, [&](size_t k) {
+                Project& project = *projects[order[k].first];
+                size_t index = order[k].second;
+                std::unique_ptr<Prepared> prepared = prepare(project, index, options, executor, progress);
+                if (prepared->ok) {
+                    std::lock_guard<std::mutex> lock(summaryMutex);
+                    summary.bytesRead += prepared->content.pmmSize + prepared->content.emmSize;
+                }
+                std::lock_guard<std::mutex> lock(project.mutex);
+                project.ready[index] = std::move(prepared);
+                for (auto it = project.ready.find(project.next); it != project.ready.end(); it = project.ready.find(project.next)) {
+                    std::unique_ptr<Prepared> next = std::move(it->second);
+                    project.ready.erase(it);
+                    write(project, project.next, *next);
+                    project.next++;
+                    progress.filesDone++;
+                }
+            });
+
+            // 書いたパックと重複の記録をディスクまで書き出す。追記は OS のキャッシュに置いただけなので、
+            // このまま元を消すと、電源が落ちたときに両方を失うことがある。書き出せなかったプロジェクトは元を残す
+            std::vector<char> durable(projects.size(), 1);
+            for (size_t p = 0; p < projects.size(); p++) {
+                const Project& project = *projects[p];
+                if (project.verify.empty() || options.keepOriginals) continue;
+                std::error_code ec;
+                for (const auto& path : PackStore(project.backupDir, project.stem).packPaths()) {
+                    if (!PackFile(path).sync()) durable[p] = 0;
+                }
+                if (fs::exists(project.journalPath(), ec) && !NativeSync(project.journalPath().native())) durable[p] = 0;
+                if (!durable[p]) issue(WideToUtf8(project.stem), "packs cannot be flushed to disk; originals kept");
+            }
+
+            // 3. 元のファイルと突き合わせ、一致したものだけ消す
+            uint64_t verifyBytes = 0;
+            size_t verifyCount = 0;
+            for (const auto& p : projects) {
+                verifyCount += p->verify.size();
+                for (const auto& item : p->verify) verifyBytes += item.bytes;
+            }
+            beginPhase(Phase::Verify, verifyCount, verifyBytes);
+
+            struct Packed {
+                std::shared_ptr<PackFile> pack;
+                const PackEntry* entry;
+            };
+            std::vector<std::map<std::string, Packed>> packed(projects.size());
+            std::vector<std::set<std::string>> good(projects.size());       // パックのレコードを確かめたもの
+            std::vector<std::set<std::string>> failed(projects.size());     // パックのレコードが正しくないもの
+            std::vector<std::vector<std::string>> dropped(projects.size()); // 一覧から外す重複
+            std::vector<std::vector<const Item*>> recatalog(projects.size());
+            std::mutex verifyMutex;
+            for (size_t p = 0; p < projects.size(); p++) {
+                for (const auto& path : PackStore(projects[p]->backupDir, projects[p]->stem).packPaths()) {
+                    auto pack = std::make_shared<PackFile>(path);
+                    if (!pack->load()) continue;
+                    for (const auto& e : pack->entries()) packed[p][e.name] = Packed{ pack, &e };
+                }
+            }
+
+            auto check = [&](size_t p, const Item& item) {
+                Project& project = *projects[p];
+                const std::string& target = item.sameAs.empty() ? item.name : item.sameAs;
+                auto it = packed[p].find(target);
+                Lease held = project.leases->tryAcquire(lease::NameResource(item.name));
+                if (!held) {
+                    issue(item.name, "in use by another process");
+                    return;
+                }
+                if (it == packed[p].end()) {
+                    issue(item.name, item.sameAs.empty() ? "not found in the packs" : "same as " + item.sameAs + ", which is not in the packs");
+                    return;
+                }
+                const PackEntry& e = *it->second.entry;
+                std::vector<uint8_t> pmm, emm;
+                if (!readFile(item.pmm, pmm, false) || !readFile(emmPath(item.pmm), emm, true)) {
+                    issue(item.name, "cannot be read");
+                    return;
+                }
+                progress.bytesDone += pmm.size() + emm.size();
+                {
+                    std::lock_guard<std::mutex> lock(summaryMutex);
+                    summary.bytesRead += pmm.size() + emm.size();
+                }
+                if (pmm.size() != e.pmmRaw || Crc32(pmm.data(), pmm.size()) != e.pmmCrc ||
+                    emm.size() != e.emmRaw || Crc32(emm.data(), emm.size()) != e.emmCrc) {
+                    issue(item.name, "differs from " + target + " in the pack; original kept");
+                    return;
+                }
+                // 重複のときは同じ内容のレコード（前回までに取り込んだものかもしれない）を一度だけ確かめる
+                bool verified = false;
+                {
+                    std::lock_guard<std::mutex> lock(verifyMutex);
+                    if (failed[p].count(target)) return;
+                    verified = good[p].count(target) != 0;
+                }
+                if (!verified) {
+                    bool ok = it->second.pack->verify(e, nullptr);
+                    std::lock_guard<std::mutex> lock(verifyMutex);
+                    (ok ? good : failed)[p].insert(target);
+                    if (!ok) {
+                        issue(target, "pack record is corrupt; original kept");
+                        return;
+                    }
+                }
+                if (item.sameAs.empty()) {
+                    const CatalogEntry* listed = project.catalog ? project.catalog->find(item.name) : nullptr;
+                    if (!listed || listed->storage != CatalogStorage::Pack) {
+                        std::lock_guard<std::mutex> lock(verifyMutex);
+                        recatalog[p].push_back(&item);
+                    }
+                }
+                {
+                    std::lock_guard<std::mutex> lock(summaryMutex);
+                    summary.verified++;
+                }
+                if (options.keepOriginals || !durable[p]) return;
+                std::error_code ec;
+                bool removed = fs::remove(item.pmm, ec) && !ec;
+                fs::remove(emmPath(item.pmm), ec);
+                if (!item.sameAs.empty()) {
+                    // 重複はパックに無いので一覧から外す。付随ファイルは、同じ内容のものに無ければそちらへ移す
+                    static const wchar_t* const suffixes[] = { L".kfs", L".thumb.bmp", L".pose" };
+                    for (const wchar_t* suffix : suffixes) {
+                        fs::path from = project.backupDir / (Utf8ToWide(item.name) + suffix);
+                        fs::path to = project.backupDir / (Utf8ToWide(item.sameAs) + suffix);
+                        if (!fs::exists(from, ec)) continue;
+                        if (fs::exists(to, ec)) fs::remove(from, ec);
+                        else fs::rename(from, to, ec);
+                    }
+                    std::lock_guard<std::mutex> lock(verifyMutex);
+                    dropped[p].push_back(item.name);
+                }
+                if (removed) {
+                    std::lock_guard<std::mutex> lock(summaryMutex);
+                    summary.removed++;
+                }
+            };
+
+            // パックに入れたものを先に確かめ、その結果を見てから重複を片付ける
+            for (int pass = 0; pass < 2; pass++) {
+                std::vector<std::pair<size_t, const Item*>> work;
+                for (size_t p = 0; p < projects.size(); p++) {
+                    for (const auto& item : projects[p]->verify) {
+                        if (item.sameAs.empty() == (pass == 0)) work.emplace_back(p, &item);
+                    }
+                }
+                executor.parallelFor(work.size(), TaskPriority::Maintenance, [&](size_t i) {
+                    check(work[i].first, *work[i].second);
+                    progress.filesDone++;
+                });
+            }
+
+            for (size_t p = 0; p < projects.size(); p++) {
+                Project& project = *projects[p];
+                if (!project.catalog) continue;
+                // パックには書いたが一覧に載る前に止まったもの
+                for (const Item* item : recatalog[p]) {
+                    const PackEntry& e = *packed[p][item->name].entry;
+                    CatalogEntry entry;
+                    if (const CatalogEntry* old = project.catalog->find(item->name)) entry = *old;
+                    entry.name = item->name;
+                    entry.time = item->time;
+                    entry.storage = CatalogStorage::Pack;
+                    entry.location = WideToUtf8(packed[p][item->name].pack->path().filename().wstring());
+                    entry.pmmSize = e.pmmRaw;
+                    entry.pmmCrc = e.pmmCrc;
+                    entry.emmSize = e.emmRaw;
+                    if (!project.catalog->add(entry)) issue(item->name, "cannot be added to the catalog");
+                }
+                project.catalog->remove(dropped[p]);
+
+                // 元のファイルが残っている重複だけを記録に残す
+                std::vector<std::pair<std::string, std::string>> remaining;
+                for (const auto& item : project.verify) {
+                    std::error_code ec;
+                    if (!item.sameAs.empty() && fs::exists(item.pmm, ec)) remaining.emplace_back(item.name, item.sameAs);
+                }
+                fs::path journal = project.journalPath();
+                std::error_code ec;
+                if (remaining.empty()) {
+                    fs::remove(journal, ec);
+                    continue;
+                }
+                fs::path tmp = journal;
+                tmp += L".tmp";
+                fs::remove(tmp, ec);
+                bool ok = true;
+                for (const auto& r : remaining) ok = ok && appendJournal(tmp, r.first, r.second);
+                if (!ok || !ReplaceFileAtomic(tmp, journal)) fs::remove(tmp, ec);
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(reportMutex);
+            finished = true;
+            progress.phase = static_cast<int>(Phase::Done);
+        }
+        reportCv.notify_all();
+        reporter.join();
+        summary.seconds = elapsed();
+        return summary;
+    }
+}
@@ -0,0 +1,64 @@
+﻿#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include <experimental/filesystem>
+#include "BackupStore.h"
+#include "TaskExecutor.h"
+
+namespace fs = std::experimental::filesystem;
+
+// 以前の triggerSave が Backup フォルダに書いた個別ファイル（<stem>_YYYYMMDD_HHMMSS.pmm / .emm）を
+// パックと一覧へ取り込む。BackupTool import から使う。
+//
+// 指定したフォルダの下にあるすべての Backup フォルダを探し、プロジェクトごとに時刻順で取り込む。
+//   1. 読み込み・圧縮は executor（Maintenance）で並列に行う。プロジェクトを順に混ぜて配るので、
+//      フォルダ（ディスク）が違えば読み書きも並列になる
+//   2. 書き込みはプロジェクトごとに時刻順で、直前に取り込んだものと中身が同じ（サイズ・CRC32・
+//      64bit ハッシュが一致する）スナップショットはパックに書かず、同じ内容として記録だけする
+//   3. すべて書いてから、元のファイルを読み直してパックのレコードと一致することを確かめ、
+//      確かめられたものだけ元のファイルを消す（keepOriginals なら消さない）
+// 途中で止めても、パックに入ったものは次回は確認から、重複として飛ばしたものは
+// Backup/<stem>.import に記録してあるので、そのまま続きから再開できる。
+// 取り込み中のバックアップ名にはリース（BackupLease.h）を持つので、MMD が動いていても構わない。
+
+namespace migrate {
+    struct Options {
+        int level = 9;              // LzCodec の圧縮レベル。0 なら無圧縮
+        bool keepOriginals = false;
+        bool keepDuplicates = false;
+        bool dryRun = false;        // 探して数えるだけ
+    };
+
+    enum class Phase { Scan, Ingest, Verify, Done };
+
+    // 別スレッドから読むので atomic にしてある
+    struct Progress {
+        std::atomic<int> phase{ static_cast<int>(Phase::Scan) };
+        std::atomic<uint64_t> filesTotal{ 0 };
+        std::atomic<uint64_t> filesDone{ 0 };
+        std::atomic<uint64_t> bytesTotal{ 0 };
+        std::atomic<uint64_t> bytesDone{ 0 };
+    };
+
+    struct Summary {
+        size_t backupDirs = 0;
+        size_t projects = 0;
+        size_t found = 0;           // 取り込む対象の個別ファイル（確認待ちを含む）
+        uint64_t foundBytes = 0;
+        size_t imported = 0;        // パックに書いたもの
+        size_t duplicates = 0;      // 直前と同じ内容だったもの
+        size_t verified = 0;
+        size_t removed = 0;         // 確かめて元のファイルを消したもの
+        uint64_t bytesRead = 0;
+        uint64_t bytesStored = 0;   // パックに書いた格納サイズ
+        double seconds = 0;
+        std::vector<store::Issue> issues;
+    };
+
+    // roots の下の Backup フォルダをすべて取り込む。onProgress はおよそ1秒ごとに別スレッドから呼ばれる
+    Summary Run(const std::vector<fs::path>& roots, const Options& options, TaskExecutor& executor,
+        const std::function<void(const Progress&, double seconds)>& onProgress);
+}
@@ -0,0 +1,304 @@
+﻿#include "BackupIo.h"
+#include "AsyncIo.h"
+#include "BackupFormat.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cwchar>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// --- TokenBucket ---
+
+TokenBucket::TokenBucket()
+    : m_rate(0), m_burst(0), m_tokens(0), m_lastRefill(std::chrono::steady_clock::now()),
+    m_cancelled(false), m_throttledNs(0), m_bytes(0) {}
+
+void TokenBucket::configure(uint64_t bytesPerSec, uint64_t burstBytes) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_rate.store(bytesPerSec, std::memory_order_relaxed);
+    m_burst = static_cast<double>(std::max<uint64_t>(burstBytes, kIoChunkSize));
+    m_tokens = m_burst;
+    m_lastRefill = std::chrono::steady_clock::now();
+}
+
+uint64_t TokenBucket::acquire(uint64_t bytes) {
+    m_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    uint64_t rate = m_rate.load(std::memory_order_relaxed);
+    if (rate == 0) return 0;
+
+    double waitSec = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - m_lastRefill).count();
+        m_lastRefill = now;
+        m_tokens = (std::min)(m_burst, m_tokens + elapsed * static_cast<double>(rate));
+        m_tokens -= static_cast<double>(bytes);
+        if (m_tokens < 0) waitSec = -m_tokens / static_cast<double>(rate);
+    }
+    if (waitSec <= 0) return 0;
+
+    // stop() を待たせないよう小刻みに待つ
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(waitSec));
+    while (!m_cancelled.load(std::memory_order_relaxed)) {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) break;
+        std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(deadline - now, std::chrono::milliseconds(50)));
+    }
+    uint64_t waited = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+    m_throttledNs.fetch_add(waited, std::memory_order_relaxed);
+    return waited;
+}
+
+// --- BackgroundIoScope ---
+
+#ifndef _WIN32
+namespace {
+    const int kIoprioWhoProcess = 1;
+    const int kIoprioClassShift = 13;
+    const int kIoprioClassIdle = 3;
+}
+#endif
+
+BackgroundIoScope::BackgroundIoScope(bool enable) : m_active(false), m_previous(0) {
+    if (!enable) return;
+#ifdef _WIN32
+    m_active = SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN) != FALSE;
+#else
+    // who=0 は呼び出しスレッド
+    m_previous = static_cast<int>(syscall(SYS_ioprio_get, kIoprioWhoProcess, 0));
+    m_active = m_previous >= 0 &&
+        syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, kIoprioClassIdle << kIoprioClassShift) == 0;
+#endif
+}
+
+BackgroundIoScope::~BackgroundIoScope() {
+    if (!m_active) return;
+#ifdef _WIN32
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+#else
+    syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, m_previous);
+#endif
+}
+
+// --- CopyFileThrottled ---
+
+bool CopyFileThrottled(const fs::path& src, const fs::path& dst, TokenBucket* bucket) {
+    // 1MB ずつ読んで書くのを繰り返すより、いくつも同時に出しておく方が SSD では速い
+    return CopyFileAsync(src, dst, bucket, SharedAsyncIo());
+}
+
+bool ReplaceFileAtomic(const fs::path& from, const fs::path& to) {
+    return NativeReplace(from.native(), to.native());
+}
+
+// --- NativePath ---
+
+namespace {
+    void appendWide(NativePath& out, const wchar_t* s, size_t n) {
+#ifdef _WIN32
+        out.append(s, n);
+#else
+        AppendUtf8(s, n, out);
+#endif
+    }
+
+    void assignDir(NativePath& out, const fs::path& dir) {
+        out.assign(dir.native());
+        const NativePath::value_type sep = fs::path::preferred_separator;
+        if (!out.empty() && out.back() != sep && out.back() != '/') out += sep;
+    }
+}
+
+void BuildPath(NativePath& out, const fs::path& dir, const std::wstring& name, const wchar_t* suffix) {
+    assignDir(out, dir);
+    appendWide(out, name.data(), name.size());
+    if (suffix) appendWide(out, suffix, wcslen(suffix));
+}
+
+void BuildPath(NativePath& out, const fs::path& dir, const std::string& name, const wchar_t* suffix) {
+    assignDir(out, dir);
+#ifdef _WIN32
+    AppendWide(name.data(), name.size(), out);
+#else
+    out += name;
+#endif
+    if (suffix) appendWide(out, suffix, wcslen(suffix));
+}
+
+void BuildPath(NativePath& out, const fs::path& dir, const NativePath& fileName) {
+    assignDir(out, dir);
+    out += fileName;
+}
+
+#ifdef _WIN32
+bool NativeExists(const NativePath& path) {
+    return GetFileAttributesW(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+}
+
+bool NativeRemove(const NativePath& path) {
+    return DeleteFileW(path.c_str()) != FALSE;
+}
+
+bool NativeFileSize(const NativePath& path, uint64_t& size) {
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &data)) return false;
+    size = static_cast<uint64_t>(data.nFileSizeHigh) << 32 | data.nFileSizeLow;
+    return true;
+}
+
+namespace {
+    bool writeHandle(HANDLE h, const void* data, size_t size) {
+        DWORD written = 0;
+        bool ok = WriteFile(h, data, static_cast<DWORD>(size), &written, NULL) && written == size;
+        return CloseHandle(h) && ok;
+    }
+}
+
+bool NativeAppend(const NativePath& path, const void* data, size_t size) {
+    HANDLE h = CreateFileW(path.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    return h != INVALID_HANDLE_VALUE && writeHandle(h, data, size);
+}
+
+bool NativeReplace(const NativePath& from, const NativePath& to) {
+    return MoveFileExW(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != FALSE;
+}
+
+bool NativeWrite(const NativePath& path, const void* data, size_t size) {
+    HANDLE h = CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    return h != INVALID_HANDLE_VALUE && writeHandle(h, data, size);
+}
+
+bool NativeSync(const NativePath& path) {
+    // FlushFileBuffers には書き込みの権限が要る
+    HANDLE h = CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h == INVALID_HANDLE_VALUE) return false;
+    bool ok = FlushFileBuffers(h) != FALSE;
+    return CloseHandle(h) && ok;
+}
+
+bool DirectoryList::read(const fs::path& dir) {
+    m_count = 0;
+    assignDir(m_pattern, dir);
+    m_pattern += L'*';
+    WIN32_FIND_DATAW data;
+    HANDLE find = FindFirstFileExW(m_pattern.c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+    if (find == INVALID_HANDLE_VALUE) return GetLastError() == ERROR_FILE_NOT_FOUND;
+    do {
+        if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) add(data.cFileName);
+    } while (FindNextFileW(find, &data));
+    FindClose(find);
+    return true;
+}
+#else
+bool NativeExists(const NativePath& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+bool NativeRemove(const NativePath& path) {
+    return unlink(path.c_str()) == 0;
+}
+
+bool NativeFileSize(const NativePath& path, uint64_t& size) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return false;
+    size = static_cast<uint64_t>(st.st_size);
+    return true;
+}
+
+namespace {
+    bool writeFd(int fd, const void* data, size_t size) {
+        const char* p = static_cast<const char*>(data);
+        bool ok = true;
+        while (size > 0) {
+            ssize_t n = ::write(fd, p, size);
+            if (n <= 0) {
+                ok = false;
+                break;
+            }
+            p += n;
+            size -= static_cast<size_t>(n);
+        }
+        return close(fd) == 0 && ok;
+    }
+}
+
+bool NativeAppend(const NativePath& path, const void* data, size_t size) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    return fd >= 0 && writeFd(fd, data, size);
+}
+
+bool NativeReplace(const NativePath& from, const NativePath& to) {
+    return rename(from.c_str(), to.c_str()) == 0;
+}
+
+bool NativeWrite(const NativePath& path, const void* data, size_t size) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    return fd >= 0 && writeFd(fd, data, size);
+}
+
+namespace {
+    bool syncFd(int fd) {
+        if (fd < 0) return false;
+        bool ok = fsync(fd) == 0;
+        return close(fd) == 0 && ok;
+    }
+}
+
+bool NativeSync(const NativePath& path) {
+    if (!syncFd(open(path.c_str(), O_RDONLY | O_CLOEXEC))) return false;
+    // 作ったばかりのファイルは、ディレクトリの項目も書き出さないと名前ごと消えることがある
+    size_t slash = path.rfind('/');
+    NativePath dir = slash == NativePath::npos ? NativePath(".") : slash == 0 ? NativePath("/") : path.substr(0, slash);
+    return syncFd(open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+}
+
+bool DirectoryList::read(const fs::path& dir) {
+    // opendir は malloc するので、getdents64 で固定のバッファに読む
+    struct LinuxDirent64 {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[1];
+    };
+    m_count = 0;
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return errno == ENOENT;
+    alignas(8) char buffer[16 * 1024];
+    for (;;) {
+        long n = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+        if (n <= 0) break;
+        for (long pos = 0; pos < n;) {
+            const LinuxDirent64* d = reinterpret_cast<const LinuxDirent64*>(buffer + pos);
+            pos += d->d_reclen;
+            struct stat st;
+            if (d->d_type == DT_REG || (d->d_type == DT_UNKNOWN && fstatat(fd, d->d_name, &st, 0) == 0 && S_ISREG(st.st_mode))) {
+                add(d->d_name);
+            }
+        }
+    }
+    close(fd);
+    return true;
+}
+#endif
+
+void DirectoryList::add(const NativePath::value_type* name) {
+    if (m_count == m_names.size()) m_names.emplace_back();
+    m_names[m_count++].assign(name);
+}
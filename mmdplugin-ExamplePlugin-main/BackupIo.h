@@ -0,0 +1,108 @@
+﻿#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <experimental/filesystem>
+
+namespace fs = std::experimental::filesystem;
+
+// バイト数単位のトークンバケット。不足分は借り越し、借りた分だけ呼び出し元を待たせる
+class TokenBucket {
+public:
+    TokenBucket();
+
+    // bytesPerSec が 0 なら無制限
+    void configure(uint64_t bytesPerSec, uint64_t burstBytes);
+    bool enabled() const { return m_rate.load(std::memory_order_relaxed) != 0; }
+
+    // bytes 分のトークンを取得する。待った時間(ns)を返す
+    uint64_t acquire(uint64_t bytes);
+
+    // 待機中の acquire をすぐに戻す（stop() 用）
+    void cancel() { m_cancelled.store(true, std::memory_order_relaxed); }
+    void reset() { m_cancelled.store(false, std::memory_order_relaxed); }
+
+    uint64_t throttledNs() const { return m_throttledNs.load(std::memory_order_relaxed); }
+    uint64_t bytesPassed() const { return m_bytes.load(std::memory_order_relaxed); }
+
+private:
+    std::mutex m_mutex;
+    std::atomic<uint64_t> m_rate;
+    double m_burst;
+    double m_tokens;
+    std::chrono::steady_clock::time_point m_lastRefill;
+
+    std::atomic<bool> m_cancelled;
+    std::atomic<uint64_t> m_throttledNs;
+    std::atomic<uint64_t> m_bytes;
+};
+
+// スコープ内のスレッドを低I/O優先度にする
+// Windows: THREAD_MODE_BACKGROUND_BEGIN、Linux: ioprio_set(IOPRIO_CLASS_IDLE)
+class BackgroundIoScope {
+public:
+    explicit BackgroundIoScope(bool enable);
+    ~BackgroundIoScope();
+
+    BackgroundIoScope(const BackgroundIoScope&) = delete;
+    BackgroundIoScope& operator=(const BackgroundIoScope&) = delete;
+
+private:
+    bool m_active;
+    int m_previous;
+};
+
+// 1MB 単位で読み書きし、bucket があれば帯域を制限するファイルコピー（上書き）。
+// プロセスで共有する SharedAsyncIo() でいくつものかたまりを同時に読み書きする（AsyncIo.h）
+bool CopyFileThrottled(const fs::path& src, const fs::path& dst, TokenBucket* bucket);
+
+// from を to へアトミックに置き換える（to が既にあれば上書き）
+bool ReplaceFileAtomic(const fs::path& from, const fs::path& to);
+
+// 読み込み・書き込みの両方で共有するチャンクサイズ
+const size_t kIoChunkSize = 1024 * 1024;
+
+// --- バックアップのたびに通るところ用のファイル操作 ---
+// fs::path は作るたびに確保するので、使い回す文字列でパスを組み立てて OS の関数を直接呼ぶ。
+// 文字列は Windows では UTF-16、それ以外では UTF-8（fs::path::string_type と同じ）
+typedef fs::path::string_type NativePath;
+
+// out = dir + 区切り + name + suffix。out の容量が足りていれば確保しない
+void BuildPath(NativePath& out, const fs::path& dir, const std::wstring& name, const wchar_t* suffix);
+// name が UTF-8 の版（一覧に載っているバックアップ名から組み立てるとき）
+void BuildPath(NativePath& out, const fs::path& dir, const std::string& name, const wchar_t* suffix);
+// out = dir + 区切り + fileName
+void BuildPath(NativePath& out, const fs::path& dir, const NativePath& fileName);
+
+bool NativeExists(const NativePath& path);
+bool NativeRemove(const NativePath& path);
+// 読めなければ false
+bool NativeFileSize(const NativePath& path, uint64_t& size);
+// 末尾に追記する（無ければ作る）
+bool NativeAppend(const NativePath& path, const void* data, size_t size);
+// 作り直して書く
+bool NativeWrite(const NativePath& path, const void* data, size_t size);
+// ReplaceFileAtomic と同じ
+bool NativeReplace(const NativePath& from, const NativePath& to);
+// 書いた中身をディスクまで書き出す（電源が落ちても残るように）。POSIX では名前が残るよう親ディレクトリも
+bool NativeSync(const NativePath& path);
+
+// ディレクトリ内の通常ファイルの名前。読み直しても前回の文字列を使い回す
+class DirectoryList {
+public:
+    DirectoryList() : m_count(0) {}
+
+    bool read(const fs::path& dir);
+    size_t size() const { return m_count; }
+    const NativePath& name(size_t i) const { return m_names[i]; }
+
+private:
+    void add(const NativePath::value_type* name);
+
+    std::vector<NativePath> m_names;
+    size_t m_count;
+    NativePath m_pattern;
+};
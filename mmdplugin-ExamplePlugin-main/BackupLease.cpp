@@ -0,0 +1,293 @@
+﻿#include "BackupLease.h"
+#include "BackupFormat.h"
+#include <algorithm>
+#include <map>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// 共有メモリ上の atomic はプロセスをまたいで使うので、ロックを使わない実装でなければならない
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "64-bit atomics must be lock-free");
+
+struct LeaseTable::Header {
+    std::atomic<uint64_t> format;       // Magic << 32 | Version。0 なら未使用（最初に開いた側が書く）
+    std::atomic<uint64_t> sequence;     // トークンの通し番号
+    uint64_t reserved[6];
+};
+
+struct LeaseTable::Slot {
+    std::atomic<uint64_t> owner;        // 持ち主のトークン。0 なら空き
+    std::atomic<int64_t> expiresMs;     // steady_clock のミリ秒。過ぎていれば空きとみなす
+    std::atomic<uint64_t> key;          // 資源の名前のハッシュ
+    uint64_t reserved;
+};
+
+static_assert(sizeof(std::atomic<uint64_t>) == 8, "unexpected atomic layout");
+
+namespace {
+    const size_t kTableSize = 64 + lease::SlotCount * 32;
+    const uint64_t kFormat = static_cast<uint64_t>(lease::Magic) << 32 | lease::Version;
+
+    int64_t nowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    uint64_t resourceKey(const std::string& resource) {
+        uint64_t h = 0xCBF29CE484222325ull;
+        for (unsigned char c : resource) h = (h ^ c) * 0x100000001B3ull;
+        return h ? h : 1;
+    }
+
+    std::string lowerUtf8(const std::wstring& s) {
+        // Windows のファイル名は大文字小文字を区別しないので、資源名は小文字にそろえる
+        std::wstring lower = s;
+        for (auto& c : lower) {
+            if (c >= L'A' && c <= L'Z') c = static_cast<wchar_t>(c - L'A' + L'a');
+        }
+        return WideToUtf8(lower);
+    }
+
+    std::mutex g_tablesMutex;
+    std::map<std::wstring, std::weak_ptr<LeaseTable>> g_tables;
+}
+
+namespace lease {
+    std::string NameResource(const std::string& backupName) {
+        std::string out;
+        NameResource(backupName, out);
+        return out;
+    }
+    void NameResource(const std::string& backupName, std::string& out) {
+        // lowerUtf8 と同じ結果になる（小文字にするのは ASCII だけなので UTF-8 のまま変えてよい）
+        out.assign("name:");
+        for (char c : backupName) out += (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+    }
+    std::string PackResource(const fs::path& packPath) {
+        return "pack:" + lowerUtf8(packPath.filename().wstring());
+    }
+    std::string CatalogResource(const std::wstring& stem) {
+        return "catalog:" + lowerUtf8(stem);
+    }
+    std::string ReplicaResource(const std::wstring& stem) {
+        return "replica:" + lowerUtf8(stem);
+    }
+}
+
+// --- Lease ---
+
+Lease::Lease(Lease&& other) : m_table(std::move(other.m_table)), m_slot(other.m_slot), m_token(other.m_token) {
+    other.m_token = 0;
+}
+
+Lease& Lease::operator=(Lease&& other) {
+    if (this != &other) {
+        release();
+        m_table = std::move(other.m_table);
+        m_slot = other.m_slot;
+        m_token = other.m_token;
+        other.m_token = 0;
+    }
+    return *this;
+}
+
+void Lease::release() {
+    if (m_token != 0 && m_table) m_table->release(m_slot, m_token);
+    m_token = 0;
+    m_table.reset();
+}
+
+// --- LeaseTable ---
+
+std::shared_ptr<LeaseTable> LeaseTable::open(const fs::path& backupDir) {
+    std::wstring key = Utf8ToWide(lowerUtf8(backupDir.wstring()));
+    std::lock_guard<std::mutex> lock(g_tablesMutex);
+    std::shared_ptr<LeaseTable> table = g_tables[key].lock();
+    if (!table) {
+        std::error_code ec;
+        fs::create_directories(backupDir, ec);
+        table.reset(new LeaseTable(backupDir / L"AutoBackup.lease"));
+        g_tables[key] = table;
+    }
+    return table;
+}
+
+LeaseTable::LeaseTable(const fs::path& path)
+    : m_view(nullptr),
+#ifdef _WIN32
+    m_file(nullptr), m_mapping(nullptr),
+#else
+    m_fd(-1),
+#endif
+    m_stopping(false) {
+    if (!map(path)) {
+        unmap();
+        return;
+    }
+    // 形式の違う表（新しい版が作ったものなど）には触れない
+    uint64_t expected = 0;
+    Header* header = static_cast<Header*>(m_view);
+    if (!header->format.compare_exchange_strong(expected, kFormat) && expected != kFormat) unmap();
+}
+
+LeaseTable::~LeaseTable() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_cv.notify_all();
+    if (m_thread.joinable()) m_thread.join();
+    unmap();
+}
+
+#ifdef _WIN32
+bool LeaseTable::map(const fs::path& path) {
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    m_file = file;
+    // 足りない分は 0 で伸ばされる。0 はすべて空きの状態として有効
+    m_mapping = CreateFileMappingW(file, NULL, PAGE_READWRITE, 0, static_cast<DWORD>(kTableSize), NULL);
+    if (!m_mapping) return false;
+    m_view = MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, kTableSize);
+    return m_view != nullptr;
+}
+
+void LeaseTable::unmap() {
+    if (m_view) UnmapViewOfFile(m_view);
+    if (m_mapping) CloseHandle(m_mapping);
+    if (m_file) CloseHandle(m_file);
+    m_view = nullptr;
+    m_mapping = nullptr;
+    m_file = nullptr;
+}
+#else
+bool LeaseTable::map(const fs::path& path) {
+    m_fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (m_fd < 0) return false;
+    struct stat st;
+    if (fstat(m_fd, &st) != 0) return false;
+    if (static_cast<size_t>(st.st_size) < kTableSize && ftruncate(m_fd, static_cast<off_t>(kTableSize)) != 0) return false;
+    void* view = mmap(nullptr, kTableSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (view == MAP_FAILED) return false;
+    m_view = view;
+    return true;
+}
+
+void LeaseTable::unmap() {
+    if (m_view) munmap(m_view, kTableSize);
+    if (m_fd >= 0) ::close(m_fd);
+    m_view = nullptr;
+    m_fd = -1;
+}
+#endif
+
+LeaseTable::Slot* LeaseTable::slot(uint32_t index) const {
+    return reinterpret_cast<Slot*>(static_cast<uint8_t*>(m_view) + sizeof(Header)) + index;
+}
+
+Lease LeaseTable::tryAcquire(const std::string& resource) {
+    Lease lease;
+    if (!m_view) {
+        // 調停できないときは常に取れたことにする
+        lease.m_table = shared_from_this();
+        lease.m_slot = lease::SlotCount;
+        lease.m_token = 1;
+        return lease;
+    }
+    if (isHeld(resource)) return lease;
+
+    uint64_t key = resourceKey(resource);
+    Header* header = static_cast<Header*>(m_view);
+    uint64_t token = header->sequence.fetch_add(1) + 1;
+    int64_t now = nowMs();
+
+    // 空いているか期限切れのスロットを取る。期限・持ち主・キーの順に書き、キーが見えたときには期限も見えるようにする
+    // 期限は持ち主より先に、見た値からの CAS で延ばす。持ち主を先に書くと、その後で古い期限を見た
+    // 別のプロセスに期限切れとして横取りされる。期限を先に延ばしておけば、同じ古い期限を見ていた側の CAS は失敗し、
+    // 新しい持ち主を見た側はそのあと読む期限も新しい
+    uint32_t claimed = lease::SlotCount;
+    for (uint32_t i = 0; i < lease::SlotCount && claimed == lease::SlotCount; i++) {
+        uint32_t index = static_cast<uint32_t>((key + i) % lease::SlotCount);
+        Slot* s = slot(index);
+        uint64_t owner = s->owner.load();
+        int64_t expires = s->expiresMs.load();
+        if (owner != 0 && expires >= now) continue;
+        if (!s->expiresMs.compare_exchange_strong(expires, now + lease::LeaseTtl.count())) continue;
+        if (!s->owner.compare_exchange_strong(owner, token)) continue;
+        s->key.store(key);
+        claimed = index;
+    }
+    if (claimed == lease::SlotCount) return lease;  // 表が埋まっている
+
+    // 同時に同じ資源を取ったものがいれば譲る
+    for (uint32_t i = 0; i < lease::SlotCount; i++) {
+        if (i == claimed) continue;
+        Slot* s = slot(i);
+        if (s->key.load() == key && s->owner.load() != 0 && s->expiresMs.load() >= now) {
+            uint64_t mine = token;
+            slot(claimed)->owner.compare_exchange_strong(mine, 0);
+            return lease;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_held.emplace_back(claimed, token);
+        if (!m_thread.joinable()) m_thread = std::thread(&LeaseTable::keepAlive, this);
+    }
+    lease.m_table = shared_from_this();
+    lease.m_slot = claimed;
+    lease.m_token = token;
+    return lease;
+}
+
+Lease LeaseTable::acquire(const std::string& resource, std::chrono::milliseconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::chrono::milliseconds wait(1);
+    for (;;) {
+        Lease lease = tryAcquire(resource);
+        if (lease || std::chrono::steady_clock::now() >= deadline) return lease;
+        std::this_thread::sleep_for(wait);
+        wait = (std::min)(wait * 2, std::chrono::milliseconds(50));
+    }
+}
+
+bool LeaseTable::isHeld(const std::string& resource) const {
+    if (!m_view) return false;
+    uint64_t key = resourceKey(resource);
+    int64_t now = nowMs();
+    for (uint32_t i = 0; i < lease::SlotCount; i++) {
+        Slot* s = slot(i);
+        if (s->key.load() == key && s->owner.load() != 0 && s->expiresMs.load() >= now) return true;
+    }
+    return false;
+}
+
+void LeaseTable::release(uint32_t index, uint64_t token) {
+    if (!m_view || index >= lease::SlotCount) return;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_held.erase(std::remove(m_held.begin(), m_held.end(), std::make_pair(index, token)), m_held.end());
+    }
+    // 期限切れで他に取られていれば何もしない
+    slot(index)->owner.compare_exchange_strong(token, 0);
+}
+
+void LeaseTable::keepAlive() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stopping) {
+        m_cv.wait_for(lock, lease::RenewInterval);
+        int64_t expires = nowMs() + lease::LeaseTtl.count();
+        for (const auto& held : m_held) {
+            Slot* s = slot(held.first);
+            if (s->owner.load() == held.second) s->expiresMs.store(expires);
+        }
+    }
+}
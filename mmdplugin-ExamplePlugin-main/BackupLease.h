@@ -0,0 +1,112 @@
+﻿#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <experimental/filesystem>
+
+namespace fs = std::experimental::filesystem;
+
+// 同じ Backup フォルダを使う複数の MMD（とそのワーカースレッド）の調停
+//
+// Backup/AutoBackup.lease を各プロセスが共有メモリとして開き、その上の固定個のスロットで
+// 「名前・パック・一覧」などの資源ごとのリースを CAS で取り合う。フォルダ全体のロックは無く、
+// 違う資源を触る書き手どうしは待たない。
+//   - リースには期限があり、持っているプロセスが生きている間は裏のスレッドが延長し続ける。
+//     異常終了したプロセスのリースは期限（LeaseTtl）が切れると他が取れる
+//   - トークンはファイル上の通し番号から取るので、プロセスをまたいで重ならない
+//   - 同じ資源を同時に取りに来たときは、相手を見つけた側が譲る（どちらも譲ることはあるが、
+//     両方が取ることは無い）
+// 期限の比較に steady_clock を使うので、調停できるのは同じ PC 上のプロセスどうしだけ。
+// ファイルを開けないとき（読み取り専用のフォルダなど）は調停せず、どのリースも取れたものとして扱う。
+
+namespace lease {
+    const uint32_t Magic = 0x534C4241;  // "ABLS"
+    const uint32_t Version = 1;
+    const uint32_t SlotCount = 256;
+    const std::chrono::milliseconds LeaseTtl = std::chrono::seconds(10);
+    const std::chrono::milliseconds RenewInterval = std::chrono::seconds(2);
+
+    // 資源の名前（Backup フォルダの中で一意にする）
+    std::string NameResource(const std::string& backupName);
+    // out を使い回す版（バックアップのたびに呼ぶところ用）
+    void NameResource(const std::string& backupName, std::string& out);
+    std::string PackResource(const fs::path& packPath);
+    std::string CatalogResource(const std::wstring& stem);
+    std::string ReplicaResource(const std::wstring& stem);
+}
+
+class LeaseTable;
+
+// 取ったリース。破棄すると手放す
+class Lease {
+public:
+    Lease() : m_slot(0), m_token(0) {}
+    Lease(Lease&& other);
+    Lease& operator=(Lease&& other);
+    ~Lease() { release(); }
+
+    Lease(const Lease&) = delete;
+    Lease& operator=(const Lease&) = delete;
+
+    explicit operator bool() const { return m_token != 0; }
+    void release();
+
+private:
+    friend class LeaseTable;
+    std::shared_ptr<LeaseTable> m_table;
+    uint32_t m_slot;
+    uint64_t m_token;
+};
+
+class LeaseTable : public std::enable_shared_from_this<LeaseTable> {
+public:
+    // backupDir ごとに1つを共有する（同じプロセスのスレッドどうしも同じ表で調停する）
+    static std::shared_ptr<LeaseTable> open(const fs::path& backupDir);
+    ~LeaseTable();
+
+    LeaseTable(const LeaseTable&) = delete;
+    LeaseTable& operator=(const LeaseTable&) = delete;
+
+    // 共有メモリを開けていて調停が効いているか
+    bool shared() const { return m_view != nullptr; }
+
+    // すぐに取れなければ空の Lease を返す
+    Lease tryAcquire(const std::string& resource);
+    // 取れるまで間を空けて試す。timeout を過ぎたら空の Lease を返す
+    Lease acquire(const std::string& resource, std::chrono::milliseconds timeout);
+    // 自分も含め、誰かが期限内のリースを持っているか
+    bool isHeld(const std::string& resource) const;
+
+private:
+    struct Header;
+    struct Slot;
+
+    explicit LeaseTable(const fs::path& path);
+    bool map(const fs::path& path);
+    void unmap();
+    Slot* slot(uint32_t index) const;
+    void release(uint32_t index, uint64_t token);
+    void keepAlive();
+
+    void* m_view;
+#ifdef _WIN32
+    void* m_file;
+    void* m_mapping;
+#else
+    int m_fd;
+#endif
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::vector<std::pair<uint32_t, uint64_t>> m_held;  // このプロセスが持っている (スロット, トークン)
+    bool m_stopping;
+    std::thread m_thread;
+
+    friend class Lease;
+};
@@ -0,0 +1,176 @@
+﻿#include "BackupMetrics.h"
+#include <fstream>
+#include <cstdio>
+#include <iomanip>
+#include <sstream>
+
+namespace {
+    const wchar_t* kStageNames[] = {
+        L"保存要求",
+        L"保存待ち",
+        L"コピー",
+        L"世代整理",
+        L"パック詰め直し",
+        L"再圧縮",
+        L"キーフレーム",
+        L"サムネイル",
+        L"モーション",
+        L"ポーズ",
+        L"写しの更新",
+        L"合計",
+    };
+
+    const char* kStageTraceNames[] = {
+        "SaveRequest",
+        "SaveWait",
+        "Copy",
+        "Retention",
+        "Compaction",
+        "Recompress",
+        "Keyframes",
+        "Thumbnail",
+        "Motion",
+        "Pose",
+        "Mirror",
+        "Backup",
+    };
+
+    static_assert(sizeof(kStageNames) / sizeof(kStageNames[0]) == static_cast<size_t>(BackupStage::Count), "");
+    static_assert(sizeof(kStageTraceNames) / sizeof(kStageTraceNames[0]) == static_cast<size_t>(BackupStage::Count), "");
+
+    // トレース用のスレッド番号（OS のスレッドIDに依存しない連番）
+    uint32_t currentTraceTid() {
+        static std::atomic<uint32_t> s_nextTid(1);
+        thread_local uint32_t tid = s_nextTid.fetch_add(1, std::memory_order_relaxed);
+        return tid;
+    }
+
+    int highestBit(uint64_t v) {
+        int n = 0;
+        while (v >>= 1) n++;
+        return n;
+    }
+}
+
+const wchar_t* GetStageName(BackupStage stage) { return kStageNames[static_cast<int>(stage)]; }
+const char* GetStageTraceName(BackupStage stage) { return kStageTraceNames[static_cast<int>(stage)]; }
+
+// --- LatencyHistogram ---
+
+LatencyHistogram::LatencyHistogram() : m_count(0), m_sum(0), m_max(0) {
+    for (auto& b : m_buckets) b.store(0, std::memory_order_relaxed);
+}
+
+int LatencyHistogram::bucketIndex(uint64_t ns) {
+    if (ns < SubBuckets) return static_cast<int>(ns);
+    int msb = highestBit(ns);
+    int shift = msb - SubBucketBits;
+    int sub = static_cast<int>((ns >> shift) & (SubBuckets - 1));
+    return (shift + 1) * SubBuckets + sub;
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(int index) {
+    if (index < SubBuckets) return static_cast<uint64_t>(index);
+    int shift = index / SubBuckets - 1;
+    uint64_t sub = static_cast<uint64_t>(index % SubBuckets);
+    return ((SubBuckets + sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+    m_buckets[bucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t cur = m_max.load(std::memory_order_relaxed);
+    while (ns > cur && !m_max.compare_exchange_weak(cur, ns, std::memory_order_relaxed)) {}
+}
+
+uint64_t LatencyHistogram::percentileNs(double p) const {
+    uint64_t total = count();
+    if (total == 0) return 0;
+    uint64_t target = static_cast<uint64_t>(p * static_cast<double>(total) + 0.5);
+    if (target < 1) target = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < BucketCount; i++) {
+        seen += m_buckets[i].load(std::memory_order_relaxed);
+        if (seen >= target) {
+            uint64_t bound = bucketUpperBound(i);
+            return bound < maxNs() ? bound : maxNs();
+        }
+    }
+    return maxNs();
+}
+
+// --- TraceRing ---
+
+TraceRing::TraceRing() : m_next(0) {
+    for (auto& s : m_slots) {
+        s.seq.store(0, std::memory_order_relaxed);
+        s.stage.store(0, std::memory_order_relaxed);
+        s.tid.store(0, std::memory_order_relaxed);
+        s.startNs.store(0, std::memory_order_relaxed);
+        s.durNs.store(0, std::memory_order_relaxed);
+    }
+}
+
+void TraceRing::push(BackupStage stage, uint32_t tid, uint64_t startNs, uint64_t durNs) {
+    uint64_t i = m_next.fetch_add(1, std::memory_order_relaxed);
+    Slot& s = m_slots[i % Capacity];
+    s.seq.store(0, std::memory_order_relaxed);
+    // 読み手が新しい値を1つでも見たなら、seq が 0 になったことも見えるようにする
+    std::atomic_thread_fence(std::memory_order_release);
+    s.stage.store(static_cast<int>(stage), std::memory_order_relaxed);
+    s.tid.store(tid, std::memory_order_relaxed);
+    s.startNs.store(startNs, std::memory_order_relaxed);
+    s.durNs.store(durNs, std::memory_order_relaxed);
+    s.seq.store(i + 1, std::memory_order_release);
+}
+
+// --- BackupMetrics ---
+
+BackupMetrics::BackupMetrics() : m_epoch(std::chrono::steady_clock::now()) {}
+
+uint64_t BackupMetrics::nowNs() const {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - m_epoch).count());
+}
+
+void BackupMetrics::record(BackupStage stage, uint64_t startNs, uint64_t endNs) {
+    uint64_t dur = endNs > startNs ? endNs - startNs : 0;
+    m_histograms[static_cast<int>(stage)].record(dur);
+    m_trace.push(stage, currentTraceTid(), startNs, dur);
+}
+
+std::wstring BackupMetrics::summary() const {
+    std::wostringstream ss;
+    ss << std::fixed << std::setprecision(1);
+    bool any = false;
+    for (int i = 0; i < static_cast<int>(BackupStage::Count); i++) {
+        const LatencyHistogram& h = m_histograms[i];
+        if (h.count() == 0) continue;
+        any = true;
+        ss << L"・" << kStageNames[i] << L": "
+            << L"中央 " << h.percentileNs(0.5) / 1e6 << L" ms / "
+            << L"p99 " << h.percentileNs(0.99) / 1e6 << L" ms / "
+            << L"最大 " << h.maxNs() / 1e6 << L" ms ("
+            << h.count() << L"回)\n";
+    }
+    if (!any) ss << L"・まだ計測データがありません\n";
+    return ss.str();
+}
+
+bool BackupMetrics::writeChromeTrace(const fs::path& path) const {
+    std::ofstream ofs(path.c_str(), std::ios::binary | std::ios::trunc);
+    if (!ofs.is_open()) return false;
+
+    ofs << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    ofs << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"AutoBackup\"}}";
+    char line[256];
+    m_trace.forEach([&](BackupStage stage, uint32_t tid, uint64_t startNs, uint64_t durNs) {
+        snprintf(line, sizeof(line),
+            ",\n{\"name\":\"%s\",\"cat\":\"backup\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+            GetStageTraceName(stage), tid, startNs / 1000.0, durNs / 1000.0);
+        ofs << line;
+    });
+    ofs << "\n]}\n";
+    return ofs.good();
+}
@@ -0,0 +1,134 @@
+﻿#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <experimental/filesystem>
+
+namespace fs = std::experimental::filesystem;
+
+// バックアップ処理の段階
+enum class BackupStage : int {
+    SaveRequest = 0,   // WM_COMMAND による保存要求
+    SaveWait,          // 保存完了待ち
+    Copy,              // pmm/emm のコピー
+    Retention,         // 古いバックアップの削除
+    Compaction,        // パックファイルの詰め直し
+    Recompress,        // 古いスナップショットの再圧縮
+    Keyframes,         // モデルごとのキーフレームの保存
+    Thumbnail,         // 描画スレッドでのサムネイルの縮小・読み戻し
+    Motion,            // モーションだけのバックアップ（VMD）
+    Pose,              // 描画スレッドでの評価済みポーズの取得
+    Mirror,            // キーフレームの写しの更新（変化があったときだけ記録）
+    Total,             // triggerSave 全体
+    Count
+};
+
+const wchar_t* GetStageName(BackupStage stage);
+const char* GetStageTraceName(BackupStage stage);
+
+// HDR 風の対数線形ヒストグラム（ナノ秒単位、ロックフリー）
+// 2のべき乗ごとに SubBuckets 個へ分割するため、相対誤差は 1/SubBuckets 程度
+class LatencyHistogram {
+public:
+    static const int SubBucketBits = 4;
+    static const int SubBuckets = 1 << SubBucketBits;
+    static const int BucketCount = (64 - SubBucketBits + 1) * SubBuckets;
+
+    LatencyHistogram();
+
+    void record(uint64_t ns);
+
+    uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+    uint64_t totalNs() const { return m_sum.load(std::memory_order_relaxed); }
+    uint64_t maxNs() const { return m_max.load(std::memory_order_relaxed); }
+    uint64_t percentileNs(double p) const;
+
+private:
+    static int bucketIndex(uint64_t ns);
+    static uint64_t bucketUpperBound(int index);
+
+    std::atomic<uint32_t> m_buckets[BucketCount];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sum;
+    std::atomic<uint64_t> m_max;
+};
+
+// Chrome trace_event 用のイベントを固定長リングバッファに記録する
+class TraceRing {
+public:
+    static const uint32_t Capacity = 4096;
+
+    TraceRing();
+
+    void push(BackupStage stage, uint32_t tid, uint64_t startNs, uint64_t durNs);
+
+    // 古い順にイベントを列挙する（書き込み中のスロットと、読んでいる間に書き換わったスロットは読み飛ばす）
+    template<class F>
+    void forEach(F&& func) const {
+        uint64_t end = m_next.load(std::memory_order_acquire);
+        uint64_t begin = end > Capacity ? end - Capacity : 0;
+        for (uint64_t i = begin; i < end; i++) {
+            const Slot& s = m_slots[i % Capacity];
+            if (s.seq.load(std::memory_order_acquire) != i + 1) continue;
+            int stage = s.stage.load(std::memory_order_relaxed);
+            uint32_t tid = s.tid.load(std::memory_order_relaxed);
+            uint64_t startNs = s.startNs.load(std::memory_order_relaxed);
+            uint64_t durNs = s.durNs.load(std::memory_order_relaxed);
+            // 一周してきた書き手が途中まで書いていれば seq が変わっている（seqlock と同じ確かめ方）
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (s.seq.load(std::memory_order_relaxed) != i + 1) continue;
+            func(static_cast<BackupStage>(stage), tid, startNs, durNs);
+        }
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> seq;
+        std::atomic<int> stage;
+        std::atomic<uint32_t> tid;
+        std::atomic<uint64_t> startNs;
+        std::atomic<uint64_t> durNs;
+    };
+
+    Slot m_slots[Capacity];
+    std::atomic<uint64_t> m_next;
+};
+
+// 段階ごとのヒストグラムとトレースをまとめたもの
+class BackupMetrics {
+public:
+    BackupMetrics();
+
+    uint64_t nowNs() const;
+    void record(BackupStage stage, uint64_t startNs, uint64_t endNs);
+
+    const LatencyHistogram& histogram(BackupStage stage) const { return m_histograms[static_cast<int>(stage)]; }
+
+    // About ダイアログ用の要約
+    std::wstring summary() const;
+
+    // Chrome の trace_event 形式 (chrome://tracing / Perfetto) で書き出す
+    bool writeChromeTrace(const fs::path& path) const;
+
+private:
+    std::chrono::steady_clock::time_point m_epoch;
+    LatencyHistogram m_histograms[static_cast<int>(BackupStage::Count)];
+    TraceRing m_trace;
+};
+
+// スコープの所要時間を記録する
+class StageTimer {
+public:
+    StageTimer(BackupMetrics& metrics, BackupStage stage)
+        : m_metrics(metrics), m_stage(stage), m_start(metrics.nowNs()) {}
+    ~StageTimer() { m_metrics.record(m_stage, m_start, m_metrics.nowNs()); }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+private:
+    BackupMetrics& m_metrics;
+    BackupStage m_stage;
+    uint64_t m_start;
+};
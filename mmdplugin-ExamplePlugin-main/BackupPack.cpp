@@ -0,0 +1,811 @@
+﻿#include "BackupPack.h"
+#include "BackupFormat.h"
+#include "BackupLease.h"
+#include "LzCodec.h"
+#include "TaskExecutor.h"
+#include <algorithm>
+#include <map>
+
+namespace {
+    const uint32_t kRecordMagic = 0x52504241;   // "ABPR"
+    const uint32_t kIndexMagic = 0x58504241;    // "ABPX"
+    const uint32_t kFooterMagic = 0x46504241;   // "ABPF"
+    const uint32_t kPackVersion = 1;
+    const uint64_t kFooterSize = 32;
+    const uint64_t kRecordFixedSize = 4 + 2 + 1 + 1 + 8 + 8 + 8 + 4 + 8 + 8 + 4 + 2;
+    const uint16_t kRecordHeaderVersion = 1;
+    const size_t kLzBlockSize = 4 * 1024 * 1024;   // 圧縮の単位（展開時のメモリ量もこれで決まる）
+    const uint64_t kLzBlockHeaderSize = 8;
+
+    uint64_t streamSize(std::fstream& f) {
+        f.seekg(0, std::ios::end);
+        std::streamoff size = f.tellg();
+        return size < 0 ? 0 : static_cast<uint64_t>(size);
+    }
+
+    bool readAt(std::fstream& f, uint64_t offset, void* dst, size_t size) {
+        f.clear();
+        f.seekg(static_cast<std::streamoff>(offset));
+        f.read(static_cast<char*>(dst), static_cast<std::streamsize>(size));
+        return f.gcount() == static_cast<std::streamsize>(size);
+    }
+
+    void writeRecordHeader(std::vector<uint8_t>& out, const PackEntry& e, uint32_t magic) {
+        ByteWriter w(out);
+        w.u32(magic);
+        w.u16(kRecordHeaderVersion);
+        w.u8(e.codec);
+        w.u8(0);
+        w.i64(e.time);
+        w.u64(e.pmmStored);
+        w.u64(e.pmmRaw);
+        w.u32(e.pmmCrc);
+        w.u64(e.emmStored);
+        w.u64(e.emmRaw);
+        w.u32(e.emmCrc);
+        w.str(e.name);
+    }
+
+    // ファイルの内容を out に書き足す。書いたバイト数と CRC を返す
+    bool appendFile(std::fstream& out, const fs::path& src, TokenBucket* bucket, uint64_t& size, uint32_t& crc) {
+        size = 0;
+        crc = 0;
+        std::ifstream in(src.c_str(), std::ios::binary);
+        if (!in.is_open()) return false;
+        std::vector<char> buffer(kIoChunkSize);
+        while (in) {
+            in.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            std::streamsize n = in.gcount();
+            if (n <= 0) break;
+            if (bucket) bucket->acquire(static_cast<uint64_t>(n));
+            out.write(buffer.data(), n);
+            if (!out) return false;
+            crc = Crc32(buffer.data(), static_cast<size_t>(n), crc);
+            size += static_cast<uint64_t>(n);
+        }
+        return in.eof();
+    }
+
+    // src の [offset, offset+size) を dst に流し込む
+    bool copyRange(std::fstream& src, uint64_t offset, uint64_t size, std::ostream& dst, TokenBucket* bucket, uint32_t* crc) {
+        std::vector<char> buffer(kIoChunkSize);
+        src.clear();
+        src.seekg(static_cast<std::streamoff>(offset));
+        uint32_t c = 0;
+        while (size > 0) {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(size, buffer.size()));
+            if (bucket) bucket->acquire(n);
+            src.read(buffer.data(), static_cast<std::streamsize>(n));
+            if (src.gcount() != static_cast<std::streamsize>(n)) return false;
+            if (crc) c = Crc32(buffer.data(), n, c);
+            dst.write(buffer.data(), static_cast<std::streamsize>(n));
+            if (!dst) return false;
+            size -= n;
+        }
+        if (crc) *crc = c;
+        return true;
+    }
+
+    // 一度に読み込んで並列に処理するブロックの数（executor が無ければ 1 つずつ）
+    size_t batchBlocks(TaskExecutor* executor) {
+        return executor ? executor->concurrency() : 1;
+    }
+
+    // 格納形式に関係なく、展開後のデータを順に sink へ渡す。LZ のブロックは executor で並列に展開する
+    bool readStored(std::fstream& f, uint64_t offset, uint64_t stored, uint8_t codec, TokenBucket* bucket,
+        const std::function<bool(const uint8_t*, size_t)>& sink, TaskExecutor* executor = nullptr,
+        TaskPriority priority = TaskPriority::Maintenance) {
+        if (codec == PackCodecRaw) {
+            std::vector<uint8_t> buffer(kIoChunkSize);
+            while (stored > 0) {
+                size_t n = static_cast<size_t>(std::min<uint64_t>(stored, buffer.size()));
+                if (bucket) bucket->acquire(n);
+                if (!readAt(f, offset, buffer.data(), n) || !sink(buffer.data(), n)) return false;
+                offset += n;
+                stored -= n;
+            }
+            return true;
+        }
+        if (codec != PackCodecLz) return false;
+
+        struct Block {
+            std::vector<uint8_t> packed;
+            std::vector<uint8_t> raw;
+            uint32_t rawSize = 0;
+            bool ok = false;
+        };
+        std::vector<Block> batch(batchBlocks(executor));
+        while (stored > 0) {
+            // ファイルからの読み込みは順に行い、展開だけを並列にする
+            size_t count = 0;
+            for (; count < batch.size() && stored > 0; count++) {
+                Block& b = batch[count];
+                uint8_t header[kLzBlockHeaderSize];
+                if (stored < kLzBlockHeaderSize || !readAt(f, offset, header, sizeof(header))) return false;
+                ByteReader r(header, sizeof(header));
+                b.rawSize = r.u32();
+                uint32_t packedSize = r.u32();
+                if (b.rawSize > kLzBlockSize || packedSize > stored - kLzBlockHeaderSize || packedSize > b.rawSize) return false;
+                offset += kLzBlockHeaderSize;
+                stored -= kLzBlockHeaderSize;
+
+                b.packed.resize(packedSize);
+                if (bucket) bucket->acquire(packedSize);
+                if (!readAt(f, offset, b.packed.data(), b.packed.size())) return false;
+                offset += packedSize;
+                stored -= packedSize;
+            }
+            auto expand = [&](size_t i) {
+                Block& b = batch[i];
+                if (b.packed.size() == b.rawSize) {
+                    b.ok = true;
+                    return;
+                }
+                b.raw.resize(b.rawSize);
+                b.ok = lz::decompress(b.packed.data(), b.packed.size(), b.raw.data(), b.raw.size());
+            };
+            if (executor && count > 1) {
+                if (!executor->parallelFor(count, priority, expand)) return false;
+            }
+            else {
+                for (size_t i = 0; i < count; i++) expand(i);
+            }
+            for (size_t i = 0; i < count; i++) {
+                Block& b = batch[i];
+                // 縮まなかったブロックはそのまま格納されている
+                const std::vector<uint8_t>& data = b.packed.size() == b.rawSize ? b.packed : b.raw;
+                if (!b.ok || !sink(data.data(), data.size())) return false;
+            }
+        }
+        return true;
+    }
+
+    // raw を1ブロック（[展開後u32][格納u32][データ]）として out に追加する。縮まなければそのまま格納する
+    void appendLzBlock(const uint8_t* raw, size_t n, int level, std::vector<uint8_t>& out) {
+        size_t start = out.size();
+        ByteWriter w(out);
+        w.u32(static_cast<uint32_t>(n));
+        w.u32(0);
+        size_t packed = lz::compress(raw, n, out, level);
+        if (packed >= n) {
+            out.resize(start + kLzBlockHeaderSize);
+            out.insert(out.end(), raw, raw + n);
+            packed = n;
+        }
+        uint32_t packed32 = static_cast<uint32_t>(packed);
+        memcpy(out.data() + start + 4, &packed32, 4);
+    }
+
+    // 無圧縮の [offset, offset+size) をブロックごとに圧縮して writePos から書く。
+    // 同じファイルを読み書きするので、毎回位置を指定し直す。圧縮は executor で並列に行う
+    bool writeCompressed(std::fstream& f, uint64_t offset, uint64_t size, int level, TokenBucket* bucket,
+        const std::function<bool()>& keepGoing, uint64_t& writePos, uint64_t& stored, uint32_t& crc, TaskExecutor* executor) {
+        stored = 0;
+        crc = 0;
+        struct Block {
+            std::vector<uint8_t> raw;
+            std::vector<uint8_t> out;
+        };
+        std::vector<Block> batch(batchBlocks(executor));
+        while (size > 0) {
+            if (keepGoing && !keepGoing()) return false;
+            size_t count = 0;
+            for (; count < batch.size() && size > 0; count++) {
+                size_t n = static_cast<size_t>(std::min<uint64_t>(size, kLzBlockSize));
+                Block& b = batch[count];
+                b.raw.resize(n);
+                if (bucket) bucket->acquire(n);
+                if (!readAt(f, offset, b.raw.data(), n)) return false;
+                crc = Crc32(b.raw.data(), n, crc);
+                offset += n;
+                size -= n;
+            }
+            auto compress = [&](size_t i) {
+                batch[i].out.clear();
+                appendLzBlock(batch[i].raw.data(), batch[i].raw.size(), level, batch[i].out);
+            };
+            if (executor && count > 1) {
+                if (!executor->parallelFor(count, TaskPriority::Maintenance, compress)) return false;
+            }
+            else {
+                for (size_t i = 0; i < count; i++) compress(i);
+            }
+
+            for (size_t i = 0; i < count; i++) {
+                const std::vector<uint8_t>& out = batch[i].out;
+                if (bucket) bucket->acquire(out.size());
+                f.clear();
+                f.seekp(static_cast<std::streamoff>(writePos));
+                f.write(reinterpret_cast<const char*>(out.data()), static_cast<std::streamsize>(out.size()));
+                if (!f) return false;
+                writePos += out.size();
+                stored += out.size();
+            }
+        }
+        return true;
+    }
+}
+
+uint64_t PackEntry::headerSize() const {
+    return kRecordFixedSize + name.size();
+}
+
+// --- PackFile ---
+
+const PackEntry* PackFile::find(const std::string& name) const {
+    for (const auto& e : m_entries) {
+        if (e.name == name) return &e;
+    }
+    return nullptr;
+}
+
+uint64_t PackFile::liveBytes() const {
+    uint64_t total = 0;
+    for (const auto& e : m_entries) total += e.recordSize();
+    return total;
+}
+
+bool PackFile::load() {
+    m_entries.clear();
+    m_dataEnd = 0;
+    m_fileSize = 0;
+    if (!fs::exists(m_path)) return true;
+
+    std::fstream f(m_path.c_str(), std::ios::in | std::ios::binary);
+    if (!f.is_open()) return false;
+    m_fileSize = streamSize(f);
+    if (m_fileSize < kFooterSize) return scanRecords();
+
+    uint8_t footer[kFooterSize];
+    if (!readAt(f, m_fileSize - kFooterSize, footer, sizeof(footer))) return scanRecords();
+    ByteReader fr(footer, sizeof(footer));
+    uint64_t indexOffset = fr.u64();
+    uint32_t indexSize = fr.u32();
+    uint32_t entryCount = fr.u32();
+    uint32_t indexCrc = fr.u32();
+    uint32_t version = fr.u32();
+    fr.u32();
+    uint32_t magic = fr.u32();
+    if (magic != kFooterMagic || version != kPackVersion || indexOffset + indexSize + kFooterSize != m_fileSize) {
+        return scanRecords();
+    }
+
+    std::vector<uint8_t> index(indexSize);
+    if (!readAt(f, indexOffset, index.data(), index.size()) || Crc32(index.data(), index.size()) != indexCrc) {
+        return scanRecords();
+    }
+
+    ByteReader r(index.data(), index.size());
+    if (r.u32() != kIndexMagic || r.u32() != entryCount) return scanRecords();
+    m_entries.reserve(entryCount);
+    for (uint32_t i = 0; i < entryCount && r.ok(); i++) {
+        PackEntry e;
+        e.offset = r.u64();
+        e.time = r.i64();
+        e.codec = r.u8();
+        e.pmmStored = r.u64();
+        e.pmmRaw = r.u64();
+        e.pmmCrc = r.u32();
+        e.emmStored = r.u64();
+        e.emmRaw = r.u64();
+        e.emmCrc = r.u32();
+        e.name = r.str();
+        m_entries.push_back(e);
+    }
+    if (!r.ok()) return scanRecords();
+    m_dataEnd = indexOffset;
+    return true;
+}
+
+bool PackFile::scanRecords() {
+    m_entries.clear();
+    m_dataEnd = 0;
+    std::fstream f(m_path.c_str(), std::ios::in | std::ios::binary);
+    if (!f.is_open()) return false;
+    m_fileSize = streamSize(f);
+
+    uint64_t pos = 0;
+    std::vector<uint8_t> header(kRecordFixedSize + 0xFFFF);
+    while (pos + kRecordFixedSize <= m_fileSize) {
+        if (!readAt(f, pos, header.data(), kRecordFixedSize)) break;
+        ByteReader r(header.data(), kRecordFixedSize);
+        if (r.u32() != kRecordMagic || r.u16() != kRecordHeaderVersion) break;
+        PackEntry e;
+        e.offset = pos;
+        e.codec = r.u8();
+        r.u8();
+        e.time = r.i64();
+        e.pmmStored = r.u64();
+        e.pmmRaw = r.u64();
+        e.pmmCrc = r.u32();
+        e.emmStored = r.u64();
+        e.emmRaw = r.u64();
+        e.emmCrc = r.u32();
+        uint16_t nameLen = r.u16();
+        if (!readAt(f, pos + kRecordFixedSize, header.data() + kRecordFixedSize, nameLen)) break;
+        e.name.assign(reinterpret_cast<const char*>(header.data() + kRecordFixedSize), nameLen);
+        if (e.offset + e.recordSize() > m_fileSize) break;
+        // 再圧縮で追記し直したレコードは後ろにある方を使う
+        m_entries.erase(std::remove_if(m_entries.begin(), m_entries.end(), [&](const PackEntry& old) {
+            return old.name == e.name;
+        }), m_entries.end());
+        m_entries.push_back(e);
+        pos += e.recordSize();
+    }
+    // 索引から外していたレコードも復活するが、失うよりはよい
+    m_dataEnd = pos;
+    return true;
+}
+
+bool PackFile::writeIndex(std::fstream& f) {
+    std::vector<uint8_t> index;
+    ByteWriter w(index);
+    w.u32(kIndexMagic);
+    w.u32(static_cast<uint32_t>(m_entries.size()));
+    for (const auto& e : m_entries) {
+        w.u64(e.offset);
+        w.i64(e.time);
+        w.u8(e.codec);
+        w.u64(e.pmmStored);
+        w.u64(e.pmmRaw);
+        w.u32(e.pmmCrc);
+        w.u64(e.emmStored);
+        w.u64(e.emmRaw);
+        w.u32(e.emmCrc);
+        w.str(e.name);
+    }
+    std::vector<uint8_t> footer;
+    ByteWriter fw(footer);
+    fw.u64(m_dataEnd);
+    fw.u32(static_cast<uint32_t>(index.size()));
+    fw.u32(static_cast<uint32_t>(m_entries.size()));
+    fw.u32(Crc32(index.data(), index.size()));
+    fw.u32(kPackVersion);
+    fw.u32(0);
+    fw.u32(kFooterMagic);
+
+    f.clear();
+    f.seekp(static_cast<std::streamoff>(m_dataEnd));
+    f.write(reinterpret_cast<const char*>(index.data()), static_cast<std::streamsize>(index.size()));
+    f.write(reinterpret_cast<const char*>(footer.data()), static_cast<std::streamsize>(footer.size()));
+    f.flush();
+    m_fileSize = m_dataEnd + index.size() + footer.size();
+    return f.good();
+}
+
+bool PackFile::append(const std::string& name, int64_t time, const fs::path& pmm, const fs::path& emm, TokenBucket* bucket, PackEntry* added) {
+    if (!load()) return false;
+    if (!fs::exists(m_path)) {
+        std::ofstream create(m_path.c_str(), std::ios::binary);
+        if (!create.is_open()) return false;
+    }
+    std::fstream f(m_path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+    if (!f.is_open()) return false;
+
+    PackEntry e;
+    e.name = name;
+    e.time = time;
+    e.offset = m_dataEnd;
+    e.codec = PackCodecRaw;
+
+    // 書き終わるまでは不正なマジックにしておき、途中で落ちても走査で拾わないようにする
+    std::vector<uint8_t> header;
+    writeRecordHeader(header, e, 0);
+    f.seekp(static_cast<std::streamoff>(e.offset));
+    f.write(reinterpret_cast<const char*>(header.data()), static_cast<std::streamsize>(header.size()));
+
+    bool copied = appendFile(f, pmm, bucket, e.pmmRaw, e.pmmCrc);
+    e.pmmStored = e.pmmRaw;
+    if (copied && !emm.empty() && fs::exists(emm)) {
+        copied = appendFile(f, emm, bucket, e.emmRaw, e.emmCrc);
+        e.emmStored = e.emmRaw;
+    }
+    if (!copied) {
+        restoreIndex(f);
+        return false;
+    }
+
+    header.clear();
+    writeRecordHeader(header, e, kRecordMagic);
+    f.seekp(static_cast<std::streamoff>(e.offset));
+    f.write(reinterpret_cast<const char*>(header.data()), static_cast<std::streamsize>(header.size()));
+
+    m_entries.push_back(e);
+    m_dataEnd = e.offset + e.recordSize();
+    if (added) *added = e;
+    bool ok = writeIndex(f);
+    f.close();
+    return ok && truncateToIndex();
+}
+
+bool PackFile::appendPrepared(const PreparedRecord& record, PackEntry* added) {
+    if (!load()) return false;
+    if (!fs::exists(m_path)) {
+        std::ofstream create(m_path.c_str(), std::ios::binary);
+        if (!create.is_open()) return false;
+    }
+    std::fstream f(m_path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+    if (!f.is_open()) return false;
+
+    PackEntry e = record.entry;
+    e.offset = m_dataEnd;
+    std::vector<uint8_t> header;
+    writeRecordHeader(header, e, 0);
+    f.seekp(static_cast<std::streamoff>(e.offset));
+    f.write(reinterpret_cast<const char*>(header.data()), static_cast<std::streamsize>(header.size()));
+    f.write(reinterpret_cast<const char*>(record.data.data()), static_cast<std::streamsize>(record.data.size()));
+    if (!f) {
+        restoreIndex(f);
+        return false;
+    }
+
+    header.clear();
+    writeRecordHeader(header, e, kRecordMagic);
+    f.seekp(static_cast<std::streamoff>(e.offset));
+    f.write(reinterpret_cast<const char*>(header.data()), static_cast<std::streamsize>(header.size()));
+
+    m_entries.push_back(e);
+    m_dataEnd = e.offset + e.recordSize();
+    if (added) *added = e;
+    bool ok = writeIndex(f);
+    f.close();
+    return ok && truncateToIndex();
+}
+
+bool PackFile::restoreIndex(std::fstream& f) {
+    // 失敗したストリームには書き出せなかったバッファが残っていることがあるので、閉じて開き直してから書く。
+    // 索引を書けないままだと、次の load() はフッタを見つけられず走査に戻り、索引から外したレコードまで復活する
+    f.close();
+    bool ok = false;
+    {
+        std::fstream g(m_path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        ok = g.is_open() && writeIndex(g);
+    }
+    if (!ok) {
+        // 空きが無くて書けなかったなら、途中まで書いたレコードを先に切り落として場所を空ける
+        std::error_code ec;
+        fs::resize_file(m_path, m_dataEnd, ec);
+        std::fstream g(m_path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        ok = !ec && g.is_open() && writeIndex(g);
+    }
+    return truncateToIndex() && ok;
+}
+
+bool PackFile::truncateToIndex() {
+    // 索引が短くなった場合や復旧後は古いデータが残るので、フッタが末尾になるよう切り詰める
+    std::error_code ec;
+    uint64_t actual = fs::file_size(m_path, ec);
+    if (ec) return false;
+    if (actual > m_fileSize) fs::resize_file(m_path, m_fileSize, ec);
+    return !ec;
+}
+
+bool PackFile::remove(const std::vector<std::string>& names) {
+    if (!load()) return false;
+    size_t before = m_entries.size();
+    m_entries.erase(std::remove_if(m_entries.begin(), m_entries.end(), [&](const PackEntry& e) {
+        return std::find(names.begin(), names.end(), e.name) != names.end();
+    }), m_entries.end());
+    if (m_entries.size() == before) return true;
+
+    {
+        std::fstream f(m_path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        if (!f.is_open() || !writeIndex(f)) return false;
+    }
+    return truncateToIndex();
+}
+
+bool PackFile::sync() const {
+    return NativeSync(m_path.native());
+}
+
+bool PackFile::readData(const PackEntry& entry, std::vector<uint8_t>& pmm, std::vector<uint8_t>* emm, TokenBucket* bucket) const {
+    std::fstream f(m_path.c_str(), std::ios::in | std::ios::binary);
+    if (!f.is_open()) return false;
+    auto readInto = [&](uint64_t offset, uint64_t stored, uint64_t rawSize, uint32_t expectedCrc, std::vector<uint8_t>& out) {
+        out.clear();
+        out.reserve(static_cast<size_t>(rawSize));
+        bool ok = readStored(f, offset, stored, entry.codec, bucket, [&](const uint8_t* p, size_t n) {
+            out.insert(out.end(), p, p + n);
+            return true;
+        });
+        return ok && out.size() == rawSize && Crc32(out.data(), out.size()) == expectedCrc;
+    };
+    if (!readInto(entry.dataOffset(), entry.pmmStored, entry.pmmRaw, entry.pmmCrc, pmm)) return false;
+    if (emm && !readInto(entry.dataOffset() + entry.pmmStored, entry.emmStored, entry.emmRaw, entry.emmCrc, *emm)) return false;
+    return true;
+}
+
+bool PackFile::verify(const PackEntry& entry, uint64_t* bytesRead) const {
+    std::fstream f(m_path.c_str(), std::ios::in | std::ios::binary);
+    if (!f.is_open()) return false;
+    auto check = [&](uint64_t offset, uint64_t stored, uint64_t rawSize, uint32_t expectedCrc) {
+        uint32_t crc = 0;
+        uint64_t size = 0;
+        bool ok = readStored(f, offset, stored, entry.codec, nullptr, [&](const uint8_t* p, size_t n) {
+            crc = Crc32(p, n, crc);
+            size += n;
+            return true;
+        });
+        if (bytesRead) *bytesRead += stored;
+        return ok && size == rawSize && crc == expectedCrc;
+    };
+    return check(entry.dataOffset(), entry.pmmStored, entry.pmmRaw, entry.pmmCrc) &&
+        check(entry.dataOffset() + entry.pmmStored, entry.emmStored, entry.emmRaw, entry.emmCrc);
+}
+
+bool PackFile::extract(const PackEntry& entry, const fs::path& pmmOut, const fs::path& emmOut, TokenBucket* bucket, TaskExecutor* executor) const {
+    std::fstream f(m_path.c_str(), std::ios::in | std::ios::binary);
+    if (!f.is_open()) return false;
+    auto extractTo = [&](const fs::path& outPath, uint64_t offset, uint64_t stored, uint64_t rawSize, uint32_t expectedCrc) {
+        std::ofstream out(outPath.c_str(), std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) return false;
+        uint32_t crc = 0;
+        uint64_t written = 0;
+        bool ok = readStored(f, offset, stored, entry.codec, bucket, [&](const uint8_t* p, size_t n) {
+            crc = Crc32(p, n, crc);
+            written += n;
+            out.write(reinterpret_cast<const char*>(p), static_cast<std::streamsize>(n));
+            return static_cast<bool>(out);
+        }, executor, TaskPriority::Interactive);
+        return ok && written == rawSize && crc == expectedCrc;
+    };
+
+    bool ok = extractTo(pmmOut, entry.dataOffset(), entry.pmmStored, entry.pmmRaw, entry.pmmCrc);
+    if (ok && !emmOut.empty() && entry.emmRaw > 0) {
+        ok = extractTo(emmOut, entry.dataOffset() + entry.pmmStored, entry.emmStored, entry.emmRaw, entry.emmCrc);
+        if (!ok) fs::remove(emmOut);
+    }
+    if (!ok) fs::remove(pmmOut);
+    return ok;
+}
+
+bool PackFile::compact(TokenBucket* bucket) {
+    if (!load()) return false;
+    fs::path tmpPath = m_path;
+    tmpPath += L".tmp";
+
+    std::vector<PackEntry> moved;
+    uint64_t pos = 0;
+    {
+        std::fstream src(m_path.c_str(), std::ios::in | std::ios::binary);
+        std::fstream dst(tmpPath.c_str(), std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!src.is_open() || !dst.is_open()) return false;
+        for (const auto& e : m_entries) {
+            if (!copyRange(src, e.offset, e.recordSize(), dst, bucket, nullptr)) {
+                dst.close();
+                fs::remove(tmpPath);
+                return false;
+            }
+            PackEntry ne = e;
+            ne.offset = pos;
+            pos += e.recordSize();
+            moved.push_back(ne);
+        }
+        m_entries = moved;
+        m_dataEnd = pos;
+        if (!writeIndex(dst)) {
+            dst.close();
+            fs::remove(tmpPath);
+            load();
+            return false;
+        }
+    }
+    if (!ReplaceFileAtomic(tmpPath, m_path)) {
+        fs::remove(tmpPath);
+        load();
+        return false;
+    }
+    return true;
+}
+
+size_t PackFile::recompress(int64_t olderThan, int level, TokenBucket* bucket, const std::function<bool()>& keepGoing, TaskExecutor* executor) {
+    if (!load()) return 0;
+    std::fstream f(m_path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+    if (!f.is_open()) return 0;
+
+    size_t done = 0;
+    for (size_t i = 0; i < m_entries.size(); i++) {
+        const PackEntry& e = m_entries[i];
+        if (e.codec != PackCodecRaw || e.time >= olderThan) continue;
+        if (keepGoing && !keepGoing()) break;
+
+        // 新しいレコードを末尾に書き、書き終えてから索引の1件だけを差し替える
+        PackEntry ne = e;
+        ne.codec = PackCodecLz;
+        ne.offset = m_dataEnd;
+        std::vector<uint8_t> header;
+        writeRecordHeader(header, ne, 0);
+        f.clear();
+        f.seekp(static_cast<std::streamoff>(ne.offset));
+        f.write(reinterpret_cast<const char*>(header.data()), static_cast<std::streamsize>(header.size()));
+
+        uint64_t writePos = ne.dataOffset();
+        uint32_t pmmCrc = 0;
+        uint32_t emmCrc = 0;
+        bool ok = f.good() &&
+            writeCompressed(f, e.dataOffset(), e.pmmRaw, level, bucket, keepGoing, writePos, ne.pmmStored, pmmCrc, executor) &&
+            writeCompressed(f, e.dataOffset() + e.pmmStored, e.emmRaw, level, bucket, keepGoing, writePos, ne.emmStored, emmCrc, executor);
+        if (!ok) {
+            restoreIndex(f);
+            return done;
+        }
+        // 元データが壊れていた場合は手を付けない
+        if (pmmCrc != e.pmmCrc || emmCrc != e.emmCrc) {
+            writeIndex(f);
+            continue;
+        }
+
+        header.clear();
+        writeRecordHeader(header, ne, kRecordMagic);
+        f.clear();
+        f.seekp(static_cast<std::streamoff>(ne.offset));
+        f.write(reinterpret_cast<const char*>(header.data()), static_cast<std::streamsize>(header.size()));
+
+        m_entries[i] = ne;
+        m_dataEnd = writePos;
+        if (!writeIndex(f)) break;
+        done++;
+    }
+    f.close();
+    truncateToIndex();
+    return done;
+}
+
+bool PrepareRecord(const std::string& name, int64_t time, const std::vector<uint8_t>& pmm, const std::vector<uint8_t>& emm, int level,
+    PreparedRecord& out, TaskExecutor* executor) {
+    PackEntry& e = out.entry;
+    e = PackEntry();
+    e.name = name;
+    e.time = time;
+    e.codec = level > 0 ? PackCodecLz : PackCodecRaw;
+    e.pmmRaw = pmm.size();
+    e.pmmCrc = Crc32(pmm.data(), pmm.size());
+    e.emmRaw = emm.size();
+    e.emmCrc = Crc32(emm.data(), emm.size());
+    out.data.clear();
+    bool ok = true;
+    auto store = [&](const std::vector<uint8_t>& raw) {
+        size_t start = out.data.size();
+        if (level <= 0) {
+            out.data.insert(out.data.end(), raw.begin(), raw.end());
+        }
+        else {
+            // ブロックごとに別々に圧縮してからつなぐ
+            size_t blocks = (raw.size() + kLzBlockSize - 1) / kLzBlockSize;
+            std::vector<std::vector<uint8_t>> packed(blocks);
+            auto compress = [&](size_t i) {
+                size_t pos = i * kLzBlockSize;
+                appendLzBlock(raw.data() + pos, (std::min)(raw.size() - pos, kLzBlockSize), level, packed[i]);
+            };
+            if (executor && blocks > 1) {
+                ok = executor->parallelFor(blocks, TaskPriority::Maintenance, compress) && ok;
+            }
+            else {
+                for (size_t i = 0; i < blocks; i++) compress(i);
+            }
+            for (const auto& b : packed) out.data.insert(out.data.end(), b.begin(), b.end());
+        }
+        return static_cast<uint64_t>(out.data.size() - start);
+    };
+    e.pmmStored = store(pmm);
+    e.emmStored = store(emm);
+    return ok;
+}
+
+// --- PackStore ---
+
+fs::path PackStore::packPath(int index) const {
+    wchar_t suffix[16];
+    swprintf(suffix, 16, L".%03d.pack", index);
+    return m_dir / (m_stem + suffix);
+}
+
+std::vector<fs::path> PackStore::packPaths() const {
+    std::vector<fs::path> paths;
+    for (int i = 0; i < 1000; i++) {
+        fs::path p = packPath(i);
+        if (!fs::exists(p)) break;
+        paths.push_back(p);
+    }
+    return paths;
+}
+
+bool PackStore::append(const std::string& name, int64_t time, const fs::path& pmm, const fs::path& emm, TokenBucket* bucket,
+    fs::path* outPath, PackEntry* added) {
+    return appendTo(outPath, [&](PackFile& pack) { return pack.append(name, time, pmm, emm, bucket, added); });
+}
+
+bool PackStore::appendPrepared(const PreparedRecord& record, fs::path* outPath, PackEntry* added) {
+    return appendTo(outPath, [&](PackFile& pack) { return pack.appendPrepared(record, added); });
+}
+
+bool PackStore::appendTo(fs::path* outPath, const std::function<bool(PackFile&)>& write) {
+    // 最後のパックを他のプロセスが書いていれば、待たずに空いている他のパック（無ければ新しいパック）へ書く。
+    // 新しいパックも使われていれば空くまで待つ
+    std::shared_ptr<LeaseTable> leases = LeaseTable::open(m_dir);
+    auto deadline = std::chrono::steady_clock::now() + lease::LeaseTtl * 3;
+    for (;;) {
+        std::vector<fs::path> paths = packPaths();
+        std::vector<fs::path> candidates;
+        for (auto it = paths.rbegin(); it != paths.rend(); ++it) {
+            std::error_code ec;
+            if (fs::file_size(*it, ec) < PackFile::MaxPackSize && !ec) candidates.push_back(*it);
+        }
+        candidates.push_back(packPath(static_cast<int>(paths.size())));
+        for (const auto& target : candidates) {
+            Lease held = leases->tryAcquire(lease::PackResource(target));
+            if (!held) continue;
+            if (outPath) *outPath = target;
+            PackFile pack(target);
+            return write(pack);
+        }
+        if (std::chrono::steady_clock::now() >= deadline) return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+size_t PackStore::applyRetention(int maxFiles, std::vector<std::string>* removedNames) {
+    struct Item { int64_t time; std::string name; size_t pack; };
+    std::vector<fs::path> paths = packPaths();
+    std::vector<Item> items;
+    // 他のプロセスが書き換えている途中の索引を読まないよう、パックごとにリースを取って読む
+    std::shared_ptr<LeaseTable> leases = LeaseTable::open(m_dir);
+    for (size_t i = 0; i < paths.size(); i++) {
+        Lease held = leases->acquire(lease::PackResource(paths[i]), lease::LeaseTtl * 3);
+        PackFile pack(paths[i]);
+        if (!held || !pack.load()) continue;
+        for (const auto& e : pack.entries()) items.push_back(Item{ e.time, e.name, i });
+    }
+    if (maxFiles <= 0 || items.size() <= static_cast<size_t>(maxFiles)) return 0;
+
+    std::sort(items.begin(), items.end(), [](const Item& a, const Item& b) {
+        return a.time != b.time ? a.time < b.time : a.name < b.name;
+    });
+    std::map<size_t, std::vector<std::string>> victims;
+    size_t count = items.size() - static_cast<size_t>(maxFiles);
+    for (size_t i = 0; i < count; i++) {
+        // 作成中（名前のリースが生きている）のものは消さない
+        if (leases->isHeld(lease::NameResource(items[i].name))) continue;
+        victims[items[i].pack].push_back(items[i].name);
+    }
+
+    size_t removed = 0;
+    for (const auto& v : victims) {
+        Lease held = leases->acquire(lease::PackResource(paths[v.first]), lease::LeaseTtl * 3);
+        PackFile pack(paths[v.first]);
+        if (!held || !pack.remove(v.second)) continue;
+        removed += v.second.size();
+        if (removedNames) removedNames->insert(removedNames->end(), v.second.begin(), v.second.end());
+    }
+    return removed;
+}
+
+size_t PackStore::compact(double deadRatio, TokenBucket* bucket) {
+    size_t compacted = 0;
+    std::shared_ptr<LeaseTable> leases = LeaseTable::open(m_dir);
+    for (const auto& path : packPaths()) {
+        // 他のプロセスが使っているパックは次の機会に回す
+        Lease held = leases->tryAcquire(lease::PackResource(path));
+        if (!held) continue;
+        PackFile pack(path);
+        if (!pack.load() || pack.fileSize() == 0) continue;
+        double dead = static_cast<double>(pack.fileSize() - pack.liveBytes()) / static_cast<double>(pack.fileSize());
+        // 索引とフッタ分は常に残るので、小さすぎるパックは対象外
+        if (dead > deadRatio && pack.fileSize() - pack.liveBytes() > kIoChunkSize && pack.compact(bucket)) compacted++;
+    }
+    return compacted;
+}
+
+size_t PackStore::recompress(int64_t olderThan, int level, TokenBucket* bucket, const std::function<bool()>& keepGoing, TaskExecutor* executor) {
+    size_t done = 0;
+    std::shared_ptr<LeaseTable> leases = LeaseTable::open(m_dir);
+    for (const auto& path : packPaths()) {
+        if (keepGoing && !keepGoing()) break;
+        Lease held = leases->tryAcquire(lease::PackResource(path));
+        if (!held) continue;
+        PackFile pack(path);
+        done += pack.recompress(olderThan, level, bucket, keepGoing, executor);
+    }
+    return done;
+}
@@ -0,0 +1,151 @@
+﻿#pragma once
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+#include <experimental/filesystem>
+#include "BackupIo.h"
+#include "TaskExecutor.h"
+
+namespace fs = std::experimental::filesystem;
+
+// パックファイル: 多数のスナップショットを1つのファイルに追記していく形式
+//
+//   [レコード]...[索引][フッタ(32バイト)]
+//
+// レコードは自己記述的なヘッダ + 名前 + pmm本体 + emm本体。
+// 追記時は古い索引の位置から新しいレコードを書き、その後ろに索引とフッタを書き直す。
+// 世代整理では索引から外すだけにし、不要領域が増えたら compact() で詰め直す。
+// フッタが壊れている場合（追記中のクラッシュ）はレコードを先頭から走査して索引を復旧する。
+//
+// 新しいバックアップは速度優先で無圧縮のまま追記し、古くなったものを recompress() で
+// 高圧縮のレコードとして末尾に追記し直す。索引の差し替えは1件ずつなので、途中で
+// 中断しても済んだ分は残り、次回は codec が無圧縮のものから再開できる。
+//
+// 複数の MMD が同じフォルダを使うときのため、PackStore はパックを書き換える間そのパックの
+// リース（BackupLease.h）を持つ。追記先が使われていれば新しいパックに書き、詰め直しと
+// 再圧縮は使われているパックを飛ばす。PackFile を直接使う書き換えは調停されない。
+
+struct PackEntry {
+    std::string name;       // 元のバックアップ名（拡張子なし、UTF-8）
+    int64_t time = 0;       // 作成時刻（UNIX秒）
+    uint64_t offset = 0;    // レコード先頭の位置
+    uint8_t codec = 0;      // PackCodec
+    uint64_t pmmStored = 0; // 格納サイズ
+    uint64_t pmmRaw = 0;    // 展開後のサイズ
+    uint32_t pmmCrc = 0;    // 展開後のCRC32
+    uint64_t emmStored = 0;
+    uint64_t emmRaw = 0;
+    uint32_t emmCrc = 0;
+
+    uint64_t headerSize() const;
+    uint64_t dataOffset() const { return offset + headerSize(); }
+    uint64_t recordSize() const { return headerSize() + pmmStored + emmStored; }
+};
+
+enum PackCodec : uint8_t {
+    PackCodecRaw = 0,
+    PackCodecLz = 1,    // LzCodec のブロック列（[展開後u32][格納u32][データ]...、両者が同じなら無圧縮）
+};
+
+// メモリ上で圧縮まで済ませたレコード。PrepareRecord で作り、PackStore::appendPrepared で書く
+// （書き込みを待つ間に CPU で圧縮しておける。BackupImport から使う）
+struct PreparedRecord {
+    PackEntry entry;            // offset 以外
+    std::vector<uint8_t> data;  // pmm と emm の格納データを続けたもの
+};
+
+// level が 0 なら無圧縮、それ以外は LzCodec の level で圧縮する（executor があればブロックごとに並列に）。
+// 途中で取り消されたら false
+bool PrepareRecord(const std::string& name, int64_t time, const std::vector<uint8_t>& pmm, const std::vector<uint8_t>& emm, int level,
+    PreparedRecord& out, TaskExecutor* executor = nullptr);
+
+class PackFile {
+public:
+    static const uint64_t MaxPackSize = 1ull << 30;  // これを超えたら次のパックへ
+
+    explicit PackFile(const fs::path& path) : m_path(path), m_dataEnd(0), m_fileSize(0) {}
+
+    // 索引を読み込む。ファイルが無ければ空として true を返す
+    bool load();
+
+    const fs::path& path() const { return m_path; }
+    const std::vector<PackEntry>& entries() const { return m_entries; }
+    const PackEntry* find(const std::string& name) const;
+    uint64_t fileSize() const { return m_fileSize; }
+    uint64_t liveBytes() const;
+
+    // pmm（と存在すれば emm）を1レコードとして追記する
+    bool append(const std::string& name, int64_t time, const fs::path& pmm, const fs::path& emm, TokenBucket* bucket, PackEntry* added = nullptr);
+    bool appendPrepared(const PreparedRecord& record, PackEntry* added = nullptr);
+
+    // 索引から外す（データは compact() まで残る）
+    bool remove(const std::vector<std::string>& names);
+
+    // レコードと索引をディスクまで書き出す。追記は flush までなので、元のファイルを消す前に呼ぶ
+    bool sync() const;
+
+    // スナップショットを通常の .pmm / .emm に取り出す。emmOut が空なら emm は出力しない。
+    // executor があれば圧縮されたブロックを Interactive の優先度で並列に展開する
+    bool extract(const PackEntry& entry, const fs::path& pmmOut, const fs::path& emmOut, TokenBucket* bucket,
+        TaskExecutor* executor = nullptr) const;
+
+    // 本体をメモリに読み込む（CRC も確認する）
+    bool readData(const PackEntry& entry, std::vector<uint8_t>& pmm, std::vector<uint8_t>* emm, TokenBucket* bucket) const;
+
+    // 本体を展開して CRC を確かめるだけで、どこにも出力しない。bytesRead に格納サイズを足す
+    bool verify(const PackEntry& entry, uint64_t* bytesRead) const;
+
+    // 生きているレコードだけを一時ファイルに書き直し、アトミックに置き換える
+    bool compact(TokenBucket* bucket);
+
+    // time が olderThan より前の無圧縮レコードを level で圧縮し直す（executor があれば Maintenance で並列に）。
+    // keepGoing が false を返したらその時点で止める。圧縮し直した数を返す
+    size_t recompress(int64_t olderThan, int level, TokenBucket* bucket, const std::function<bool()>& keepGoing,
+        TaskExecutor* executor = nullptr);
+
+private:
+    bool scanRecords();
+    bool writeIndex(std::fstream& fsPack);
+    bool truncateToIndex();
+    // 追記に失敗した後、元の索引を書き戻して途中まで書いたレコードを切り落とす（f は閉じる）
+    bool restoreIndex(std::fstream& f);
+
+    fs::path m_path;
+    std::vector<PackEntry> m_entries;
+    uint64_t m_dataEnd;   // レコード領域の終端（＝索引の位置）
+    uint64_t m_fileSize;
+};
+
+// 1つのプロジェクト（<stem>.000.pack, <stem>.001.pack, ...）のパック群
+class PackStore {
+public:
+    PackStore(const fs::path& backupDir, const std::wstring& stem) : m_dir(backupDir), m_stem(stem) {}
+
+    // 連番を存在確認するだけで列挙する（ディレクトリ走査はしない）
+    std::vector<fs::path> packPaths() const;
+
+    bool append(const std::string& name, int64_t time, const fs::path& pmm, const fs::path& emm, TokenBucket* bucket,
+        fs::path* packPath = nullptr, PackEntry* added = nullptr);
+    bool appendPrepared(const PreparedRecord& record, fs::path* packPath = nullptr, PackEntry* added = nullptr);
+
+    // 古い順に maxFiles を超えた分を索引から外す。外した数を返す
+    size_t applyRetention(int maxFiles, std::vector<std::string>* removedNames = nullptr);
+
+    // 不要領域が deadRatio を超えたパックを詰め直す。詰め直した数を返す
+    size_t compact(double deadRatio, TokenBucket* bucket);
+
+    // 全パックの古いスナップショットを圧縮し直す。圧縮し直した数を返す
+    size_t recompress(int64_t olderThan, int level, TokenBucket* bucket, const std::function<bool()>& keepGoing,
+        TaskExecutor* executor = nullptr);
+
+    static bool isPackFile(const fs::path& path) { return path.extension() == L".pack"; }
+
+private:
+    fs::path packPath(int index) const;
+    bool appendTo(fs::path* packPath, const std::function<bool(PackFile&)>& write);
+
+    fs::path m_dir;
+    std::wstring m_stem;
+};
@@ -0,0 +1,477 @@
+﻿#include "BackupReplica.h"
+#include "AsyncIo.h"
+#include "BackupFormat.h"
+#include "BackupLease.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cwchar>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <map>
+#include <sstream>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace replica {
+    namespace {
+        // 複製先のファイル。位置を指定して書く（複製元は AsyncReader で先読みする）
+        class RawFile {
+        public:
+            RawFile() {}
+            ~RawFile() { close(); }
+            RawFile(const RawFile&) = delete;
+            RawFile& operator=(const RawFile&) = delete;
+
+#ifdef _WIN32
+            bool openWrite(const fs::path& path) {
+                m_h = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+                return m_h != INVALID_HANDLE_VALUE;
+            }
+            bool writeAt(uint64_t offset, const void* data, size_t size) {
+                OVERLAPPED ov = {};
+                ov.Offset = static_cast<DWORD>(offset);
+                ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+                DWORD written = 0;
+                return WriteFile(m_h, data, static_cast<DWORD>(size), &written, &ov) && written == size;
+            }
+            bool truncate(uint64_t size) {
+                LARGE_INTEGER pos;
+                pos.QuadPart = static_cast<LONGLONG>(size);
+                return SetFilePointerEx(m_h, pos, NULL, FILE_BEGIN) && SetEndOfFile(m_h);
+            }
+            bool flush() { return FlushFileBuffers(m_h) != FALSE; }
+            void close() {
+                if (m_h != INVALID_HANDLE_VALUE) CloseHandle(m_h);
+                m_h = INVALID_HANDLE_VALUE;
+            }
+
+        private:
+            HANDLE m_h = INVALID_HANDLE_VALUE;
+#else
+            bool openWrite(const fs::path& path) {
+                m_fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+                return m_fd >= 0;
+            }
+            bool writeAt(uint64_t offset, const void* data, size_t size) {
+                return pwrite(m_fd, data, size, static_cast<off_t>(offset)) == static_cast<ssize_t>(size);
+            }
+            bool truncate(uint64_t size) { return ftruncate(m_fd, static_cast<off_t>(size)) == 0; }
+            bool flush() { return fsync(m_fd) == 0; }
+            void close() {
+                if (m_fd >= 0) ::close(m_fd);
+                m_fd = -1;
+            }
+
+        private:
+            int m_fd = -1;
+#endif
+        };
+
+        uint64_t blockHash(const uint8_t* p, size_t n) {
+            uint64_t h = 0x9E3779B97F4A7C15ull ^ n;
+            size_t i = 0;
+            for (; i + 8 <= n; i += 8) {
+                uint64_t w;
+                memcpy(&w, p + i, 8);
+                h ^= w * 0xFF51AFD7ED558CCDull;
+                h = (h << 31 | h >> 33) * 0xC4CEB9FE1A85EC53ull;
+            }
+            for (; i < n; i++) h = (h ^ p[i]) * 0x100000001B3ull;
+            h ^= h >> 33;
+            h *= 0xFF51AFD7ED558CCDull;
+            h ^= h >> 33;
+            return h;
+        }
+
+        struct FileRecord {
+            uint64_t size = 0;
+            int64_t mtime = 0;
+            bool complete = false;
+            std::vector<uint64_t> hashes;
+        };
+        typedef std::map<std::string, FileRecord> Manifest;
+
+        fs::path manifestPath(const fs::path& backupDir, const std::wstring& stem) {
+            return backupDir / (stem + L".replica");
+        }
+
+        bool loadManifest(const fs::path& path, Manifest& manifest) {
+            manifest.clear();
+            std::ifstream in(path.c_str(), std::ios::binary);
+            if (!in.is_open()) return true;
+            std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            ByteReader r(data.data(), data.size());
+            if (r.u32() != ManifestMagic || r.u32() != ManifestVersion) return false;
+            uint32_t count = r.u32();
+            for (uint32_t i = 0; i < count && r.ok(); i++) {
+                std::string name = r.str();
+                FileRecord rec;
+                rec.size = r.u64();
+                rec.mtime = r.i64();
+                rec.complete = r.u8() != 0;
+                uint32_t blocks = r.u32();
+                if (blocks > data.size() / 8) return false;
+                rec.hashes.resize(blocks);
+                for (auto& h : rec.hashes) h = r.u64();
+                if (r.ok()) manifest[name] = rec;
+            }
+            return r.ok();
+        }
+
+        bool saveManifest(const fs::path& path, const Manifest& manifest) {
+            std::vector<uint8_t> data;
+            ByteWriter w(data);
+            w.u32(ManifestMagic);
+            w.u32(ManifestVersion);
+            w.u32(static_cast<uint32_t>(manifest.size()));
+            for (const auto& it : manifest) {
+                w.str(it.first);
+                w.u64(it.second.size);
+                w.i64(it.second.mtime);
+                w.u8(it.second.complete ? 1 : 0);
+                w.u32(static_cast<uint32_t>(it.second.hashes.size()));
+                for (uint64_t h : it.second.hashes) w.u64(h);
+            }
+            fs::path tmp = path;
+            tmp += L".tmp";
+            {
+                std::ofstream out(tmp.c_str(), std::ios::binary | std::ios::trunc);
+                if (!out.is_open()) return false;
+                out.write(reinterpret_cast<const char*>(data.data()), data.size());
+                if (!out) return false;
+            }
+            return ReplaceFileAtomic(tmp, path);
+        }
+
+        int64_t modifiedTime(const fs::path& path) {
+            std::error_code ec;
+            auto t = fs::last_write_time(path, ec);
+            return ec ? 0 : static_cast<int64_t>(t.time_since_epoch().count());
+        }
+
+        // 複製元のファイルのうち、このプロジェクトのもの。一覧は最後に送る
+        std::vector<fs::path> sourceFiles(const fs::path& backupDir, const std::wstring& stem) {
+            std::vector<fs::path> files;
+            std::error_code ec;
+            for (fs::directory_iterator it(backupDir, ec), end; !ec && it != end; it.increment(ec)) {
+                const fs::path& p = it->path();
+                if (!IsProjectFile(p.filename().wstring(), stem) || !fs::is_regular_file(it->status())) continue;
+                files.push_back(p);
+            }
+            std::sort(files.begin(), files.end(), [](const fs::path& a, const fs::path& b) {
+                bool ca = a.extension() == L".catalog", cb = b.extension() == L".catalog";
+                return ca != cb ? cb : a < b;
+            });
+            return files;
+        }
+    }
+
+    bool IsProjectFile(const std::wstring& fileName, const std::wstring& stem) {
+        if (fileName.size() <= stem.size() || fileName.compare(0, stem.size(), stem) != 0) return false;
+        const wchar_t* rest = fileName.c_str() + stem.size();
+        const size_t restLength = fileName.size() - stem.size();
+        if (wcscmp(rest, L".catalog") == 0) return true;
+        // .NNN.pack
+        auto digit = [](wchar_t c) { return c >= L'0' && c <= L'9'; };
+        if (restLength == 9 && rest[0] == L'.' && digit(rest[1]) && digit(rest[2]) && digit(rest[3]) &&
+            wcscmp(rest + 4, L".pack") == 0) return true;
+        // バックアップ名の後ろに拡張子。書きかけの .tmp は送らない
+        size_t dot = fileName.find(L'.', stem.size());
+        if (dot == std::wstring::npos || !IsBackupName(fileName.c_str(), dot, stem.c_str(), stem.size())) return false;
+        return fs::path(fileName).extension() != L".tmp";
+    }
+
+    fs::path TargetDir(const fs::path& replicaRoot, const fs::path& backupDir) {
+        fs::path project = backupDir.parent_path();
+        std::string key = WideToUtf8(project.wstring());
+        wchar_t suffix[16];
+        swprintf(suffix, sizeof(suffix) / sizeof(suffix[0]), L"_%08x", Crc32(key.data(), key.size()));
+        return replicaRoot / (project.filename().wstring() + suffix);
+    }
+
+    SyncStatus Sync(const fs::path& backupDir, const std::wstring& stem, const fs::path& replicaRoot,
+        TokenBucket* bucket, const std::atomic<bool>* cancel, SyncStats& stats, std::string& error) {
+        // 複製先の根元が無ければ作らずにオフラインとみなす（外れたドライブの文字に書かない）
+        std::error_code ec;
+        if (!fs::is_directory(replicaRoot, ec)) {
+            error = "replica root is not reachable: " + WideToUtf8(replicaRoot.wstring());
+            return SyncStatus::Offline;
+        }
+        fs::path target = TargetDir(replicaRoot, backupDir);
+        fs::create_directories(target, ec);
+        if (!fs::is_directory(target, ec)) {
+            error = "cannot create " + WideToUtf8(target.wstring());
+            return SyncStatus::Offline;
+        }
+
+        // 同じプロジェクトを開いている別の MMD が複製中なら、今回は譲って後で再試行する
+        Lease held = LeaseTable::open(backupDir)->tryAcquire(lease::ReplicaResource(stem));
+        if (!held) {
+            error = "another instance is replicating " + WideToUtf8(stem);
+            return SyncStatus::Failed;
+        }
+
+        fs::path mpath = manifestPath(backupDir, stem);
+        Manifest manifest;
+        if (!loadManifest(mpath, manifest)) manifest.clear();  // 読めなければ全部送り直す
+
+        const uint64_t flushEvery = 16 * 1024 * 1024;
+        std::vector<fs::path> files = sourceFiles(backupDir, stem);
+        for (const auto& src : files) {
+            std::string name = WideToUtf8(src.filename().wstring());
+            fs::path dst = target / src.filename();
+            FileRecord& rec = manifest[name];
+            stats.files++;
+
+            int64_t mtime = modifiedTime(src);
+            uint64_t srcSize = fs::file_size(src, ec);
+            if (ec) continue;  // 世代整理で消えたところ
+            uint64_t dstSize = fs::file_size(dst, ec);
+            bool dstExists = !ec;
+            if (rec.complete && rec.size == srcSize && rec.mtime == mtime && dstExists && dstSize == srcSize) {
+                stats.unchanged++;
+                continue;
+            }
+            // 複製先が消えていたら記録を信用しない
+            if (!dstExists) rec.hashes.clear();
+
+            AsyncReader in(SharedAsyncIo(), BlockSize);
+            RawFile out;
+            if (!in.open(src)) continue;
+            if (!out.openWrite(dst)) {
+                error = "cannot open " + WideToUtf8(dst.wstring());
+                saveManifest(mpath, manifest);
+                return SyncStatus::Failed;
+            }
+            rec.complete = false;
+
+            uint64_t offset = 0;
+            uint64_t unflushed = 0;
+            size_t index = 0;
+            for (;; index++) {
+                if (cancel && cancel->load(std::memory_order_relaxed)) {
+                    if (out.flush()) saveManifest(mpath, manifest);
+                    return SyncStatus::Cancelled;
+                }
+                const uint8_t* block = nullptr;
+                size_t got = 0;
+                if (!in.next(block, got)) {
+                    error = "cannot read " + name;
+                    break;
+                }
+                if (got == 0) break;
+                stats.bytesScanned += got;
+                uint64_t h = blockHash(block, got);
+                if (index >= rec.hashes.size() || rec.hashes[index] != h) {
+                    if (bucket) bucket->acquire(got);
+                    if (!out.writeAt(offset, block, got)) {
+                        error = "cannot write " + WideToUtf8(dst.wstring());
+                        if (out.flush()) saveManifest(mpath, manifest);
+                        return SyncStatus::Failed;
+                    }
+                    // 記録は flush の後で残す（書けていないブロックを送ったことにしない）
+                    if (index >= rec.hashes.size()) rec.hashes.resize(index + 1, 0);
+                    rec.hashes[index] = h;
+                    stats.bytesSent += got;
+                    unflushed += got;
+                    if (unflushed >= flushEvery) {
+                        if (!out.flush()) {
+                            error = "cannot flush " + WideToUtf8(dst.wstring());
+                            return SyncStatus::Failed;
+                        }
+                        saveManifest(mpath, manifest);
+                        unflushed = 0;
+                    }
+                }
+                offset += got;
+            }
+            rec.hashes.resize(static_cast<size_t>((offset + BlockSize - 1) / BlockSize));
+            if (!out.truncate(offset) || !out.flush()) {
+                error = "cannot finish " + WideToUtf8(dst.wstring());
+                return SyncStatus::Failed;
+            }
+            rec.size = offset;
+            rec.mtime = mtime;
+            rec.complete = offset == srcSize;  // 読んでいる間に伸びていたら次でもう一度見る
+            saveManifest(mpath, manifest);
+        }
+
+        // 複製元から消えたファイル
+        for (auto it = manifest.begin(); it != manifest.end();) {
+            // 前方一致で選んでいた版が送った、別のプロジェクトのファイル。複製先のものは相手の複製が
+            // 管理しているので消さず、記録から外すだけにする
+            if (!IsProjectFile(Utf8ToWide(it->first), stem)) {
+                it = manifest.erase(it);
+                continue;
+            }
+            bool present = std::any_of(files.begin(), files.end(), [&](const fs::path& p) {
+                return WideToUtf8(p.filename().wstring()) == it->first;
+            });
+            if (present && fs::exists(backupDir / Utf8ToWide(it->first), ec)) {
+                ++it;
+                continue;
+            }
+            fs::remove(target / Utf8ToWide(it->first), ec);
+            stats.removed++;
+            it = manifest.erase(it);
+        }
+        if (!saveManifest(mpath, manifest)) {
+            error = "cannot write " + WideToUtf8(mpath.wstring());
+            return SyncStatus::Failed;
+        }
+        return SyncStatus::Done;
+    }
+}
+
+// --- BackupReplicator ---
+
+BackupReplicator::BackupReplicator()
+    : m_stopping(false), m_busy(false), m_failures(0), m_cancel(false), m_bytesSent(0) {}
+
+BackupReplicator::~BackupReplicator() {
+    stop();
+}
+
+void BackupReplicator::start(const fs::path& replicaRoot, const ReplicaOptions& options) {
+    stop();
+    m_root = replicaRoot;
+    m_options = options;
+    m_bucket.reset();
+    m_bucket.configure(options.bytesPerSec, options.burstBytes);
+    m_cancel = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = false;
+        m_failures = 0;
+        m_nextAttempt = std::chrono::steady_clock::now();
+    }
+    loadQueue();
+    m_thread = std::thread(&BackupReplicator::run, this);
+}
+
+void BackupReplicator::stop() {
+    if (!m_thread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_cancel = true;
+    m_bucket.cancel();
+    m_cv.notify_all();
+    m_thread.join();
+}
+
+void BackupReplicator::enqueue(const fs::path& backupDir, const std::wstring& stem) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = std::find_if(m_queue.begin(), m_queue.end(), [&](const Job& j) { return j.backupDir == backupDir && j.stem == stem; });
+        if (it != m_queue.end()) {
+            it->generation++;
+        }
+        else {
+            m_queue.push_back(Job{ backupDir, stem, 1 });
+            saveQueue();
+        }
+    }
+    m_cv.notify_all();
+}
+
+bool BackupReplicator::idle() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_queue.empty() && !m_busy;
+}
+
+uint32_t BackupReplicator::failures() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_failures;
+}
+
+size_t BackupReplicator::queued() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_queue.size();
+}
+
+std::wstring BackupReplicator::summary() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::wostringstream ss;
+    ss << std::fixed << std::setprecision(1);
+    ss << L"・複製先: " << m_root.wstring() << L"\n";
+    ss << L"・送信: " << m_bytesSent.load(std::memory_order_relaxed) / (1024.0 * 1024.0) << L" MB、待ち " << m_queue.size() << L" 件\n";
+    if (m_failures > 0) {
+        ss << L"・連続 " << m_failures << L" 回失敗（" << Utf8ToWide(m_lastError) << L"）\n";
+    }
+    return ss.str();
+}
+
+void BackupReplicator::run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stopping) {
+        if (m_queue.empty()) {
+            m_cv.wait(lock);
+            continue;
+        }
+        if (std::chrono::steady_clock::now() < m_nextAttempt) {
+            m_cv.wait_until(lock, m_nextAttempt);
+            continue;
+        }
+
+        Job job = m_queue.front();
+        m_busy = true;
+        lock.unlock();
+
+        replica::SyncStats stats;
+        std::string error;
+        replica::SyncStatus status;
+        {
+            BackgroundIoScope lowPriority(true);
+            status = replica::Sync(job.backupDir, job.stem, m_root, &m_bucket, &m_cancel, stats, error);
+        }
+        m_bytesSent.fetch_add(stats.bytesSent, std::memory_order_relaxed);
+
+        lock.lock();
+        m_busy = false;
+        if (status == replica::SyncStatus::Done) {
+            m_failures = 0;
+            // 複製中に新しいバックアップが来ていたらもう一度送る
+            auto it = std::find_if(m_queue.begin(), m_queue.end(), [&](const Job& j) { return j.backupDir == job.backupDir && j.stem == job.stem; });
+            if (it != m_queue.end()) {
+                if (it->generation == job.generation) m_queue.erase(it);
+                else std::rotate(m_queue.begin(), it, it + 1 == m_queue.end() ? m_queue.end() : it + 1);
+            }
+            saveQueue();
+        }
+        else if (status != replica::SyncStatus::Cancelled) {
+            // 先頭のまま、間を空けて再試行する
+            m_failures++;
+            m_lastError = error;
+            std::chrono::milliseconds backoff = m_options.minBackoff * (1 << (std::min)(m_failures - 1, 16u));
+            m_nextAttempt = std::chrono::steady_clock::now() + (std::min)(backoff, m_options.maxBackoff);
+        }
+    }
+}
+
+void BackupReplicator::saveQueue() {
+    if (m_options.queuePath.empty()) return;
+    std::ofstream out(m_options.queuePath.c_str(), std::ios::binary | std::ios::trunc);
+    for (const auto& job : m_queue) out << WideToUtf8(job.backupDir.wstring()) << '\t' << WideToUtf8(job.stem) << '\n';
+}
+
+void BackupReplicator::loadQueue() {
+    if (m_options.queuePath.empty()) return;
+    std::ifstream in(m_options.queuePath.c_str(), std::ios::binary);
+    std::string line;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    while (std::getline(in, line)) {
+        size_t tab = line.find('\t');
+        if (tab == std::string::npos) continue;
+        m_queue.push_back(Job{ fs::path(Utf8ToWide(line.substr(0, tab))), Utf8ToWide(line.substr(tab + 1)), 1 });
+    }
+}
@@ -0,0 +1,112 @@
+﻿#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <experimental/filesystem>
+#include "BackupIo.h"
+
+namespace fs = std::experimental::filesystem;
+
+// Backup フォルダを別のドライブや NAS へ複製する
+//
+// 複製先は <ReplicaDir>/<プロジェクトのフォルダ名>_<フォルダのパスの CRC>/ で、Backup フォルダのうち
+// そのプロジェクトのファイル（パック・一覧・.kfs など）を同じ名前で置く。
+// 送った内容は 256KB ごとのハッシュとして複製元の <stem>.replica に残し、次からはハッシュが
+// 変わったブロックだけを書く。パックや一覧はほとんど末尾への追記なので、送るのは増えた分で済む。
+// ブロックを書いて複製先を flush してから記録を更新するので、途中で止まっても次は続きから送る。
+// 複製元から消えたファイル（世代整理で消えたもの）は複製先からも消す。記録に無いファイルには触れない。
+// 一覧は最後に送り、複製先の一覧がまだ届いていないデータを指さないようにする。
+
+namespace replica {
+    const uint32_t ManifestMagic = 0x50524241;  // "ABRP"
+    const uint32_t ManifestVersion = 1;
+    const size_t BlockSize = 256 * 1024;
+
+    enum class SyncStatus {
+        Done,
+        Offline,    // 複製先のフォルダが無い（ドライブが外れている、NAS に届かない）
+        Failed,     // 読み書きに失敗した
+        Cancelled,
+    };
+
+    struct SyncStats {
+        uint32_t files = 0;
+        uint32_t unchanged = 0;     // 大きさと更新時刻が記録と同じで読まずに済んだもの
+        uint32_t removed = 0;
+        uint64_t bytesScanned = 0;
+        uint64_t bytesSent = 0;
+    };
+
+    fs::path TargetDir(const fs::path& replicaRoot, const fs::path& backupDir);
+
+    // Backup フォルダのファイル名が、プロジェクト stem の複製するファイル（<stem>.catalog、<stem>.NNN.pack、
+    // バックアップ名 <stem>_YYYYMMDD_HHMMSS[_N] の .pmm・.emm・.kfs など）か。
+    // 同じフォルダの複製先を共有する、名前が前方一致する別のプロジェクト（scene に対する scene2）のものは含まない
+    bool IsProjectFile(const std::wstring& fileName, const std::wstring& stem);
+
+    // 1回分の複製を呼び出し元のスレッドで行う。cancel が true になったら、そこまでを記録して戻る
+    SyncStatus Sync(const fs::path& backupDir, const std::wstring& stem, const fs::path& replicaRoot,
+        TokenBucket* bucket, const std::atomic<bool>* cancel, SyncStats& stats, std::string& error);
+}
+
+struct ReplicaOptions {
+    uint64_t bytesPerSec = 0;           // 0 なら無制限
+    uint64_t burstBytes = 4 * 1024 * 1024;
+    std::chrono::milliseconds minBackoff = std::chrono::seconds(5);
+    std::chrono::milliseconds maxBackoff = std::chrono::minutes(10);
+    fs::path queuePath;                 // 待ちを残すファイル（次の起動で続きから送る）。空なら残さない
+};
+
+// 複製を専用のスレッドで行う。enqueue() はすぐに戻り、バックアップ本体を待たせない。
+// 失敗したら minBackoff から倍々に maxBackoff まで間を空けて再試行する
+class BackupReplicator {
+public:
+    BackupReplicator();
+    ~BackupReplicator();
+
+    void start(const fs::path& replicaRoot, const ReplicaOptions& options);
+    void stop();
+    bool running() const { return m_thread.joinable(); }
+
+    void enqueue(const fs::path& backupDir, const std::wstring& stem);
+
+    // 待ちが無く、複製中でもない
+    bool idle() const;
+    uint64_t bytesSent() const { return m_bytesSent.load(std::memory_order_relaxed); }
+    uint32_t failures() const;
+    // 複製を待っているプロジェクトの数
+    size_t queued() const;
+    std::wstring summary() const;
+
+private:
+    struct Job {
+        fs::path backupDir;
+        std::wstring stem;
+        uint64_t generation;    // enqueue のたびに増える。複製中に増えたらもう一度送る
+    };
+
+    void run();
+    void saveQueue();
+    void loadQueue();
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::vector<Job> m_queue;
+    bool m_stopping;
+    bool m_busy;
+    uint32_t m_failures;
+    std::string m_lastError;
+    std::chrono::steady_clock::time_point m_nextAttempt;
+
+    std::thread m_thread;
+    std::atomic<bool> m_cancel;
+    std::atomic<uint64_t> m_bytesSent;
+    fs::path m_root;
+    ReplicaOptions m_options;
+    TokenBucket m_bucket;
+};
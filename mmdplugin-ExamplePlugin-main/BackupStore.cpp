@@ -0,0 +1,509 @@
+﻿#include "BackupStore.h"
+#include "AsyncIo.h"
+#include "BackupFormat.h"
+#include "BackupIo.h"
+#include "BackupLease.h"
+#include "BackupPack.h"
+#include "EmergencyDump.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <cwchar>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+namespace {
+    double processCpuSeconds() {
+#ifdef _WIN32
+        FILETIME created, exited, kernel, user;
+        if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) return 0;
+        auto toSeconds = [](const FILETIME& t) {
+            return (static_cast<uint64_t>(t.dwHighDateTime) << 32 | t.dwLowDateTime) / 1e7;
+        };
+        return toSeconds(kernel) + toSeconds(user);
+#else
+        return static_cast<double>(clock()) / CLOCKS_PER_SEC;
+#endif
+    }
+
+    bool allDigits(const std::wstring& s, size_t from, size_t to) {
+        if (from >= to) return false;
+        for (size_t i = from; i < to; i++) {
+            if (s[i] < L'0' || s[i] > L'9') return false;
+        }
+        return true;
+    }
+
+    // "<stem>.NNN.pack" の stem
+    bool packStem(const fs::path& path, std::wstring& stem) {
+        if (!PackStore::isPackFile(path)) return false;
+        fs::path base = path.stem();
+        std::wstring index = base.extension().wstring();
+        if (index.size() != 4 || !allDigits(index, 1, index.size())) return false;
+        stem = base.stem().wstring();
+        return true;
+    }
+
+    // バックアップ名に付く付随ファイルなら、そのバックアップ名を返す
+    bool sidecarName(const fs::path& path, std::wstring& name) {
+        static const wchar_t* const suffixes[] = { L".kfs", L".thumb.bmp", L".pose" };
+        std::wstring file = path.filename().wstring();
+        for (const wchar_t* suffix : suffixes) {
+            size_t n = wcslen(suffix);
+            if (file.size() > n && file.compare(file.size() - n, n, suffix) == 0) {
+                name = file.substr(0, file.size() - n);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint64_t fileSize(const fs::path& path) {
+        std::error_code ec;
+        uint64_t size = fs::file_size(path, ec);
+        return ec ? 0 : size;
+    }
+
+    // 先のかたまりを読んでいる間に CRC を計算する
+    bool crcFile(const fs::path& path, uint64_t& size, uint32_t& crc) {
+        AsyncReader in(SharedAsyncIo());
+        if (!in.open(path)) return false;
+        size = 0;
+        crc = 0;
+        for (;;) {
+            const uint8_t* data = nullptr;
+            size_t n = 0;
+            if (!in.next(data, n)) return false;
+            if (n == 0) return true;
+            crc = Crc32(data, n, crc);
+            size += n;
+        }
+    }
+
+    // パックの索引をまとめて読んでおく（verify / gc の各スレッドで共有する）
+    typedef std::map<std::string, std::shared_ptr<PackFile>> PackIndex;
+
+    PackIndex loadPacks(const fs::path& backupDir, const std::vector<store::Project>& projects, std::vector<store::Issue>* issues) {
+        PackIndex packs;
+        auto add = [&](const CatalogEntry& e) {
+            if (e.storage != CatalogStorage::Pack || packs.count(e.location)) return;
+            auto pack = std::make_shared<PackFile>(backupDir / Utf8ToWide(e.location));
+            std::error_code ec;
+            if (!fs::exists(pack->path(), ec) || !pack->load()) {
+                if (issues) issues->push_back(store::Issue{ e.location, "pack index cannot be read" });
+                pack.reset();
+            }
+            packs[e.location] = pack;
+        };
+        for (const auto& p : projects) {
+            for (const auto& e : p.entries) add(e);
+            for (const auto& e : p.uncataloged) add(e);
+        }
+        return packs;
+    }
+
+    // 実体があり、大きさが一致するか（中身は読まない）
+    bool stored(const fs::path& backupDir, const PackIndex& packs, const CatalogEntry& e) {
+        if (e.storage == CatalogStorage::Loose) {
+            std::error_code ec;
+            return fs::file_size(backupDir / Utf8ToWide(e.location), ec) == e.pmmSize && !ec;
+        }
+        auto it = packs.find(e.location);
+        if (it == packs.end() || !it->second) return false;
+        const PackEntry* pe = it->second->find(e.name);
+        return pe && pe->pmmRaw == e.pmmSize;
+    }
+}
+
+namespace store {
+    unsigned DefaultThreads() {
+        return (std::max)(1u, std::thread::hardware_concurrency());
+    }
+
+    fs::path ResolveBackupDir(const fs::path& arg) {
+        std::error_code ec;
+        if (arg.extension() == L".pmm" && !fs::is_directory(arg, ec)) return arg.parent_path() / L"Backup";
+        if (fs::is_directory(arg / L"Backup", ec)) return arg / L"Backup";
+        return arg;
+    }
+
+    bool SplitBackupName(const std::wstring& name, std::wstring& stem, int64_t& time) {
+        // 末尾の _N（同じ秒の2つ目以降）を外す
+        size_t end = name.size();
+        bool plain = end >= 16 && name[end - 16] == L'_' && name[end - 7] == L'_' &&
+            allDigits(name, end - 15, end - 7) && allDigits(name, end - 6, end);
+        if (!plain) {
+            size_t underscore = name.rfind(L'_');
+            if (underscore == std::wstring::npos || !allDigits(name, underscore + 1, end)) return false;
+            end = underscore;
+            if (end < 16 || name[end - 16] != L'_' || name[end - 7] != L'_' ||
+                !allDigits(name, end - 15, end - 7) || !allDigits(name, end - 6, end)) return false;
+        }
+        if (end == 16) return false;
+        stem = name.substr(0, end - 16);
+
+        tm t = {};
+        if (swscanf(name.c_str() + end - 15, L"%4d%2d%2d", &t.tm_year, &t.tm_mon, &t.tm_mday) != 3 ||
+            swscanf(name.c_str() + end - 6, L"%2d%2d%2d", &t.tm_hour, &t.tm_min, &t.tm_sec) != 3) return false;
+        t.tm_year -= 1900;
+        t.tm_mon -= 1;
+        t.tm_isdst = -1;
+        time_t tt = mktime(&t);
+        if (tt == static_cast<time_t>(-1)) return false;
+        time = static_cast<int64_t>(tt);
+        return true;
+    }
+
+    bool ListProjects(const fs::path& backupDir, std::vector<Project>& projects) {
+        projects.clear();
+        std::error_code ec;
+        if (!fs::is_directory(backupDir, ec)) return false;
+
+        std::map<std::wstring, Project> byStem;
+        std::map<std::wstring, std::vector<fs::path>> packs;
+        std::vector<CatalogEntry> loose;
+        for (fs::directory_iterator it(backupDir, ec), end; !ec && it != end; it.increment(ec)) {
+            const fs::path& p = it->path();
+            std::wstring stem;
+            int64_t time = 0;
+            if (p.extension() == L".catalog") {
+                byStem[p.stem().wstring()].hasCatalog = true;
+            }
+            else if (packStem(p, stem)) {
+                packs[stem].push_back(p);
+            }
+            else if (p.extension() == L".pmm" && SplitBackupName(p.stem().wstring(), stem, time)) {
+                CatalogEntry e;
+                e.name = WideToUtf8(p.stem().wstring());
+                e.time = time;
+                e.storage = CatalogStorage::Loose;
+                e.location = WideToUtf8(p.filename().wstring());
+                e.pmmSize = fileSize(p);
+                fs::path emm = p;
+                emm.replace_extension(L".emm");
+                e.emmSize = fileSize(emm);
+                loose.push_back(e);
+                byStem[stem];
+            }
+        }
+        for (const auto& it : packs) byStem[it.first];
+
+        for (auto& it : byStem) {
+            Project& project = it.second;
+            project.stem = it.first;
+            std::set<std::string> known;
+            if (project.hasCatalog) {
+                BackupCatalog catalog(backupDir, project.stem);
+                if (catalog.load()) project.entries = catalog.entries();
+                for (const auto& e : project.entries) known.insert(e.name);
+            }
+            std::vector<CatalogEntry>& extra = project.hasCatalog ? project.uncataloged : project.entries;
+            for (const auto& path : packs[project.stem]) {
+                PackFile pack(path);
+                if (!pack.load()) continue;
+                for (const auto& pe : pack.entries()) {
+                    if (known.count(pe.name)) continue;
+                    CatalogEntry e;
+                    e.name = pe.name;
+                    e.time = pe.time;
+                    e.storage = CatalogStorage::Pack;
+                    e.location = WideToUtf8(path.filename().wstring());
+                    e.pmmSize = pe.pmmRaw;
+                    e.pmmCrc = pe.pmmCrc;
+                    e.emmSize = pe.emmRaw;
+                    extra.push_back(e);
+                }
+            }
+            for (const auto& e : loose) {
+                std::wstring stem;
+                int64_t time;
+                if (SplitBackupName(Utf8ToWide(e.name), stem, time) && stem == project.stem && !known.count(e.name)) extra.push_back(e);
+            }
+            auto byTime = [](const CatalogEntry& a, const CatalogEntry& b) {
+                return a.time != b.time ? a.time < b.time : a.name < b.name;
+            };
+            std::stable_sort(project.entries.begin(), project.entries.end(), byTime);
+            std::stable_sort(project.uncataloged.begin(), project.uncataloged.end(), byTime);
+            projects.push_back(project);
+        }
+        return true;
+    }
+
+    const CatalogEntry* FindEntry(const std::vector<Project>& projects, const std::string& key, const Project** owner) {
+        if (!key.empty() && key[0] == '#') {
+            if (projects.size() != 1) return nullptr;
+            size_t index = static_cast<size_t>(strtoul(key.c_str() + 1, nullptr, 10));
+            if (index >= projects[0].entries.size()) return nullptr;
+            if (owner) *owner = &projects[0];
+            return &projects[0].entries[index];
+        }
+        for (const auto& p : projects) {
+            for (const auto* list : { &p.entries, &p.uncataloged }) {
+                for (const auto& e : *list) {
+                    if (e.name != key) continue;
+                    if (owner) *owner = &p;
+                    return &e;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    std::map<std::wstring, ProjectStats> ComputeStats(const fs::path& backupDir, const std::vector<Project>& projects) {
+        std::map<std::wstring, ProjectStats> stats;
+        for (const auto& p : projects) {
+            ProjectStats& s = stats[p.stem];
+            for (const auto* list : { &p.entries, &p.uncataloged }) {
+                for (const auto& e : *list) {
+                    s.backups++;
+                    s.rawBytes += e.pmmSize + e.emmSize;
+                    if (e.storage == CatalogStorage::Loose) s.loose++;
+                    if (s.oldest == 0 || e.time < s.oldest) s.oldest = e.time;
+                    s.newest = (std::max)(s.newest, e.time);
+                }
+            }
+        }
+
+        std::error_code ec;
+        for (fs::directory_iterator it(backupDir, ec), end; !ec && it != end; it.increment(ec)) {
+            const fs::path& p = it->path();
+            std::wstring stem, name;
+            int64_t time;
+            if (packStem(p, stem) && stats.count(stem)) {
+                ProjectStats& s = stats[stem];
+                PackFile pack(p);
+                s.packs++;
+                s.packBytes += fileSize(p);
+                if (pack.load()) s.packLiveBytes += pack.liveBytes();
+            }
+            else if (sidecarName(p, name) && SplitBackupName(name, stem, time) && stats.count(stem)) {
+                stats[stem].sidecars++;
+                stats[stem].sidecarBytes += fileSize(p);
+            }
+            else if ((p.extension() == L".pmm" || p.extension() == L".emm") && SplitBackupName(p.stem().wstring(), stem, time) && stats.count(stem)) {
+                stats[stem].looseBytes += fileSize(p);
+            }
+        }
+        return stats;
+    }
+
+    VerifyResult Verify(const fs::path& backupDir, const std::vector<Project>& projects, TaskExecutor& executor) {
+        VerifyResult result;
+        auto wallStart = std::chrono::steady_clock::now();
+        double cpuStart = processCpuSeconds();
+
+        PackIndex packs = loadPacks(backupDir, projects, &result.issues);
+        // どの項目からも参照されていないパックも、索引が読めるかだけは確かめる
+        std::error_code ec;
+        for (fs::directory_iterator it(backupDir, ec), end; !ec && it != end; it.increment(ec)) {
+            std::wstring stem;
+            std::string file = WideToUtf8(it->path().filename().wstring());
+            if (!packStem(it->path(), stem) || packs.count(file)) continue;
+            PackFile pack(it->path());
+            if (!pack.load()) result.issues.push_back(Issue{ file, "pack index cannot be read" });
+        }
+        for (const auto& p : projects) {
+            if (p.hasCatalog && p.entries.empty() && fileSize(backupDir / (p.stem + L".catalog")) > 8) {
+                result.issues.push_back(Issue{ WideToUtf8(p.stem) + ".catalog", "catalog cannot be read" });
+            }
+        }
+
+        // 同じパックのレコードが近い順に並ぶよう、置き場所と位置で並べてから分け合う
+        struct Task {
+            const CatalogEntry* entry;
+            const PackEntry* packed;
+            bool cataloged;
+        };
+        std::vector<Task> tasks;
+        for (const auto& p : projects) {
+            for (const auto* list : { &p.entries, &p.uncataloged }) {
+                for (const auto& e : *list) {
+                    const PackEntry* pe = nullptr;
+                    if (e.storage == CatalogStorage::Pack) {
+                        auto it = packs.find(e.location);
+                        if (it != packs.end() && it->second) pe = it->second->find(e.name);
+                    }
+                    tasks.push_back(Task{ &e, pe, list == &p.entries });
+                    if (list != &p.entries) result.uncataloged++;
+                }
+            }
+        }
+        std::sort(tasks.begin(), tasks.end(), [](const Task& a, const Task& b) {
+            if (a.entry->location != b.entry->location) return a.entry->location < b.entry->location;
+            return (a.packed ? a.packed->offset : 0) < (b.packed ? b.packed->offset : 0);
+        });
+
+        std::mutex mutex;
+        std::atomic<uint64_t> bytesRead(0);
+        executor.parallelFor(tasks.size(), TaskPriority::Maintenance, [&](size_t i) {
+            const Task& t = tasks[i];
+            const CatalogEntry& e = *t.entry;
+            std::vector<std::string> problems;
+            uint64_t read = 0;
+
+            if (e.storage == CatalogStorage::Pack) {
+                auto it = packs.find(e.location);
+                if (it == packs.end() || !it->second) {
+                    problems.push_back("pack is missing: " + e.location);
+                }
+                else if (!t.packed) {
+                    problems.push_back("not in " + e.location);
+                }
+                else if (t.packed->pmmRaw != e.pmmSize || (e.pmmCrc != 0 && t.packed->pmmCrc != e.pmmCrc)) {
+                    problems.push_back("pack record does not match the catalog");
+                }
+                else if (!it->second->verify(*t.packed, &read)) {
+                    problems.push_back("pack record is corrupt");
+                }
+            }
+            else {
+                fs::path pmm = backupDir / Utf8ToWide(e.location);
+                uint64_t size = 0;
+                uint32_t crc = 0;
+                if (!crcFile(pmm, size, crc)) problems.push_back("file is missing: " + e.location);
+                else if (size != e.pmmSize) problems.push_back("size does not match the catalog");
+                else if (e.pmmCrc != 0 && crc != e.pmmCrc) problems.push_back("CRC does not match the catalog");
+                read += size;
+                if (e.emmSize > 0) {
+                    fs::path emm = pmm;
+                    emm.replace_extension(L".emm");
+                    if (!crcFile(emm, size, crc) || size != e.emmSize) problems.push_back("EMM is missing or truncated");
+                    read += size;
+                }
+            }
+
+            fs::path kfs = backupDir / (Utf8ToWide(e.name) + L".kfs");
+            std::error_code ec;
+            if (fs::exists(kfs, ec)) {
+                emergency::Dump dump;
+                if (!emergency::Read(kfs, dump) || !dump.complete) problems.push_back("keyframes cannot be read");
+                read += fileSize(kfs);
+            }
+            else if (!e.sketch.empty()) {
+                problems.push_back("keyframes are missing");
+            }
+
+            bytesRead += read;
+            if (problems.empty()) return;
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& problem : problems) result.issues.push_back(Issue{ e.name, problem });
+        });
+
+        result.checked = tasks.size();
+        result.bytesRead = bytesRead;
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+        result.cpuSeconds = processCpuSeconds() - cpuStart;
+        std::sort(result.issues.begin(), result.issues.end(), [](const Issue& a, const Issue& b) {
+            return a.name < b.name;
+        });
+        return result;
+    }
+
+    GcPlan PlanGc(const fs::path& backupDir, const std::vector<Project>& projects, TaskExecutor& executor) {
+        GcPlan plan;
+        PackIndex packs = loadPacks(backupDir, projects, nullptr);
+        std::shared_ptr<LeaseTable> leases = LeaseTable::open(backupDir);
+
+        // 一覧の項目ごとに実体を確かめる
+        struct Check {
+            const Project* project;
+            const CatalogEntry* entry;
+            bool stored;
+        };
+        std::vector<Check> checks;
+        for (const auto& p : projects) {
+            for (const auto& e : p.entries) checks.push_back(Check{ &p, &e, true });
+        }
+        executor.parallelFor(checks.size(), TaskPriority::Maintenance, [&](size_t i) {
+            checks[i].stored = stored(backupDir, packs, *checks[i].entry);
+        });
+
+        std::set<std::string> live;
+        for (const auto& c : checks) {
+            if (c.stored || leases->isHeld(lease::NameResource(c.entry->name))) live.insert(c.entry->name);
+            else plan.dangling[c.project->stem].push_back(c.entry->name);
+        }
+        for (const auto& p : projects) {
+            for (const auto& e : p.uncataloged) live.insert(e.name);
+        }
+
+        auto staleBefore = fs::file_time_type::clock::now() - std::chrono::hours(1);
+        std::error_code ec;
+        for (fs::directory_iterator it(backupDir, ec), end; !ec && it != end; it.increment(ec)) {
+            const fs::path& p = it->path();
+            std::wstring name, stem;
+            int64_t time;
+            bool garbage = false;
+            if (sidecarName(p, name) && SplitBackupName(name, stem, time)) {
+                garbage = !live.count(WideToUtf8(name)) && !leases->isHeld(lease::NameResource(WideToUtf8(name)));
+            }
+            else if (p.extension() == L".tmp") {
+                std::error_code timeEc;
+                auto modified = fs::last_write_time(p, timeEc);
+                garbage = !timeEc && modified < staleBefore;
+            }
+            if (!garbage) continue;
+            plan.files.push_back(p);
+            plan.bytes += fileSize(p);
+        }
+        std::sort(plan.files.begin(), plan.files.end());
+        return plan;
+    }
+
+    size_t ApplyGc(const fs::path& backupDir, const GcPlan& plan) {
+        std::shared_ptr<LeaseTable> leases = LeaseTable::open(backupDir);
+        size_t done = 0;
+        for (const auto& path : plan.files) {
+            // 計画の後で作成が始まったものは残す
+            std::wstring name;
+            if (sidecarName(path, name) && leases->isHeld(lease::NameResource(WideToUtf8(name)))) continue;
+            std::error_code ec;
+            if (fs::remove(path, ec)) done++;
+        }
+        for (const auto& it : plan.dangling) {
+            BackupCatalog catalog(backupDir, it.first);
+            if (catalog.remove(it.second)) done += it.second.size();
+        }
+        return done;
+    }
+
+    bool Restore(const fs::path& backupDir, const CatalogEntry& entry, const fs::path& outPmm, std::string& error, TaskExecutor* executor) {
+        fs::path outEmm = outPmm;
+        outEmm.replace_extension(L".emm");
+        if (entry.storage == CatalogStorage::Pack) {
+            PackFile pack(backupDir / Utf8ToWide(entry.location));
+            const PackEntry* pe = pack.load() ? pack.find(entry.name) : nullptr;
+            if (!pe) {
+                error = "not found in " + entry.location;
+                return false;
+            }
+            if (!pack.extract(*pe, outPmm, pe->emmRaw > 0 ? outEmm : fs::path(), nullptr, executor)) {
+                error = "pack record is corrupt or the output cannot be written";
+                return false;
+            }
+            return true;
+        }
+
+        fs::path pmm = backupDir / Utf8ToWide(entry.location);
+        if (!CopyFileThrottled(pmm, outPmm, nullptr) || fileSize(outPmm) != entry.pmmSize) {
+            error = "cannot copy " + entry.location;
+            return false;
+        }
+        fs::path emm = pmm;
+        emm.replace_extension(L".emm");
+        std::error_code ec;
+        if (fs::exists(emm, ec) && !CopyFileThrottled(emm, outEmm, nullptr)) {
+            error = "cannot copy " + WideToUtf8(emm.filename().wstring());
+            return false;
+        }
+        return true;
+    }
+}
@@ -0,0 +1,84 @@
+﻿#pragma once
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include <experimental/filesystem>
+#include "BackupCatalog.h"
+#include "TaskExecutor.h"
+
+namespace fs = std::experimental::filesystem;
+
+// Backup フォルダ全体（そこを使うすべてのプロジェクト）をまとめて扱う。BackupTool の
+// list / stats / verify / restore / diff / gc / compact から使う。
+//
+// 一覧（<stem>.catalog）があるプロジェクトは一覧を正とし、一覧に無い実体（一覧の導入前に
+// triggerSave が書いた個別ファイルや、一覧を書く前に落ちたもの）は uncataloged として別に持つ。
+// 一覧の無いプロジェクトはパックの索引と個別ファイルから項目を組み立てる。
+
+namespace store {
+    struct Project {
+        std::wstring stem;
+        bool hasCatalog = false;
+        std::vector<CatalogEntry> entries;      // 作成時刻順
+        std::vector<CatalogEntry> uncataloged;  // 実体はあるが一覧に無いもの
+    };
+
+    // プロジェクトの .pmm ならその Backup フォルダ、フォルダの中に Backup があればそれ、それ以外はそのまま
+    fs::path ResolveBackupDir(const fs::path& arg);
+
+    // "<stem>_YYYYMMDD_HHMMSS[_N]" を stem と時刻（ローカル時刻）に分ける
+    bool SplitBackupName(const std::wstring& name, std::wstring& stem, int64_t& time);
+
+    bool ListProjects(const fs::path& backupDir, std::vector<Project>& projects);
+
+    // 名前か、プロジェクトが1つだけなら "#番号"（一覧の順）で探す
+    const CatalogEntry* FindEntry(const std::vector<Project>& projects, const std::string& key, const Project** owner = nullptr);
+
+    struct ProjectStats {
+        size_t backups = 0;
+        size_t loose = 0;
+        uint64_t rawBytes = 0;          // 展開後の PMM と EMM の合計
+        uint64_t looseBytes = 0;
+        size_t packs = 0;
+        uint64_t packBytes = 0;
+        uint64_t packLiveBytes = 0;     // 索引から参照されているレコード
+        size_t sidecars = 0;            // .kfs / .thumb.bmp / .pose
+        uint64_t sidecarBytes = 0;
+        int64_t oldest = 0;
+        int64_t newest = 0;
+    };
+    std::map<std::wstring, ProjectStats> ComputeStats(const fs::path& backupDir, const std::vector<Project>& projects);
+
+    struct Issue {
+        std::string name;               // バックアップ名かファイル名
+        std::string problem;
+    };
+
+    struct VerifyResult {
+        size_t checked = 0;
+        size_t uncataloged = 0;         // 正常だが一覧に無いもの（問題には数えない）
+        uint64_t bytesRead = 0;
+        double seconds = 0;
+        double cpuSeconds = 0;
+        std::vector<Issue> issues;
+    };
+    // すべての実体を読み、サイズ・CRC・.kfs が読めることを executor で並列に確かめる
+    VerifyResult Verify(const fs::path& backupDir, const std::vector<Project>& projects, TaskExecutor& executor);
+
+    struct GcPlan {
+        std::vector<fs::path> files;                            // 消すファイル
+        std::map<std::wstring, std::vector<std::string>> dangling;  // 実体の無い一覧の項目（stem ごと）
+        uint64_t bytes = 0;
+    };
+    // 持ち主のいない付随ファイル、1時間以上前の一時ファイル、実体の無い一覧の項目を集める。
+    // 作成中（名前のリースが生きている）のものは対象にしない
+    GcPlan PlanGc(const fs::path& backupDir, const std::vector<Project>& projects, TaskExecutor& executor);
+    size_t ApplyGc(const fs::path& backupDir, const GcPlan& plan);
+
+    // PMM（と EMM）を outPmm に取り出す。パックでも個別ファイルでもよい
+    bool Restore(const fs::path& backupDir, const CatalogEntry& entry, const fs::path& outPmm, std::string& error,
+        TaskExecutor* executor = nullptr);
+
+    unsigned DefaultThreads();
+}
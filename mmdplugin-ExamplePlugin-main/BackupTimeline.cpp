@@ -0,0 +1,181 @@
+﻿#include "BackupTimeline.h"
+#include "BackupFormat.h"
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+
+namespace {
+    bool readFile(const fs::path& path, std::vector<uint8_t>& out) {
+        std::ifstream in(path.c_str(), std::ios::binary);
+        if (!in.is_open()) return false;
+        in.seekg(0, std::ios::end);
+        std::streamoff size = in.tellg();
+        in.seekg(0, std::ios::beg);
+        if (size < 0) return false;
+        out.resize(static_cast<size_t>(size));
+        return size == 0 || static_cast<bool>(in.read(reinterpret_cast<char*>(out.data()), size));
+    }
+
+    // "<stem>_YYYYMMDD_HHMMSS[_N]" の時刻（ローカル時刻として解釈する）。_N は同じ秒の2つ目以降
+    bool parseBackupTime(const std::wstring& name, const std::wstring& stem, int64_t& time) {
+        if (name.size() < stem.size() + 16 || name.compare(0, stem.size(), stem) != 0 || name[stem.size()] != L'_') return false;
+        size_t rest = stem.size() + 16;
+        if (name.size() > rest && (name[rest] != L'_' || name.size() == rest + 1 ||
+            name.find_first_not_of(L"0123456789", rest + 1) != std::wstring::npos)) return false;
+        tm t = {};
+        wchar_t sep = 0;
+        if (swscanf(name.c_str() + stem.size() + 1, L"%4d%2d%2d%lc%2d%2d%2d",
+            &t.tm_year, &t.tm_mon, &t.tm_mday, &sep, &t.tm_hour, &t.tm_min, &t.tm_sec) != 7 || sep != L'_') return false;
+        t.tm_year -= 1900;
+        t.tm_mon -= 1;
+        t.tm_isdst = -1;
+        time_t tt = mktime(&t);
+        if (tt == static_cast<time_t>(-1)) return false;
+        time = static_cast<int64_t>(tt);
+        return true;
+    }
+}
+
+// --- SnapshotCache ---
+
+size_t SnapshotCache::sizeOf(const TimelineSnapshot& snapshot) {
+    return (snapshot.pmm ? snapshot.pmm->size() : 0) + (snapshot.emm ? snapshot.emm->size() : 0);
+}
+
+bool SnapshotCache::get(const std::string& name, TimelineSnapshot& out) {
+    auto it = m_index.find(name);
+    if (it == m_index.end()) {
+        m_misses++;
+        return false;
+    }
+    m_items.splice(m_items.begin(), m_items, it->second);
+    out = *it->second;
+    m_hits++;
+    return true;
+}
+
+void SnapshotCache::put(const TimelineSnapshot& snapshot) {
+    auto it = m_index.find(snapshot.entry.name);
+    if (it != m_index.end()) {
+        m_bytes -= sizeOf(*it->second);
+        m_items.erase(it->second);
+        m_index.erase(it);
+    }
+    // 1つで上限を超えるものは保持しない
+    size_t size = sizeOf(snapshot);
+    if (size > m_capacity) return;
+
+    m_items.push_front(snapshot);
+    m_index[snapshot.entry.name] = m_items.begin();
+    m_bytes += size;
+    while (m_bytes > m_capacity && !m_items.empty()) {
+        m_bytes -= sizeOf(m_items.back());
+        m_index.erase(m_items.back().entry.name);
+        m_items.pop_back();
+    }
+}
+
+void SnapshotCache::clear() {
+    m_items.clear();
+    m_index.clear();
+    m_bytes = 0;
+}
+
+// --- BackupTimeline ---
+
+BackupTimeline::BackupTimeline(const fs::path& backupDir, const std::wstring& stem, size_t cacheBytes)
+    : m_dir(backupDir), m_stem(stem), m_cache(cacheBytes) {}
+
+bool BackupTimeline::refresh() {
+    m_entries.clear();
+    m_packs.clear();
+
+    BackupCatalog catalog(m_dir, m_stem);
+    if (!catalog.load()) return false;
+    m_entries = catalog.entries();
+    if (m_entries.empty()) scanBackupDir();
+    return true;
+}
+
+void BackupTimeline::scanBackupDir() {
+    PackStore store(m_dir, m_stem);
+    for (const auto& path : store.packPaths()) {
+        PackFile pack(path);
+        if (!pack.load()) continue;
+        for (const auto& pe : pack.entries()) {
+            CatalogEntry e;
+            e.name = pe.name;
+            e.time = pe.time;
+            e.storage = CatalogStorage::Pack;
+            e.location = WideToUtf8(path.filename().wstring());
+            e.pmmSize = pe.pmmRaw;
+            e.pmmCrc = pe.pmmCrc;
+            e.emmSize = pe.emmRaw;
+            m_entries.push_back(e);
+        }
+    }
+
+    std::error_code ec;
+    for (fs::directory_iterator it(m_dir, ec), last; !ec && it != last; it.increment(ec)) {
+        const fs::path& p = it->path();
+        CatalogEntry e;
+        if (p.extension() != L".pmm" || !parseBackupTime(p.stem().wstring(), m_stem, e.time)) continue;
+        e.name = WideToUtf8(p.stem().wstring());
+        e.storage = CatalogStorage::Loose;
+        e.location = WideToUtf8(p.filename().wstring());
+        e.pmmSize = fs::file_size(p, ec);
+        m_entries.push_back(e);
+    }
+
+    std::stable_sort(m_entries.begin(), m_entries.end(), [](const CatalogEntry& a, const CatalogEntry& b) {
+        return a.time < b.time;
+    });
+}
+
+const CatalogEntry* BackupTimeline::entryAt(int64_t time) const {
+    auto it = std::upper_bound(m_entries.begin(), m_entries.end(), time, [](int64_t t, const CatalogEntry& e) {
+        return t < e.time;
+    });
+    if (it == m_entries.begin()) return nullptr;
+    return &*(it - 1);
+}
+
+PackFile* BackupTimeline::openPack(const std::string& location) {
+    auto it = m_packs.find(location);
+    if (it != m_packs.end()) return it->second.get();
+    std::unique_ptr<PackFile> pack(new PackFile(m_dir / Utf8ToWide(location)));
+    if (!pack->load()) return nullptr;
+    PackFile* p = pack.get();
+    m_packs[location] = std::move(pack);
+    return p;
+}
+
+bool BackupTimeline::at(int64_t time, TimelineSnapshot& out) {
+    const CatalogEntry* entry = entryAt(time);
+    return entry && load(*entry, out);
+}
+
+bool BackupTimeline::load(const CatalogEntry& entry, TimelineSnapshot& out) {
+    if (m_cache.get(entry.name, out)) return true;
+
+    auto pmm = std::make_shared<std::vector<uint8_t>>();
+    auto emm = std::make_shared<std::vector<uint8_t>>();
+    if (entry.storage == CatalogStorage::Pack) {
+        PackFile* pack = openPack(entry.location);
+        const PackEntry* pe = pack ? pack->find(entry.name) : nullptr;
+        if (!pe || !pack->readData(*pe, *pmm, pe->emmRaw > 0 ? emm.get() : nullptr, nullptr)) return false;
+    }
+    else {
+        fs::path path = m_dir / Utf8ToWide(entry.location);
+        if (!readFile(path, *pmm)) return false;
+        path.replace_extension(L".emm");
+        if (fs::exists(path)) readFile(path, *emm);
+    }
+
+    out.entry = entry;
+    out.pmm = pmm;
+    out.emm = emm;
+    m_cache.put(out);
+    return true;
+}
@@ -0,0 +1,80 @@
+﻿#pragma once
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <experimental/filesystem>
+#include "BackupCatalog.h"
+#include "BackupPack.h"
+
+namespace fs = std::experimental::filesystem;
+
+// 指定した時刻のプロジェクトの状態を取り出す
+//
+// バックアップはどれも pmm 全体のスナップショットなので、ある時刻の状態は
+// 「その時刻以前で最も新しいバックアップ」そのもので、差分を積み重ねる必要はない。
+// 時刻の検索は一覧（作成時刻順）の二分探索で行い、取り出した本体は LRU で保持して
+// 履歴を行き来するときに同じパックを何度も読み直さないようにする。
+
+// 展開済みのスナップショット（キャッシュと共有するので書き換えない）
+struct TimelineSnapshot {
+    CatalogEntry entry;
+    std::shared_ptr<const std::vector<uint8_t>> pmm;
+    std::shared_ptr<const std::vector<uint8_t>> emm;    // 無ければ空
+};
+
+// 使った順に保持し、合計サイズが上限を超えたら古いものから捨てる
+class SnapshotCache {
+public:
+    explicit SnapshotCache(size_t capacityBytes) : m_capacity(capacityBytes), m_bytes(0), m_hits(0), m_misses(0) {}
+
+    bool get(const std::string& name, TimelineSnapshot& out);
+    void put(const TimelineSnapshot& snapshot);
+    void clear();
+
+    size_t bytes() const { return m_bytes; }
+    uint64_t hits() const { return m_hits; }
+    uint64_t misses() const { return m_misses; }
+
+private:
+    static size_t sizeOf(const TimelineSnapshot& snapshot);
+
+    std::list<TimelineSnapshot> m_items;    // 先頭が最近使ったもの
+    std::unordered_map<std::string, std::list<TimelineSnapshot>::iterator> m_index;
+    size_t m_capacity;
+    size_t m_bytes;
+    uint64_t m_hits;
+    uint64_t m_misses;
+};
+
+class BackupTimeline {
+public:
+    BackupTimeline(const fs::path& backupDir, const std::wstring& stem, size_t cacheBytes = 256 * 1024 * 1024);
+
+    // 一覧を読み直す。一覧が無いプロジェクト（古いバックアップ）はパックの索引と
+    // <名前>_YYYYMMDD_HHMMSS.pmm のファイル名から作る
+    bool refresh();
+    const std::vector<CatalogEntry>& entries() const { return m_entries; }
+
+    // time 以前で最も新しいバックアップ。time より前に何も無ければ nullptr
+    const CatalogEntry* entryAt(int64_t time) const;
+
+    // time の時点の状態を取り出す
+    bool at(int64_t time, TimelineSnapshot& out);
+    bool load(const CatalogEntry& entry, TimelineSnapshot& out);
+
+    const SnapshotCache& cache() const { return m_cache; }
+
+private:
+    void scanBackupDir();
+    PackFile* openPack(const std::string& location);
+
+    fs::path m_dir;
+    std::wstring m_stem;
+    std::vector<CatalogEntry> m_entries;                        // 作成時刻順
+    std::map<std::string, std::unique_ptr<PackFile>> m_packs;   // 読み込み済みの索引
+    SnapshotCache m_cache;
+};
@@ -0,0 +1,2537 @@
+﻿// AutoBackup のバックアップを扱うコマンドラインツール
+//
+//   BackupTool list <pack|Backupフォルダ|プロジェクト.pmm>
+//   BackupTool stats <Backupフォルダ|プロジェクト.pmm>
+//   BackupTool verify <Backupフォルダ|プロジェクト.pmm> [--threads N]
+//   BackupTool restore <Backupフォルダ|プロジェクト.pmm> <名前|#番号> [出力.pmm] [--force]
+//   BackupTool diff <Backupフォルダ|プロジェクト.pmm> <名前|#番号> <名前|#番号>
+//   BackupTool gc <Backupフォルダ|プロジェクト.pmm> [--dry-run] [--threads N]
+//   BackupTool compact <Backupフォルダ|プロジェクト.pmm> [--ratio X]
+//   BackupTool import <フォルダ>... [--threads N] [--level N] [--keep-originals] [--keep-duplicates] [--dry-run]
+//   BackupTool extract <pack> <名前|#番号> [出力.pmm]
+//   BackupTool at <プロジェクト.pmm> <時刻>... [-o 出力.pmm]
+//   BackupTool similar <プロジェクト.pmm> <名前|#番号|キーフレーム.kfs> [件数]
+//   BackupTool codec <キーフレーム.kfs>...
+//   BackupTool codeccheck
+//   BackupTool simulate <作業フォルダ> [オプション]
+//   BackupTool replay <セッション.abtrace> <作業フォルダ> [--policy 間隔:上限:pack|loose]...
+//   BackupTool stress <作業フォルダ> [--procs N] [--saves N] [--keep N] [--loose]
+//   BackupTool scale [ファイル] [--max N] [--mb N]
+//   BackupTool iobench <ファイル> [--block KB] [--max-depth N] [--count N] [--mb N] [--direct]
+//   BackupTool iobench <ファイル> --foreground [--copy-mb N] [--limit-kbps N] [--seconds N] [--block KB] [--direct]
+//   BackupTool crashcheck <作業フォルダ> [--models N] [--bones N] [--steps N] [--arena MB] [--runs N]
+//   BackupTool alloccheck <作業フォルダ> [--cycles N] [--keep N]
+//   BackupTool thumbcheck
+//   BackupTool packcheck <作業フォルダ>
+//   BackupTool watch [--interval ms] [--count N] [--json]
+//   BackupTool metricsbench [--seconds N]
+//   BackupTool tracebench [--seconds N]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <experimental/filesystem>
+#include "../BackupCycle.h"
+#include "../BackupEngine.h"
+#include "../BackupFormat.h"
+#include "../AllocCounter.h"
+#include "../AsyncIo.h"
+#include "../BackupImport.h"
+#include "../BackupMetrics.h"
+#include "../BackupPack.h"
+#include "../BackupReplica.h"
+#include "../BackupStore.h"
+#include "../BackupTimeline.h"
+#include "../EmergencyDump.h"
+#include "../EmergencyWriter.h"
+#include "../HostSimulator.h"
+#include "../KeyframeCodec.h"
+#include "../LiveMetrics.h"
+#include "../LzCodec.h"
+#include "../SceneSketch.h"
+#include "../SessionReplay.h"
+#include "../SessionTrace.h"
+#include "../TaskExecutor.h"
+#include "../Thumbnail.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::experimental::filesystem;
+
+namespace {
+    void printUsage() {
+        printf("usage:\n");
+        printf("  BackupTool list <pack|store>\n");
+        printf("  BackupTool stats <store>\n");
+        printf("  BackupTool verify <store> [--threads N]\n");
+        printf("  BackupTool restore <store> <name|#index> [out.pmm] [--force]\n");
+        printf("  BackupTool diff <store> <name|#index> <name|#index>\n");
+        printf("  BackupTool gc <store> [--dry-run] [--threads N]\n");
+        printf("  BackupTool compact <store> [--ratio X]\n");
+        printf("      store: a Backup folder, a folder containing one, or a project .pmm\n");
+        printf("  BackupTool import <folder>... [--threads N] [--level N] [--keep-originals] [--keep-duplicates] [--dry-run]\n");
+        printf("      moves loose backups in every Backup folder below <folder> into packs\n");
+        printf("  BackupTool extract <pack> <name|#index> [out.pmm]\n");
+        printf("  BackupTool at <project.pmm> <time>... [-o out.pmm]\n");
+        printf("      time: \"YYYY-MM-DD HH:MM[:SS]\" or \"HH:MM[:SS]\" (today)\n");
+        printf("  BackupTool similar <project.pmm> <name|#index|file.kfs> [count]\n");
+        printf("  BackupTool codec <file.kfs>...\n");
+        printf("  BackupTool codeccheck\n");
+        printf("      round-trips generated scenes through the keyframe codec and fails if it is larger or slower than lz-fast\n");
+        printf("  BackupTool simulate <dir> [--saves N] [--models N] [--bones N] [--edits N] [--seed N]\n");
+        printf("                            [--keep N] [--loose] [--max-ms X] [--min-mbps X] [--trace out.json]\n");
+        printf("                            [--replica <dir>] [--replica-kbps N] [--replica-outage] [--publish]\n");
+        printf("  BackupTool replay <session.abtrace> <dir> [--policy minutes:keep:pack|loose]... [--bones N]\n");
+        printf("  BackupTool stress <dir> [--procs N] [--saves N] [--keep N] [--loose]\n");
+        printf("  BackupTool scale [file] [--max N] [--mb N]\n");
+        printf("      compresses file (or generated data) on 1..N threads and reports the speedup\n");
+        printf("  BackupTool iobench <file> [--block KB] [--max-depth N] [--count N] [--mb N] [--direct]\n");
+        printf("      random reads at queue depth 1..N (creates file with --mb MB if missing)\n");
+        printf("  BackupTool iobench <file> --foreground [--copy-mb N] [--limit-kbps N] [--seconds N] [--block KB] [--direct]\n");
+        printf("      foreground read latency alone, during a backup copy, and during a throttled low-priority copy\n");
+        printf("  BackupTool crashcheck <dir> [--models N] [--bones N] [--morphs N] [--edits N] [--steps N] [--arena MB] [--runs N]\n");
+        printf("      times the emergency dump of a large scene, then crashes child processes and checks their dumps\n");
+        printf("  BackupTool alloccheck <dir> [--cycles N] [--keep N]\n");
+        printf("      fails if a warm loose backup cycle with .kfs and thumbnail allocates (build with AUTOBACKUP_COUNT_ALLOCATIONS)\n");
+        printf("  BackupTool thumbcheck\n");
+        printf("      compares the thumbnail downscale against the scalar reference on odd sizes and padded rows\n");
+        printf("  BackupTool packcheck <dir>\n");
+        printf("      fails appends midway and checks the pack keeps its index (records dropped by retention stay dropped)\n");
+        printf("  BackupTool watch [--interval ms] [--count N] [--json]\n");
+        printf("      polls the live metrics every running AutoBackup publishes on this machine (--json: one line per poll)\n");
+        printf("  BackupTool metricsbench [--seconds N]\n");
+        printf("      measures the cost of publishing a metrics update and checks readers never see a torn update\n");
+        printf("  BackupTool tracebench [--seconds N]\n");
+        printf("      fails if recording a stage timing costs 1 us or more, or a trace dump sees a torn event\n");
+    }
+
+    std::string formatTime(int64_t t) {
+        time_t tt = static_cast<time_t>(t);
+        tm local;
+#ifdef _WIN32
+        localtime_s(&local, &tt);
+#else
+        localtime_r(&tt, &local);
+#endif
+        char buf[32];
+        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &local);
+        return buf;
+    }
+
+    // "YYYY-MM-DD HH:MM[:SS]" または当日の "HH:MM[:SS]"（ローカル時刻）
+    bool parseTime(const std::string& s, int64_t& out) {
+        time_t now = time(nullptr);
+        tm t;
+#ifdef _WIN32
+        localtime_s(&t, &now);
+#else
+        localtime_r(&now, &t);
+#endif
+        int y = 0, mo = 0, d = 0, h = 0, mi = 0, sec = 0;
+        int n = sscanf(s.c_str(), "%d-%d-%d %d:%d:%d", &y, &mo, &d, &h, &mi, &sec);
+        if (n >= 5) {
+            t.tm_year = y - 1900;
+            t.tm_mon = mo - 1;
+            t.tm_mday = d;
+        }
+        else {
+            sec = 0;
+            n = sscanf(s.c_str(), "%d:%d:%d", &h, &mi, &sec);
+            if (n < 2) return false;
+        }
+        t.tm_hour = h;
+        t.tm_min = mi;
+        t.tm_sec = sec;
+        t.tm_isdst = -1;
+        time_t tt = mktime(&t);
+        if (tt == static_cast<time_t>(-1)) return false;
+        out = static_cast<int64_t>(tt);
+        return true;
+    }
+
+    bool loadPack(PackFile& pack) {
+        if (!fs::exists(pack.path()) || !pack.load()) {
+            fprintf(stderr, "cannot read pack: %s\n", WideToUtf8(pack.path().wstring()).c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool loadStore(const std::wstring& arg, fs::path& backupDir, std::vector<store::Project>& projects) {
+        backupDir = store::ResolveBackupDir(arg);
+        if (!store::ListProjects(backupDir, projects)) {
+            fprintf(stderr, "not a backup folder: %s\n", WideToUtf8(backupDir.wstring()).c_str());
+            return false;
+        }
+        // プロジェクトの .pmm を渡されたら、そのプロジェクトだけにする
+        fs::path project(arg);
+        if (project.extension() == L".pmm") {
+            std::wstring stem = project.stem().wstring();
+            projects.erase(std::remove_if(projects.begin(), projects.end(), [&](const store::Project& p) {
+                return p.stem != stem;
+            }), projects.end());
+        }
+        return true;
+    }
+
+    const char* storageName(const CatalogEntry& e) {
+        return e.storage == CatalogStorage::Pack ? "pack" : "loose";
+    }
+
+    std::string formatBytes(uint64_t bytes) {
+        char buf[32];
+        if (bytes >= 1024ull * 1024 * 1024) snprintf(buf, sizeof(buf), "%.2f GB", bytes / (1024.0 * 1024 * 1024));
+        else if (bytes >= 1024 * 1024) snprintf(buf, sizeof(buf), "%.1f MB", bytes / (1024.0 * 1024));
+        else snprintf(buf, sizeof(buf), "%.1f KB", bytes / 1024.0);
+        return buf;
+    }
+
+    // 引数の末尾の --threads N を取り出す
+    unsigned takeThreads(std::vector<std::wstring>& args) {
+        for (size_t i = 0; i + 1 < args.size(); i++) {
+            if (args[i] != L"--threads") continue;
+            unsigned n = static_cast<unsigned>(atoi(WideToUtf8(args[i + 1]).c_str()));
+            args.erase(args.begin() + i, args.begin() + i + 2);
+            return n;
+        }
+        return 0;
+    }
+
+    // --threads N（0 なら CPU の数）で動かす。呼び出し元も処理に加わるのでワーカーは1つ少なくてよい
+    unsigned startExecutor(TaskExecutor& executor, unsigned threads) {
+        if (threads == 0) threads = store::DefaultThreads();
+        executor.start(threads - 1);
+        return threads;
+    }
+
+    int cmdListStore(const std::wstring& arg) {
+        fs::path backupDir;
+        std::vector<store::Project> projects;
+        if (!loadStore(arg, backupDir, projects)) return 1;
+        for (const auto& p : projects) {
+            printf("%s%s\n", WideToUtf8(p.stem).c_str(), p.hasCatalog ? "" : " (no catalog)");
+            int i = 0;
+            for (const auto& e : p.entries) {
+                printf("  #%-4d %s  %12llu  %-5s  %s%s\n", i++, formatTime(e.time).c_str(),
+                    static_cast<unsigned long long>(e.pmmSize + e.emmSize), storageName(e), e.name.c_str(),
+                    e.sketch.empty() ? "" : "  +keyframes");
+            }
+            for (const auto& e : p.uncataloged) {
+                printf("  -     %s  %12llu  %-5s  %s  (not in catalog)\n", formatTime(e.time).c_str(),
+                    static_cast<unsigned long long>(e.pmmSize + e.emmSize), storageName(e), e.name.c_str());
+            }
+        }
+        return 0;
+    }
+
+    int cmdStats(const std::vector<std::wstring>& args) {
+        if (args.empty()) { printUsage(); return 2; }
+        fs::path backupDir;
+        std::vector<store::Project> projects;
+        if (!loadStore(args[0], backupDir, projects)) return 1;
+        std::map<std::wstring, store::ProjectStats> stats = store::ComputeStats(backupDir, projects);
+
+        printf("%-24s %7s %6s %11s %11s %6s %11s %6s %11s  %s\n", "project", "backups", "loose", "raw", "loose size",
+            "packs", "pack size", "live", "sidecars", "range");
+        store::ProjectStats total;
+        for (const auto& it : stats) {
+            const store::ProjectStats& s = it.second;
+            printf("%-24s %7zu %6zu %11s %11s %6zu %11s %5.0f%% %11s  %s .. %s\n", WideToUtf8(it.first).c_str(), s.backups,
+                s.loose, formatBytes(s.rawBytes).c_str(), formatBytes(s.looseBytes).c_str(), s.packs, formatBytes(s.packBytes).c_str(),
+                s.packBytes ? s.packLiveBytes * 100.0 / s.packBytes : 100.0, formatBytes(s.sidecarBytes).c_str(),
+                s.oldest ? formatTime(s.oldest).c_str() : "-", s.newest ? formatTime(s.newest).c_str() : "-");
+            total.backups += s.backups;
+            total.rawBytes += s.rawBytes;
+            total.looseBytes += s.looseBytes;
+            total.packBytes += s.packBytes;
+            total.packLiveBytes += s.packLiveBytes;
+            total.sidecarBytes += s.sidecarBytes;
+        }
+        uint64_t onDisk = total.looseBytes + total.packBytes + total.sidecarBytes;
+        printf("%zu projects, %zu backups, %s on disk for %s of snapshots (%s reclaimable by compact)\n", stats.size(),
+            total.backups, formatBytes(onDisk).c_str(), formatBytes(total.rawBytes).c_str(),
+            formatBytes(total.packBytes - total.packLiveBytes).c_str());
+        return 0;
+    }
+
+    // すべてのバックアップを読んで確かめる。問題があれば 1 を返す（夜間の定期実行向け）
+    int cmdVerify(std::vector<std::wstring> args) {
+        unsigned threads = takeThreads(args);
+        if (args.empty()) { printUsage(); return 2; }
+        fs::path backupDir;
+        std::vector<store::Project> projects;
+        if (!loadStore(args[0], backupDir, projects)) return 1;
+        TaskExecutor executor;
+        threads = startExecutor(executor, threads);
+
+        store::VerifyResult result = store::Verify(backupDir, projects, executor);
+        for (const auto& issue : result.issues) printf("FAIL  %s: %s\n", issue.name.c_str(), issue.problem.c_str());
+        printf("%zu backups checked (%zu not in a catalog), %s read in %.1f s (%.1f MB/s) on %u threads, cpu %.1f s\n",
+            result.checked, result.uncataloged, formatBytes(result.bytesRead).c_str(), result.seconds,
+            result.seconds > 0 ? result.bytesRead / (1024.0 * 1024.0) / result.seconds : 0.0, threads, result.cpuSeconds);
+        if (!result.issues.empty()) {
+            printf("%zu problems\n", result.issues.size());
+            return 1;
+        }
+        printf("ok\n");
+        return 0;
+    }
+
+    int cmdRestore(const std::vector<std::wstring>& argv) {
+        std::vector<std::wstring> args;
+        bool force = false;
+        for (const auto& a : argv) {
+            if (a == L"--force") force = true;
+            else args.push_back(a);
+        }
+        if (args.size() < 2) { printUsage(); return 2; }
+        fs::path backupDir;
+        std::vector<store::Project> projects;
+        if (!loadStore(args[0], backupDir, projects)) return 1;
+        std::string key = WideToUtf8(args[1]);
+        const CatalogEntry* entry = store::FindEntry(projects, key);
+        if (!entry) {
+            fprintf(stderr, "backup not found: %s\n", key.c_str());
+            return 1;
+        }
+        fs::path out = args.size() >= 3 ? fs::path(args[2]) : fs::path(Utf8ToWide(entry->name) + L".pmm");
+        std::error_code ec;
+        if (!force && fs::exists(out, ec)) {
+            fprintf(stderr, "%s exists (use --force to overwrite)\n", WideToUtf8(out.wstring()).c_str());
+            return 1;
+        }
+        TaskExecutor executor;
+        startExecutor(executor, 0);
+        std::string error;
+        if (!store::Restore(backupDir, *entry, out, error, &executor)) {
+            fprintf(stderr, "%s: %s\n", entry->name.c_str(), error.c_str());
+            return 1;
+        }
+        printf("restored %s -> %s\n", entry->name.c_str(), WideToUtf8(out.wstring()).c_str());
+        return 0;
+    }
+
+    // 2つのバックアップのキーフレームを、モデル・ボーン・モーフ・フレームごとに比べる
+    struct KeyDiff {
+        size_t added = 0;
+        size_t removed = 0;
+        size_t changed = 0;
+        bool empty() const { return added == 0 && removed == 0 && changed == 0; }
+    };
+
+    template <typename Frame, typename Key, typename Same>
+    KeyDiff diffFrames(const std::vector<Frame>& a, const std::vector<Frame>& b, Key key, Same same) {
+        std::map<decltype(key(a[0])), const Frame*> before;
+        for (const auto& f : a) before[key(f)] = &f;
+        KeyDiff d;
+        for (const auto& f : b) {
+            auto it = before.find(key(f));
+            if (it == before.end()) {
+                d.added++;
+                continue;
+            }
+            if (!same(*it->second, f)) d.changed++;
+            before.erase(it);
+        }
+        d.removed = before.size();
+        return d;
+    }
+
+    void diffMotion(const VmdMotion& a, const VmdMotion& b, KeyDiff& bones, KeyDiff& morphs, KeyDiff& cameras) {
+        bones = diffFrames(a.bones, b.bones, [](const VmdBoneFrame& f) { return std::make_pair(f.name, f.frame); },
+            [](const VmdBoneFrame& x, const VmdBoneFrame& y) {
+                return memcmp(x.position, y.position, sizeof(x.position)) == 0 && memcmp(x.rotation, y.rotation, sizeof(x.rotation)) == 0 &&
+                    memcmp(x.interpolation, y.interpolation, sizeof(x.interpolation)) == 0;
+            });
+        morphs = diffFrames(a.morphs, b.morphs, [](const VmdMorphFrame& f) { return std::make_pair(f.name, f.frame); },
+            [](const VmdMorphFrame& x, const VmdMorphFrame& y) { return x.weight == y.weight; });
+        cameras = diffFrames(a.cameras, b.cameras, [](const VmdCameraFrame& f) { return f.frame; },
+            [](const VmdCameraFrame& x, const VmdCameraFrame& y) {
+                return x.distance == y.distance && memcmp(x.position, y.position, sizeof(x.position)) == 0 &&
+                    memcmp(x.rotation, y.rotation, sizeof(x.rotation)) == 0 && x.viewAngle == y.viewAngle &&
+                    x.perspectiveOff == y.perspectiveOff && memcmp(x.interpolation, y.interpolation, sizeof(x.interpolation)) == 0;
+            });
+    }
+
+    std::string diffText(const KeyDiff& d) {
+        char buf[48];
+        snprintf(buf, sizeof(buf), "+%zu -%zu ~%zu", d.added, d.removed, d.changed);
+        return buf;
+    }
+
+    int cmdDiff(const std::vector<std::wstring>& args) {
+        if (args.size() < 3) { printUsage(); return 2; }
+        fs::path backupDir;
+        std::vector<store::Project> projects;
+        if (!loadStore(args[0], backupDir, projects)) return 1;
+        const CatalogEntry* entries[2];
+        emergency::Dump dumps[2];
+        bool keyframes = true;
+        for (int i = 0; i < 2; i++) {
+            std::string key = WideToUtf8(args[1 + i]);
+            entries[i] = store::FindEntry(projects, key);
+            if (!entries[i]) {
+                fprintf(stderr, "backup not found: %s\n", key.c_str());
+                return 1;
+            }
+            if (!emergency::Read(backupDir / (Utf8ToWide(entries[i]->name) + L".kfs"), dumps[i])) keyframes = false;
+        }
+        const CatalogEntry& a = *entries[0];
+        const CatalogEntry& b = *entries[1];
+        printf("%s  %s  %llu bytes\n", a.name.c_str(), formatTime(a.time).c_str(), static_cast<unsigned long long>(a.pmmSize));
+        printf("%s  %s  %llu bytes\n", b.name.c_str(), formatTime(b.time).c_str(), static_cast<unsigned long long>(b.pmmSize));
+        if (a.pmmSize == b.pmmSize && a.pmmCrc != 0 && a.pmmCrc == b.pmmCrc) {
+            printf("identical\n");
+            return 0;
+        }
+        if (!keyframes) {
+            printf("no keyframes were saved for one of them; only sizes can be compared (%+lld bytes)\n",
+                static_cast<long long>(b.pmmSize) - static_cast<long long>(a.pmmSize));
+            return 0;
+        }
+
+        // 同じ名前のモデルどうしを、出てきた順に組にする
+        auto keyed = [](const emergency::Dump& d) {
+            std::map<std::pair<std::string, int>, const emergency::Model*> models;
+            std::map<std::string, int> seen;
+            for (const auto& m : d.models) models[std::make_pair(m.name, seen[m.name]++)] = &m;
+            return models;
+        };
+        auto before = keyed(dumps[0]);
+        auto after = keyed(dumps[1]);
+        static const VmdMotion none;
+        printf("%-24s %-18s %-18s %-18s\n", "model", "bones", "morphs", "camera");
+        size_t differing = 0;
+        auto row = [&](const std::string& label, const VmdMotion& x, const VmdMotion& y, const char* note) {
+            KeyDiff bones, morphs, cameras;
+            diffMotion(x, y, bones, morphs, cameras);
+            if (bones.empty() && morphs.empty() && cameras.empty()) return;
+            differing++;
+            printf("%-24s %-18s %-18s %-18s%s\n", label.c_str(), diffText(bones).c_str(), diffText(morphs).c_str(),
+                diffText(cameras).c_str(), note);
+        };
+        row("(camera)", dumps[0].camera, dumps[1].camera, "");
+        for (const auto& it : before) {
+            auto other = after.find(it.first);
+            row(it.first.first, it.second->motion, other != after.end() ? other->second->motion : none,
+                other != after.end() ? "" : "  (removed)");
+        }
+        for (const auto& it : after) {
+            if (!before.count(it.first)) row(it.first.first, none, it.second->motion, "  (added)");
+        }
+        printf("%zu of %zu tracks differ (model names are Shift-JIS)\n", differing, (std::max)(before.size(), after.size()) + 1);
+        return 0;
+    }
+
+    int cmdGc(std::vector<std::wstring> args) {
+        unsigned threads = takeThreads(args);
+        bool dryRun = std::find(args.begin(), args.end(), L"--dry-run") != args.end();
+        args.erase(std::remove(args.begin(), args.end(), L"--dry-run"), args.end());
+        if (args.empty()) { printUsage(); return 2; }
+        fs::path backupDir;
+        std::vector<store::Project> projects;
+        if (!loadStore(args[0], backupDir, projects)) return 1;
+
+        TaskExecutor executor;
+        startExecutor(executor, threads);
+        store::GcPlan plan = store::PlanGc(backupDir, projects, executor);
+        for (const auto& path : plan.files) printf("%s %s\n", dryRun ? "would remove" : "remove", WideToUtf8(path.filename().wstring()).c_str());
+        for (const auto& it : plan.dangling) {
+            for (const auto& name : it.second) printf("%s catalog entry %s (data is gone)\n", dryRun ? "would drop" : "drop", name.c_str());
+        }
+        size_t entries = 0;
+        for (const auto& it : plan.dangling) entries += it.second.size();
+        if (dryRun) {
+            printf("%zu files (%s) and %zu catalog entries are garbage\n", plan.files.size(), formatBytes(plan.bytes).c_str(), entries);
+            return 0;
+        }
+        size_t done = store::ApplyGc(backupDir, plan);
+        printf("removed %zu of %zu items, %s freed\n", done, plan.files.size() + entries, formatBytes(plan.bytes).c_str());
+        return 0;
+    }
+
+    int cmdCompact(const std::vector<std::wstring>& args) {
+        if (args.empty()) { printUsage(); return 2; }
+        double ratio = 0.0;
+        for (size_t i = 1; i + 1 < args.size(); i += 2) {
+            if (args[i] == L"--ratio") ratio = atof(WideToUtf8(args[i + 1]).c_str());
+            else { printUsage(); return 2; }
+        }
+        fs::path backupDir;
+        std::vector<store::Project> projects;
+        if (!loadStore(args[0], backupDir, projects)) return 1;
+        auto packBytes = [&]() {
+            uint64_t total = 0;
+            for (const auto& it : store::ComputeStats(backupDir, projects)) total += it.second.packBytes;
+            return total;
+        };
+        uint64_t before = packBytes();
+        size_t compacted = 0;
+        for (const auto& p : projects) compacted += PackStore(backupDir, p.stem).compact(ratio, nullptr);
+        uint64_t after = packBytes();
+        printf("compacted %zu packs: %s -> %s\n", compacted, formatBytes(before).c_str(), formatBytes(after).c_str());
+        return 0;
+    }
+
+    // 以前の個別ファイルのバックアップをパックへ移す
+    int cmdImport(std::vector<std::wstring> args) {
+        migrate::Options options;
+        unsigned threads = takeThreads(args);
+        std::vector<fs::path> roots;
+        for (size_t i = 0; i < args.size(); i++) {
+            if (args[i] == L"--level" && i + 1 < args.size()) options.level = atoi(WideToUtf8(args[++i]).c_str());
+            else if (args[i] == L"--keep-originals") options.keepOriginals = true;
+            else if (args[i] == L"--keep-duplicates") options.keepDuplicates = true;
+            else if (args[i] == L"--dry-run") options.dryRun = true;
+            else if (args[i].compare(0, 2, L"--") == 0) { printUsage(); return 2; }
+            else roots.push_back(args[i]);
+        }
+        if (roots.empty()) { printUsage(); return 2; }
+
+        TaskExecutor executor;
+        startExecutor(executor, threads);
+        static const char* const phases[] = { "scan", "import", "verify", "done" };
+        uint64_t lastBytes = 0;
+        double lastSeconds = 0;
+        migrate::Summary summary = migrate::Run(roots, options, executor, [&](const migrate::Progress& p, double seconds) {
+            uint64_t bytes = p.bytesDone;
+            double rate = seconds > lastSeconds && bytes >= lastBytes ? (bytes - lastBytes) / (1024.0 * 1024.0) / (seconds - lastSeconds) : 0.0;
+            lastBytes = bytes;
+            lastSeconds = seconds;
+            fprintf(stderr, "\r%-6s %llu/%llu files  %s / %s  %.1f MB/s   ", phases[p.phase], static_cast<unsigned long long>(p.filesDone.load()),
+                static_cast<unsigned long long>(p.filesTotal.load()), formatBytes(bytes).c_str(), formatBytes(p.bytesTotal).c_str(), rate);
+            fflush(stderr);
+        });
+        fprintf(stderr, "\n");
+
+        for (const auto& issue : summary.issues) printf("FAIL  %s: %s\n", issue.name.c_str(), issue.problem.c_str());
+        printf("%zu Backup folders, %zu projects, %zu loose backups (%s)\n", summary.backupDirs, summary.projects, summary.found,
+            formatBytes(summary.foundBytes).c_str());
+        if (options.dryRun) return 0;
+        printf("imported %zu, %zu identical to the previous one, %s stored\n", summary.imported, summary.duplicates,
+            formatBytes(summary.bytesStored).c_str());
+        printf("verified %zu, removed %zu originals\n", summary.verified, summary.removed);
+        printf("%s read in %.1f s (%.1f MB/s)\n", formatBytes(summary.bytesRead).c_str(), summary.seconds,
+            summary.seconds > 0 ? summary.bytesRead / (1024.0 * 1024.0) / summary.seconds : 0.0);
+        return summary.issues.empty() ? 0 : 1;
+    }
+
+    int cmdList(const std::vector<std::wstring>& args) {
+        if (args.size() < 1) { printUsage(); return 2; }
+        if (!PackStore::isPackFile(args[0])) return cmdListStore(args[0]);
+        PackFile pack(args[0]);
+        if (!loadPack(pack)) return 1;
+        int i = 0;
+        for (const auto& e : pack.entries()) {
+            printf("#%-4d %s  %12llu  %-3s  %s\n", i++, formatTime(e.time).c_str(),
+                static_cast<unsigned long long>(e.pmmRaw + e.emmRaw), e.codec == PackCodecLz ? "lz" : "raw", e.name.c_str());
+        }
+        printf("%zu snapshots, %llu / %llu bytes live\n", pack.entries().size(),
+            static_cast<unsigned long long>(pack.liveBytes()), static_cast<unsigned long long>(pack.fileSize()));
+        return 0;
+    }
+
+    int cmdExtract(const std::vector<std::wstring>& args) {
+        if (args.size() < 2) { printUsage(); return 2; }
+        PackFile pack(args[0]);
+        if (!loadPack(pack)) return 1;
+
+        const PackEntry* entry = nullptr;
+        std::string key = WideToUtf8(args[1]);
+        if (!key.empty() && key[0] == '#') {
+            size_t index = static_cast<size_t>(strtoul(key.c_str() + 1, nullptr, 10));
+            if (index < pack.entries().size()) entry = &pack.entries()[index];
+        }
+        else {
+            entry = pack.find(key);
+        }
+        if (!entry) {
+            fprintf(stderr, "snapshot not found: %s\n", key.c_str());
+            return 1;
+        }
+
+        fs::path out = args.size() >= 3 ? fs::path(args[2]) : fs::path(Utf8ToWide(entry->name) + L".pmm");
+        fs::path emmOut = out;
+        emmOut.replace_extension(L".emm");
+        if (!pack.extract(*entry, out, emmOut, nullptr)) {
+            fprintf(stderr, "extract failed (checksum mismatch or write error)\n");
+            return 1;
+        }
+        printf("extracted %s -> %s\n", entry->name.c_str(), WideToUtf8(out.wstring()).c_str());
+        return 0;
+    }
+
+    bool writeAll(const fs::path& path, const std::vector<uint8_t>& data) {
+        FILE* f = nullptr;
+#ifdef _WIN32
+        if (_wfopen_s(&f, path.c_str(), L"wb") != 0) f = nullptr;
+#else
+        f = fopen(path.c_str(), "wb");
+#endif
+        if (!f) return false;
+        bool ok = data.empty() || fwrite(data.data(), 1, data.size(), f) == data.size();
+        return fclose(f) == 0 && ok;
+    }
+
+    // 時刻を指定して取り出す。複数の時刻を続けて渡すと、履歴を行き来したときの所要時間がわかる
+    int cmdAt(const std::vector<std::wstring>& args) {
+        if (args.size() < 2) { printUsage(); return 2; }
+        fs::path project(args[0]);
+        std::vector<int64_t> times;
+        fs::path out;
+        for (size_t i = 1; i < args.size(); i++) {
+            if (args[i] == L"-o" && i + 1 < args.size()) {
+                out = args[++i];
+                continue;
+            }
+            int64_t t;
+            if (!parseTime(WideToUtf8(args[i]), t)) {
+                fprintf(stderr, "bad time: %s\n", WideToUtf8(args[i]).c_str());
+                return 2;
+            }
+            times.push_back(t);
+        }
+        if (times.empty()) { printUsage(); return 2; }
+
+        BackupTimeline timeline(project.parent_path() / L"Backup", project.stem().wstring());
+        if (!timeline.refresh() || timeline.entries().empty()) {
+            fprintf(stderr, "no backups for %s\n", WideToUtf8(project.wstring()).c_str());
+            return 1;
+        }
+
+        TimelineSnapshot snapshot;
+        for (int64_t t : times) {
+            auto start = std::chrono::steady_clock::now();
+            bool ok = timeline.at(t, snapshot);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            if (!ok) {
+                fprintf(stderr, "%s: no backup at or before this time\n", formatTime(t).c_str());
+                return 1;
+            }
+            printf("%s -> %s (%s)  %8.2f ms\n", formatTime(t).c_str(), snapshot.entry.name.c_str(),
+                formatTime(snapshot.entry.time).c_str(), ms);
+        }
+        printf("cache: %llu hits, %llu misses, %.1f MB\n",
+            static_cast<unsigned long long>(timeline.cache().hits()), static_cast<unsigned long long>(timeline.cache().misses()),
+            timeline.cache().bytes() / (1024.0 * 1024.0));
+
+        if (out.empty()) return 0;
+        fs::path emmOut = out;
+        emmOut.replace_extension(L".emm");
+        if (!writeAll(out, *snapshot.pmm) || (!snapshot.emm->empty() && !writeAll(emmOut, *snapshot.emm))) {
+            fprintf(stderr, "write failed: %s\n", WideToUtf8(out.wstring()).c_str());
+            return 1;
+        }
+        printf("wrote %s\n", WideToUtf8(out.wstring()).c_str());
+        return 0;
+    }
+
+    // 一覧のスケッチだけで、指定したバックアップ（または .kfs）に似ている順に並べる
+    int cmdSimilar(const std::vector<std::wstring>& args) {
+        if (args.size() < 2) { printUsage(); return 2; }
+        fs::path project(args[0]);
+        BackupCatalog catalog(project.parent_path() / L"Backup", project.stem().wstring());
+        if (!catalog.load() || catalog.entries().empty()) {
+            fprintf(stderr, "no catalog for %s\n", WideToUtf8(project.wstring()).c_str());
+            return 1;
+        }
+
+        SceneSketch target;
+        std::string key = WideToUtf8(args[1]);
+        if (fs::path(args[1]).extension() == L".kfs") {
+            emergency::Dump dump;
+            if (!emergency::Read(args[1], dump)) {
+                fprintf(stderr, "cannot read keyframes: %s\n", key.c_str());
+                return 1;
+            }
+            target = SketchScene(dump);
+        }
+        else {
+            const CatalogEntry* entry = nullptr;
+            if (!key.empty() && key[0] == '#') {
+                size_t index = static_cast<size_t>(strtoul(key.c_str() + 1, nullptr, 10));
+                if (index < catalog.entries().size()) entry = &catalog.entries()[index];
+            }
+            else {
+                entry = catalog.find(key);
+            }
+            if (!entry || entry->sketch.empty()) {
+                fprintf(stderr, "snapshot not found or has no sketch: %s\n", key.c_str());
+                return 1;
+            }
+            target = entry->sketch;
+        }
+
+        size_t count = args.size() >= 3 ? static_cast<size_t>(strtoul(WideToUtf8(args[2]).c_str(), nullptr, 10)) : 20;
+        auto start = std::chrono::steady_clock::now();
+        std::vector<CatalogMatch> matches = catalog.rankBySimilarity(target);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        for (size_t i = 0; i < matches.size() && i < count; i++) {
+            const CatalogMatch& m = matches[i];
+            std::vector<std::string> differing = SketchDifferingModels(target, m.entry->sketch);
+            printf("%5.1f%%  %s  %s  (%zu models differ)\n", m.similarity * 100, formatTime(m.entry->time).c_str(),
+                m.entry->name.c_str(), differing.size());
+        }
+        printf("ranked %zu backups in %.3f ms\n", matches.size(), ms);
+        return 0;
+    }
+
+    bool readAll(const fs::path& path, std::vector<uint8_t>& data) {
+        FILE* f = nullptr;
+#ifdef _WIN32
+        if (_wfopen_s(&f, path.c_str(), L"rb") != 0) f = nullptr;
+#else
+        f = fopen(path.c_str(), "rb");
+#endif
+        if (!f) return false;
+        data.clear();
+        uint8_t buf[65536];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) data.insert(data.end(), buf, buf + n);
+        bool ok = !ferror(f);
+        fclose(f);
+        return ok;
+    }
+
+    // 1回が短いので、合計が 200ms を超えるまで繰り返して1回あたりの秒数を求める
+    template <typename F>
+    double timeRepeated(F f) {
+        int runs = 0;
+        double elapsed = 0;
+        auto start = std::chrono::steady_clock::now();
+        do {
+            f();
+            runs++;
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        } while (elapsed < 0.2);
+        return elapsed / runs;
+    }
+
+    // キーフレーム用の圧縮と汎用の LZ を、実際の .kfs で比べる
+    int cmdCodec(const std::vector<std::wstring>& args) {
+        if (args.empty()) { printUsage(); return 2; }
+        const char* names[] = { "lz-fast", "lz-high", "kfc" };
+        const int codecs = 3;
+        uint64_t totalRaw = 0;
+        uint64_t totalBytes[codecs] = {};
+        double totalEnc[codecs] = {};
+        double totalDec[codecs] = {};
+
+        printf("%-8s %12s %12s %7s %10s %10s  %s\n", "codec", "raw", "bytes", "ratio", "enc MB/s", "dec MB/s", "file");
+        std::vector<uint8_t> raw, encoded, decoded;
+        for (const auto& arg : args) {
+            std::string label = WideToUtf8(fs::path(arg).filename().wstring());
+            if (!readAll(arg, raw)) {
+                fprintf(stderr, "cannot read: %s\n", WideToUtf8(arg).c_str());
+                return 1;
+            }
+            // 圧縮済みのものは元の形に戻してから比べる
+            if (kfc::IsEncoded(raw.data(), raw.size())) {
+                if (!kfc::Decode(raw.data(), raw.size(), decoded)) {
+                    fprintf(stderr, "cannot decode: %s\n", label.c_str());
+                    return 1;
+                }
+                raw.swap(decoded);
+            }
+            totalRaw += raw.size();
+
+            for (int c = 0; c < codecs; c++) {
+                double enc = timeRepeated([&]() {
+                    if (c == 2) {
+                        kfc::Encode(raw.data(), raw.size(), encoded);
+                    }
+                    else {
+                        encoded.clear();
+                        lz::compress(raw.data(), raw.size(), encoded, c == 0 ? lz::FastLevel : lz::HighLevel);
+                    }
+                });
+                bool ok = true;
+                double dec = timeRepeated([&]() {
+                    if (c == 2) {
+                        ok = kfc::Decode(encoded.data(), encoded.size(), decoded);
+                    }
+                    else {
+                        decoded.resize(raw.size());
+                        ok = lz::decompress(encoded.data(), encoded.size(), decoded.data(), decoded.size());
+                    }
+                });
+                if (!ok || decoded != raw) {
+                    fprintf(stderr, "%s: %s round trip failed\n", label.c_str(), names[c]);
+                    return 1;
+                }
+                totalBytes[c] += encoded.size();
+                totalEnc[c] += enc;
+                totalDec[c] += dec;
+                printf("%-8s %12zu %12zu %6.1f%% %10.0f %10.0f  %s\n", names[c], raw.size(), encoded.size(),
+                    raw.empty() ? 0.0 : encoded.size() * 100.0 / raw.size(), raw.size() / enc / 1e6, raw.size() / dec / 1e6, label.c_str());
+            }
+        }
+        if (args.size() > 1) {
+            for (int c = 0; c < codecs; c++) {
+                printf("%-8s %12llu %12llu %6.1f%% %10.0f %10.0f  (total)\n", names[c],
+                    static_cast<unsigned long long>(totalRaw), static_cast<unsigned long long>(totalBytes[c]),
+                    totalRaw ? totalBytes[c] * 100.0 / totalRaw : 0.0, totalRaw / totalEnc[c] / 1e6, totalRaw / totalDec[c] / 1e6);
+            }
+        }
+        return 0;
+    }
+
+    // キーフレーム用の圧縮を、合成したシーン（作りたてのものと、編集を重ねたもの）で確かめる。
+    //   - 元に戻ること。途中で切れたものは展開に失敗し、1バイト壊したものは失敗するか元と同じになること
+    //   - 汎用の LZ（lz-fast）より大きくならないこと。一番大きいシーンでは圧縮・展開とも遅くないこと
+    //     （時間は揺れるので、展開は 8 割まで許す）
+    //   - Crc32（PCLMULQDQ を使う版）が表引きと同じ値になること
+    int cmdCodecCheck(const std::vector<std::wstring>& args) {
+        if (!args.empty()) { printUsage(); return 2; }
+
+        uint32_t seed = 12345;
+        std::vector<uint8_t> buffer(1 << 20);
+        for (auto& b : buffer) {
+            seed = seed * 1664525u + 1013904223u;
+            b = static_cast<uint8_t>(seed >> 24);
+        }
+        for (size_t offset = 0; offset < 16; offset++) {
+            for (size_t size = 0; size < 600; size++) {
+                uint32_t init = static_cast<uint32_t>(size * 2654435761u);
+                if (Crc32(buffer.data() + offset, size, init) != Crc32Scalar(buffer.data() + offset, size, init)) {
+                    fprintf(stderr, "FAILED: Crc32 of %zu bytes at offset %zu differs from the table\n", size, offset);
+                    return 1;
+                }
+            }
+        }
+        if (Crc32(buffer.data(), buffer.size()) != Crc32Scalar(buffer.data(), buffer.size())) {
+            fprintf(stderr, "FAILED: Crc32 of 1 MB differs from the table\n");
+            return 1;
+        }
+        double crcSec = timeRepeated([&]() { seed ^= Crc32(buffer.data(), buffer.size()); });
+        double tableSec = timeRepeated([&]() { seed ^= Crc32Scalar(buffer.data(), buffer.size()); });
+        printf("crc32: %.0f MB/s, table %.0f MB/s\n", buffer.size() / crcSec / 1e6, buffer.size() / tableSec / 1e6);
+
+        SimulatorSettings settings;
+        settings.seed = 3;
+        HostSimulator sim(fs::path(L"codeccheck.pmm"), settings);   // save() は呼ばないので書き出さない
+        const int steps[] = { 0, 10, 100, 300 };
+        int done = 0;
+        std::vector<uint8_t> raw, encoded, decoded, packed;
+        kfc::Encoder encoder;
+        printf("%6s %10s %10s %10s\n", "steps", "raw", "kfc", "lz-fast");
+        for (int target : steps) {
+            while (done < target) {
+                sim.step();
+                done++;
+            }
+            sim.snapshot(raw, 0);
+            if (!encoder.encode(raw.data(), raw.size(), encoded) || !kfc::Decode(encoded.data(), encoded.size(), decoded) || decoded != raw) {
+                fprintf(stderr, "FAILED: %d steps: round trip failed\n", target);
+                return 1;
+            }
+            packed.clear();
+            lz::compress(raw.data(), raw.size(), packed, lz::FastLevel);
+            printf("%6d %10zu %10zu %10zu\n", target, raw.size(), encoded.size(), packed.size());
+            // 作りたてのシーンはどちらも 1KB ほどで、列ごとの印の分だけ LZ より大きくなることがあるので少し余裕を見る
+            if (encoded.size() > packed.size() + packed.size() / 20 + 256) {
+                fprintf(stderr, "FAILED: %d steps: %zu bytes, lz-fast %zu\n", target, encoded.size(), packed.size());
+                return 1;
+            }
+
+            std::vector<uint8_t> broken;
+            for (size_t cut = 0; cut < encoded.size(); cut += encoded.size() / 37 + 1) {
+                if (kfc::Decode(encoded.data(), cut, decoded)) {
+                    fprintf(stderr, "FAILED: %d steps: decoded the first %zu of %zu bytes\n", target, cut, encoded.size());
+                    return 1;
+                }
+            }
+            for (size_t at = 0; at < encoded.size(); at += encoded.size() / 53 + 1) {
+                broken = encoded;
+                broken[at] ^= 0x5A;
+                if (kfc::Decode(broken.data(), broken.size(), decoded) && decoded != raw) {
+                    fprintf(stderr, "FAILED: %d steps: byte %zu broken, decoded to something else\n", target, at);
+                    return 1;
+                }
+            }
+        }
+
+        // 一番大きいシーンで速さを比べる。ほかの処理に割り込まれた回を除くため、交互に数回測って一番速いものを使う
+        lz::Compressor lzc;
+        double kfcEnc = 1e9, kfcDec = 1e9, lzEnc = 1e9, lzDec = 1e9;
+        for (int round = 0; round < 5; round++) {
+            kfcEnc = (std::min)(kfcEnc, timeRepeated([&]() { encoder.encode(raw.data(), raw.size(), encoded); }));
+            kfcDec = (std::min)(kfcDec, timeRepeated([&]() { kfc::Decode(encoded.data(), encoded.size(), decoded); }));
+            lzEnc = (std::min)(lzEnc, timeRepeated([&]() {
+                packed.clear();
+                lzc.compress(raw.data(), raw.size(), packed, lz::FastLevel);
+            }));
+            lzDec = (std::min)(lzDec, timeRepeated([&]() {
+                decoded.resize(raw.size());
+                lz::decompress(packed.data(), packed.size(), decoded.data(), decoded.size());
+            }));
+        }
+        const double mb = raw.size() / 1e6;
+        printf("kfc:     encode %6.0f MB/s, decode %6.0f MB/s\n", mb / kfcEnc, mb / kfcDec);
+        printf("lz-fast: encode %6.0f MB/s, decode %6.0f MB/s\n", mb / lzEnc, mb / lzDec);
+        if (kfcEnc > lzEnc || kfcDec > lzDec / 0.8) {
+            fprintf(stderr, "FAILED: keyframe codec is slower than lz-fast\n");
+            return 1;
+        }
+        printf("OK\n");
+        return 0;
+    }
+
+    // thumb::Downscale と同じ手順を HalveScalar だけで行う
+    void downscaleReference(const uint8_t* src, int width, int height, size_t srcStride, int levels, thumb::Image& dst) {
+        if (levels <= 0) {
+            thumb::Downscale(src, width, height, srcStride, 0, dst);
+            return;
+        }
+        thumb::HalveScalar(src, width, height, srcStride, dst);
+        thumb::Image tmp;
+        for (int i = 1; i < levels && dst.width >= 2 && dst.height >= 2; i++) {
+            thumb::HalveScalar(dst.pixels.data(), dst.width, dst.height, dst.stride(), tmp);
+            std::swap(dst, tmp);
+        }
+    }
+
+    bool sameImage(const thumb::Image& a, const thumb::Image& b) {
+        return a.width == b.width && a.height == b.height && a.pixels == b.pixels;
+    }
+
+    // サムネイルの縮小（SSE2 のある環境ではその版）が、スカラーの参照実装と1バイトも違わないか確かめる。
+    // 端数の列が SIMD の4画素単位に収まらない幅、行間に詰め物のある入力、4バイト境界にない先頭も試す
+    int cmdThumbCheck(const std::vector<std::wstring>& args) {
+        if (!args.empty()) { printUsage(); return 2; }
+        const int sizes[][2] = {
+            { 1, 1 }, { 2, 1 }, { 1, 2 }, { 2, 2 }, { 3, 5 }, { 5, 3 }, { 7, 9 }, { 8, 8 }, { 9, 2 }, { 10, 10 },
+            { 15, 7 }, { 16, 4 }, { 17, 17 }, { 31, 3 }, { 33, 33 }, { 64, 1 }, { 767, 431 }, { 768, 432 }, { 1921, 1081 },
+        };
+        const size_t pads[] = { 0, 4, 60 };         // 行末の詰め物（バイト）
+        const size_t offsets[] = { 0, 1, 3 };       // 先頭のずれ（バイト）
+        // 乱数のほか、丸めと飽和を見るために全部 255 と 0/255 の縞も使う
+        const char* fills[] = { "random", "white", "stripes" };
+
+        uint32_t seed = 12345;
+        auto next = [&]() { seed = seed * 1664525u + 1013904223u; return static_cast<uint8_t>(seed >> 24); };
+        std::vector<uint8_t> buffer;
+        thumb::Image simd, reference;
+        int cases = 0;
+        for (const auto& size : sizes) {
+            for (size_t pad : pads) {
+                for (size_t offset : offsets) {
+                    for (int fill = 0; fill < 3; fill++) {
+                        const int width = size[0];
+                        const int height = size[1];
+                        const size_t stride = static_cast<size_t>(width) * 4 + pad;
+                        // 最後の行の詰め物は読まれないはずなので、確保しない
+                        buffer.resize(offset + stride * (height - 1) + static_cast<size_t>(width) * 4);
+                        for (size_t i = 0; i < buffer.size(); i++) {
+                            buffer[i] = fill == 0 ? next() : fill == 1 ? 255 : static_cast<uint8_t>((i / 4) % 2 ? 255 : 0);
+                        }
+                        const uint8_t* src = buffer.data() + offset;
+                        for (int levels = 0; levels <= 3; levels++) {
+                            thumb::Downscale(src, width, height, stride, levels, simd);
+                            downscaleReference(src, width, height, stride, levels, reference);
+                            cases++;
+                            if (!sameImage(simd, reference)) {
+                                fprintf(stderr, "FAILED: %dx%d pad %zu offset %zu %s levels %d: %dx%d differs from the reference %dx%d\n",
+                                    width, height, pad, offset, fills[fill], levels, simd.width, simd.height, reference.width, reference.height);
+                                return 1;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        printf("%d cases match the scalar reference\n", cases);
+
+        // 実際に CPU で縮める大きさ（GPU で 768 幅まで縮めた後の2段）での速さ
+        const int width = 768;
+        const int height = 432;
+        buffer.resize(static_cast<size_t>(width) * 4 * height);
+        for (auto& b : buffer) b = next();
+        double simdSec = timeRepeated([&]() { thumb::Downscale(buffer.data(), width, height, width * 4, 2, simd); });
+        double scalarSec = timeRepeated([&]() { downscaleReference(buffer.data(), width, height, width * 4, 2, reference); });
+        printf("downscale %dx%d by 4: %.1f us, scalar reference %.1f us (%.1fx)\n", width, height, simdSec * 1e6, scalarSec * 1e6,
+            scalarSec / simdSec);
+        printf("OK\n");
+        return 0;
+    }
+
+    // 追記が途中で失敗しても、パックが元の索引で終わっていることを確かめる。
+    // 索引が書けていないと次の load() はレコードを走査し直し、世代整理で外したものまで戻ってしまう
+    int cmdPackCheck(const std::vector<std::wstring>& args) {
+        if (args.size() != 1) { printUsage(); return 2; }
+        fs::path dir = args[0];
+        std::error_code ec;
+        fs::remove_all(dir, ec);
+        fs::create_directories(dir, ec);
+        if (ec) {
+            fprintf(stderr, "cannot create %s\n", WideToUtf8(dir.wstring()).c_str());
+            return 1;
+        }
+
+        uint32_t seed = 12345;
+        std::vector<uint8_t> data(256 * 1024);
+        for (auto& b : data) {
+            seed = seed * 1664525u + 1013904223u;
+            b = static_cast<uint8_t>(seed >> 24);
+        }
+        fs::path pmm = dir / L"source.pmm";
+        if (!writeAll(pmm, data)) {
+            fprintf(stderr, "cannot write %s\n", WideToUtf8(pmm.wstring()).c_str());
+            return 1;
+        }
+
+        fs::path packPath = dir / L"check.abpack";
+        {
+            PackFile pack(packPath);
+            for (int i = 1; i <= 6; i++) {
+                if (!pack.append("check_" + std::to_string(i), i, pmm, fs::path(), nullptr)) {
+                    fprintf(stderr, "FAILED: cannot append to %s\n", WideToUtf8(packPath.wstring()).c_str());
+                    return 1;
+                }
+            }
+            // 世代整理で古い3件を外す（データは残る）
+            if (!pack.remove({ "check_1", "check_2", "check_3" })) {
+                fprintf(stderr, "FAILED: cannot remove records from the index\n");
+                return 1;
+            }
+        }
+
+        // 読み直して索引のとおりの件数で、ファイルがフッタで終わっているか
+        auto intact = [&](const char* after, size_t expected) {
+            PackFile pack(packPath);
+            std::error_code sizeEc;
+            uint64_t size = fs::file_size(packPath, sizeEc);
+            if (!pack.load() || sizeEc || pack.entries().size() != expected || size != pack.fileSize()) {
+                fprintf(stderr, "FAILED: after %s the pack lists %zu records (expected %zu), %llu bytes on disk, index ends at %llu\n",
+                    after, pack.entries().size(), expected, static_cast<unsigned long long>(size),
+                    static_cast<unsigned long long>(pack.fileSize()));
+                return false;
+            }
+            printf("after %s: %zu records, footer at the end\n", after, expected);
+            return true;
+        };
+        if (!intact("retention", 3)) return 1;
+
+        {
+            PackFile pack(packPath);
+            if (pack.append("check_7", 7, dir / L"missing.pmm", fs::path(), nullptr)) {
+                fprintf(stderr, "FAILED: appending a missing file succeeded\n");
+                return 1;
+            }
+        }
+        if (!intact("an append from a missing file", 3)) return 1;
+
+#ifndef _WIN32
+        // ディスクが一杯になった代わりに、ファイルの大きさの上限でレコードの途中から書けなくする
+        {
+            PackFile pack(packPath);
+            pack.load();
+            PreparedRecord record;
+            PrepareRecord("check_9", 9, data, std::vector<uint8_t>(), 0, record);
+            rlimit saved;
+            getrlimit(RLIMIT_FSIZE, &saved);
+            rlimit limited = saved;
+            limited.rlim_cur = static_cast<rlim_t>(pack.fileSize() + data.size() / 2);
+            signal(SIGXFSZ, SIG_IGN);
+            setrlimit(RLIMIT_FSIZE, &limited);
+            bool appended = pack.append("check_8", 8, pmm, fs::path(), nullptr);
+            bool prepared = pack.appendPrepared(record);
+            setrlimit(RLIMIT_FSIZE, &saved);
+            signal(SIGXFSZ, SIG_DFL);
+            if (appended || prepared) {
+                fprintf(stderr, "FAILED: an append past the file size limit succeeded\n");
+                return 1;
+            }
+        }
+        if (!intact("appends failing midway through the record", 3)) return 1;
+#endif
+
+        {
+            PackFile pack(packPath);
+            if (!pack.append("check_10", 10, pmm, fs::path(), nullptr)) {
+                fprintf(stderr, "FAILED: cannot append after the failed appends\n");
+                return 1;
+            }
+        }
+        if (!intact("a successful append", 4)) return 1;
+        printf("OK\n");
+        return 0;
+    }
+
+    // 複製先の内容が複製元と同じか、1バイトずつ比べる
+    bool compareReplica(const fs::path& backupDir, const std::wstring& stem, const fs::path& replicaRoot, size_t& files) {
+        fs::path target = replica::TargetDir(replicaRoot, backupDir);
+        files = 0;
+        std::error_code ec;
+        for (fs::directory_iterator it(backupDir, ec), end; !ec && it != end; it.increment(ec)) {
+            const fs::path& src = it->path();
+            if (!replica::IsProjectFile(src.filename().wstring(), stem) || !fs::is_regular_file(it->status())) continue;
+            std::vector<uint8_t> a, b;
+            if (!readAll(src, a) || !readAll(target / src.filename(), b) || a != b) {
+                fprintf(stderr, "replica differs: %s\n", WideToUtf8(src.filename().wstring()).c_str());
+                return false;
+            }
+            files++;
+        }
+        return true;
+    }
+
+    // MMD の代わりに HostSimulator で編集・保存を繰り返し、バックアップの経路を通しで測る。
+    // 1回の手順はプラグインと同じ BackupCycle を通る。段階ごとの記録が回数と経過時間に合っているか、
+    // 一覧と実体が合っているかを最後に確かめ、p99 が --max-ms を超えるか、コピーの速さが --min-mbps に
+    // 届かなければ失敗を返す（ctest ではこの2つで遅延と速さを確かめる）。作業フォルダは始めに空にする。
+    // --replica を付けると複製を裏で走らせ、--replica-outage では途中で複製先を外して戻す。
+    // 複製では、追いついて中身が一致すること、--replica-kbps の帯域を超えて送っていないこと、
+    // 外した間に失敗して再試行したことも確かめる
+    int cmdSimulate(const std::vector<std::wstring>& args) {
+        if (args.empty()) { printUsage(); return 2; }
+        fs::path dir(args[0]);
+        SimulatorSettings settings;
+        BackupPolicy policy;
+        int saves = 50;
+        double maxMs = 0;
+        double minMBps = 0;
+        fs::path tracePath;
+        fs::path replicaRoot;
+        uint64_t replicaKBps = 0;
+        bool replicaOutage = false;
+        bool publish = false;
+        for (size_t i = 1; i < args.size(); i++) {
+            const std::wstring& opt = args[i];
+            if (opt == L"--loose") {
+                policy.usePackFiles = false;
+                continue;
+            }
+            if (opt == L"--publish") {
+                publish = true;
+                continue;
+            }
+            if (opt == L"--replica-outage") {
+                replicaOutage = true;
+                continue;
+            }
+            if (i + 1 >= args.size()) { printUsage(); return 2; }
+            std::string value = WideToUtf8(args[++i]);
+            int n = atoi(value.c_str());
+            if (opt == L"--saves") saves = n;
+            else if (opt == L"--models") settings.models = n;
+            else if (opt == L"--bones") settings.bones = n;
+            else if (opt == L"--edits") settings.editsPerStep = n;
+            else if (opt == L"--keep") policy.maxBackupFiles = n;
+            else if (opt == L"--seed") settings.seed = static_cast<uint32_t>(n);
+            else if (opt == L"--max-ms") maxMs = atof(value.c_str());
+            else if (opt == L"--min-mbps") minMBps = atof(value.c_str());
+            else if (opt == L"--trace") tracePath = args[i];
+            else if (opt == L"--replica") replicaRoot = args[i];
+            else if (opt == L"--replica-kbps") replicaKBps = static_cast<uint64_t>(n);
+            else { printUsage(); return 2; }
+        }
+
+        // 前回の Backup が残っていると一覧の件数が合わない
+        std::error_code ec;
+        fs::remove_all(dir, ec);
+        fs::create_directories(dir, ec);
+        HostSimulator host(dir / L"simulated.pmm", settings);
+        BackupEngine engine(host.pmmPath(), policy);
+        BackupMetrics metrics;
+        BackupCycle cycle;
+        uint64_t storedBytes = 0;
+        uint64_t kfsRaw = 0;
+        uint64_t kfsBytes = 0;
+        uint64_t measuredNs = 0;
+
+        BackupReplicator replicator;
+        fs::path offlineRoot = replicaRoot;
+        offlineRoot += L".offline";
+        uint32_t replicaRetries = 0;
+        ReplicaOptions replicaOptions;
+        std::chrono::steady_clock::time_point firstEnqueue;
+        if (!replicaRoot.empty()) {
+            fs::create_directories(replicaRoot, ec);
+            ReplicaOptions& options = replicaOptions;
+            options.bytesPerSec = replicaKBps * 1024;
+            options.burstBytes = (std::max)(options.bytesPerSec, static_cast<uint64_t>(replica::BlockSize));
+            options.minBackoff = std::chrono::milliseconds(50);
+            options.maxBackoff = std::chrono::seconds(1);
+            replicator.start(replicaRoot, options);
+        }
+
+        // プラグインと同じ形で公開し、BackupTool watch で見られるようにする
+        LiveMetricsPublisher live;
+        if (publish) {
+            if (!live.open()) {
+                fprintf(stderr, "cannot publish metrics (shared memory unavailable or all slots taken)\n");
+                return 1;
+            }
+            live.setProject(WideToUtf8(engine.stem()));
+            printf("publishing metrics in slot %u\n", live.slotIndex());
+        }
+
+        // 名前が秒単位なので、時刻は5分おきに進める
+        int64_t start = static_cast<int64_t>(time(nullptr));
+        for (int i = 0; i < saves; i++) {
+            host.step();
+            std::string error;
+            uint64_t cycleStart = metrics.nowNs();
+            if (!RunSimulatedBackup(host, engine, cycle, start + i * 300, metrics, error)) {
+                live.backupFailed();
+                fprintf(stderr, "%s\n", error.c_str());
+                return 1;
+            }
+            uint64_t cycleNs = metrics.nowNs() - cycleStart;
+            measuredNs += cycleNs;
+            const BackupCycleResult& backup = cycle.result();
+            live.backupFinished(start + i * 300, cycleNs, backup.storedBytes, engine.storedBytes());
+            live.heartbeat(replicator.queued(), 0, replicator.bytesSent(), replicator.failures());
+            storedBytes += backup.storedBytes;
+            kfsRaw += backup.kfsRaw;
+            kfsBytes += backup.kfsBytes;
+
+            if (replicator.running()) {
+                // 外したままの区間でも複製を頼み続ける（失敗して間を空けて再試行するはず）。
+                // 戻す前に、外れたことに複製が一度は気付くまで待つ（速いマシンでも必ず失敗の経路を通す）
+                if (replicaOutage && i == saves / 3) fs::rename(replicaRoot, offlineRoot, ec);
+                if (replicaOutage && i == saves * 2 / 3) {
+                    auto noticeDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+                    while (replicator.failures() == 0 && std::chrono::steady_clock::now() < noticeDeadline) {
+                        replicator.enqueue(engine.backupDir(), engine.stem());
+                        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                    }
+                    replicaRetries = (std::max)(replicaRetries, replicator.failures());
+                    fs::rename(offlineRoot, replicaRoot, ec);
+                }
+                if (i == 0) firstEnqueue = std::chrono::steady_clock::now();
+                replicator.enqueue(engine.backupDir(), engine.stem());
+                replicaRetries = (std::max)(replicaRetries, replicator.failures());
+            }
+        }
+
+        // 記録した遅延が実際の経過と合っているか確かめる。--max-ms はこの記録を見るので、
+        // 段階の計測が抜けたり二重になったりすると、遅くなっても気付けない
+        const BackupStage cycleStages[] = { BackupStage::SaveRequest, BackupStage::SaveWait, BackupStage::Copy,
+            BackupStage::Keyframes, BackupStage::Retention, BackupStage::Total };
+        uint64_t stagesNs = 0;
+        for (BackupStage stage : cycleStages) {
+            const LatencyHistogram& h = metrics.histogram(stage);
+            if (h.count() != static_cast<uint64_t>(saves)) {
+                fprintf(stderr, "%s recorded %llu times for %d saves\n", GetStageTraceName(stage),
+                    static_cast<unsigned long long>(h.count()), saves);
+                return 1;
+            }
+            if (stage != BackupStage::Total) stagesNs += h.totalNs();
+        }
+        uint64_t recordedNs = metrics.histogram(BackupStage::Total).totalNs();
+        if (stagesNs > recordedNs || recordedNs > measuredNs) {
+            fprintf(stderr, "recorded latency does not add up: stages %.3f ms, total %.3f ms, measured %.3f ms\n",
+                stagesNs / 1e6, recordedNs / 1e6, measuredNs / 1e6);
+            return 1;
+        }
+
+        // 一覧の件数と、すべての項目の実体（サイズ・CRC）を確かめる
+        BackupCatalog catalog(engine.backupDir(), engine.stem());
+        size_t expected = policy.maxBackupFiles > 0 && policy.maxBackupFiles < 9999
+            ? (std::min)(static_cast<size_t>(saves), static_cast<size_t>(policy.maxBackupFiles)) : static_cast<size_t>(saves);
+        if (!catalog.load() || catalog.entries().size() != expected) {
+            fprintf(stderr, "catalog has %zu entries, expected %zu\n", catalog.entries().size(), expected);
+            return 1;
+        }
+        for (const auto& e : catalog.entries()) {
+            if (!catalog.verify(e)) {
+                fprintf(stderr, "backup does not match catalog: %s\n", e.name.c_str());
+                return 1;
+            }
+        }
+
+        printf("%d saves, %zu keyframes, %zu backups kept (%s)\n", saves, host.keyframeCount(), expected,
+            policy.usePackFiles ? "pack" : "loose");
+        printf("%-12s %6s %10s %10s %10s %10s\n", "stage", "count", "p50 ms", "p95 ms", "p99 ms", "max ms");
+        for (int s = 0; s < static_cast<int>(BackupStage::Count); s++) {
+            const LatencyHistogram& h = metrics.histogram(static_cast<BackupStage>(s));
+            if (h.count() == 0) continue;
+            printf("%-12s %6llu %10.3f %10.3f %10.3f %10.3f\n", GetStageTraceName(static_cast<BackupStage>(s)),
+                static_cast<unsigned long long>(h.count()), h.percentileNs(0.5) / 1e6, h.percentileNs(0.95) / 1e6,
+                h.percentileNs(0.99) / 1e6, h.maxNs() / 1e6);
+        }
+        const LatencyHistogram& copy = metrics.histogram(BackupStage::Copy);
+        double copyMBps = copy.totalNs() ? storedBytes * 1e3 / copy.totalNs() : 0.0;
+        printf("copy %.1f MB/s, keyframes %.1f%% of raw\n", copyMBps, kfsRaw ? kfsBytes * 100.0 / kfsRaw : 0.0);
+
+        if (replicator.running()) {
+            // 残りが送り終わるのを待つ。帯域を絞っているときはその分だけ待つ
+            uint64_t scanned = 0;
+            for (fs::directory_iterator it(engine.backupDir(), ec), end; !ec && it != end; it.increment(ec)) {
+                scanned += fs::file_size(it->path(), ec);
+            }
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30)
+                + std::chrono::seconds(replicaKBps ? scanned / (replicaKBps * 1024) : 0);
+            auto waitStart = std::chrono::steady_clock::now();
+            while (!replicator.idle() && std::chrono::steady_clock::now() < deadline) {
+                replicaRetries = (std::max)(replicaRetries, replicator.failures());
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            double drainMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - waitStart).count();
+            double replicaSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - firstEnqueue).count();
+            bool idle = replicator.idle();
+            replicator.stop();
+            size_t files = 0;
+            if (!idle) {
+                fprintf(stderr, "replica did not catch up\n");
+                return 1;
+            }
+            if (!compareReplica(engine.backupDir(), engine.stem(), replicaRoot, files)) return 1;
+            printf("replica: %zu files identical, %.1f MB sent for %.1f MB of backups, %u retries, caught up %.0f ms after the last save\n",
+                files, replicator.bytesSent() / (1024.0 * 1024.0), scanned / (1024.0 * 1024.0), replicaRetries, drainMs);
+            if (replicaOutage && replicaRetries == 0) {
+                fprintf(stderr, "replica never failed while the target was offline\n");
+                return 1;
+            }
+            if (replicaKBps > 0) {
+                // 最初のひとかたまり（burst。TokenBucket は kIoChunkSize まで切り上げる）の後は、帯域の上限を超えて送っていないか
+                double burst = static_cast<double>((std::max)(replicaOptions.burstBytes, static_cast<uint64_t>(kIoChunkSize)));
+                double allowed = burst + replicaOptions.bytesPerSec * replicaSec;
+                printf("replica: %.0f KB/s on average over %.1f s (limit %llu KB/s)\n", replicator.bytesSent() / 1024.0 / replicaSec,
+                    replicaSec, static_cast<unsigned long long>(replicaKBps));
+                if (replicator.bytesSent() > allowed * 1.05) {
+                    fprintf(stderr, "replica sent %.1f MB in %.1f s, more than the %llu KB/s limit allows\n",
+                        replicator.bytesSent() / (1024.0 * 1024.0), replicaSec, static_cast<unsigned long long>(replicaKBps));
+                    return 1;
+                }
+            }
+        }
+
+        if (!tracePath.empty() && !metrics.writeChromeTrace(tracePath)) {
+            fprintf(stderr, "cannot write trace: %s\n", WideToUtf8(tracePath.wstring()).c_str());
+            return 1;
+        }
+        double p99 = metrics.histogram(BackupStage::Total).percentileNs(0.99) / 1e6;
+        if (maxMs > 0 && p99 > maxMs) {
+            fprintf(stderr, "p99 %.3f ms exceeds %.3f ms\n", p99, maxMs);
+            return 1;
+        }
+        if (minMBps > 0 && copyMBps < minMBps) {
+            fprintf(stderr, "copy %.1f MB/s is below %.1f MB/s\n", copyMBps, minMBps);
+            return 1;
+        }
+        return 0;
+    }
+
+    // 記録した編集セッションを、バックアップの設定ごとに仮想時間で再生して比べる
+    // 設定は "間隔(分):上限:pack|loose"（上限 0 は無制限）
+    int cmdReplay(const std::vector<std::wstring>& args) {
+        if (args.size() < 2) { printUsage(); return 2; }
+        session::Trace trace;
+        if (!session::ReadTrace(args[0], trace)) {
+            fprintf(stderr, "cannot read session: %s\n", WideToUtf8(args[0]).c_str());
+            return 1;
+        }
+        fs::path workDir(args[1]);
+        SimulatorSettings settings;
+        std::vector<std::string> specs;
+        for (size_t i = 2; i + 1 < args.size(); i += 2) {
+            std::string value = WideToUtf8(args[i + 1]);
+            if (args[i] == L"--policy") specs.push_back(value);
+            else if (args[i] == L"--bones") settings.bones = atoi(value.c_str());
+            else { printUsage(); return 2; }
+        }
+        if (specs.empty()) specs = { "1:50:pack", "5:50:pack", "10:50:pack", "5:50:loose" };
+
+        size_t edits = 0, commands = 0;
+        uint64_t keys = 0, clicks = 0;
+        for (const auto& e : trace.events) {
+            if (e.kind == session::EventEdit) edits++;
+            else if (e.kind == session::EventCommand) commands++;
+            else {
+                keys += e.keys;
+                clicks += e.clicks;
+            }
+        }
+        printf("session %s, %.1f min, %zu edits, %zu commands, %llu keys, %llu clicks%s\n", formatTime(trace.startTime).c_str(),
+            trace.durationMs() / 60000.0, edits, commands, static_cast<unsigned long long>(keys),
+            static_cast<unsigned long long>(clicks), trace.truncated ? " (truncated)" : "");
+        printf("%-16s %7s %10s %10s %10s %9s %10s %10s %8s\n", "policy", "backups", "MB", "lost min", "lost edits",
+            "cpu ms", "stall ms", "stall max", "speedup");
+
+        for (size_t p = 0; p < specs.size(); p++) {
+            const std::string& spec = specs[p];
+            ReplayPolicy policy;
+            char storage[16] = "pack";
+            int keep = 50;
+            if (sscanf(spec.c_str(), "%d:%d:%15s", &policy.intervalMinutes, &keep, storage) < 2 || policy.intervalMinutes < 1) {
+                fprintf(stderr, "bad policy: %s\n", spec.c_str());
+                return 2;
+            }
+            policy.label = spec;
+            policy.backup.maxBackupFiles = keep > 0 ? keep : 9999;
+            policy.backup.usePackFiles = std::string(storage) != "loose";
+
+            ReplayResult result;
+            std::string error;
+            if (!ReplaySession(trace, workDir / Utf8ToWide("replay_" + std::to_string(p)), policy, settings, result, error)) {
+                fprintf(stderr, "%s: %s\n", spec.c_str(), error.c_str());
+                return 1;
+            }
+            printf("%-16s %7d %10.1f %10.1f %10llu %9.0f %10.1f %10.1f %7.0fx\n", spec.c_str(), result.backups,
+                result.bytesWritten / (1024.0 * 1024.0), result.worstLostMs / 60000.0,
+                static_cast<unsigned long long>(result.worstLostEdits), result.cpuMs, result.stallMs, result.stallMaxMs,
+                result.wallMs > 0 ? trace.durationMs() / result.wallMs : 0.0);
+        }
+        return 0;
+    }
+
+    int run(const std::vector<std::wstring>& argv);
+
+#ifdef _WIN32
+    typedef HANDLE WorkerHandle;
+#else
+    typedef pid_t WorkerHandle;
+#endif
+
+    // 自分自身を別のプロセスとして argv で動かす
+    bool spawnSelf(const std::vector<std::wstring>& argv, WorkerHandle& handle) {
+#ifdef _WIN32
+        wchar_t exe[MAX_PATH];
+        if (!GetModuleFileNameW(NULL, exe, MAX_PATH)) return false;
+        std::wstring cmd = L"\"" + std::wstring(exe) + L"\"";
+        for (const auto& a : argv) cmd += L" \"" + a + L"\"";
+        STARTUPINFOW si = { sizeof(si) };
+        PROCESS_INFORMATION pi;
+        if (!CreateProcessW(exe, &cmd[0], NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi)) return false;
+        CloseHandle(pi.hThread);
+        handle = pi.hProcess;
+        return true;
+#else
+        fflush(stdout);
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid < 0) return false;
+        if (pid == 0) {
+            int code = run(argv);
+            fflush(stdout);
+            fflush(stderr);
+            _exit(code);
+        }
+        handle = pid;
+        return true;
+#endif
+    }
+
+    int waitWorker(WorkerHandle handle) {
+#ifdef _WIN32
+        WaitForSingleObject(handle, INFINITE);
+        DWORD code = 1;
+        GetExitCodeProcess(handle, &code);
+        CloseHandle(handle);
+        return static_cast<int>(code);
+#else
+        int status = 0;
+        if (waitpid(handle, &status, 0) < 0) return 1;
+        return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+#endif
+    }
+
+    // stress から起動される1プロセス分。同じプロジェクトのプロセスは同じ PMM・同じ時刻でバックアップするので、名前は必ずぶつかる
+    int cmdStressWorker(const std::vector<std::wstring>& args) {
+        if (args.size() < 5) { printUsage(); return 2; }
+        fs::path dir(args[0]);
+        int index = atoi(WideToUtf8(args[1]).c_str());
+        int saves = atoi(WideToUtf8(args[2]).c_str());
+        BackupPolicy policy;
+        policy.maxBackupFiles = atoi(WideToUtf8(args[3]).c_str());
+        policy.usePackFiles = args[4] != L"loose";
+        int64_t start = args.size() > 5 ? atoll(WideToUtf8(args[5]).c_str()) : static_cast<int64_t>(time(nullptr));
+        std::wstring stem = args.size() > 6 ? args[6] : L"stress";
+
+        SimulatorSettings settings;
+        settings.models = 2;
+        settings.bones = 40;
+        settings.morphs = 10;
+        settings.editsPerStep = 50;
+        settings.seed = static_cast<uint32_t>(index + 1);
+        HostSimulator host(dir / (stem + L".pmm"), settings);
+        BackupEngine engine(host.pmmPath(), policy);
+        BackupMetrics metrics;
+        BackupCycle cycle;
+        for (int i = 0; i < saves; i++) {
+            host.step();
+            std::string error;
+            if (!RunSimulatedBackup(host, engine, cycle, start + i, metrics, error)) {
+                fprintf(stderr, "worker %d: %s\n", index, error.c_str());
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    // 同じ Backup フォルダへ複数のプロセスから同時にバックアップし、名前の衝突・取りこぼし・
+    // 他のプロセスのバックアップの削除が無いことを確かめる。名前が前方一致する2つのプロジェクト
+    // （stress と stress2）を同じフォルダで同時に動かし、互いの世代整理が相手のものに触れないことも見る
+    int cmdStress(const std::vector<std::wstring>& args) {
+        if (args.empty()) { printUsage(); return 2; }
+        fs::path dir(args[0]);
+        int procs = 4;
+        int saves = 40;
+        int keep = 50;
+        bool loose = false;
+        for (size_t i = 1; i < args.size(); i++) {
+            const std::wstring& opt = args[i];
+            if (opt == L"--loose") {
+                loose = true;
+                continue;
+            }
+            if (i + 1 >= args.size()) { printUsage(); return 2; }
+            int n = atoi(WideToUtf8(args[++i]).c_str());
+            if (opt == L"--procs") procs = (std::max)(n, 1);
+            else if (opt == L"--saves") saves = (std::max)(n, 1);
+            else if (opt == L"--keep") keep = (std::max)(n, 1);
+            else { printUsage(); return 2; }
+        }
+
+        std::error_code ec;
+        fs::remove_all(dir, ec);
+        fs::create_directories(dir, ec);
+        std::wstring start = std::to_wstring(static_cast<int64_t>(time(nullptr)));
+        // 後の方が前の方の名前で始まる。後の方のバックアップは前の方の世代整理で先に消されやすい名前になる
+        const std::wstring stems[] = { L"stress", L"stress2" };
+        auto wallStart = std::chrono::steady_clock::now();
+        std::vector<WorkerHandle> workers;
+        for (int p = 0; p < procs; p++) {
+            for (const std::wstring& stem : stems) {
+                WorkerHandle handle;
+                std::vector<std::wstring> argv = { L"stress-worker", dir.wstring(), std::to_wstring(p), std::to_wstring(saves),
+                    std::to_wstring(keep), loose ? L"loose" : L"pack", start, stem };
+                if (!spawnSelf(argv, handle)) {
+                    fprintf(stderr, "cannot start worker %d for %s\n", p, WideToUtf8(stem).c_str());
+                    return 1;
+                }
+                workers.push_back(handle);
+            }
+        }
+        int failed = 0;
+        for (auto handle : workers) {
+            if (waitWorker(handle) != 0) failed++;
+        }
+        double wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - wallStart).count();
+        if (failed > 0) {
+            fprintf(stderr, "%d of %zu workers failed\n", failed, workers.size());
+            return 1;
+        }
+
+        // プロジェクトごとに、一覧・実体・付随ファイルが互いに過不足なく対応しているか
+        fs::path backupDir = dir / L"Backup";
+        std::map<std::wstring, std::vector<std::string>> stored, sidecars;
+        for (fs::directory_iterator it(backupDir, ec), end; !ec && it != end; it.increment(ec)) {
+            const fs::path& p = it->path();
+            std::wstring stem;
+            int64_t time = 0;
+            if (!store::SplitBackupName(p.stem().wstring(), stem, time)) continue;
+            if (p.extension() == L".kfs") sidecars[stem].push_back(WideToUtf8(p.stem().wstring()));
+            else if (p.extension() == L".pmm") stored[stem].push_back(WideToUtf8(p.stem().wstring()));
+        }
+        size_t total = static_cast<size_t>(procs) * static_cast<size_t>(saves);
+        size_t expected = (std::min)(total, static_cast<size_t>(keep));
+        for (const std::wstring& stem : stems) {
+            const std::string project = WideToUtf8(stem);
+            BackupCatalog catalog(backupDir, stem);
+            if (!catalog.load() || catalog.entries().size() != expected) {
+                fprintf(stderr, "%s: catalog has %zu entries, expected %zu\n", project.c_str(), catalog.entries().size(), expected);
+                return 1;
+            }
+            std::vector<std::string> cataloged;
+            size_t suffixed = 0;
+            for (const auto& e : catalog.entries()) {
+                if (!catalog.verify(e)) {
+                    fprintf(stderr, "%s: backup does not match catalog: %s\n", project.c_str(), e.name.c_str());
+                    return 1;
+                }
+                cataloged.push_back(e.name);
+                if (e.name.size() > project.size() + std::string("_YYYYMMDD_HHMMSS").size()) suffixed++;
+            }
+            std::sort(cataloged.begin(), cataloged.end());
+
+            std::vector<std::string>& names = stored[stem];
+            std::vector<fs::path> packPaths = PackStore(backupDir, stem).packPaths();
+            for (const auto& path : packPaths) {
+                PackFile pack(path);
+                if (!loadPack(pack)) return 1;
+                for (const auto& e : pack.entries()) names.push_back(e.name);
+            }
+            std::vector<std::string>& kfs = sidecars[stem];
+            std::sort(names.begin(), names.end());
+            std::sort(kfs.begin(), kfs.end());
+            if (std::adjacent_find(names.begin(), names.end()) != names.end()) {
+                fprintf(stderr, "%s: the same name was stored twice\n", project.c_str());
+                return 1;
+            }
+            if (names != cataloged) {
+                fprintf(stderr, "%s: %zu backups stored but %zu in the catalog\n", project.c_str(), names.size(), cataloged.size());
+                return 1;
+            }
+            if (kfs != cataloged) {
+                fprintf(stderr, "%s: %zu keyframe files for %zu backups\n", project.c_str(), kfs.size(), cataloged.size());
+                return 1;
+            }
+            printf("%s: %d processes x %d saves (%s, keep %d): %zu backups kept, %zu renamed on collision, %zu packs\n",
+                project.c_str(), procs, saves, loose ? "loose" : "pack", keep, expected, suffixed, packPaths.size());
+        }
+        printf("%.0f ms\n", wallMs);
+        return 0;
+    }
+
+    // TaskExecutor のスケーリングを測る。file（無ければ PMM に似た生成データ）を 1MB ずつ
+    // Maintenance の優先度で圧縮し、1..N 並列の速度と効率を出す。最後に、大きな処理の途中で
+    // stop() してから戻るまでの時間を測る
+    int cmdScale(const std::vector<std::wstring>& args) {
+        unsigned maxThreads = store::DefaultThreads();
+        size_t mb = 64;
+        fs::path file;
+        for (size_t i = 0; i < args.size(); i++) {
+            if (args[i] == L"--max" && i + 1 < args.size()) maxThreads = static_cast<unsigned>(atoi(WideToUtf8(args[++i]).c_str()));
+            else if (args[i] == L"--mb" && i + 1 < args.size()) mb = static_cast<size_t>(atoi(WideToUtf8(args[++i]).c_str()));
+            else if (args[i].compare(0, 2, L"--") == 0) { printUsage(); return 2; }
+            else file = args[i];
+        }
+        if (maxThreads < 1) maxThreads = 1;
+        if (mb < 1) mb = 1;
+
+        std::vector<uint8_t> data;
+        if (!file.empty()) {
+            if (!readAll(file, data) || data.empty()) {
+                fprintf(stderr, "cannot read %s\n", WideToUtf8(file.wstring()).c_str());
+                return 1;
+            }
+        }
+        else {
+            // キーフレームのように、同じ形のレコードが少しずつ違う値で並ぶデータ
+            data.resize(mb * 1024 * 1024);
+            uint32_t seed = 12345;
+            for (size_t i = 0; i < data.size(); i += 4) {
+                seed = seed * 1103515245u + 12345u;
+                uint32_t v = (i % 111 < 64) ? static_cast<uint32_t>(i / 111) : (seed >> 24) & 0x0f;
+                memcpy(data.data() + i, &v, (std::min)(size_t(4), data.size() - i));
+            }
+        }
+
+        const size_t block = 1024 * 1024;
+        size_t blocks = (data.size() + block - 1) / block;
+        std::vector<std::vector<uint8_t>> packed(blocks);
+        auto compressAll = [&](TaskExecutor& executor) {
+            return executor.parallelFor(blocks, TaskPriority::Maintenance, [&](size_t i) {
+                size_t pos = i * block;
+                packed[i].clear();
+                lz::compress(data.data() + pos, (std::min)(data.size() - pos, block), packed[i], lz::HighLevel);
+            });
+        };
+
+        printf("%s in %zu blocks, level %d, %u cores\n", formatBytes(data.size()).c_str(), blocks, lz::HighLevel,
+            std::thread::hardware_concurrency());
+        printf("%8s %10s %10s %8s %10s\n", "threads", "ms", "MB/s", "speedup", "efficiency");
+        double base = 0;
+        for (unsigned threads = 1; threads <= maxThreads; threads++) {
+            TaskExecutor executor;
+            executor.start(threads - 1);
+            auto t0 = std::chrono::steady_clock::now();
+            compressAll(executor);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+            if (threads == 1) base = ms;
+            double speedup = ms > 0 ? base / ms : 0.0;
+            printf("%8u %10.1f %10.1f %7.2fx %9.0f%%\n", threads, ms, ms > 0 ? data.size() / (1024.0 * 1024.0) / (ms / 1000.0) : 0.0,
+                speedup, speedup / threads * 100.0);
+        }
+
+        // 圧縮結果が元に戻ることを確かめる
+        std::vector<uint8_t> check(block);
+        for (size_t i = 0; i < blocks; i++) {
+            size_t pos = i * block;
+            size_t n = (std::min)(data.size() - pos, block);
+            if (!lz::decompress(packed[i].data(), packed[i].size(), check.data(), n) || memcmp(check.data(), data.data() + pos, n) != 0) {
+                fprintf(stderr, "block %zu does not round-trip\n", i);
+                return 1;
+            }
+        }
+
+        // 取り消し: 圧縮を何周も繰り返す処理の途中で stop() する
+        TaskExecutor executor;
+        executor.start(maxThreads - 1);
+        std::chrono::steady_clock::time_point returned;
+        std::thread job([&]() {
+            for (int round = 0; round < 100 && !executor.cancelled(); round++) compressAll(executor);
+            returned = std::chrono::steady_clock::now();
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        auto t0 = std::chrono::steady_clock::now();
+        executor.stop();
+        double stopMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        job.join();
+        double jobMs = std::chrono::duration<double, std::milli>(returned - t0).count();
+        printf("cancel: stop() returned in %.1f ms, running job returned in %.1f ms (one block is %.1f ms on one thread)\n",
+            stopMs, (std::max)(0.0, jobMs), base / blocks);
+        return 0;
+    }
+
+    // AsyncIo のキューの深さごとの速さを測る。file のランダムな位置を block KB ずつ読む。
+    // file が無ければ --mb の大きさで作る。--direct なら OS のキャッシュを通さない（SSD 自体の速さを見るとき）
+    // MMD がテクスチャなどを読むのに見立てた読み込みの遅延を、バックアップのコピーと並べて測る。
+    // コピーしないとき・そのままコピーするとき・帯域制限と低I/O優先度でコピーするときを比べる
+    int ioForeground(const fs::path& file, size_t blockSize, uint64_t blocks, uint8_t* buffer, bool direct,
+        size_t copyMb, uint64_t limitKBps, int seconds) {
+        // コピー元は読み込むファイルとは別にし、ページキャッシュに載ったものを読み合わないようにする
+        fs::path source = file;
+        source += L".copysrc";
+        fs::path target = file;
+        target += L".copydst";
+        std::error_code ec;
+        if (fs::file_size(source, ec) < copyMb * kIoChunkSize || ec) {
+            std::vector<uint8_t> chunk(kIoChunkSize);
+            uint32_t seed = 3;
+            for (auto& b : chunk) b = static_cast<uint8_t>((seed = seed * 1103515245u + 12345u) >> 24);
+            FILE* fp = fopen(WideToUtf8(source.wstring()).c_str(), "wb");
+            if (!fp) {
+                fprintf(stderr, "cannot create %s\n", WideToUtf8(source.wstring()).c_str());
+                return 1;
+            }
+            for (size_t i = 0; i < copyMb; i++) fwrite(chunk.data(), 1, chunk.size(), fp);
+            fclose(fp);
+        }
+
+        struct Scenario {
+            const char* name;
+            bool copy;
+            bool limited;   // TokenBucket と BackgroundIoScope（プラグインの自動バックアップと同じ）
+        };
+        const Scenario scenarios[] = { { "idle", false, false }, { "copy", true, false }, { "throttled", true, true } };
+        printf("foreground %zu KB random reads every 5 ms for %d s%s; backup copy of %zu MB, throttled at %llu KB/s\n",
+            blockSize / 1024, seconds, direct ? ", unbuffered" : " (page cache; use --direct for the device itself)", copyMb,
+            static_cast<unsigned long long>(limitKBps));
+        printf("%-10s %7s %10s %10s %10s %10s %10s\n", "scenario", "reads", "p50 us", "p99 us", "max us", "copy MB/s", "waited s");
+        for (const Scenario& scenario : scenarios) {
+            TokenBucket bucket;
+            bucket.configure(scenario.limited ? limitKBps * 1024 : 0, 4 * kIoChunkSize);
+            std::atomic<bool> copying(scenario.copy);
+            std::atomic<bool> copyFailed(false);
+            std::thread copier;
+            if (scenario.copy) {
+                copier = std::thread([&] {
+                    BackgroundIoScope lowPriority(scenario.limited);
+                    while (copying.load()) {
+                        if (!CopyFileThrottled(source, target, &bucket)) {
+                            copyFailed = true;
+                            return;
+                        }
+                    }
+                });
+            }
+
+            AsyncIo io(1);
+            AsyncFile in;
+            if (!io.open(file, AsyncIo::OpenMode::Read, in, direct)) {
+                copying = false;
+                bucket.cancel();
+                if (copier.joinable()) copier.join();
+                fprintf(stderr, "cannot open %s\n", WideToUtf8(file.wstring()).c_str());
+                return 1;
+            }
+            LatencyHistogram latency;
+            uint64_t state = 0x2545F4914F6CDD1Dull;
+            size_t failed = 0;
+            auto start = std::chrono::steady_clock::now();
+            auto deadline = start + std::chrono::seconds(seconds);
+            while (std::chrono::steady_clock::now() < deadline) {
+                state = state * 6364136223846793005ull + 1442695040888963407ull;
+                uint64_t offset = ((state >> 17) % blocks) * blockSize;
+                auto t0 = std::chrono::steady_clock::now();
+                io.read(in, offset, buffer, blockSize, [&](int64_t got) {
+                    if (got != static_cast<int64_t>(blockSize)) failed++;
+                });
+                io.drain();
+                latency.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - t0).count()));
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            uint64_t copied = bucket.bytesPassed();
+            // 待っている分はすぐ戻し、コピーの途中で止める
+            copying = false;
+            bucket.cancel();
+            if (copier.joinable()) copier.join();
+            in.close();
+            if (failed || copyFailed) {
+                fprintf(stderr, "%s\n", failed ? "foreground reads failed" : "backup copy failed");
+                return 1;
+            }
+            printf("%-10s %7llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", scenario.name, static_cast<unsigned long long>(latency.count()),
+                latency.percentileNs(0.5) / 1e3, latency.percentileNs(0.99) / 1e3, latency.maxNs() / 1e3,
+                copied / (1024.0 * 1024.0) / elapsed, bucket.throttledNs() / 1e9);
+        }
+        fs::remove(target, ec);
+        return 0;
+    }
+
+    int cmdIoBench(const std::vector<std::wstring>& args) {
+        if (args.empty()) { printUsage(); return 2; }
+        fs::path file(args[0]);
+        size_t blockKB = 64;
+        unsigned maxDepth = 32;
+        size_t count = 4096;
+        size_t mb = 256;
+        bool direct = false;
+        bool foreground = false;
+        size_t copyMb = 256;
+        uint64_t limitKBps = 20 * 1024;
+        int seconds = 5;
+        for (size_t i = 1; i < args.size(); i++) {
+            if (args[i] == L"--block" && i + 1 < args.size()) blockKB = static_cast<size_t>(atoi(WideToUtf8(args[++i]).c_str()));
+            else if (args[i] == L"--foreground") foreground = true;
+            else if (args[i] == L"--copy-mb" && i + 1 < args.size()) copyMb = static_cast<size_t>((std::max)(atoi(WideToUtf8(args[++i]).c_str()), 1));
+            else if (args[i] == L"--limit-kbps" && i + 1 < args.size()) limitKBps = static_cast<uint64_t>((std::max)(atoi(WideToUtf8(args[++i]).c_str()), 64));
+            else if (args[i] == L"--seconds" && i + 1 < args.size()) seconds = (std::max)(atoi(WideToUtf8(args[++i]).c_str()), 1);
+            else if (args[i] == L"--max-depth" && i + 1 < args.size()) maxDepth = static_cast<unsigned>(atoi(WideToUtf8(args[++i]).c_str()));
+            else if (args[i] == L"--count" && i + 1 < args.size()) count = static_cast<size_t>(atoi(WideToUtf8(args[++i]).c_str()));
+            else if (args[i] == L"--mb" && i + 1 < args.size()) mb = static_cast<size_t>(atoi(WideToUtf8(args[++i]).c_str()));
+            else if (args[i] == L"--direct") direct = true;
+            else { printUsage(); return 2; }
+        }
+        blockKB = (std::max)(size_t(4), blockKB / 4 * 4);  // --direct のため 4KB の倍数にする
+        maxDepth = (std::max)(1u, maxDepth);
+        count = (std::max)(size_t(1), count);
+        const size_t blockSize = blockKB * 1024;
+
+        std::error_code ec;
+        if (!fs::exists(file, ec)) {
+            std::vector<uint8_t> chunk(kIoChunkSize);
+            uint32_t seed = 1;
+            for (auto& b : chunk) b = static_cast<uint8_t>((seed = seed * 1103515245u + 12345u) >> 24);
+            FILE* fp = fopen(WideToUtf8(file.wstring()).c_str(), "wb");
+            if (!fp) {
+                fprintf(stderr, "cannot create %s\n", WideToUtf8(file.wstring()).c_str());
+                return 1;
+            }
+            for (size_t i = 0; i < mb; i++) fwrite(chunk.data(), 1, chunk.size(), fp);
+            fclose(fp);
+        }
+        uint64_t fileSize = fs::file_size(file, ec);
+        if (ec || fileSize < blockSize) {
+            fprintf(stderr, "%s is smaller than one block\n", WideToUtf8(file.wstring()).c_str());
+            return 1;
+        }
+        uint64_t blocks = fileSize / blockSize;
+
+        // O_DIRECT / FILE_FLAG_NO_BUFFERING はバッファも 4096 境界にそろえる
+        const size_t align = 4096;
+        std::vector<uint8_t> memory(static_cast<size_t>(maxDepth) * blockSize + align);
+        uint8_t* base = memory.data() + (align - reinterpret_cast<uintptr_t>(memory.data()) % align) % align;
+        if (foreground) return ioForeground(file, blockSize, blocks, base, direct, copyMb, limitKBps, seconds);
+
+        printf("%s, %s random reads of %zu KB x %zu%s\n", WideToUtf8(file.wstring()).c_str(), formatBytes(fileSize).c_str(),
+            blockKB, count, direct ? ", unbuffered" : " (page cache; use --direct for the device itself)");
+        printf("%-9s %6s %10s %10s %10s\n", "backend", "depth", "IOPS", "MB/s", "avg us");
+        std::vector<bool> kernelQueues;
+        kernelQueues.push_back(true);
+#ifndef _WIN32
+        kernelQueues.push_back(false);
+#endif
+        for (bool kernelQueue : kernelQueues) {
+            for (unsigned depth = 1; depth <= maxDepth; depth *= 2) {
+                AsyncIo io(depth, kernelQueue);
+                AsyncFile in;
+                if (!io.open(file, AsyncIo::OpenMode::Read, in, direct)) {
+                    fprintf(stderr, "cannot open %s\n", WideToUtf8(file.wstring()).c_str());
+                    return 1;
+                }
+                uint64_t state = 0x9E3779B97F4A7C15ull;
+                size_t issued = 0, failed = 0;
+                auto t0 = std::chrono::steady_clock::now();
+                std::function<void(unsigned)> issue = [&](unsigned slot) {
+                    if (issued >= count) return;
+                    issued++;
+                    state = state * 6364136223846793005ull + 1442695040888963407ull;
+                    uint64_t offset = ((state >> 17) % blocks) * blockSize;
+                    io.read(in, offset, base + static_cast<size_t>(slot) * blockSize, blockSize, [&, slot](int64_t got) {
+                        if (got != static_cast<int64_t>(blockSize)) failed++;
+                        issue(slot);
+                    });
+                };
+                for (unsigned slot = 0; slot < depth; slot++) issue(slot);
+                io.drain();
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+                if (failed) {
+                    fprintf(stderr, "%zu reads failed\n", failed);
+                    return 1;
+                }
+                printf("%-9s %6u %10.0f %10.1f %10.1f\n", io.backendName(), depth, count / seconds,
+                    count * blockSize / (1024.0 * 1024.0) / seconds, seconds * 1e6 / count * depth);
+            }
+        }
+        return 0;
+    }
+
+    // crashcheck・crash-worker の共通の引数（シーンの大きさと書き出し用の領域）
+    struct CrashScene {
+        SimulatorSettings settings;
+        int steps = 150;
+        int arenaMb = 64;
+    };
+
+    bool parseCrashScene(const std::vector<std::wstring>& args, size_t from, CrashScene& scene, int* runs) {
+        // 既定は数十万キーのシーン（長めの作品の途中くらい）
+        scene.settings.models = 6;
+        scene.settings.bones = 300;
+        scene.settings.morphs = 100;
+        scene.settings.editsPerStep = 2000;
+        for (size_t i = from; i < args.size(); i++) {
+            if (i + 1 >= args.size()) return false;
+            int v = atoi(WideToUtf8(args[i + 1]).c_str());
+            if (args[i] == L"--models") scene.settings.models = (std::min)((std::max)(v, 1), emergency::Scene::SlotCount);
+            else if (args[i] == L"--bones") scene.settings.bones = (std::max)(v, 1);
+            else if (args[i] == L"--morphs") scene.settings.morphs = (std::max)(v, 0);
+            else if (args[i] == L"--edits") scene.settings.editsPerStep = (std::max)(v, 0);
+            else if (args[i] == L"--steps") scene.steps = (std::max)(v, 0);
+            else if (args[i] == L"--arena") scene.arenaMb = (std::max)(v, 1);
+            else if (args[i] == L"--runs" && runs) *runs = (std::max)(v, 1);
+            else return false;
+            i++;
+        }
+        return true;
+    }
+
+    std::vector<std::wstring> crashSceneArgs(const CrashScene& scene) {
+        return { L"--models", std::to_wstring(scene.settings.models), L"--bones", std::to_wstring(scene.settings.bones),
+            L"--morphs", std::to_wstring(scene.settings.morphs), L"--edits", std::to_wstring(scene.settings.editsPerStep),
+            L"--steps", std::to_wstring(scene.steps), L"--arena", std::to_wstring(scene.arenaMb) };
+    }
+
+    // 書き出した緊急保存が最後まで読め、キーフレームが欠けていないか
+    bool checkDump(const fs::path& path, size_t expectedKeys, std::string& problem) {
+        emergency::Dump dump;
+        if (!emergency::Read(path, dump)) problem = "cannot be read";
+        else if (!dump.complete) problem = "directory missing (dump did not finish)";
+        else if (dump.keyframeCount() != expectedKeys) {
+            problem = std::to_string(dump.keyframeCount()) + " of " + std::to_string(expectedKeys) + " keyframes";
+        }
+        else return true;
+        return false;
+    }
+
+#ifdef _WIN32
+    const wchar_t* const kCrashModes[] = { L"access", L"raise", L"heap" };
+#else
+    const wchar_t* const kCrashModes[] = { L"access", L"abort" };
+#endif
+
+    // crashcheck から起動される1プロセス分。CrashGuard を張ってから落ちる
+    int cmdCrashWorker(const std::vector<std::wstring>& args) {
+        if (args.size() < 2) { printUsage(); return 2; }
+        CrashScene scene;
+        if (!parseCrashScene(args, 2, scene, nullptr)) { printUsage(); return 2; }
+        HostSimulator host(fs::path(args[0]) / L"crash.pmm", scene.settings);
+        for (int i = 0; i < scene.steps; i++) host.step();
+
+        emergency::Arena arena;
+        emergency::DumpWriter writer;
+        emergency::CrashGuard guard;
+        if (!arena.reserve(static_cast<size_t>(scene.arenaMb) * 1024 * 1024)) return 2;
+        writer.attach(arena.data(), arena.size());
+        if (!guard.arm(fs::path(args[0]) / (L"crash-" + args[1] + L".dump"), writer, host.dumpScene())) return 2;
+
+        const std::wstring& mode = args[1];
+#ifdef _WIN32
+        // エラー報告のダイアログを出さずに終わらせる
+        SetErrorMode(SEM_FAILCRITICALERRORS | SEM_NOGPFAULTERRORBOX);
+        if (mode == L"raise") RaiseException(0xE0000001, EXCEPTION_NONCONTINUABLE, 0, nullptr);
+        // ヒープ破損は未処理例外フィルタまで届かないことがあるので、ベクター例外の側で拾えることを見る
+        if (mode == L"heap") RaiseException(0xC0000374, EXCEPTION_NONCONTINUABLE, 0, nullptr);
+#else
+        if (mode == L"abort") abort();
+#endif
+        if (mode == L"access") {
+            volatile int* volatile target = nullptr;
+            *target = 1;
+        }
+        // 落ちなかった（呼び出し元は終了コード 0 を失敗として扱う）
+        return 0;
+    }
+
+    // 緊急保存の書き出しを、実際の大きさのシーンで測る。MMD のメモリの代わりに HostSimulator の
+    // シーンを、プラグインと同じ DumpWriter で先に確保した領域を通して書く。続けて子プロセスで
+    // CrashGuard を張ったまま落とし、例外フィルタ（Windows）・シグナル（それ以外）の経路で書けたかを見る
+    int cmdCrashCheck(const std::vector<std::wstring>& args) {
+        if (args.empty()) { printUsage(); return 2; }
+        fs::path dir(args[0]);
+        CrashScene scene;
+        int runs = 5;
+        if (!parseCrashScene(args, 1, scene, &runs)) { printUsage(); return 2; }
+        std::error_code ec;
+        fs::create_directories(dir, ec);
+
+        HostSimulator host(dir / L"crash.pmm", scene.settings);
+        for (int i = 0; i < scene.steps; i++) host.step();
+        size_t keys = host.keyframeCount();
+
+        emergency::Arena arena;
+        if (!arena.reserve(static_cast<size_t>(scene.arenaMb) * 1024 * 1024)) {
+            fprintf(stderr, "cannot reserve a %d MB arena\n", scene.arenaMb);
+            return 1;
+        }
+        emergency::DumpWriter writer;
+        writer.attach(arena.data(), arena.size());
+        printf("scene: %d models x %d bones, %zu keyframes; arena %d MB (largest section needs %.1f MB)\n",
+            scene.settings.models, scene.settings.bones, keys, scene.arenaMb, host.dumpArenaBytes() / (1024.0 * 1024.0));
+
+        int failed = 0;
+        fs::path path = dir / L"crashcheck.dump";
+        std::vector<double> ms;
+        uint64_t bytes = 0;
+        for (int r = 0; r < runs; r++) {
+            emergency::FileSink sink;
+            if (!sink.open(path)) {
+                fprintf(stderr, "cannot create %s\n", WideToUtf8(path.wstring()).c_str());
+                return 1;
+            }
+            uint32_t sections = 0;
+            bool truncated = false;
+            auto start = std::chrono::steady_clock::now();
+            bool ok = writer.write(sink, host.dumpScene(), static_cast<int64_t>(time(nullptr)), &sections, &truncated);
+            ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+            bytes = sink.size();
+            if (!ok || truncated) {
+                fprintf(stderr, "run %d: %s\n", r + 1, ok ? "truncated (arena too small)" : "write failed");
+                failed++;
+            }
+        }
+        std::sort(ms.begin(), ms.end());
+        std::string problem;
+        if (!checkDump(path, keys, problem)) {
+            fprintf(stderr, "dump: %s\n", problem.c_str());
+            failed++;
+        }
+        printf("direct: %s in %.1f ms median (min %.1f, max %.1f, %d runs)\n", formatBytes(bytes).c_str(),
+            ms[ms.size() / 2], ms.front(), ms.back(), runs);
+
+        for (const wchar_t* mode : kCrashModes) {
+            fs::path dumpPath = dir / (std::wstring(L"crash-") + mode + L".dump");
+            fs::remove(dumpPath, ec);
+            std::vector<std::wstring> argv = { L"crash-worker", dir.wstring(), mode };
+            for (const auto& a : crashSceneArgs(scene)) argv.push_back(a);
+            WorkerHandle handle;
+            if (!spawnSelf(argv, handle)) {
+                fprintf(stderr, "cannot start crash worker\n");
+                return 1;
+            }
+            int code = waitWorker(handle);
+            problem.clear();
+            if (code == 0) problem = "worker did not crash";
+            else if (code == 2) problem = "worker could not arm the handler";
+            else checkDump(dumpPath, keys, problem);
+            printf("crash %-7s %s\n", WideToUtf8(mode).c_str(), problem.empty() ? "dump complete" : problem.c_str());
+            if (!problem.empty()) failed++;
+        }
+
+        if (failed) {
+            fprintf(stderr, "FAILED: %d check(s)\n", failed);
+            return 1;
+        }
+        printf("OK\n");
+        return 0;
+    }
+
+    // 温まった後のバックアップ1回（名前の予約・コピー・一覧への登録・世代整理）でヒープを
+    // 確保しないことを確かめる。個別ファイル（Loose）で、上限を超えて毎回1つ消える状態まで回してから数える。
+    // 確保があれば 1 を返すので、CI で AUTOBACKUP_COUNT_ALLOCATIONS を付けて作ったものを走らせる
+    // alloccheck 用の MMD の代わり。プラグインの既定（KeyframeSnapshots=1, Thumbnails=1）と同じ付随ファイルを作る。
+    // 保存は MMD 側の仕事なので数えず、キーフレームの取り込みとサムネイルの書き出しはステージごとに数える
+    class AllocCheckHost : public BackupHost {
+    public:
+        // 読み戻したビューポートと同じ大きさ（幅 192 の 4 倍）で、GPU の後の 2 段を CPU で縮める
+        static const int ThumbLevels = 2;
+
+        explicit AllocCheckHost(HostSimulator& sim) : m_sim(sim) {
+            m_frame.width = 768;
+            m_frame.height = 432;
+            m_frame.pixels.resize(m_frame.stride() * m_frame.height);
+            for (size_t i = 0; i < m_frame.pixels.size(); i++) m_frame.pixels[i] = static_cast<uint8_t>(i * 7 + i / 3072);
+        }
+
+        bool requestSave() override {
+            uint64_t before = alloccount::Count();
+            bool ok = m_sim.save();
+            saveAllocations += alloccount::Count() - before;
+            return ok;
+        }
+        void stored(const fs::path& backupDir, const std::wstring& name) override {
+            uint64_t before = alloccount::Count();
+            BuildPath(m_thumbPath, backupDir, name, L".thumb.bmp");
+            if (!m_writer.write(m_frame, ThumbLevels, m_thumbPath)) thumbnailFailed = true;
+            thumbnailAllocations += alloccount::Count() - before;
+        }
+        bool captureKeyframes(std::vector<uint8_t>& image, int64_t now) override {
+            uint64_t before = alloccount::Count();
+            m_sim.snapshot(image, now);
+            keyframeAllocations += alloccount::Count() - before;
+            return true;
+        }
+
+        uint64_t saveAllocations = 0;       // MMD 側の保存なので数えない
+        uint64_t keyframeAllocations = 0;
+        uint64_t thumbnailAllocations = 0;
+        bool thumbnailFailed = false;
+
+    private:
+        HostSimulator& m_sim;
+        thumb::Image m_frame;
+        thumb::BmpWriter m_writer;
+        NativePath m_thumbPath;
+    };
+
+    int cmdAllocCheck(const std::vector<std::wstring>& args) {
+        if (args.empty()) { printUsage(); return 2; }
+        fs::path dir(args[0]);
+        int keep = 10;
+        int cycles = 0;
+        for (size_t i = 1; i < args.size(); i++) {
+            if (args[i] == L"--cycles" && i + 1 < args.size()) cycles = atoi(WideToUtf8(args[++i]).c_str());
+            else if (args[i] == L"--keep" && i + 1 < args.size()) keep = atoi(WideToUtf8(args[++i]).c_str());
+            else { printUsage(); return 2; }
+        }
+        keep = (std::max)(1, keep);
+        // 一覧は削除レコードが「生きている数の2倍 + 64」を超えると書き直すので、数える間に一度は書き直しが入るようにする
+        if (cycles <= 0) cycles = keep * 2 + 80;
+        if (!alloccount::Enabled()) {
+            fprintf(stderr, "built without AUTOBACKUP_COUNT_ALLOCATIONS; configure with -DAUTOBACKUP_COUNT_ALLOCATIONS=ON\n");
+            return 2;
+        }
+
+        std::error_code ec;
+        fs::remove_all(dir, ec);
+        fs::create_directories(dir, ec);
+        fs::path pmmPath = dir / L"alloccheck.pmm";
+        fs::path emmPath = dir / L"alloccheck.emm";
+        if (!writeAll(emmPath, std::vector<uint8_t>(4096, 0x5a))) {
+            fprintf(stderr, "cannot write %s\n", WideToUtf8(emmPath.wstring()).c_str());
+            return 1;
+        }
+        SimulatorSettings settings;
+        settings.seed = 7;
+        HostSimulator sim(pmmPath, settings);
+        AllocCheckHost host(sim);
+
+        BackupPolicy policy;
+        policy.usePackFiles = false;
+        policy.maxBackupFiles = keep;
+        BackupEngine engine(pmmPath, policy);
+        BackupCycle cycle;
+        BackupMetrics metrics;
+        // 同じ秒の名前にならないよう、1回ごとに時刻を1分進める
+        int64_t now = static_cast<int64_t>(time(nullptr)) / 60 * 60;
+
+        // シーンが大きくなればバッファは伸びるので、数える間は編集せず同じシーンを保存し続ける
+        uint64_t cycleAllocations = 0;
+        size_t removed = 0;
+        auto backup = [&](bool count) {
+            uint64_t before = alloccount::Count();
+            uint64_t hostBefore = host.saveAllocations + host.keyframeAllocations + host.thumbnailAllocations;
+            bool ok = cycle.run(host, engine, now, nullptr, true, metrics) && cycle.result().keyframes && !host.thumbnailFailed;
+            uint64_t hostAllocations = host.saveAllocations + host.keyframeAllocations + host.thumbnailAllocations - hostBefore;
+            if (count) {
+                cycleAllocations += alloccount::Count() - before - hostAllocations;
+                removed += engine.removedNames().size();
+            }
+            now += 60;
+            return ok;
+        };
+
+        // 上限まで溜め、一覧の書き直しも一度は通す
+        int warmup = keep * 3 + 80;
+        for (int i = 0; i < warmup; i++) {
+            if (i < 10) sim.step();
+            if (!backup(false)) {
+                fprintf(stderr, "backup failed during warm-up: %s\n", cycle.result().error.c_str());
+                return 1;
+            }
+        }
+        host.keyframeAllocations = host.thumbnailAllocations = 0;
+        for (int i = 0; i < cycles; i++) {
+            if (!backup(true)) {
+                fprintf(stderr, "backup failed: %s\n", cycle.result().error.c_str());
+                return 1;
+            }
+        }
+
+        uint64_t pmmSize = fs::file_size(pmmPath, ec);
+        printf("%d warm loose backup cycles (keep %d, %zu removed, %s per copy, .kfs %s of %s, %s):\n", cycles, keep, removed,
+            formatBytes(pmmSize).c_str(), formatBytes(cycle.result().kfsBytes).c_str(), formatBytes(cycle.result().kfsRaw).c_str(),
+            SharedAsyncIo().backendName());
+        printf("  %-10s %llu allocations\n", "cycle", static_cast<unsigned long long>(cycleAllocations));
+        printf("  %-10s %llu allocations\n", "keyframes", static_cast<unsigned long long>(host.keyframeAllocations));
+        printf("  %-10s %llu allocations\n", "thumbnail", static_cast<unsigned long long>(host.thumbnailAllocations));
+        uint64_t total = cycleAllocations + host.keyframeAllocations + host.thumbnailAllocations;
+
+        BackupCatalog catalog(engine.backupDir(), engine.stem());
+        if (!catalog.load() || catalog.entries().size() != static_cast<size_t>(keep) || removed != static_cast<size_t>(cycles)) {
+            fprintf(stderr, "unexpected state: %zu cataloged, %zu removed\n", catalog.entries().size(), removed);
+            return 1;
+        }
+        for (const auto& e : catalog.entries()) {
+            if (!catalog.verify(e) || e.pmmSize != pmmSize || e.emmSize != 4096 || e.sketch.models.empty()) {
+                fprintf(stderr, "%s does not match the source\n", e.name.c_str());
+                return 1;
+            }
+            // 一覧の要約（image から直接作ったもの）が、.kfs を読み戻して作ったものと同じこと
+            emergency::Dump dump;
+            SceneSketch reread;
+            if (emergency::Read(engine.backupDir() / (Utf8ToWide(e.name) + L".kfs"), dump)) reread = SketchScene(dump);
+            bool sameSketch = reread.models.size() == e.sketch.models.size();
+            for (size_t m = 0; sameSketch && m < reread.models.size(); m++) {
+                const ModelSketch& a = reread.models[m];
+                const ModelSketch& b = e.sketch.models[m];
+                sameSketch = a.name == b.name && a.keyframes == b.keyframes && a.digest == b.digest && memcmp(a.mins, b.mins, sizeof(a.mins)) == 0;
+            }
+            if (!sameSketch) {
+                fprintf(stderr, "%s: the cataloged sketch differs from its .kfs\n", e.name.c_str());
+                return 1;
+            }
+        }
+        // 世代整理で消えたバックアップの付随ファイルも残っていないこと
+        size_t kfsFiles = 0;
+        size_t thumbFiles = 0;
+        for (const auto& file : fs::directory_iterator(engine.backupDir())) {
+            std::wstring name = file.path().filename().wstring();
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, L".kfs") == 0) kfsFiles++;
+            if (name.size() > 10 && name.compare(name.size() - 10, 10, L".thumb.bmp") == 0) thumbFiles++;
+        }
+        if (kfsFiles != static_cast<size_t>(keep) || thumbFiles != static_cast<size_t>(keep)) {
+            fprintf(stderr, "unexpected attachments: %zu .kfs, %zu .thumb.bmp\n", kfsFiles, thumbFiles);
+            return 1;
+        }
+        if (total > 0) {
+            fprintf(stderr, "FAILED: warm backup cycles allocated %llu times\n", static_cast<unsigned long long>(total));
+            return 1;
+        }
+        printf("OK: no allocations\n");
+        return 0;
+    }
+
+    // 公開されている値を JSON の文字列にする（プロジェクト名に引用符などが入ることがある）
+    std::string jsonString(const std::string& s) {
+        std::string out = "\"";
+        for (unsigned char c : s) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += static_cast<char>(c);
+            }
+            else if (c < 0x20) {
+                char esc[8];
+                snprintf(esc, sizeof(esc), "\\u%04x", c);
+                out += esc;
+            }
+            else {
+                out += static_cast<char>(c);
+            }
+        }
+        return out + "\"";
+    }
+
+    int64_t unixMsNow() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // 動いている AutoBackup が公開している値を一定間隔で読む。
+    // 監視用のエージェントから使うときは --json（1回の読み取りで1行）
+    int cmdWatch(const std::vector<std::wstring>& args) {
+        int intervalMs = 1000;
+        int count = 0;
+        bool json = false;
+        for (size_t i = 0; i < args.size(); i++) {
+            if (args[i] == L"--json") {
+                json = true;
+                continue;
+            }
+            if (i + 1 >= args.size()) { printUsage(); return 2; }
+            int n = atoi(WideToUtf8(args[++i]).c_str());
+            if (args[i - 1] == L"--interval") intervalMs = (std::max)(n, 10);
+            else if (args[i - 1] == L"--count") count = (std::max)(n, 0);
+            else { printUsage(); return 2; }
+        }
+
+        // 公開していると見なす更新間隔（ワーカースレッドはおよそ1秒ごとに更新する）
+        const int64_t aliveMs = 10 * 1000;
+        LiveMetricsReader reader;
+        bool opened = false;
+        std::string error;
+        std::string lastError;
+        std::vector<live::Snapshot> snapshots;
+        for (int poll = 0; count == 0 || poll < count; poll++) {
+            if (poll > 0) std::this_thread::sleep_for(std::chrono::milliseconds(intervalMs));
+            // 読み始めてから起動した MMD も拾えるよう、開けるまで毎回試す
+            if (!opened) {
+                opened = reader.open(error);
+                if (!opened && error != lastError) {
+                    fprintf(stderr, "%s\n", error.c_str());
+                    lastError = error;
+                }
+            }
+            snapshots.clear();
+            if (opened) reader.read(snapshots);
+            int64_t nowMs = unixMsNow();
+
+            if (json) {
+                printf("{\"time\":%lld,\"instances\":[", static_cast<long long>(nowMs));
+                for (size_t i = 0; i < snapshots.size(); i++) {
+                    const live::Snapshot& snap = snapshots[i];
+                    printf("%s{\"slot\":%u,\"pid\":%llu,\"project\":%s", i ? "," : "", snap.slot,
+                        static_cast<unsigned long long>(snap.pid), jsonString(snap.project).c_str());
+                    for (uint32_t f = 0; f < live::FieldCount; f++) {
+                        printf(",\"%s\":%llu", live::FieldName(static_cast<live::Field>(f)), static_cast<unsigned long long>(snap.values[f]));
+                    }
+                    uint64_t written = snap.values[live::BytesWritten];
+                    printf(",\"dedupRatio\":%.3f,\"alive\":%s}", written ? static_cast<double>(snap.values[live::SourceBytes]) / written : 0.0,
+                        nowMs - static_cast<int64_t>(snap.values[live::UpdatedMs]) < aliveMs ? "true" : "false");
+                }
+                printf("]}\n");
+                fflush(stdout);
+                continue;
+            }
+
+            printf("%s  %zu instance(s)\n", formatTime(nowMs / 1000).c_str(), snapshots.size());
+            if (snapshots.empty()) continue;
+            printf("%4s %8s %-24s %-19s %9s %7s %5s %10s %6s %5s %10s %8s\n", "slot", "pid", "project", "last backup", "took ms",
+                "backups", "fail", "written", "ratio", "queue", "throttled", "updated");
+            for (const live::Snapshot& snap : snapshots) {
+                const uint64_t* v = snap.values;
+                std::string last = v[live::LastBackupTime] ? formatTime(static_cast<int64_t>(v[live::LastBackupTime])) : "-";
+                int64_t age = nowMs - static_cast<int64_t>(v[live::UpdatedMs]);
+                char updated[32];
+                if (age < aliveMs) snprintf(updated, sizeof(updated), "%.1fs", (std::max)(age, static_cast<int64_t>(0)) / 1000.0);
+                else snprintf(updated, sizeof(updated), "stale");
+                printf("%4u %8llu %-24.24s %-19s %9.1f %7llu %5llu %10s %6.2f %5llu %9.1fs %8s\n", snap.slot,
+                    static_cast<unsigned long long>(snap.pid), snap.project.empty() ? "-" : snap.project.c_str(), last.c_str(),
+                    v[live::LastBackupNs] / 1e6, static_cast<unsigned long long>(v[live::Backups]),
+                    static_cast<unsigned long long>(v[live::Failures]), formatBytes(v[live::BytesWritten]).c_str(),
+                    v[live::BytesWritten] ? static_cast<double>(v[live::SourceBytes]) / v[live::BytesWritten] : 0.0,
+                    static_cast<unsigned long long>(v[live::QueueDepth]), v[live::ThrottledNs] / 1e9, updated);
+            }
+            fflush(stdout);
+        }
+        return opened ? 0 : 1;
+    }
+
+    // 公開1回の時間と、読み手が書きかけの値を受け取らないことを確かめる。
+    // 書き手は backupFinished(n, n, 1, 1) を繰り返すので、正しく読めた値は5項目がすべて同じになる
+    // 段階の計測1回（StageTimer の時刻2回とヒストグラム・トレースへの記録）の所要時間と、
+    // 書き出し中にリングが一周しても壊れたイベントが出ないことを確かめる
+    int cmdTraceBench(const std::vector<std::wstring>& args) {
+        int seconds = 2;
+        for (size_t i = 0; i < args.size(); i++) {
+            if (args[i] == L"--seconds" && i + 1 < args.size()) seconds = (std::max)(atoi(WideToUtf8(args[++i]).c_str()), 1);
+            else { printUsage(); return 2; }
+        }
+        const double budgetNs = 1000.0;
+
+        // 1スレッドと、全段階を同じヒストグラムに記録して取り合う複数スレッド
+        std::unique_ptr<BackupMetrics> metrics(new BackupMetrics());
+        const uint64_t perThread = 2 * 1000 * 1000;
+        double worstNs = 0;
+        for (unsigned threads : { 1u, (std::max)(2u, (std::min)(std::thread::hardware_concurrency(), 8u)) }) {
+            std::vector<std::thread> workers;
+            auto start = std::chrono::steady_clock::now();
+            for (unsigned t = 0; t < threads; t++) {
+                workers.emplace_back([&] {
+                    for (uint64_t n = 0; n < perThread; n++) {
+                        StageTimer timer(*metrics, BackupStage::Copy);
+                    }
+                });
+            }
+            for (auto& w : workers) w.join();
+            // スレッドごとの1回あたり（並列に走るので、経過時間をスレッドあたりの回数で割る）
+            double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / perThread;
+            printf("record: %.1f ns per event on %u thread%s\n", ns, threads, threads > 1 ? "s" : "");
+            worstNs = (std::max)(worstNs, ns);
+        }
+
+        // 書き手2つがリングを回し続ける間に読み手が列挙し、書きかけのイベントが混ざらないか
+        std::unique_ptr<TraceRing> ring(new TraceRing());
+        std::atomic<bool> writing(true);
+        std::vector<std::thread> writers;
+        for (uint64_t t = 0; t < 2; t++) {
+            writers.emplace_back([&, t] {
+                for (uint64_t n = t; writing.load(std::memory_order_relaxed); n += 2) {
+                    ring->push(static_cast<BackupStage>(n % static_cast<uint64_t>(BackupStage::Count)), static_cast<uint32_t>(n), n, 2 * n + 1);
+                }
+            });
+        }
+        uint64_t events = 0;
+        uint64_t torn = 0;
+        uint64_t dumps = 0;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+        while (std::chrono::steady_clock::now() < deadline) {
+            ring->forEach([&](BackupStage stage, uint32_t tid, uint64_t startNs, uint64_t durNs) {
+                events++;
+                if (static_cast<uint64_t>(stage) != startNs % static_cast<uint64_t>(BackupStage::Count) ||
+                    tid != static_cast<uint32_t>(startNs) || durNs != 2 * startNs + 1) {
+                    torn++;
+                }
+            });
+            dumps++;
+        }
+        writing = false;
+        for (auto& w : writers) w.join();
+
+        printf("trace: %llu dumps while the ring wrapped, %llu events, %llu torn\n", static_cast<unsigned long long>(dumps),
+            static_cast<unsigned long long>(events), static_cast<unsigned long long>(torn));
+        if (torn > 0 || events == 0) {
+            fprintf(stderr, "FAILED: %s\n", torn > 0 ? "a dump saw a partially written event" : "the dump never saw an event");
+            return 1;
+        }
+        if (worstNs >= budgetNs) {
+            fprintf(stderr, "FAILED: recording took %.1f ns per event (budget %.0f ns)\n", worstNs, budgetNs);
+            return 1;
+        }
+        printf("OK\n");
+        return 0;
+    }
+
+    int cmdMetricsBench(const std::vector<std::wstring>& args) {
+        int seconds = 2;
+        for (size_t i = 0; i < args.size(); i++) {
+            if (args[i] == L"--seconds" && i + 1 < args.size()) seconds = (std::max)(atoi(WideToUtf8(args[++i]).c_str()), 1);
+            else { printUsage(); return 2; }
+        }
+
+        LiveMetricsPublisher publisher;
+        if (!publisher.open()) {
+            fprintf(stderr, "cannot publish metrics (shared memory unavailable or all slots taken)\n");
+            return 1;
+        }
+        publisher.setProject("metricsbench");
+        uint32_t slot = publisher.slotIndex();
+        std::string error;
+        LiveMetricsReader reader;
+        if (!reader.open(error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+
+        // 読み手のいないときの1回あたり
+        const uint64_t quietUpdates = 10 * 1000 * 1000;
+        uint64_t n = 0;
+        auto start = std::chrono::steady_clock::now();
+        while (n < quietUpdates) {
+            n++;
+            publisher.backupFinished(static_cast<int64_t>(n), n, 1, 1);
+        }
+        double quietNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / quietUpdates;
+
+        // 読み手が読み続けている間の1回あたりと、読み取りの整合
+        std::atomic<bool> writing(true);
+        uint64_t reads = 0;
+        uint64_t torn = 0;
+        uint64_t missed = 0;
+        std::thread readerThread([&] {
+            std::vector<live::Snapshot> snapshots;
+            uint64_t previous = 0;
+            while (writing.load(std::memory_order_relaxed)) {
+                reader.read(snapshots);
+                bool found = false;
+                for (const live::Snapshot& snap : snapshots) {
+                    if (snap.slot != slot) continue;
+                    found = true;
+                    const uint64_t* v = snap.values;
+                    uint64_t backups = v[live::Backups];
+                    if (v[live::LastBackupTime] != backups || v[live::LastBackupNs] != backups || v[live::BytesWritten] != backups ||
+                        v[live::SourceBytes] != backups || backups < previous || snap.project != "metricsbench") {
+                        torn++;
+                    }
+                    previous = backups;
+                }
+                if (found) reads++;
+                else missed++;
+            }
+        });
+        uint64_t contendedStart = n;
+        start = std::chrono::steady_clock::now();
+        auto deadline = start + std::chrono::seconds(seconds);
+        while (std::chrono::steady_clock::now() < deadline) {
+            for (int i = 0; i < 1000; i++) {
+                n++;
+                publisher.backupFinished(static_cast<int64_t>(n), n, 1, 1);
+            }
+        }
+        double contendedNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (n - contendedStart);
+        writing = false;
+        readerThread.join();
+
+        printf("update: %.1f ns without readers, %.1f ns while a reader polls (%llu updates)\n", quietNs, contendedNs,
+            static_cast<unsigned long long>(n));
+        printf("reader: %llu consistent reads, %llu torn, %llu skipped while being written\n", static_cast<unsigned long long>(reads - torn),
+            static_cast<unsigned long long>(torn), static_cast<unsigned long long>(missed));
+        if (torn > 0 || reads == 0) {
+            fprintf(stderr, "FAILED: %s\n", torn > 0 ? "a reader saw a partially written update" : "the reader never saw the slot");
+            return 1;
+        }
+        printf("OK\n");
+        return 0;
+    }
+
+    int run(const std::vector<std::wstring>& argv) {
+        if (argv.empty()) { printUsage(); return 2; }
+        std::vector<std::wstring> args(argv.begin() + 1, argv.end());
+        if (argv[0] == L"list") return cmdList(args);
+        if (argv[0] == L"extract") return cmdExtract(args);
+        if (argv[0] == L"at") return cmdAt(args);
+        if (argv[0] == L"similar") return cmdSimilar(args);
+        if (argv[0] == L"codec") return cmdCodec(args);
+        if (argv[0] == L"codeccheck") return cmdCodecCheck(args);
+        if (argv[0] == L"simulate") return cmdSimulate(args);
+        if (argv[0] == L"replay") return cmdReplay(args);
+        if (argv[0] == L"stats") return cmdStats(args);
+        if (argv[0] == L"verify") return cmdVerify(args);
+        if (argv[0] == L"restore") return cmdRestore(args);
+        if (argv[0] == L"diff") return cmdDiff(args);
+        if (argv[0] == L"gc") return cmdGc(args);
+        if (argv[0] == L"compact") return cmdCompact(args);
+        if (argv[0] == L"import") return cmdImport(args);
+        if (argv[0] == L"stress") return cmdStress(args);
+        if (argv[0] == L"stress-worker") return cmdStressWorker(args);
+        if (argv[0] == L"scale") return cmdScale(args);
+        if (argv[0] == L"iobench") return cmdIoBench(args);
+        if (argv[0] == L"crashcheck") return cmdCrashCheck(args);
+        if (argv[0] == L"crash-worker") return cmdCrashWorker(args);
+        if (argv[0] == L"alloccheck") return cmdAllocCheck(args);
+        if (argv[0] == L"thumbcheck") return cmdThumbCheck(args);
+        if (argv[0] == L"packcheck") return cmdPackCheck(args);
+        if (argv[0] == L"watch") return cmdWatch(args);
+        if (argv[0] == L"metricsbench") return cmdMetricsBench(args);
+        if (argv[0] == L"tracebench") return cmdTraceBench(args);
+        printUsage();
+        return 2;
+    }
+}
+
+#ifdef _WIN32
+int wmain(int argc, wchar_t** argv) {
+    SetConsoleOutputCP(CP_UTF8);
+    std::vector<std::wstring> args;
+    for (int i = 1; i < argc; i++) args.push_back(argv[i]);
+    return run(args);
+}
+#else
+int main(int argc, char** argv) {
+    std::vector<std::wstring> args;
+    for (int i = 1; i < argc; i++) args.push_back(Utf8ToWide(argv[i]));
+    return run(args);
+}
+#endif
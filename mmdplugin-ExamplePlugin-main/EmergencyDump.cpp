@@ -0,0 +1,317 @@
+﻿#include "EmergencyDump.h"
+#include "BackupFormat.h"
+#include "KeyframeCodec.h"
+#include <algorithm>
+#include <fstream>
+
+// ヘッダ:      magic, version, time(i64), nowFrame(i32), 予約, dirOffset(u64), sectionCount, 予約, 予約(u64)
+//              続けて pmm のパス (u16 文字数 + UTF-16)
+// セクション:  magic, kind, index, flags, size(u64, ヘッダを除く) + 本体
+//   カメラ:    count, { frame, 距離, xyz, rxyz, 補間(MMD内部の24バイト), パース, 視野角 }...
+//   モデル:    名前, パス, ボーン数, { 名前, count, { frame, xyz, クォータニオン, 補間x1 y1 x2 y2 }... }...
+//              モーフ数, { 名前, count, { frame, 値 }... }...
+//              表示・IK count, { frame, 表示, IK数, IKのON/OFF... }...
+// ディレクトリ: magic, count, { kind, index, offset(u64), size(u64, ヘッダ込み), flags }...
+//
+// バックアップごとの .kfs は KeyframeCodec で圧縮して保存するので、ファイルから読むときは展開してから扱う。
+
+namespace emergency {
+
+namespace {
+    std::string readName(ByteReader& r) {
+        uint16_t n = r.u16();
+        const uint8_t* p = r.skip(n);
+        return p ? std::string(reinterpret_cast<const char*>(p), n) : std::string();
+    }
+
+    std::wstring readUtf16(ByteReader& r) {
+        uint16_t n = r.u16();
+        std::wstring s;
+        s.reserve(n);
+        for (uint16_t i = 0; i < n && r.ok(); i++) s += static_cast<wchar_t>(r.u16());
+        return s;
+    }
+
+    void readCamera(ByteReader& r, VmdMotion& motion) {
+        motion.modelName = VmdCameraModelName;
+        uint32_t count = r.u32();
+        for (uint32_t i = 0; i < count && r.ok(); i++) {
+            VmdCameraFrame f;
+            f.frame = static_cast<uint32_t>(r.u32());
+            f.distance = r.f32();
+            for (float& v : f.position) v = r.f32();
+            for (float& v : f.rotation) v = r.f32();
+            uint8_t hokan[4][6];
+            r.raw(hokan, sizeof(hokan));
+            // MMD 内部は (ax[6], ay[6], bx[6], by[6])、VMD は曲線ごとに (ax, bx, ay, by)
+            for (int c = 0; c < 6; c++) {
+                f.interpolation[c * 4 + 0] = hokan[0][c];
+                f.interpolation[c * 4 + 1] = hokan[2][c];
+                f.interpolation[c * 4 + 2] = hokan[1][c];
+                f.interpolation[c * 4 + 3] = hokan[3][c];
+            }
+            f.perspectiveOff = r.u32() ? 0 : 1;
+            f.viewAngle = r.u32();
+            if (r.ok()) motion.cameras.push_back(f);
+        }
+    }
+
+    void readModel(ByteReader& r, Model& model) {
+        model.name = readName(r);
+        model.filePath = readUtf16(r);
+        model.motion.modelName = model.name;
+
+        uint32_t boneCount = r.u32();
+        for (uint32_t b = 0; b < boneCount && r.ok(); b++) {
+            std::string name = readName(r);
+            uint32_t count = r.u32();
+            for (uint32_t i = 0; i < count && r.ok(); i++) {
+                VmdBoneFrame f;
+                f.name = name;
+                f.frame = r.u32();
+                for (float& v : f.position) v = r.f32();
+                for (float& v : f.rotation) v = r.f32();
+                uint8_t curve[4][4];
+                r.raw(curve, sizeof(curve));
+                VmdMakeBoneInterpolation(curve[0], curve[1], curve[2], curve[3], f.interpolation);
+                if (r.ok()) model.motion.bones.push_back(f);
+            }
+        }
+
+        uint32_t morphCount = r.u32();
+        for (uint32_t m = 0; m < morphCount && r.ok(); m++) {
+            std::string name = readName(r);
+            uint32_t count = r.u32();
+            for (uint32_t i = 0; i < count && r.ok(); i++) {
+                VmdMorphFrame f;
+                f.name = name;
+                f.frame = r.u32();
+                f.weight = r.f32();
+                if (r.ok()) model.motion.morphs.push_back(f);
+            }
+        }
+
+        // IK の名前は MMD 内部から取れないので、表示の ON/OFF だけを復元する
+        uint32_t configCount = r.u32();
+        for (uint32_t i = 0; i < configCount && r.ok(); i++) {
+            VmdShowIkFrame f;
+            f.frame = r.u32();
+            f.show = r.u8();
+            uint32_t ikCount = r.u32();
+            r.skip(ikCount);
+            if (r.ok()) model.motion.showIk.push_back(f);
+        }
+    }
+
+    bool readSection(const uint8_t* data, uint64_t dataSize, uint64_t offset, Dump& dump, uint64_t& next) {
+        if (offset + SectionHeaderSize > dataSize) return false;
+        ByteReader h(data + offset, SectionHeaderSize);
+        if (h.u32() != SectionMagic) return false;
+        uint32_t kind = h.u32();
+        uint32_t index = h.u32();
+        uint32_t flags = h.u32();
+        uint64_t size = h.u64();
+        if (size > dataSize - offset - SectionHeaderSize) return false;
+        next = offset + SectionHeaderSize + size;
+
+        ByteReader r(data + offset + SectionHeaderSize, static_cast<size_t>(size));
+        if (kind == SectionCamera) {
+            dump.cameraFlags = flags;
+            readCamera(r, dump.camera);
+        }
+        else if (kind == SectionModel) {
+            Model model;
+            model.index = index;
+            model.flags = flags;
+            readModel(r, model);
+            dump.models.push_back(model);
+        }
+        return true;
+    }
+
+    // ファイルを読み、KeyframeCodec で圧縮されていれば展開する
+    bool loadFile(const fs::path& path, std::vector<uint8_t>& data) {
+        std::ifstream in(path.c_str(), std::ios::binary);
+        if (!in.is_open()) return false;
+        data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        if (!kfc::IsEncoded(data.data(), data.size())) return true;
+        std::vector<uint8_t> raw;
+        if (!kfc::Decode(data.data(), data.size(), raw)) return false;
+        data.swap(raw);
+        return true;
+    }
+
+    // モデルのセクションの先頭から名前とパスだけを読む
+    void readModelHead(const uint8_t* body, size_t size, SectionInfo& info) {
+        ByteReader r(body, size);
+        info.name = readName(r);
+        info.filePath = readUtf16(r);
+    }
+}
+
+size_t Dump::keyframeCount() const {
+    size_t n = camera.cameras.size();
+    for (const auto& m : models) n += m.motion.bones.size() + m.motion.morphs.size() + m.motion.showIk.size();
+    return n;
+}
+
+bool Read(const fs::path& path, Dump& dump) {
+    dump = Dump();
+    std::vector<uint8_t> data;
+    if (!loadFile(path, data)) return false;
+    return Read(data.data(), data.size(), dump);
+}
+
+bool Read(const uint8_t* data, size_t size, Dump& dump) {
+    dump = Dump();
+    if (size < HeaderSize) return false;
+
+    ByteReader h(data, size);
+    if (h.u32() != FileMagic || h.u32() != Version) return false;
+    dump.time = h.i64();
+    dump.nowFrame = static_cast<int32_t>(h.u32());
+    h.u32();
+    uint64_t dirOffset = h.u64();
+    uint32_t sectionCount = h.u32();
+    h.u32();
+    h.u64();
+    dump.pmmPath = readUtf16(h);
+    if (!h.ok()) return false;
+    uint64_t firstSection = h.pos();
+
+    // ディレクトリがそろっていればそれを使う
+    if (dirOffset >= firstSection && dirOffset + 8 <= size) {
+        ByteReader d(data + dirOffset, static_cast<size_t>(size - dirOffset));
+        if (d.u32() == DirMagic && d.u32() == sectionCount) {
+            bool ok = true;
+            for (uint32_t i = 0; i < sectionCount && ok; i++) {
+                d.u32();
+                d.u32();
+                uint64_t offset = d.u64();
+                d.u64();
+                d.u32();
+                uint64_t next;
+                ok = d.ok() && readSection(data, size, offset, dump, next);
+            }
+            if (ok) {
+                dump.complete = true;
+                return true;
+            }
+            dump.camera = VmdMotion();
+            dump.models.clear();
+        }
+    }
+
+    // 途中で止まったファイルは先頭から辿れるところまで読む
+    uint64_t pos = firstSection;
+    uint64_t next = 0;
+    while (readSection(data, size, pos, dump, next)) pos = next;
+    return !dump.models.empty() || !dump.camera.cameras.empty();
+}
+
+bool ReadDirectory(const fs::path& path, std::vector<SectionInfo>& sections) {
+    sections.clear();
+    std::ifstream in(path.c_str(), std::ios::binary);
+    if (!in.is_open()) return false;
+
+    uint8_t header[HeaderSize];
+    if (!in.read(reinterpret_cast<char*>(header), sizeof(header))) return false;
+    if (kfc::IsEncoded(header, sizeof(header))) {
+        // 圧縮されたものは全体を展開してから読む
+        in.close();
+        std::vector<uint8_t> data;
+        return loadFile(path, data) && ReadDirectory(data.data(), data.size(), sections);
+    }
+    ByteReader h(header, sizeof(header));
+    if (h.u32() != FileMagic || h.u32() != Version) return false;
+    h.i64();
+    h.u32();
+    h.u32();
+    uint64_t dirOffset = h.u64();
+    uint32_t sectionCount = h.u32();
+    if (dirOffset < HeaderSize || sectionCount > 0x10000) return false;
+
+    const size_t entrySize = 28;
+    std::vector<uint8_t> dir(8 + static_cast<size_t>(sectionCount) * entrySize);
+    in.seekg(static_cast<std::streamoff>(dirOffset));
+    if (!in.read(reinterpret_cast<char*>(dir.data()), static_cast<std::streamsize>(dir.size()))) return false;
+    ByteReader d(dir.data(), dir.size());
+    if (d.u32() != DirMagic || d.u32() != sectionCount) return false;
+
+    for (uint32_t i = 0; i < sectionCount; i++) {
+        SectionInfo info;
+        info.kind = d.u32();
+        info.index = d.u32();
+        info.offset = d.u64();
+        info.size = d.u64();
+        info.flags = d.u32();
+        if (info.size < SectionHeaderSize) return false;
+
+        // モデルは名前とパスだけを先頭から読む（名前 u16+最大50、パス u16+最大256文字）
+        if (info.kind == SectionModel) {
+            uint8_t head[2 + 50 + 2 + 512];
+            size_t want = static_cast<size_t>(std::min<uint64_t>(sizeof(head), info.size - SectionHeaderSize));
+            in.seekg(static_cast<std::streamoff>(info.offset + SectionHeaderSize));
+            if (!in.read(reinterpret_cast<char*>(head), static_cast<std::streamsize>(want))) return false;
+            readModelHead(head, want, info);
+        }
+        sections.push_back(info);
+    }
+    return d.ok();
+}
+
+bool ReadSection(const fs::path& path, const SectionInfo& section, Dump& dump) {
+    std::ifstream in(path.c_str(), std::ios::binary);
+    if (!in.is_open()) return false;
+    uint8_t magic[4] = {};
+    in.read(reinterpret_cast<char*>(magic), sizeof(magic));
+    if (kfc::IsEncoded(magic, sizeof(magic))) {
+        in.close();
+        std::vector<uint8_t> data;
+        return loadFile(path, data) && ReadSection(data.data(), data.size(), section, dump);
+    }
+    in.clear();
+    std::vector<uint8_t> data(static_cast<size_t>(section.size));
+    in.seekg(static_cast<std::streamoff>(section.offset));
+    if (!in.read(reinterpret_cast<char*>(data.data()), static_cast<std::streamsize>(data.size()))) return false;
+    uint64_t next = 0;
+    return readSection(data.data(), data.size(), 0, dump, next);
+}
+
+bool ReadDirectory(const uint8_t* data, size_t size, std::vector<SectionInfo>& sections) {
+    sections.clear();
+    if (size < HeaderSize) return false;
+    ByteReader h(data, HeaderSize);
+    if (h.u32() != FileMagic || h.u32() != Version) return false;
+    h.i64();
+    h.u32();
+    h.u32();
+    uint64_t dirOffset = h.u64();
+    uint32_t sectionCount = h.u32();
+    if (dirOffset < HeaderSize || dirOffset > size || sectionCount > 0x10000) return false;
+
+    ByteReader d(data + dirOffset, static_cast<size_t>(size - dirOffset));
+    if (d.u32() != DirMagic || d.u32() != sectionCount) return false;
+    for (uint32_t i = 0; i < sectionCount; i++) {
+        SectionInfo info;
+        info.kind = d.u32();
+        info.index = d.u32();
+        info.offset = d.u64();
+        info.size = d.u64();
+        info.flags = d.u32();
+        if (!d.ok() || info.size < SectionHeaderSize || info.offset > size || info.size > size - info.offset) return false;
+        if (info.kind == SectionModel) {
+            readModelHead(data + info.offset + SectionHeaderSize, static_cast<size_t>(info.size - SectionHeaderSize), info);
+        }
+        sections.push_back(info);
+    }
+    return true;
+}
+
+bool ReadSection(const uint8_t* data, size_t size, const SectionInfo& section, Dump& dump) {
+    if (section.offset > size || section.size > size - section.offset) return false;
+    uint64_t next = 0;
+    return readSection(data + section.offset, section.size, 0, dump, next);
+}
+
+}
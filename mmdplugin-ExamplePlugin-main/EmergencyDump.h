@@ -0,0 +1,127 @@
+﻿#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <experimental/filesystem>
+#include "VmdFile.h"
+
+namespace fs = std::experimental::filesystem;
+
+// 緊急保存ファイル（MMD が異常終了したときのキーフレーム）
+//
+//   [ヘッダ(48バイト)][セクション]...[ディレクトリ]
+//
+// セクションはカメラ1つとモデルごとに1つ。各セクションは先頭に自分の種類とサイズを持つので、
+// 書き出し途中で止まってディレクトリが無くても先頭から辿れる。
+// ディレクトリとヘッダのオフセットは最後に書き、そろっていれば完全なファイルとみなす。
+
+namespace emergency {
+    const uint32_t FileMagic = 0x44454241;      // "ABED"
+    const uint32_t SectionMagic = 0x53454241;   // "ABES"
+    const uint32_t DirMagic = 0x44444241;       // "ABDD"
+    const uint32_t Version = 1;
+    const uint32_t HeaderSize = 48;
+    const uint32_t SectionHeaderSize = 24;
+
+    enum SectionKind : uint32_t {
+        SectionCamera = 1,
+        SectionModel = 2,
+    };
+
+    enum SectionFlags : uint32_t {
+        SectionTruncated = 1,   // 領域が足りず途中までしか書けなかった
+        SectionFaulted = 2,     // メモリの読み出しに失敗した（壊れていた）
+    };
+
+    // 緊急時用の書き込み先。確保済みの領域にだけ書き、ヒープは使わない
+    class ArenaWriter {
+    public:
+        ArenaWriter(uint8_t* base, size_t capacity) : m_base(base), m_capacity(capacity), m_pos(0), m_overflow(false) {}
+
+        void u8(uint8_t v) { raw(&v, sizeof(v)); }
+        void u16(uint16_t v) { raw(&v, sizeof(v)); }
+        void u32(uint32_t v) { raw(&v, sizeof(v)); }
+        void i32(int32_t v) { raw(&v, sizeof(v)); }
+        void i64(int64_t v) { raw(&v, sizeof(v)); }
+        void u64(uint64_t v) { raw(&v, sizeof(v)); }
+        void f32(float v) { raw(&v, sizeof(v)); }
+        void raw(const void* data, size_t size) {
+            if (m_overflow || size > m_capacity - m_pos) {
+                m_overflow = true;
+                return;
+            }
+            memcpy(m_base + m_pos, data, size);
+            m_pos += size;
+        }
+        // NUL 終端の固定長文字列（最大 maxLen バイト）
+        void cstr(const char* s, size_t maxLen) {
+            uint16_t n = 0;
+            while (n < maxLen && s[n] != '\0') n++;
+            u16(n);
+            raw(s, n);
+        }
+        void patchU32(size_t pos, uint32_t v) {
+            if (pos + sizeof(v) <= m_pos) memcpy(m_base + pos, &v, sizeof(v));
+        }
+
+        size_t pos() const { return m_pos; }
+        bool overflow() const { return m_overflow; }
+        // 書きかけを捨てて pos まで戻す
+        void rewind(size_t pos) {
+            m_pos = pos;
+            m_overflow = false;
+        }
+        const uint8_t* data() const { return m_base; }
+
+    private:
+        uint8_t* m_base;
+        size_t m_capacity;
+        size_t m_pos;
+        bool m_overflow;
+    };
+
+    struct Model {
+        uint32_t index = 0;
+        uint32_t flags = 0;
+        std::string name;           // Shift-JIS
+        std::wstring filePath;
+        VmdMotion motion;
+    };
+
+    struct Dump {
+        int64_t time = 0;           // 異常終了した時刻（UNIX秒）
+        int32_t nowFrame = 0;
+        bool complete = false;      // ディレクトリまで書けた
+        std::wstring pmmPath;
+        uint32_t cameraFlags = 0;
+        VmdMotion camera;
+        std::vector<Model> models;
+
+        size_t keyframeCount() const;
+    };
+
+    bool Read(const fs::path& path, Dump& dump);
+    // メモリ上の緊急保存（EmergencySnapshot::capture の image。kfc で圧縮したものは不可）から読む
+    bool Read(const uint8_t* data, size_t size, Dump& dump);
+
+    // ディレクトリの1項目。モデル名とパスは各セクションの先頭だけを読んで埋める
+    struct SectionInfo {
+        uint32_t kind = 0;
+        uint32_t index = 0;
+        uint32_t flags = 0;
+        uint64_t offset = 0;
+        uint64_t size = 0;          // ヘッダ込み
+        std::string name;           // モデル名（Shift-JIS）
+        std::wstring filePath;
+    };
+
+    // セクションの本体は読まずに一覧だけを返す（ディレクトリまで書けたファイルのみ）
+    bool ReadDirectory(const fs::path& path, std::vector<SectionInfo>& sections);
+    // 1つのセクションだけを読み、dump.camera または dump.models に加える
+    bool ReadSection(const fs::path& path, const SectionInfo& section, Dump& dump);
+
+    // メモリ上の緊急保存（EmergencySnapshot::capture の image）から同様に読む
+    bool ReadDirectory(const uint8_t* data, size_t size, std::vector<SectionInfo>& sections);
+    bool ReadSection(const uint8_t* data, size_t size, const SectionInfo& section, Dump& dump);
+}
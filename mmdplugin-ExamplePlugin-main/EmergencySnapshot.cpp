@@ -0,0 +1,311 @@
+﻿#include "stdafx.h"
+#include "EmergencySnapshot.h"
+#include <chrono>
+#include <ctime>
+
+using emergency::ArenaWriter;
+using emergency::Progress;
+
+namespace {
+    const uint32_t kMaxChainSteps = 1 << 22;
+
+    uint16_t wideLength(const wchar_t* s, size_t maxLen) {
+        uint16_t n = 0;
+        while (n < maxLen && s[n] != L'\0') n++;
+        return n;
+    }
+
+    void writeCameraBody(ArenaWriter& w, const mmp::MMDMainData* data, Progress& p) {
+        emergency::BeginPhase(w, p, 1);
+        const mmp::CameraKeyFrameData* keys = data->camera_key_frame;
+        int index = 0;
+        int prevFrame = -1;
+        for (uint32_t step = 0; step < kMaxChainSteps && index >= 0 && index < 10000; step++) {
+            mmp::CameraKeyFrameData k = keys[index];
+            if (k.frame_no <= prevFrame) break;
+            w.i32(k.frame_no);
+            w.f32(k.length);
+            w.f32(k.xyz.x); w.f32(k.xyz.y); w.f32(k.xyz.z);
+            w.f32(k.rxyz.x); w.f32(k.rxyz.y); w.f32(k.rxyz.z);
+            w.raw(k.hokan1_x, 6);
+            w.raw(k.hokan1_y, 6);
+            w.raw(k.hokan2_x, 6);
+            w.raw(k.hokan2_y, 6);
+            w.i32(k.is_perspective);
+            w.i32(k.view_angle);
+            // カメラは1トラックなので、フレームごとに件数を進める
+            if (!emergency::EndTrack(w, p)) return;
+            prevFrame = k.frame_no;
+            if (k.next_index == 0) break;
+            index = k.next_index;
+        }
+        p.phase = 4;
+    }
+
+    void writeModelBody(ArenaWriter& w, const mmp::MMDModelData* model, int pmdIndex, char* (*morphName)(int, int), Progress& p) {
+        p.phase = 0;
+        w.cstr(model->name_jp, sizeof(model->name_jp));
+        uint16_t pathLen = wideLength(model->file_path, 256);
+        w.u16(pathLen);
+        w.raw(model->file_path, pathLen * sizeof(uint16_t));
+
+        // ボーン: bone_keyframe[ボーン番号] がフレーム0で、next_index で後続を辿る
+        emergency::BeginPhase(w, p, 1);
+        int boneCount = model->bone_count;
+        for (int b = 0; b < boneCount && b < 0x10000; b++) {
+            w.cstr(model->bone_current_data[b].name_jp, sizeof(model->bone_current_data[b].name_jp));
+            size_t framesPos = w.pos();
+            w.u32(0);
+            uint32_t frames = 0;
+            int index = b;
+            int prevFrame = -1;
+            for (uint32_t step = 0; step < kMaxChainSteps; step++) {
+                mmp::MMDModelData::BoneKeyFrame k = model->bone_keyframe[index];
+                if (k.frame_number <= prevFrame) break;
+                w.i32(k.frame_number);
+                w.f32(k.x); w.f32(k.y); w.f32(k.z);
+                w.raw(k.rotation_q, sizeof(k.rotation_q));
+                w.raw(k.interpolation_curve_x1, 4);
+                w.raw(k.interpolation_curve_y1, 4);
+                w.raw(k.interpolation_curve_x2, 4);
+                w.raw(k.interpolation_curve_y2, 4);
+                frames++;
+                prevFrame = k.frame_number;
+                if (k.next_index <= 0) break;
+                index = k.next_index;
+            }
+            w.patchU32(framesPos, frames);
+            if (!emergency::EndTrack(w, p)) return;
+        }
+
+        // モーフ: morph_keyframe[モーフ番号] から同様に辿る
+        emergency::BeginPhase(w, p, 2);
+        int morphCount = model->morph_count;
+        for (int m = 0; m < morphCount && m < 0x10000; m++) {
+            const char* name = morphName ? morphName(pmdIndex, m) : nullptr;
+            w.cstr(name ? name : "", 20);
+            size_t framesPos = w.pos();
+            w.u32(0);
+            uint32_t frames = 0;
+            int index = m;
+            int prevFrame = -1;
+            for (uint32_t step = 0; step < kMaxChainSteps; step++) {
+                mmp::MMDModelData::MorphKeyFrame k = model->morph_keyframe[index];
+                if (k.frame_number <= prevFrame) break;
+                w.i32(k.frame_number);
+                w.f32(k.value);
+                frames++;
+                prevFrame = k.frame_number;
+                if (k.next_index <= 0) break;
+                index = k.next_index;
+            }
+            w.patchU32(framesPos, frames);
+            if (!emergency::EndTrack(w, p)) return;
+        }
+
+        // 表示・IK: configuration_keyframe[0] から辿る。1フレームずつ件数を進める
+        emergency::BeginPhase(w, p, 3);
+        int ikCount = model->ik_count;
+        if (ikCount < 0 || ikCount > 1024) ikCount = 0;
+        int index = 0;
+        int prevFrame = -1;
+        for (uint32_t step = 0; step < kMaxChainSteps; step++) {
+            const mmp::MMDModelData::ConfigurationKeyFrame& k = model->configuration_keyframe[index];
+            if (k.frame_number <= prevFrame) break;
+            w.i32(k.frame_number);
+            w.u8(static_cast<uint8_t>(k.is_visible));
+            w.u32(static_cast<uint32_t>(ikCount));
+            if (ikCount > 0) w.raw(k.is_ik_enabled, static_cast<size_t>(ikCount));
+            if (!emergency::EndTrack(w, p)) return;
+            prevFrame = k.frame_number;
+            if (k.next_index <= 0) break;
+            index = k.next_index;
+        }
+        p.phase = 4;
+    }
+
+    // 以下の2つは C++ オブジェクトを持たない関数にして SEH で保護する
+    void guardedCamera(ArenaWriter& w, const mmp::MMDMainData* data, Progress& p) {
+        __try {
+            writeCameraBody(w, data, p);
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            p.flags |= emergency::SectionFaulted;
+        }
+    }
+
+    void guardedModel(ArenaWriter& w, const mmp::MMDModelData* model, int pmdIndex, char* (*morphName)(int, int), Progress& p) {
+        __try {
+            writeModelBody(w, model, pmdIndex, morphName, p);
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            p.flags |= emergency::SectionFaulted;
+        }
+    }
+
+    mmp::MMDMainData* guardedMainData() {
+        __try {
+            return *reinterpret_cast<mmp::MMDMainData**>(reinterpret_cast<BYTE*>(GetModuleHandleW(nullptr)) + 0x1445F8);
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            return nullptr;
+        }
+    }
+
+    mmp::MMDModelData* guardedModelPointer(const mmp::MMDMainData* data, int slot) {
+        __try {
+            return data->model_data[slot];
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            return nullptr;
+        }
+    }
+
+    // nowFrame とパスを読む。パスは呼び出し側の固定長の領域へ写す
+    bool guardedHeader(const mmp::MMDMainData* data, int32_t& nowFrame, uint16_t* path, uint16_t& pathLen) {
+        __try {
+            nowFrame = data->now_frame;
+            pathLen = wideLength(data->pmm_path, 256);
+            memcpy(path, data->pmm_path, pathLen * sizeof(uint16_t));
+            return true;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            return false;
+        }
+    }
+}
+
+class EmergencySnapshot::MmdScene : public emergency::Scene {
+public:
+    MmdScene() : m_data(nullptr), m_getMorphName(nullptr) {}
+
+    // 例外時に GetProcAddress を呼ばずに済むよう先に解決しておく
+    void resolve() {
+        m_getMorphName = reinterpret_cast<char* (*)(int, int)>(GetProcAddress(GetModuleHandleW(nullptr), "ExpGetPmdMorphName"));
+    }
+
+    bool begin(int32_t& nowFrame, const uint16_t*& path, uint16_t& pathLen) override {
+        m_data = guardedMainData();
+        if (!m_data || !guardedHeader(m_data, nowFrame, m_path, pathLen)) {
+            m_data = nullptr;
+            return false;
+        }
+        path = m_path;
+        return true;
+    }
+
+    void camera(ArenaWriter& w, Progress& p) override {
+        guardedCamera(w, m_data, p);
+    }
+
+    bool hasModel(int slot) override {
+        return guardedModelPointer(m_data, slot) != nullptr;
+    }
+
+    void model(int slot, int pmdIndex, ArenaWriter& w, Progress& p) override {
+        mmp::MMDModelData* model = guardedModelPointer(m_data, slot);
+        if (model) guardedModel(w, model, pmdIndex, m_getMorphName, p);
+    }
+
+private:
+    mmp::MMDMainData* m_data;
+    char* (*m_getMorphName)(int, int);
+    uint16_t m_path[256];
+};
+
+EmergencySnapshot::EmergencySnapshot() : m_scene(new MmdScene()) {}
+
+EmergencySnapshot::~EmergencySnapshot() {
+    disarm();
+}
+
+fs::path EmergencySnapshot::dumpPathFor(const fs::path& dir) {
+    return dir / (L"AutoBackup_emergency_" + std::to_wstring(GetCurrentProcessId()) + L".dump");
+}
+
+std::vector<fs::path> EmergencySnapshot::findLeftovers(const fs::path& dir) {
+    std::vector<fs::path> found;
+    std::error_code ec;
+    fs::path own = dumpPathFor(dir);
+    for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+        const fs::path& p = it->path();
+        std::wstring name = p.filename().wstring();
+        if (p.extension() != L".dump" || name.find(L"AutoBackup_emergency_") != 0 || p == own) continue;
+        // 起動中の MMD は共有なしで開いているので、開けなければ使用中
+        HANDLE h = CreateFileW(p.c_str(), GENERIC_READ, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (h == INVALID_HANDLE_VALUE) continue;
+        CloseHandle(h);
+        found.push_back(p);
+    }
+    return found;
+}
+
+bool EmergencySnapshot::reserve(size_t arenaBytes) {
+    if (m_writer.ready()) return true;
+    if (arenaBytes < 1024 * 1024) return false;
+    if (!m_arena.reserve(arenaBytes)) return false;
+    m_writer.attach(m_arena.data(), m_arena.size());
+    m_scene->resolve();
+    return true;
+}
+
+bool EmergencySnapshot::arm(const fs::path& dumpPath, size_t arenaBytes) {
+    if (armed() || !reserve(arenaBytes)) return false;
+    return m_guard.arm(dumpPath, m_writer, *m_scene);
+}
+
+void EmergencySnapshot::disarm() {
+    m_guard.disarm();
+    m_writer.attach(nullptr, 0);
+    m_arena.release();
+}
+
+bool EmergencySnapshot::capture(const fs::path& path, DrillResult& result) {
+    if (!m_writer.ready()) return false;
+    emergency::FileSink sink;
+    if (!sink.open(path)) return false;
+    auto start = std::chrono::steady_clock::now();
+    bool ok = m_writer.write(sink, *m_scene, static_cast<int64_t>(std::time(nullptr)), &result.sections, &result.truncated);
+    result.elapsedNs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    result.bytes = sink.size();
+    return ok;
+}
+
+bool EmergencySnapshot::capture(std::vector<uint8_t>& image, DrillResult& result) {
+    if (!m_writer.ready()) return false;
+    image.clear();
+    auto start = std::chrono::steady_clock::now();
+    emergency::MemorySink sink(image);
+    bool ok = m_writer.write(sink, *m_scene, static_cast<int64_t>(std::time(nullptr)), &result.sections, &result.truncated);
+    result.elapsedNs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    result.bytes = image.size();
+    return ok;
+}
+
+bool EmergencySnapshot::recover(const emergency::Dump& dump, const fs::path& outDir, std::vector<fs::path>& files) {
+    std::error_code ec;
+    fs::create_directories(outDir, ec);
+    if (!fs::exists(outDir)) return false;
+
+    bool ok = true;
+    if (!dump.camera.cameras.empty()) {
+        fs::path path = outDir / L"camera.vmd";
+        if (WriteVmd(path, dump.camera)) files.push_back(path);
+        else ok = false;
+    }
+    for (const auto& model : dump.models) {
+        // ファイル名はモデル名（Shift-JIS）から。使えない文字は置き換える
+        wchar_t wname[64] = {};
+        MultiByteToWideChar(932, 0, model.name.c_str(), static_cast<int>(model.name.size()), wname, 63);
+        std::wstring name = wname;
+        for (auto& c : name) {
+            if (wcschr(L"\\/:*?\"<>|", c)) c = L'_';
+        }
+        wchar_t prefix[16];
+        swprintf_s(prefix, L"%02u_", model.index);
+        fs::path path = outDir / (prefix + name + L".vmd");
+        if (WriteVmd(path, model.motion)) files.push_back(path);
+        else ok = false;
+    }
+    return ok;
+}
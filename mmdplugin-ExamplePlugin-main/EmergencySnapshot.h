@@ -0,0 +1,58 @@
+﻿#pragma once
+#include "stdafx.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <experimental/filesystem>
+#include "EmergencyDump.h"
+#include "EmergencyWriter.h"
+
+namespace fs = std::experimental::filesystem;
+
+// MMD が異常終了したときに、その時点のキーフレームを緊急保存する
+//
+// 例外発生時はヒープが壊れている可能性があるため、領域・保存先ファイル・書き出し用スレッドを
+// arm() の時点ですべて用意しておき、例外ハンドラはスレッドを起こして待つだけにする。
+// 書き出しと例外の捕捉は EmergencyWriter（BackupTool crashcheck も同じものを使う）で、
+// ここは MMD のメモリを SEH で保護しながら読む部分だけを持つ。
+class EmergencySnapshot {
+public:
+    struct DrillResult {
+        uint64_t elapsedNs = 0;
+        uint64_t bytes = 0;
+        uint32_t sections = 0;
+        bool truncated = false;     // 領域が足りなかったセクションがある
+    };
+
+    EmergencySnapshot();
+    ~EmergencySnapshot();
+
+    // 書き出し用の領域だけを用意する（例外ハンドラは登録しない）。arm() もこれを使う
+    bool reserve(size_t arenaBytes);
+    bool arm(const fs::path& dumpPath, size_t arenaBytes);
+    void disarm();  // 正常終了時。ハンドラを外し、保存先ファイルを削除する
+    bool armed() const { return m_guard.armed(); }
+
+    // 例外時と同じ書き出しを今すぐ path に行い、所要時間を測る
+    // （緊急保存のテストと、バックアップごとのキーフレーム保存に使う）
+    bool capture(const fs::path& path, DrillResult& result);
+    // 同じ形式をファイルを作らずに image へ書く（モーションの差分バックアップ用）
+    bool capture(std::vector<uint8_t>& image, DrillResult& result);
+
+    // このプロセス用の保存先（複数のMMDを同時に起動しても衝突しないようPIDを付ける）
+    static fs::path dumpPathFor(const fs::path& dir);
+    // 前回以前の緊急保存ファイル（起動中の他のMMDが使っているものは除く）
+    static std::vector<fs::path> findLeftovers(const fs::path& dir);
+    // 緊急保存をモデルごとの VMD に変換する。作ったファイルを files に返す
+    static bool recover(const emergency::Dump& dump, const fs::path& outDir, std::vector<fs::path>& files);
+
+private:
+    // MMD のメモリを書き出し元にする（例外時に読めない所は飛ばす）
+    class MmdScene;
+
+    std::unique_ptr<MmdScene> m_scene;
+    emergency::Arena m_arena;
+    emergency::DumpWriter m_writer;
+    emergency::CrashGuard m_guard;
+};
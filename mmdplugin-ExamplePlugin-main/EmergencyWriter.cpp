@@ -0,0 +1,526 @@
+﻿#include "EmergencyWriter.h"
+#include <cstring>
+#include <ctime>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace emergency {
+    namespace {
+        CrashGuard* s_guard = nullptr;
+
+        const int kDumpTimeoutMs = 15000;
+        const size_t kArenaTail = 64;           // 中断時に残りの件数(0)を書く分
+#ifdef _WIN32
+        const DWORD kStatusHeapCorruption = 0xC0000374;
+        const DWORD kStatusStackBufferOverrun = 0xC0000409;
+#else
+        const int kSignals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+#endif
+
+        // 中断した段階より後ろの件数を 0 として埋め、読み手が最後まで辿れるようにする
+        void finishBody(ArenaWriter& w, const Progress& p, size_t bodyStart, int lastPhase) {
+            int phase = p.phase;
+            if (phase == 0) {
+                w.rewind(bodyStart);
+                w.u16(0);
+                w.u16(0);
+                phase = 1;
+                w.u32(0);
+            }
+            else if (phase < 4) {
+                w.rewind(p.trackStart);
+            }
+            for (int i = phase + 1; i <= lastPhase; i++) w.u32(0);
+        }
+    }
+
+    void BeginPhase(ArenaWriter& w, Progress& p, int phase) {
+        p.phase = phase;
+        p.countPos = w.pos();
+        w.u32(0);
+        p.tracks = 0;
+        p.trackStart = w.pos();
+    }
+
+    bool EndTrack(ArenaWriter& w, Progress& p) {
+        if (w.overflow()) {
+            w.rewind(p.trackStart);
+            p.flags |= SectionTruncated;
+            return false;
+        }
+        w.patchU32(p.countPos, ++p.tracks);
+        p.trackStart = w.pos();
+        return true;
+    }
+
+    // ---- FileSink ----
+
+#ifdef _WIN32
+    FileSink::FileSink() : m_handle(INVALID_HANDLE_VALUE) {}
+
+    bool FileSink::open(const fs::path& path) {
+        close();
+        m_handle = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        return m_handle != INVALID_HANDLE_VALUE;
+    }
+
+    void FileSink::close() {
+        if (m_handle != INVALID_HANDLE_VALUE) CloseHandle(m_handle);
+        m_handle = INVALID_HANDLE_VALUE;
+    }
+
+    bool FileSink::isOpen() const {
+        return m_handle != INVALID_HANDLE_VALUE;
+    }
+
+    uint64_t FileSink::size() const {
+        LARGE_INTEGER size = {};
+        if (!isOpen() || !GetFileSizeEx(m_handle, &size)) return 0;
+        return static_cast<uint64_t>(size.QuadPart);
+    }
+
+    bool FileSink::reset() {
+        LARGE_INTEGER zero = {};
+        return SetFilePointerEx(m_handle, zero, nullptr, FILE_BEGIN) && SetEndOfFile(m_handle);
+    }
+
+    bool FileSink::write(const void* data, size_t size) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        while (size > 0) {
+            DWORD chunk = static_cast<DWORD>(size > 0x40000000 ? 0x40000000 : size);
+            DWORD written = 0;
+            if (!WriteFile(m_handle, p, chunk, &written, nullptr) || written == 0) return false;
+            p += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    bool FileSink::writeAt(uint64_t offset, const void* data, size_t size) {
+        LARGE_INTEGER pos;
+        pos.QuadPart = static_cast<LONGLONG>(offset);
+        return SetFilePointerEx(m_handle, pos, nullptr, FILE_BEGIN) && write(data, size);
+    }
+
+    void FileSink::flush() {
+        FlushFileBuffers(m_handle);
+    }
+#else
+    FileSink::FileSink() : m_fd(-1) {}
+
+    bool FileSink::open(const fs::path& path) {
+        close();
+        m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        return m_fd >= 0;
+    }
+
+    void FileSink::close() {
+        if (m_fd >= 0) ::close(m_fd);
+        m_fd = -1;
+    }
+
+    bool FileSink::isOpen() const {
+        return m_fd >= 0;
+    }
+
+    uint64_t FileSink::size() const {
+        struct stat st;
+        if (!isOpen() || fstat(m_fd, &st) != 0) return 0;
+        return static_cast<uint64_t>(st.st_size);
+    }
+
+    bool FileSink::reset() {
+        return ftruncate(m_fd, 0) == 0 && lseek(m_fd, 0, SEEK_SET) == 0;
+    }
+
+    bool FileSink::write(const void* data, size_t size) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        while (size > 0) {
+            ssize_t written = ::write(m_fd, p, size);
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) return false;
+            p += written;
+            size -= static_cast<size_t>(written);
+        }
+        return true;
+    }
+
+    bool FileSink::writeAt(uint64_t offset, const void* data, size_t size) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        while (size > 0) {
+            ssize_t written = pwrite(m_fd, p, size, static_cast<off_t>(offset));
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) return false;
+            p += written;
+            offset += static_cast<uint64_t>(written);
+            size -= static_cast<size_t>(written);
+        }
+        return true;
+    }
+
+    void FileSink::flush() {
+        fsync(m_fd);
+    }
+#endif
+
+    FileSink::~FileSink() {
+        close();
+    }
+
+    // ---- MemorySink ----
+
+    bool MemorySink::reset() {
+        m_out.resize(m_base);
+        return true;
+    }
+
+    bool MemorySink::write(const void* data, size_t size) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        m_out.insert(m_out.end(), p, p + size);
+        return true;
+    }
+
+    bool MemorySink::writeAt(uint64_t offset, const void* data, size_t size) {
+        if (m_base + offset + size > m_out.size()) return false;
+        memcpy(m_out.data() + m_base + offset, data, size);
+        return true;
+    }
+
+    // ---- Arena ----
+
+    bool Arena::reserve(size_t bytes) {
+        if (m_data && m_size >= bytes) return true;
+        release();
+#ifdef _WIN32
+        m_data = static_cast<uint8_t*>(VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+#else
+        void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        m_data = p == MAP_FAILED ? nullptr : static_cast<uint8_t*>(p);
+#endif
+        if (!m_data) return false;
+        m_size = bytes;
+        return true;
+    }
+
+    void Arena::release() {
+        if (!m_data) return;
+#ifdef _WIN32
+        VirtualFree(m_data, 0, MEM_RELEASE);
+#else
+        munmap(m_data, m_size);
+#endif
+        m_data = nullptr;
+        m_size = 0;
+    }
+
+    // ---- DumpWriter ----
+
+    bool DumpWriter::writeSection(Sink& sink, uint64_t& fileOffset, uint32_t kind, uint32_t index, uint32_t flags, size_t bodySize) {
+        // 本体は領域の SectionHeaderSize 以降に書いてあるので、先頭にヘッダを埋める
+        ArenaWriter h(m_arena, SectionHeaderSize);
+        h.u32(SectionMagic);
+        h.u32(kind);
+        h.u32(index);
+        h.u32(flags);
+        h.u64(bodySize);
+        size_t total = SectionHeaderSize + bodySize;
+        if (!sink.write(m_arena, total)) return false;
+        if (m_dirCount < MaxSections) m_dir[m_dirCount++] = DirEntry{ kind, index, fileOffset, total, flags };
+        fileOffset += total;
+        return true;
+    }
+
+    bool DumpWriter::write(Sink& sink, Scene& scene, int64_t time, uint32_t* sections, bool* truncated) {
+        if (!m_arena) return false;
+        m_dirCount = 0;
+        bool anyTruncated = false;
+
+        if (!sink.reset()) return false;
+
+        int32_t nowFrame = 0;
+        const uint16_t* path = nullptr;
+        uint16_t pathLen = 0;
+        bool readable = scene.begin(nowFrame, path, pathLen);
+        if (!readable) {
+            nowFrame = 0;
+            pathLen = 0;
+        }
+
+        // ヘッダ（ディレクトリの位置は最後に書き直す）
+        ArenaWriter w(m_arena, m_arenaSize);
+        w.u32(FileMagic);
+        w.u32(Version);
+        w.i64(time);
+        w.i32(nowFrame);
+        w.u32(0);
+        w.u64(0);
+        w.u32(0);
+        w.u32(0);
+        w.u64(0);
+        w.u16(pathLen);
+        if (pathLen) w.raw(path, pathLen * sizeof(uint16_t));
+        uint64_t fileOffset = w.pos();
+        if (!sink.write(m_arena, w.pos())) return false;
+
+        if (readable) {
+            // カメラ
+            {
+                ArenaWriter body(m_arena + SectionHeaderSize, m_arenaSize - SectionHeaderSize - kArenaTail);
+                Progress p = {};
+                scene.camera(body, p);
+                ArenaWriter tail(m_arena + SectionHeaderSize, m_arenaSize - SectionHeaderSize);
+                tail.rewind(body.pos());
+                finishBody(tail, p, 0, 1);
+                anyTruncated |= (p.flags & SectionTruncated) != 0;
+                writeSection(sink, fileOffset, SectionCamera, 0, p.flags, tail.pos());
+            }
+
+            // モデル（ExpGetPmd* の番号は読み込まれているモデルを詰めた順）
+            int pmdIndex = 0;
+            for (int slot = 0; slot < Scene::SlotCount; slot++) {
+                if (!scene.hasModel(slot)) continue;
+                ArenaWriter body(m_arena + SectionHeaderSize, m_arenaSize - SectionHeaderSize - kArenaTail);
+                Progress p = {};
+                scene.model(slot, pmdIndex, body, p);
+                ArenaWriter tail(m_arena + SectionHeaderSize, m_arenaSize - SectionHeaderSize);
+                tail.rewind(body.pos());
+                finishBody(tail, p, 0, 3);
+                anyTruncated |= (p.flags & SectionTruncated) != 0;
+                writeSection(sink, fileOffset, SectionModel, static_cast<uint32_t>(slot), p.flags, tail.pos());
+                pmdIndex++;
+            }
+        }
+
+        // ディレクトリ
+        ArenaWriter d(m_arena, m_arenaSize);
+        d.u32(DirMagic);
+        d.u32(m_dirCount);
+        for (uint32_t i = 0; i < m_dirCount; i++) {
+            d.u32(m_dir[i].kind);
+            d.u32(m_dir[i].index);
+            d.u64(m_dir[i].offset);
+            d.u64(m_dir[i].size);
+            d.u32(m_dir[i].flags);
+        }
+        if (!sink.write(m_arena, d.pos())) return false;
+
+        uint8_t patch[12];
+        memcpy(patch, &fileOffset, 8);
+        memcpy(patch + 8, &m_dirCount, 4);
+        if (!sink.writeAt(24, patch, sizeof(patch))) return false;
+        sink.flush();
+
+        if (sections) *sections = m_dirCount;
+        if (truncated) *truncated = anyTruncated;
+        return true;
+    }
+
+    // ---- CrashGuard ----
+
+    void CrashGuard::dump() {
+        m_writer->write(m_sink, *m_scene, static_cast<int64_t>(std::time(nullptr)), nullptr, nullptr);
+    }
+
+#ifdef _WIN32
+    CrashGuard::CrashGuard()
+        : m_writer(nullptr), m_scene(nullptr), m_crashed(0), m_thread(nullptr), m_crashEvent(nullptr),
+        m_doneEvent(nullptr), m_quitEvent(nullptr), m_vectored(nullptr), m_prevFilter(nullptr) {}
+
+    bool CrashGuard::arm(const fs::path& dumpPath, DumpWriter& writer, Scene& scene) {
+        if (armed() || !writer.ready()) return false;
+
+        m_crashEvent = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+        m_doneEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        m_quitEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        if (!m_sink.open(dumpPath) || !m_crashEvent || !m_doneEvent || !m_quitEvent) {
+            disarm();
+            return false;
+        }
+        m_path = dumpPath;
+        m_writer = &writer;
+        m_scene = &scene;
+
+        m_thread = CreateThread(nullptr, 256 * 1024, &CrashGuard::dumperThread, this, 0, nullptr);
+        if (!m_thread) {
+            disarm();
+            return false;
+        }
+
+        s_guard = this;
+        m_crashed = 0;
+        m_prevFilter = reinterpret_cast<void*>(SetUnhandledExceptionFilter(&CrashGuard::unhandledFilter));
+        // ヒープ破損などは未処理例外フィルタまで届かないことがあるので、ベクター例外でも拾う
+        m_vectored = AddVectoredExceptionHandler(0, &CrashGuard::vectoredHandler);
+        return true;
+    }
+
+    void CrashGuard::disarm() {
+        if (s_guard == this) {
+            if (m_vectored) RemoveVectoredExceptionHandler(m_vectored);
+            m_vectored = nullptr;
+            LPTOP_LEVEL_EXCEPTION_FILTER current = SetUnhandledExceptionFilter(reinterpret_cast<LPTOP_LEVEL_EXCEPTION_FILTER>(m_prevFilter));
+            // 後から別のフィルタが登録されていたらそちらを残す
+            if (current != &CrashGuard::unhandledFilter) SetUnhandledExceptionFilter(current);
+            s_guard = nullptr;
+        }
+        if (m_thread) {
+            SetEvent(m_quitEvent);
+            WaitForSingleObject(m_thread, INFINITE);
+            CloseHandle(m_thread);
+            m_thread = nullptr;
+        }
+        if (m_crashEvent) CloseHandle(m_crashEvent);
+        if (m_doneEvent) CloseHandle(m_doneEvent);
+        if (m_quitEvent) CloseHandle(m_quitEvent);
+        m_crashEvent = m_doneEvent = m_quitEvent = nullptr;
+        if (m_sink.isOpen()) {
+            m_sink.close();
+            DeleteFileW(m_path.c_str());
+        }
+        m_writer = nullptr;
+        m_scene = nullptr;
+    }
+
+    LONG WINAPI CrashGuard::unhandledFilter(EXCEPTION_POINTERS* info) {
+        CrashGuard* self = s_guard;
+        if (!self) return EXCEPTION_CONTINUE_SEARCH;
+        self->onCrash();
+        LPTOP_LEVEL_EXCEPTION_FILTER prev = reinterpret_cast<LPTOP_LEVEL_EXCEPTION_FILTER>(self->m_prevFilter);
+        return prev ? prev(info) : EXCEPTION_CONTINUE_SEARCH;
+    }
+
+    LONG WINAPI CrashGuard::vectoredHandler(EXCEPTION_POINTERS* info) {
+        // 通常の例外はアプリ自身が処理することがあるので、続行できないものだけを対象にする
+        DWORD code = info->ExceptionRecord->ExceptionCode;
+        CrashGuard* self = s_guard;
+        if (self && (code == kStatusHeapCorruption || code == kStatusStackBufferOverrun)) self->onCrash();
+        return EXCEPTION_CONTINUE_SEARCH;
+    }
+
+    void CrashGuard::onCrash() {
+        // 最初の1回だけ書き出す。複数のスレッドが同時に落ちた場合は書き終わるのを待つ
+        int expected = 0;
+        if (m_crashed.compare_exchange_strong(expected, 1)) SetEvent(m_crashEvent);
+        WaitForSingleObject(m_doneEvent, kDumpTimeoutMs);
+    }
+
+    DWORD WINAPI CrashGuard::dumperThread(void* param) {
+        CrashGuard* self = static_cast<CrashGuard*>(param);
+        HANDLE events[2] = { self->m_crashEvent, self->m_quitEvent };
+        if (WaitForMultipleObjects(2, events, FALSE, INFINITE) == WAIT_OBJECT_0) {
+            self->dump();
+            SetEvent(self->m_doneEvent);
+        }
+        return 0;
+    }
+#else
+    CrashGuard::CrashGuard()
+        : m_writer(nullptr), m_scene(nullptr), m_crashed(0), m_threadStarted(false), m_thread() {
+        m_wake[0] = m_wake[1] = m_done[0] = m_done[1] = -1;
+    }
+
+    bool CrashGuard::arm(const fs::path& dumpPath, DumpWriter& writer, Scene& scene) {
+        if (armed() || !writer.ready()) return false;
+
+        if (!m_sink.open(dumpPath) || pipe(m_wake) != 0 || pipe(m_done) != 0) {
+            disarm();
+            return false;
+        }
+        m_path = dumpPath;
+        m_writer = &writer;
+        m_scene = &scene;
+
+        if (pthread_create(&m_thread, nullptr, &CrashGuard::dumperThread, this) != 0) {
+            disarm();
+            return false;
+        }
+        m_threadStarted = true;
+
+        s_guard = this;
+        m_crashed = 0;
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = &CrashGuard::signalHandler;
+        sigemptyset(&action.sa_mask);
+        for (int i = 0; i < SignalCount; i++) sigaction(kSignals[i], &action, &m_previous[i]);
+        return true;
+    }
+
+    void CrashGuard::disarm() {
+        if (s_guard == this) {
+            for (int i = 0; i < SignalCount; i++) sigaction(kSignals[i], &m_previous[i], nullptr);
+            s_guard = nullptr;
+        }
+        if (m_threadStarted) {
+            char quit = 'q';
+            while (::write(m_wake[1], &quit, 1) < 0 && errno == EINTR) {}
+            pthread_join(m_thread, nullptr);
+            m_threadStarted = false;
+        }
+        for (int* fd : { &m_wake[0], &m_wake[1], &m_done[0], &m_done[1] }) {
+            if (*fd >= 0) ::close(*fd);
+            *fd = -1;
+        }
+        if (m_sink.isOpen()) {
+            m_sink.close();
+            std::error_code ec;
+            fs::remove(m_path, ec);
+        }
+        m_writer = nullptr;
+        m_scene = nullptr;
+    }
+
+    void CrashGuard::signalHandler(int sig) {
+        CrashGuard* self = s_guard;
+        if (self) {
+            self->onCrash();
+            // 元の動作に戻し、同じシグナルで終わる
+            for (int i = 0; i < SignalCount; i++) {
+                if (kSignals[i] == sig) sigaction(sig, &self->m_previous[i], nullptr);
+            }
+        }
+        else {
+            signal(sig, SIG_DFL);
+        }
+        raise(sig);
+    }
+
+    void CrashGuard::onCrash() {
+        // 最初の1回だけ書き出す。複数のスレッドが同時に落ちた場合は書き終わるのを待つ
+        int expected = 0;
+        if (m_crashed.compare_exchange_strong(expected, 1)) {
+            char crash = 'c';
+            while (::write(m_wake[1], &crash, 1) < 0 && errno == EINTR) {}
+        }
+        pollfd done = { m_done[0], POLLIN, 0 };
+        while (poll(&done, 1, kDumpTimeoutMs) < 0 && errno == EINTR) {}
+    }
+
+    void* CrashGuard::dumperThread(void* param) {
+        CrashGuard* self = static_cast<CrashGuard*>(param);
+        char command = 0;
+        while (::read(self->m_wake[0], &command, 1) < 0 && errno == EINTR) {}
+        if (command == 'c') {
+            self->dump();
+            // 読まずに残しておき、後から落ちたスレッドもすぐに戻れるようにする
+            char done = 'd';
+            while (::write(self->m_done[1], &done, 1) < 0 && errno == EINTR) {}
+        }
+        return nullptr;
+    }
+#endif
+
+    CrashGuard::~CrashGuard() {
+        disarm();
+    }
+}
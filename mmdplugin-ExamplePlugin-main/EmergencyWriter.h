@@ -0,0 +1,209 @@
+﻿#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <experimental/filesystem>
+#include "EmergencyDump.h"
+#ifndef _WIN32
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+namespace fs = std::experimental::filesystem;
+
+#ifdef _WIN32
+struct _EXCEPTION_POINTERS;
+#endif
+
+// 緊急保存ファイルの書き出し（EmergencyDump.h の形式）
+//
+// 異常終了時にも使うので、書き出しの間はヒープの確保もロックもしない。セクションの本体は先に確保した
+// 領域（Arena）に組み立ててから書き出し先（Sink）へ渡す。何を書くかは Scene が決める
+// （プラグインは MMD のメモリ、BackupTool と HostSimulator は合成したシーン）。
+// CrashGuard は例外（Windows）・シグナル（それ以外）を捕まえ、用意しておいたスレッドで書き出す。
+
+namespace emergency {
+    // 書き出し中の段階。例外で中断したときに、どこまで書けていたかを残す
+    struct Progress {
+        int phase;              // 0=名前 1=ボーン（カメラはキー） 2=モーフ 3=表示・IK 4=完了
+        size_t trackStart;      // 書きかけのトラックの先頭（中断時はここまで戻す）
+        size_t countPos;        // 現在の段階の件数の位置
+        uint32_t tracks;
+        uint32_t flags;
+    };
+
+    // 段階の件数（0）を置き、以降のトラックを数え始める
+    void BeginPhase(ArenaWriter& w, Progress& p, int phase);
+    // 1トラック分を書き終えたら件数を進める。領域が足りなければ書きかけを捨てて false
+    bool EndTrack(ArenaWriter& w, Progress& p);
+
+    // 書き出すシーン。例外時にも呼ばれるので、ヒープの確保やロックをしないこと
+    class Scene {
+    public:
+        static const int SlotCount = 255;
+
+        virtual ~Scene() {}
+        // 書き出しの始め。path は UTF-16 のプロジェクトのパス（pathLen 文字）。読めなければ false
+        virtual bool begin(int32_t& nowFrame, const uint16_t*& path, uint16_t& pathLen) = 0;
+        // カメラのセクションの本体。最後まで書けたら p.phase = 4
+        virtual void camera(ArenaWriter& w, Progress& p) = 0;
+        // slot 番目（0～SlotCount-1）にモデルがあるか
+        virtual bool hasModel(int slot) = 0;
+        // モデルのセクションの本体。pmdIndex は読み込まれているモデルを詰めた番号
+        virtual void model(int slot, int pmdIndex, ArenaWriter& w, Progress& p) = 0;
+    };
+
+    // 書き出し先
+    class Sink {
+    public:
+        virtual ~Sink() {}
+        virtual bool reset() = 0;
+        virtual bool write(const void* data, size_t size) = 0;
+        virtual bool writeAt(uint64_t offset, const void* data, size_t size) = 0;
+        virtual void flush() {}
+    };
+
+    // OS のファイルに直接書く。Windows では共有なしで開く（開けなければ使用中）
+    class FileSink : public Sink {
+    public:
+        FileSink();
+        ~FileSink();
+
+        FileSink(const FileSink&) = delete;
+        FileSink& operator=(const FileSink&) = delete;
+
+        bool open(const fs::path& path);
+        void close();
+        bool isOpen() const;
+        uint64_t size() const;
+
+        bool reset() override;
+        bool write(const void* data, size_t size) override;
+        bool writeAt(uint64_t offset, const void* data, size_t size) override;
+        void flush() override;
+
+    private:
+#ifdef _WIN32
+        void* m_handle;
+#else
+        int m_fd;
+#endif
+    };
+
+    // out の base 以降に書く（異常終了時には使わない）
+    class MemorySink : public Sink {
+    public:
+        explicit MemorySink(std::vector<uint8_t>& out) : m_out(out), m_base(out.size()) {}
+
+        bool reset() override;
+        bool write(const void* data, size_t size) override;
+        bool writeAt(uint64_t offset, const void* data, size_t size) override;
+
+    private:
+        std::vector<uint8_t>& m_out;
+        size_t m_base;
+    };
+
+    // 書き出し用の領域。例外時に確保が起きないよう、先に OS から取っておく
+    class Arena {
+    public:
+        Arena() : m_data(nullptr), m_size(0) {}
+        ~Arena() { release(); }
+
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+
+        // bytes 以上あれば何もしない
+        bool reserve(size_t bytes);
+        void release();
+        uint8_t* data() const { return m_data; }
+        size_t size() const { return m_size; }
+
+    private:
+        uint8_t* m_data;
+        size_t m_size;
+    };
+
+    // Scene を緊急保存の形式で書き出す。使うのは arena だけで、ヒープは使わない
+    class DumpWriter {
+    public:
+        DumpWriter() : m_arena(nullptr), m_arenaSize(0), m_dirCount(0) {}
+
+        void attach(uint8_t* arena, size_t size) {
+            m_arena = arena;
+            m_arenaSize = size;
+        }
+        bool ready() const { return m_arena != nullptr; }
+
+        // time は UNIX 秒。sections・truncated は null でよい
+        bool write(Sink& sink, Scene& scene, int64_t time, uint32_t* sections, bool* truncated);
+
+    private:
+        bool writeSection(Sink& sink, uint64_t& fileOffset, uint32_t kind, uint32_t index, uint32_t flags, size_t bodySize);
+
+        struct DirEntry {
+            uint32_t kind;
+            uint32_t index;
+            uint64_t offset;
+            uint64_t size;
+            uint32_t flags;
+        };
+        static const int MaxSections = Scene::SlotCount + 1;  // カメラ + モデル
+
+        uint8_t* m_arena;
+        size_t m_arenaSize;
+        DirEntry m_dir[MaxSections];
+        uint32_t m_dirCount;
+    };
+
+    // 異常終了を捕まえて書き出す。arm() で保存先を開き、書き出し用のスレッドを待たせておく。
+    // 例外・シグナルのハンドラはスレッドを起こして書き終わるのを待つだけにする
+    class CrashGuard {
+    public:
+        CrashGuard();
+        ~CrashGuard();
+
+        CrashGuard(const CrashGuard&) = delete;
+        CrashGuard& operator=(const CrashGuard&) = delete;
+
+        // writer と scene は disarm() まで使い続ける
+        bool arm(const fs::path& dumpPath, DumpWriter& writer, Scene& scene);
+        // 正常終了時。ハンドラを外し、保存先ファイルを削除する
+        void disarm();
+        bool armed() const { return m_sink.isOpen(); }
+
+    private:
+        void onCrash();
+        void dump();
+#ifdef _WIN32
+        static long __stdcall unhandledFilter(_EXCEPTION_POINTERS* info);
+        static long __stdcall vectoredHandler(_EXCEPTION_POINTERS* info);
+        static unsigned long __stdcall dumperThread(void* param);
+#else
+        static void signalHandler(int sig);
+        static void* dumperThread(void* param);
+#endif
+
+        FileSink m_sink;
+        DumpWriter* m_writer;
+        Scene* m_scene;
+        fs::path m_path;
+        std::atomic<int> m_crashed;
+#ifdef _WIN32
+        void* m_thread;
+        void* m_crashEvent;
+        void* m_doneEvent;
+        void* m_quitEvent;
+        void* m_vectored;
+        void* m_prevFilter;
+#else
+        static const int SignalCount = 5;
+        int m_wake[2];      // 書き出し用スレッドへ（'c' = 書き出す、'q' = 終わる）
+        int m_done[2];      // 書き終わった知らせ
+        bool m_threadStarted;
+        pthread_t m_thread;
+        struct sigaction m_previous[SignalCount];
+#endif
+    };
+}
@@ -1,461 +1,1339 @@
-﻿#include "stdafx.h"
-#include "ExamplePlugin.h"
-#include <experimental/filesystem>
-#include <shlwapi.h>
-#include <chrono>
-#include <iomanip>
-#include <sstream>
-#include <string>
-#include <thread>
-#include <fstream>
-
-#pragma comment(lib, "shlwapi.lib")
-namespace fs = std::experimental::filesystem;
-
-// --- 設定管理 ---
-struct PluginSettings {
-    int intervalMinutes = 5;           // バックアップ間隔（分）
-    bool showSuccessDialog = false;    // 成功ダイアログ表示
-    int maxBackupFiles = 50;           // 最大バックアップ数
-    bool autoBackupEnabled = true;     // 自動バックアップ有効/無効
-
-    fs::path settingsPath;
-
-    void Load(const fs::path& dllPath) {
-        settingsPath = dllPath.parent_path() / L"AutoBackup.ini";
-
-        // INIファイルが存在しない場合は作成
-        if (!fs::exists(settingsPath)) {
-            Save();
-            CreateDefaultIni();
-            return;
-        }
-
-        // 設定を読み込み
-        intervalMinutes = GetPrivateProfileIntW(L"Settings", L"IntervalMinutes", 5, settingsPath.c_str());
-        if (intervalMinutes < 1) intervalMinutes = 1;  // 最低1分
-        if (intervalMinutes > 1440) intervalMinutes = 1440;  // 最大24時間
-
-        showSuccessDialog = GetPrivateProfileIntW(L"Settings", L"ShowSuccessDialog", 0, settingsPath.c_str()) != 0;
-        maxBackupFiles = GetPrivateProfileIntW(L"Settings", L"MaxBackupFiles", 50, settingsPath.c_str());
-        if (maxBackupFiles < 1) maxBackupFiles = 1;
-
-        autoBackupEnabled = GetPrivateProfileIntW(L"Settings", L"AutoBackupEnabled", 1, settingsPath.c_str()) != 0;
-    }
-
-    void Save() {
-        // 設定を保存
-        WritePrivateProfileStringW(L"Settings", L"IntervalMinutes", std::to_wstring(intervalMinutes).c_str(), settingsPath.c_str());
-        WritePrivateProfileStringW(L"Settings", L"ShowSuccessDialog", showSuccessDialog ? L"1" : L"0", settingsPath.c_str());
-        WritePrivateProfileStringW(L"Settings", L"MaxBackupFiles", std::to_wstring(maxBackupFiles).c_str(), settingsPath.c_str());
-        WritePrivateProfileStringW(L"Settings", L"AutoBackupEnabled", autoBackupEnabled ? L"1" : L"0", settingsPath.c_str());
-    }
-
-    void CreateDefaultIni() {
-        // デフォルトのINIファイルを作成（コメント付き）
-        std::wofstream ofs(settingsPath);
-        if (ofs.is_open()) {
-            ofs << L"; AutoBackup Plugin Settings\n";
-            ofs << L"; 設定を変更後、MMDを再起動すると反映されます\n";
-            ofs << L";\n";
-            ofs << L"; IntervalMinutes: バックアップ間隔（分）1-1440\n";
-            ofs << L"; ShowSuccessDialog: 成功時のダイアログ表示 (0=非表示, 1=表示)\n";
-            ofs << L"; MaxBackupFiles: 最大バックアップファイル数\n";
-            ofs << L"; AutoBackupEnabled: 自動バックアップの有効/無効 (0=無効, 1=有効)\n";
-            ofs << L"\n";
-            ofs << L"[Settings]\n";
-            ofs << L"IntervalMinutes=" << intervalMinutes << L"\n";
-            ofs << L"ShowSuccessDialog=" << (showSuccessDialog ? 1 : 0) << L"\n";
-            ofs << L"MaxBackupFiles=" << maxBackupFiles << L"\n";
-            ofs << L"AutoBackupEnabled=" << (autoBackupEnabled ? 1 : 0) << L"\n";
-            ofs.close();
-        }
-    }
-};
-
-static PluginSettings g_settings;
-
-// --- グローバルなプラグインインスタンス管理 ---
-static CPlugin* g_pPlugin = nullptr;
-static LONG_PTR g_pOriginWndProc = NULL;
-
-// メニューID
-enum MenuCommands {
-    ID_BACKUP_NOW = 40001,
-    ID_TOGGLE_AUTO = 40002,
-    ID_TOGGLE_DIALOG = 40003,
-    ID_INTERVAL_1 = 40010,
-    ID_INTERVAL_3 = 40011,
-    ID_INTERVAL_5 = 40012,
-    ID_INTERVAL_10 = 40013,
-    ID_INTERVAL_15 = 40014,
-    ID_INTERVAL_30 = 40015,
-    ID_INTERVAL_60 = 40016,
-    ID_MAX_FILES_10 = 40020,
-    ID_MAX_FILES_30 = 40021,
-    ID_MAX_FILES_50 = 40022,
-    ID_MAX_FILES_100 = 40023,
-    ID_MAX_FILES_UNLIMITED = 40024,
-    ID_ABOUT = 40030
-};
-
-static LRESULT CALLBACK pluginWndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
-    if (g_pPlugin) {
-        if (uMsg == WM_COMMAND) {
-            int cmd = LOWORD(wParam);
-
-            switch (cmd) {
-            case ID_BACKUP_NOW:
-                g_pPlugin->triggerSave(true);  // 手動バックアップは常にダイアログ表示
-                return 0;
-
-            case ID_TOGGLE_AUTO:
-                g_settings.autoBackupEnabled = !g_settings.autoBackupEnabled;
-                g_settings.Save();
-                {
-                    std::wstring msg = g_settings.autoBackupEnabled ?
-                        L"自動バックアップを有効にしました" :
-                        L"自動バックアップを無効にしました";
-                    MessageBoxW(hWnd, msg.c_str(), L"自動バックアップ", MB_OK | MB_ICONINFORMATION);
-                }
-                g_pPlugin->updateMenu();
-                return 0;
-
-            case ID_TOGGLE_DIALOG:
-                g_settings.showSuccessDialog = !g_settings.showSuccessDialog;
-                g_settings.Save();
-                g_pPlugin->updateMenu();
-                return 0;
-
-                // 間隔設定
-            case ID_INTERVAL_1:
-            case ID_INTERVAL_3:
-            case ID_INTERVAL_5:
-            case ID_INTERVAL_10:
-            case ID_INTERVAL_15:
-            case ID_INTERVAL_30:
-            case ID_INTERVAL_60:
-            {
-                int intervals[] = { 1, 3, 5, 10, 15, 30, 60 };
-                g_settings.intervalMinutes = intervals[cmd - ID_INTERVAL_1];
-                g_settings.Save();
-                g_pPlugin->updateMenu();
-                MessageBoxW(hWnd,
-                    (L"バックアップ間隔を " + std::to_wstring(g_settings.intervalMinutes) + L" 分に設定しました").c_str(),
-                    L"設定変更", MB_OK | MB_ICONINFORMATION);
-            }
-            return 0;
-
-            // 最大ファイル数設定
-            case ID_MAX_FILES_10:
-            case ID_MAX_FILES_30:
-            case ID_MAX_FILES_50:
-            case ID_MAX_FILES_100:
-            {
-                int maxFiles[] = { 10, 30, 50, 100 };
-                g_settings.maxBackupFiles = maxFiles[cmd - ID_MAX_FILES_10];
-                g_settings.Save();
-                g_pPlugin->updateMenu();
-            }
-            return 0;
-
-            case ID_MAX_FILES_UNLIMITED:
-                g_settings.maxBackupFiles = 9999;
-                g_settings.Save();
-                g_pPlugin->updateMenu();
-                return 0;
-
-            case ID_ABOUT:
-            {
-                wchar_t msg[512];
-                swprintf_s(msg,
-                    L"自動バックアップ プラグイン v1.0\n\n"
-                    L"現在の設定:\n"
-                    L"・バックアップ間隔: %d 分\n"
-                    L"・最大バックアップ数: %d\n"
-                    L"・成功ダイアログ: %s\n"
-                    L"・自動バックアップ: %s\n\n"
-                    L"設定ファイル: AutoBackup.ini",
-                    g_settings.intervalMinutes,
-                    g_settings.maxBackupFiles == 9999 ? -1 : g_settings.maxBackupFiles,
-                    g_settings.showSuccessDialog ? L"表示" : L"非表示",
-                    g_settings.autoBackupEnabled ? L"有効" : L"無効");
-                MessageBoxW(hWnd, msg, L"About", MB_OK | MB_ICONINFORMATION);
-            }
-            return 0;
-            }
-        }
-    }
-    return CallWindowProc((WNDPROC)g_pOriginWndProc, hWnd, uMsg, wParam, lParam);
-}
-
-void CreateInstance(HMODULE hModule) {
-    if (g_pPlugin == nullptr) {
-        g_pPlugin = new CPlugin(hModule);
-
-        // 設定を読み込み
-        wchar_t dllPath[MAX_PATH];
-        GetModuleFileNameW(hModule, dllPath, MAX_PATH);
-        g_settings.Load(fs::path(dllPath));
-    }
-}
-
-void DeleteInstance() {
-    if (g_pPlugin) {
-        delete g_pPlugin;
-        g_pPlugin = nullptr;
-    }
-}
-
-// ---------------------------------------------
-
-CPlugin::CPlugin(HMODULE hModule) : m_hModule(hModule), m_isThreadRunning(false), m_hMenu(NULL) {}
-CPlugin::~CPlugin() {}
-
-void CPlugin::start() {
-    createMenu();
-    HWND hWnd = getHWND();
-    g_pOriginWndProc = GetWindowLongPtr(hWnd, GWLP_WNDPROC);
-    SetWindowLongPtr(hWnd, GWLP_WNDPROC, (LONG_PTR)pluginWndProc);
-    m_isThreadRunning = true;
-    m_thread = std::thread(&CPlugin::backupWorker, this);
-}
-
-void CPlugin::stop() {
-    if (g_pOriginWndProc) {
-        SetWindowLongPtr(getHWND(), GWLP_WNDPROC, g_pOriginWndProc);
-        g_pOriginWndProc = NULL;
-    }
-    m_isThreadRunning = false;
-    if (m_thread.joinable()) {
-        m_thread.join();
-    }
-}
-
-void CPlugin::createMenu() {
-    HMENU menu = GetMenu(getHWND());
-    HMENU newMenu = CreatePopupMenu();
-    m_hMenu = newMenu;
-
-    AppendMenuW(newMenu, MF_STRING, ID_BACKUP_NOW, L"今すぐバックアップ(&B)\tCtrl+Shift+S");
-    AppendMenuW(newMenu, MF_SEPARATOR, 0, NULL);
-
-    // 自動バックアップ ON/OFF
-    AppendMenuW(newMenu, MF_STRING | (g_settings.autoBackupEnabled ? MF_CHECKED : 0),
-        ID_TOGGLE_AUTO, L"自動バックアップ(&A)");
-
-    // 成功ダイアログ表示 ON/OFF
-    AppendMenuW(newMenu, MF_STRING | (g_settings.showSuccessDialog ? MF_CHECKED : 0),
-        ID_TOGGLE_DIALOG, L"完了通知を表示(&N)");
-
-    AppendMenuW(newMenu, MF_SEPARATOR, 0, NULL);
-
-    // バックアップ間隔サブメニュー
-    HMENU intervalMenu = CreatePopupMenu();
-    AppendMenuW(intervalMenu, MF_STRING | (g_settings.intervalMinutes == 1 ? MF_CHECKED : 0), ID_INTERVAL_1, L"1分");
-    AppendMenuW(intervalMenu, MF_STRING | (g_settings.intervalMinutes == 3 ? MF_CHECKED : 0), ID_INTERVAL_3, L"3分");
-    AppendMenuW(intervalMenu, MF_STRING | (g_settings.intervalMinutes == 5 ? MF_CHECKED : 0), ID_INTERVAL_5, L"5分");
-    AppendMenuW(intervalMenu, MF_STRING | (g_settings.intervalMinutes == 10 ? MF_CHECKED : 0), ID_INTERVAL_10, L"10分");
-    AppendMenuW(intervalMenu, MF_STRING | (g_settings.intervalMinutes == 15 ? MF_CHECKED : 0), ID_INTERVAL_15, L"15分");
-    AppendMenuW(intervalMenu, MF_STRING | (g_settings.intervalMinutes == 30 ? MF_CHECKED : 0), ID_INTERVAL_30, L"30分");
-    AppendMenuW(intervalMenu, MF_STRING | (g_settings.intervalMinutes == 60 ? MF_CHECKED : 0), ID_INTERVAL_60, L"60分");
-    AppendMenuW(newMenu, MF_POPUP, (UINT_PTR)intervalMenu, L"バックアップ間隔(&I) >");
-
-    // 最大ファイル数サブメニュー
-    HMENU maxFilesMenu = CreatePopupMenu();
-    AppendMenuW(maxFilesMenu, MF_STRING | (g_settings.maxBackupFiles == 10 ? MF_CHECKED : 0), ID_MAX_FILES_10, L"10個");
-    AppendMenuW(maxFilesMenu, MF_STRING | (g_settings.maxBackupFiles == 30 ? MF_CHECKED : 0), ID_MAX_FILES_30, L"30個");
-    AppendMenuW(maxFilesMenu, MF_STRING | (g_settings.maxBackupFiles == 50 ? MF_CHECKED : 0), ID_MAX_FILES_50, L"50個");
-    AppendMenuW(maxFilesMenu, MF_STRING | (g_settings.maxBackupFiles == 100 ? MF_CHECKED : 0), ID_MAX_FILES_100, L"100個");
-    AppendMenuW(maxFilesMenu, MF_STRING | (g_settings.maxBackupFiles == 9999 ? MF_CHECKED : 0), ID_MAX_FILES_UNLIMITED, L"無制限");
-    AppendMenuW(newMenu, MF_POPUP, (UINT_PTR)maxFilesMenu, L"最大バックアップ数(&M) >");
-
-    AppendMenuW(newMenu, MF_SEPARATOR, 0, NULL);
-    AppendMenuW(newMenu, MF_STRING, ID_ABOUT, L"このプラグインについて(&H)");
-
-    InsertMenuW(menu, GetMenuItemCount(menu) - 1, MF_POPUP | MF_BYPOSITION, (UINT_PTR)newMenu, L"自動バックアップ(&K)");
-    DrawMenuBar(getHWND());
-}
-
-void CPlugin::updateMenu() {
-    if (!m_hMenu) return;
-
-    // メニューアイテムのチェック状態を更新
-    CheckMenuItem(m_hMenu, ID_TOGGLE_AUTO, g_settings.autoBackupEnabled ? MF_CHECKED : MF_UNCHECKED);
-    CheckMenuItem(m_hMenu, ID_TOGGLE_DIALOG, g_settings.showSuccessDialog ? MF_CHECKED : MF_UNCHECKED);
-
-    // メニューを再描画
-    DrawMenuBar(getHWND());
-}
-
-UINT CPlugin::getBackupMenuId() const { return ID_BACKUP_NOW; }
-UINT CPlugin::getAboutMenuId() const { return ID_ABOUT; }
-
-fs::path CPlugin::getCurrentPmmPath() {
-    // ウィンドウタイトルからPMMファイルパスを取得
-    wchar_t windowTitle[MAX_PATH];
-    GetWindowTextW(getHWND(), windowTitle, MAX_PATH);
-
-    std::wstring titleStr(windowTitle);
-    size_t startPos = titleStr.find(L'[');
-    size_t endPos = titleStr.find(L']');
-
-    if (startPos == std::wstring::npos || endPos == std::wstring::npos || startPos >= endPos) {
-        // タイトルから取得できない場合はMMDMainDataから取得
-        auto mmdData = mmp::getMMDMainData();
-        if (mmdData && mmdData->pmm_path[0] != L'\0') {
-            return fs::path(mmdData->pmm_path);
-        }
-        return fs::path();
-    }
-
-    return fs::path(titleStr.substr(startPos + 1, endPos - startPos - 1));
-}
-
-void CPlugin::cleanupOldBackups(const fs::path& backupDir) {
-    if (!fs::exists(backupDir) || g_settings.maxBackupFiles <= 0 || g_settings.maxBackupFiles >= 9999) return;
-
-    // バックアップファイルのリストを作成
-    std::vector<fs::path> backupFiles;
-    for (const auto& entry : fs::directory_iterator(backupDir)) {
-        if (entry.path().extension() == L".pmm") {
-            // 現在のPMMファイル名を含むバックアップのみを対象にする
-            fs::path currentPmm = getCurrentPmmPath();
-            if (currentPmm.empty()) continue;
-
-            std::wstring backupName = entry.path().stem().wstring();
-            std::wstring originalName = currentPmm.stem().wstring();
-
-            // バックアップファイル名が元のファイル名で始まるか確認
-            if (backupName.find(originalName) == 0) {
-                backupFiles.push_back(entry.path());
-            }
-        }
-    }
-
-    // ファイル数が上限を超えている場合
-    if (backupFiles.size() > static_cast<size_t>(g_settings.maxBackupFiles)) {
-        // ファイル名（タイムスタンプ）でソート
-        std::sort(backupFiles.begin(), backupFiles.end());
-
-        // 古いファイルから削除
-        size_t filesToDelete = backupFiles.size() - g_settings.maxBackupFiles;
-        for (size_t i = 0; i < filesToDelete; i++) {
-            fs::remove(backupFiles[i]);
-
-            // 対応するemmファイルも削除
-            fs::path emmPath = backupFiles[i];
-            emmPath.replace_extension(L".emm");
-            if (fs::exists(emmPath)) {
-                fs::remove(emmPath);
-            }
-        }
-    }
-}
-
-void CPlugin::triggerSave(bool forceDialog) {
-    fs::path currentPmmPath = getCurrentPmmPath();
-
-    if (currentPmmPath.empty() || !fs::exists(currentPmmPath)) {
-        MessageBoxW(getHWND(), L"PMMファイルが保存されていないか、見つかりません。\n先に名前を付けて保存してください。", L"エラー", MB_OK | MB_ICONWARNING);
-        return;
-    }
-
-    // まず現在の状態を保存（Ctrl+S相当）
-    SendMessage(getHWND(), WM_COMMAND, 57603, 0);  // ID_FILE_SAVE
-    Sleep(300);  // 保存完了を待つ
-
-    // バックアップフォルダの作成（PMMファイルと同じ階層）
-    fs::path backupDir = currentPmmPath.parent_path() / L"Backup";
-
-    if (!fs::exists(backupDir)) {
-        fs::create_directories(backupDir);
-    }
-
-    // タイムスタンプ付きファイル名を生成
-    auto now = std::chrono::system_clock::now();
-    time_t now_c = std::chrono::system_clock::to_time_t(now);
-    tm now_tm;
-    localtime_s(&now_tm, &now_c);
-    std::wstringstream ss;
-    ss << currentPmmPath.stem().wstring()
-        << L"_"
-        << std::put_time(&now_tm, L"%Y%m%d_%H%M%S")
-        << L".pmm";
-
-    fs::path backupPath = backupDir / ss.str();
-
-    // ファイルをコピー
-    if (CopyFileW(currentPmmPath.c_str(), backupPath.c_str(), FALSE)) {
-        // emmファイルもコピー
-        fs::path emmPath = currentPmmPath;
-        emmPath.replace_extension(L".emm");
-        if (fs::exists(emmPath)) {
-            fs::path backupEmmPath = backupPath;
-            backupEmmPath.replace_extension(L".emm");
-            CopyFileW(emmPath.c_str(), backupEmmPath.c_str(), FALSE);
-        }
-
-        // 古いバックアップを削除
-        cleanupOldBackups(backupDir);
-
-        // 成功メッセージ（設定または強制表示）
-        if (g_settings.showSuccessDialog || forceDialog) {
-            std::wstring msg = L"バックアップを作成しました:\n" + backupPath.filename().wstring();
-            MessageBoxW(getHWND(), msg.c_str(), L"バックアップ完了", MB_OK | MB_ICONINFORMATION);
-        }
-
-        // 最後のバックアップ時刻を更新
-        m_lastBackupTime = std::chrono::steady_clock::now();
-
-    }
-    else {
-        MessageBoxW(getHWND(), L"バックアップに失敗しました。", L"エラー", MB_OK | MB_ICONERROR);
-    }
-}
-
-void CPlugin::backupWorker() {
-    // 初回は少し待つ
-    std::this_thread::sleep_for(std::chrono::seconds(10));
-
-    m_lastBackupTime = std::chrono::steady_clock::now();
-
-    while (m_isThreadRunning) {
-        // 1秒ごとにチェック
-        std::this_thread::sleep_for(std::chrono::seconds(1));
-
-        if (!m_isThreadRunning) break;
-
-        // 自動バックアップが無効なら何もしない
-        if (!g_settings.autoBackupEnabled) continue;
-
-        // 経過時間をチェック
-        auto now = std::chrono::steady_clock::now();
-        auto elapsed = std::chrono::duration_cast<std::chrono::minutes>(now - m_lastBackupTime);
-
-        if (elapsed.count() >= g_settings.intervalMinutes) {
-            // MMDウィンドウがアクティブな場合のみバックアップ
-            if (GetForegroundWindow() == getHWND()) {
-                fs::path currentPath = getCurrentPmmPath();
-                if (!currentPath.empty() && fs::exists(currentPath)) {
-                    triggerSave(false);  // 自動バックアップは設定に従う
-                }
-            }
-            else {
-                // アクティブでない場合も時間をリセット（次回アクティブ時に即バックアップしないように）
-                m_lastBackupTime = now;
-            }
-        }
-    }
-}
-
-// --- プラグインのエクスポート ---
-MMD_PLUGIN_API int version() {
-    return 3;
-}
-
-MMD_PLUGIN_API MMDPluginDLL3* create3(IDirect3DDevice9*) {
-    return g_pPlugin;
-}
-
+﻿#include "stdafx.h"
+#include "ExamplePlugin.h"
+#include <experimental/filesystem>
+#include <shlwapi.h>
+#include <shlobj.h>
+#include <commdlg.h>
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <fstream>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include "BackupFormat.h"
+#include "LzCodec.h"
+#include "BackupCatalog.h"
+#include "SceneSketch.h"
+#include "MotionStore.h"
+#include "BackupEngine.h"
+
+#pragma comment(lib, "shlwapi.lib")
+#pragma comment(lib, "comdlg32.lib")
+namespace fs = std::experimental::filesystem;
+
+// --- 設定管理 ---
+struct PluginSettings {
+    int intervalMinutes = 5;           // バックアップ間隔（分）
+    bool showSuccessDialog = false;    // 成功ダイアログ表示
+    int maxBackupFiles = 50;           // 最大バックアップ数
+    bool autoBackupEnabled = true;     // 自動バックアップ有効/無効
+    int ioLimitKBps = 0;               // 自動バックアップの帯域上限（KB/秒、0=無制限）
+    int ioBurstKB = 4096;              // 帯域制限のバースト量（KB）
+    bool lowPriorityIo = true;         // 自動バックアップを低I/O優先度で行う
+    bool usePackFiles = false;         // バックアップをパックファイルにまとめる
+    int coldTierHours = 24;            // これより古いパック内のバックアップを高圧縮にする（時間、0=しない）
+    int emergencyArenaMB = 64;         // 異常終了時の緊急保存用に確保する領域（MB、0=緊急保存しない）
+    bool keyframeSnapshots = true;     // バックアップごとにモデル単位のキーフレームも保存する（復元用）
+    bool thumbnails = true;            // バックアップごとにビューポートのサムネイルも保存する
+    int motionIntervalSeconds = 0;     // モデルごとの VMD でモーションだけをバックアップする間隔（秒、0=しない）
+    bool poseCheckpoints = false;      // バックアップごとに評価済みのポーズも保存する
+    bool recordSession = false;        // 編集セッション（入力・コマンド・キーフレームの増減）を記録する
+    std::wstring replicaDir;           // Backup フォルダを複製する先（別のドライブや NAS、空=しない）
+    int replicaLimitKBps = 0;          // 複製の帯域上限（KB/秒、0=無制限）
+    int workerThreads = 0;             // 圧縮・復元などに使うワーカースレッドの数（0=CPU数-1）
+    bool publishMetrics = true;        // バックアップの状態を共有メモリに公開する
+
+    fs::path settingsPath;
+
+    void Load(const fs::path& dllPath) {
+        settingsPath = dllPath.parent_path() / L"AutoBackup.ini";
+
+        // INIファイルが存在しない場合は作成
+        if (!fs::exists(settingsPath)) {
+            Save();
+            CreateDefaultIni();
+            return;
+        }
+
+        // 設定を読み込み
+        intervalMinutes = GetPrivateProfileIntW(L"Settings", L"IntervalMinutes", 5, settingsPath.c_str());
+        if (intervalMinutes < 1) intervalMinutes = 1;  // 最低1分
+        if (intervalMinutes > 1440) intervalMinutes = 1440;  // 最大24時間
+
+        showSuccessDialog = GetPrivateProfileIntW(L"Settings", L"ShowSuccessDialog", 0, settingsPath.c_str()) != 0;
+        maxBackupFiles = GetPrivateProfileIntW(L"Settings", L"MaxBackupFiles", 50, settingsPath.c_str());
+        if (maxBackupFiles < 1) maxBackupFiles = 1;
+
+        autoBackupEnabled = GetPrivateProfileIntW(L"Settings", L"AutoBackupEnabled", 1, settingsPath.c_str()) != 0;
+
+        ioLimitKBps = GetPrivateProfileIntW(L"Settings", L"IoLimitKBps", 0, settingsPath.c_str());
+        if (ioLimitKBps < 0) ioLimitKBps = 0;
+        if (ioLimitKBps > 0 && ioLimitKBps < 64) ioLimitKBps = 64;  // 最低64KB/秒
+        ioBurstKB = GetPrivateProfileIntW(L"Settings", L"IoBurstKB", 4096, settingsPath.c_str());
+        if (ioBurstKB < 1024) ioBurstKB = 1024;
+        lowPriorityIo = GetPrivateProfileIntW(L"Settings", L"LowPriorityIo", 1, settingsPath.c_str()) != 0;
+        usePackFiles = GetPrivateProfileIntW(L"Settings", L"UsePackFiles", 0, settingsPath.c_str()) != 0;
+        coldTierHours = GetPrivateProfileIntW(L"Settings", L"ColdTierHours", 24, settingsPath.c_str());
+        if (coldTierHours < 0) coldTierHours = 0;
+        emergencyArenaMB = GetPrivateProfileIntW(L"Settings", L"EmergencyArenaMB", 64, settingsPath.c_str());
+        if (emergencyArenaMB < 0) emergencyArenaMB = 0;
+        if (emergencyArenaMB > 1024) emergencyArenaMB = 1024;
+        keyframeSnapshots = GetPrivateProfileIntW(L"Settings", L"KeyframeSnapshots", 1, settingsPath.c_str()) != 0;
+        thumbnails = GetPrivateProfileIntW(L"Settings", L"Thumbnails", 1, settingsPath.c_str()) != 0;
+        motionIntervalSeconds = GetPrivateProfileIntW(L"Settings", L"MotionIntervalSeconds", 0, settingsPath.c_str());
+        if (motionIntervalSeconds < 0) motionIntervalSeconds = 0;
+        if (motionIntervalSeconds > 0 && motionIntervalSeconds < 10) motionIntervalSeconds = 10;  // 最短10秒
+        poseCheckpoints = GetPrivateProfileIntW(L"Settings", L"PoseCheckpoints", 0, settingsPath.c_str()) != 0;
+        recordSession = GetPrivateProfileIntW(L"Settings", L"RecordSession", 0, settingsPath.c_str()) != 0;
+        wchar_t replica[MAX_PATH] = {};
+        GetPrivateProfileStringW(L"Settings", L"ReplicaDir", L"", replica, MAX_PATH, settingsPath.c_str());
+        replicaDir = replica;
+        replicaLimitKBps = GetPrivateProfileIntW(L"Settings", L"ReplicaLimitKBps", 0, settingsPath.c_str());
+        if (replicaLimitKBps < 0) replicaLimitKBps = 0;
+        if (replicaLimitKBps > 0 && replicaLimitKBps < 64) replicaLimitKBps = 64;  // 最低64KB/秒
+        workerThreads = GetPrivateProfileIntW(L"Settings", L"WorkerThreads", 0, settingsPath.c_str());
+        if (workerThreads < 0) workerThreads = 0;
+        if (workerThreads > 64) workerThreads = 64;
+        publishMetrics = GetPrivateProfileIntW(L"Settings", L"PublishMetrics", 1, settingsPath.c_str()) != 0;
+    }
+
+    void Save() {
+        // 設定を保存
+        WritePrivateProfileStringW(L"Settings", L"IntervalMinutes", std::to_wstring(intervalMinutes).c_str(), settingsPath.c_str());
+        WritePrivateProfileStringW(L"Settings", L"ShowSuccessDialog", showSuccessDialog ? L"1" : L"0", settingsPath.c_str());
+        WritePrivateProfileStringW(L"Settings", L"MaxBackupFiles", std::to_wstring(maxBackupFiles).c_str(), settingsPath.c_str());
+        WritePrivateProfileStringW(L"Settings", L"AutoBackupEnabled", autoBackupEnabled ? L"1" : L"0", settingsPath.c_str());
+        WritePrivateProfileStringW(L"Settings", L"IoLimitKBps", std::to_wstring(ioLimitKBps).c_str(), settingsPath.c_str());
+        WritePrivateProfileStringW(L"Settings", L"IoBurstKB", std::to_wstring(ioBurstKB).c_str(), settingsPath.c_str());
+        WritePrivateProfileStringW(L"Settings", L"LowPriorityIo", lowPriorityIo ? L"1" : L"0", settingsPath.c_str());
+        WritePrivateProfileStringW(L"Settings", L"UsePackFiles", usePackFiles ? L"1" : L"0", settingsPath.c_str());
+        WritePrivateProfileStringW(L"Settings", L"ColdTierHours", std::to_wstring(coldTierHours).c_str(), settingsPath.c_str());
+        WritePrivateProfileStringW(L"Settings", L"EmergencyArenaMB", std::to_wstring(emergencyArenaMB).c_str(), settingsPath.c_str());
+        WritePrivateProfileStringW(L"Settings", L"KeyframeSnapshots", keyframeSnapshots ? L"1" : L"0", settingsPath.c_str());
+        WritePrivateProfileStringW(L"Settings", L"Thumbnails", thumbnails ? L"1" : L"0", settingsPath.c_str());
+        WritePrivateProfileStringW(L"Settings", L"MotionIntervalSeconds", std::to_wstring(motionIntervalSeconds).c_str(), settingsPath.c_str());
+        WritePrivateProfileStringW(L"Settings", L"PoseCheckpoints", poseCheckpoints ? L"1" : L"0", settingsPath.c_str());
+        WritePrivateProfileStringW(L"Settings", L"RecordSession", recordSession ? L"1" : L"0", settingsPath.c_str());
+        WritePrivateProfileStringW(L"Settings", L"ReplicaDir", replicaDir.c_str(), settingsPath.c_str());
+        WritePrivateProfileStringW(L"Settings", L"ReplicaLimitKBps", std::to_wstring(replicaLimitKBps).c_str(), settingsPath.c_str());
+        WritePrivateProfileStringW(L"Settings", L"WorkerThreads", std::to_wstring(workerThreads).c_str(), settingsPath.c_str());
+        WritePrivateProfileStringW(L"Settings", L"PublishMetrics", publishMetrics ? L"1" : L"0", settingsPath.c_str());
+    }
+
+    void CreateDefaultIni() {
+        // デフォルトのINIファイルを作成（コメント付き）
+        std::wofstream ofs(settingsPath);
+        if (ofs.is_open()) {
+            ofs << L"; AutoBackup Plugin Settings\n";
+            ofs << L"; 設定を変更後、MMDを再起動すると反映されます\n";
+            ofs << L";\n";
+            ofs << L"; IntervalMinutes: バックアップ間隔（分）1-1440\n";
+            ofs << L"; ShowSuccessDialog: 成功時のダイアログ表示 (0=非表示, 1=表示)\n";
+            ofs << L"; MaxBackupFiles: 最大バックアップファイル数\n";
+            ofs << L"; AutoBackupEnabled: 自動バックアップの有効/無効 (0=無効, 1=有効)\n";
+            ofs << L"; IoLimitKBps: 自動バックアップの読み書き帯域上限 KB/秒 (0=無制限, 最低64)\n";
+            ofs << L"; IoBurstKB: 帯域制限で一度に許可する量 KB (最低1024)\n";
+            ofs << L"; LowPriorityIo: 自動バックアップを低I/O優先度で行う (0=通常, 1=低優先度)\n";
+            ofs << L"; UsePackFiles: バックアップを <名前>.NNN.pack にまとめる (0=個別ファイル, 1=パック)\n";
+            ofs << L"; ColdTierHours: パック内のこの時間より古いバックアップを、MMDが操作されていない間に高圧縮にする (0=しない)\n";
+            ofs << L"; EmergencyArenaMB: MMDが異常終了したときのキーフレーム緊急保存用の領域 MB (0=緊急保存しない, 最大1024)\n";
+            ofs << L"; KeyframeSnapshots: バックアップごとに、モデル単位で今のシーンへ復元できるキーフレームを .kfs に保存する (0=しない, 1=する)\n";
+            ofs << L"; Thumbnails: バックアップごとにビューポートの縮小画像を <名前>.thumb.bmp に保存する (0=しない, 1=する)\n";
+            ofs << L"; MotionIntervalSeconds: モデル・カメラごとの VMD でモーションだけを Backup\\<名前>.motion に保存する間隔 秒 (0=しない, 最短10)\n";
+            ofs << L"; PoseCheckpoints: バックアップごとに全モデルの評価済みボーン行列とモーフ値を量子化して <名前>.pose に保存する (0=しない, 1=する)\n";
+            ofs << L"; RecordSession: 入力・コマンド・キーフレームの増減を AutoBackup_<日時>.abtrace に記録し、BackupTool replay で設定ごとに比べられるようにする (0=しない, 1=する)\n";
+            ofs << L"; ReplicaDir: Backup フォルダを裏で複製する先のフォルダ。別のドライブや NAS を指定する。届かない間は間を空けて再試行する (空=しない)\n";
+            ofs << L"; ReplicaLimitKBps: 複製の帯域上限 KB/秒 (0=無制限, 最低64)\n";
+            ofs << L"; WorkerThreads: キーフレームの書き出し・圧縮・復元に使うワーカースレッドの数。復元が最優先で、再圧縮は後回しになる (0=CPU数-1, 最大64)\n";
+            ofs << L"; PublishMetrics: バックアップの状態を共有メモリ (Local\\AutoBackup.Metrics) に公開し、BackupTool watch などから読めるようにする (0=しない, 1=する)\n";
+            ofs << L"\n";
+            ofs << L"[Settings]\n";
+            ofs << L"IntervalMinutes=" << intervalMinutes << L"\n";
+            ofs << L"ShowSuccessDialog=" << (showSuccessDialog ? 1 : 0) << L"\n";
+            ofs << L"MaxBackupFiles=" << maxBackupFiles << L"\n";
+            ofs << L"AutoBackupEnabled=" << (autoBackupEnabled ? 1 : 0) << L"\n";
+            ofs << L"IoLimitKBps=" << ioLimitKBps << L"\n";
+            ofs << L"IoBurstKB=" << ioBurstKB << L"\n";
+            ofs << L"LowPriorityIo=" << (lowPriorityIo ? 1 : 0) << L"\n";
+            ofs << L"UsePackFiles=" << (usePackFiles ? 1 : 0) << L"\n";
+            ofs << L"ColdTierHours=" << coldTierHours << L"\n";
+            ofs << L"EmergencyArenaMB=" << emergencyArenaMB << L"\n";
+            ofs << L"KeyframeSnapshots=" << (keyframeSnapshots ? 1 : 0) << L"\n";
+            ofs << L"Thumbnails=" << (thumbnails ? 1 : 0) << L"\n";
+            ofs << L"MotionIntervalSeconds=" << motionIntervalSeconds << L"\n";
+            ofs << L"PoseCheckpoints=" << (poseCheckpoints ? 1 : 0) << L"\n";
+            ofs << L"RecordSession=" << (recordSession ? 1 : 0) << L"\n";
+            ofs << L"ReplicaDir=" << replicaDir << L"\n";
+            ofs << L"ReplicaLimitKBps=" << replicaLimitKBps << L"\n";
+            ofs << L"WorkerThreads=" << workerThreads << L"\n";
+            ofs << L"PublishMetrics=" << (publishMetrics ? 1 : 0) << L"\n";
+            ofs.close();
+        }
+    }
+};
+
+static PluginSettings g_settings;
+
+// --- グローバルなプラグインインスタンス管理 ---
+static CPlugin* g_pPlugin = nullptr;
+static LONG_PTR g_pOriginWndProc = NULL;
+
+// メニューID
+enum MenuCommands {
+    ID_BACKUP_NOW = 40001,
+    ID_TOGGLE_AUTO = 40002,
+    ID_TOGGLE_DIALOG = 40003,
+    ID_TOGGLE_PACK = 40004,
+    ID_INTERVAL_1 = 40010,
+    ID_INTERVAL_3 = 40011,
+    ID_INTERVAL_5 = 40012,
+    ID_INTERVAL_10 = 40013,
+    ID_INTERVAL_15 = 40014,
+    ID_INTERVAL_30 = 40015,
+    ID_INTERVAL_60 = 40016,
+    ID_MAX_FILES_10 = 40020,
+    ID_MAX_FILES_30 = 40021,
+    ID_MAX_FILES_50 = 40022,
+    ID_MAX_FILES_100 = 40023,
+    ID_MAX_FILES_UNLIMITED = 40024,
+    ID_ABOUT = 40030,
+    ID_DUMP_TRACE = 40031,
+    ID_EMERGENCY_DRILL = 40032,
+    ID_RESTORE_MODEL = 40033,
+    ID_FIND_SIMILAR = 40034,
+    ID_POSE_BENCHMARK = 40035
+};
+
+static LRESULT CALLBACK pluginWndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
+    if (g_pPlugin) {
+        if (uMsg == WM_COMMAND) {
+            int cmd = LOWORD(wParam);
+            // メニュー・アクセラレータ・ボタンだけを記録する（入力欄の変更通知などは除く）
+            if (HIWORD(wParam) <= 1) g_pPlugin->recordCommand(cmd);
+
+            switch (cmd) {
+            case ID_BACKUP_NOW:
+                g_pPlugin->triggerSave(true);  // 手動バックアップは常にダイアログ表示
+                return 0;
+
+            case ID_TOGGLE_AUTO:
+                g_settings.autoBackupEnabled = !g_settings.autoBackupEnabled;
+                g_settings.Save();
+                {
+                    std::wstring msg = g_settings.autoBackupEnabled ?
+                        L"自動バックアップを有効にしました" :
+                        L"自動バックアップを無効にしました";
+                    MessageBoxW(hWnd, msg.c_str(), L"自動バックアップ", MB_OK | MB_ICONINFORMATION);
+                }
+                g_pPlugin->updateMenu();
+                return 0;
+
+            case ID_TOGGLE_DIALOG:
+                g_settings.showSuccessDialog = !g_settings.showSuccessDialog;
+                g_settings.Save();
+                g_pPlugin->updateMenu();
+                return 0;
+
+            case ID_TOGGLE_PACK:
+                g_settings.usePackFiles = !g_settings.usePackFiles;
+                g_settings.Save();
+                g_pPlugin->updateMenu();
+                return 0;
+
+                // 間隔設定
+            case ID_INTERVAL_1:
+            case ID_INTERVAL_3:
+            case ID_INTERVAL_5:
+            case ID_INTERVAL_10:
+            case ID_INTERVAL_15:
+            case ID_INTERVAL_30:
+            case ID_INTERVAL_60:
+            {
+                int intervals[] = { 1, 3, 5, 10, 15, 30, 60 };
+                g_settings.intervalMinutes = intervals[cmd - ID_INTERVAL_1];
+                g_settings.Save();
+                g_pPlugin->updateMenu();
+                MessageBoxW(hWnd,
+                    (L"バックアップ間隔を " + std::to_wstring(g_settings.intervalMinutes) + L" 分に設定しました").c_str(),
+                    L"設定変更", MB_OK | MB_ICONINFORMATION);
+            }
+            return 0;
+
+            // 最大ファイル数設定
+            case ID_MAX_FILES_10:
+            case ID_MAX_FILES_30:
+            case ID_MAX_FILES_50:
+            case ID_MAX_FILES_100:
+            {
+                int maxFiles[] = { 10, 30, 50, 100 };
+                g_settings.maxBackupFiles = maxFiles[cmd - ID_MAX_FILES_10];
+                g_settings.Save();
+                g_pPlugin->updateMenu();
+            }
+            return 0;
+
+            case ID_MAX_FILES_UNLIMITED:
+                g_settings.maxBackupFiles = 9999;
+                g_settings.Save();
+                g_pPlugin->updateMenu();
+                return 0;
+
+            case ID_ABOUT:
+            {
+                wchar_t msg[512];
+                swprintf_s(msg,
+                    L"自動バックアップ プラグイン v1.0\n\n"
+                    L"現在の設定:\n"
+                    L"・バックアップ間隔: %d 分\n"
+                    L"・最大バックアップ数: %d\n"
+                    L"・成功ダイアログ: %s\n"
+                    L"・自動バックアップ: %s\n\n"
+                    L"設定ファイル: AutoBackup.ini",
+                    g_settings.intervalMinutes,
+                    g_settings.maxBackupFiles == 9999 ? -1 : g_settings.maxBackupFiles,
+                    g_settings.showSuccessDialog ? L"表示" : L"非表示",
+                    g_settings.autoBackupEnabled ? L"有効" : L"無効");
+                std::wstring about = msg;
+                about += L"\n\n処理時間:\n" + g_pPlugin->getMetrics().summary();
+                about += L"\nフレーム時間:\n" + g_pPlugin->getRenderMonitor().summary();
+                {
+                    const TokenBucket& bucket = g_pPlugin->getIoBucket();
+                    wchar_t io[256];
+                    swprintf_s(io, L"\n帯域制限: %s\n・制限による待ち時間: 合計 %.1f 秒 (%.1f MB 転送)\n",
+                        g_settings.ioLimitKBps > 0 ? (std::to_wstring(g_settings.ioLimitKBps) + L" KB/秒").c_str() : L"無制限",
+                        bucket.throttledNs() / 1e9, bucket.bytesPassed() / (1024.0 * 1024.0));
+                    about += io;
+                }
+                about += L"ワーカースレッド: " + std::to_wstring(g_pPlugin->getExecutor().concurrency()) + L" 並列\n";
+                if (g_pPlugin->getLiveMetrics().active()) {
+                    about += L"外部公開: Local\\AutoBackup.Metrics (スロット " + std::to_wstring(g_pPlugin->getLiveMetrics().slotIndex()) + L")\n";
+                }
+                if (g_pPlugin->getReplicator().running()) about += L"\n複製:\n" + g_pPlugin->getReplicator().summary();
+                MessageBoxW(hWnd, about.c_str(), L"About", MB_OK | MB_ICONINFORMATION);
+            }
+            return 0;
+
+            case ID_EMERGENCY_DRILL:
+                g_pPlugin->runEmergencyDrill();
+                return 0;
+
+            case ID_RESTORE_MODEL:
+                g_pPlugin->restoreSelectedModel();
+                return 0;
+
+            case ID_FIND_SIMILAR:
+                g_pPlugin->findSimilarBackups();
+                return 0;
+
+            case ID_POSE_BENCHMARK:
+                g_pPlugin->benchmarkPoseCapture();
+                return 0;
+
+            case ID_DUMP_TRACE:
+            {
+                fs::path tracePath = g_settings.settingsPath.parent_path() / L"AutoBackup_trace.json";
+                if (g_pPlugin->dumpTrace(tracePath)) {
+                    std::wstring msg = L"計測トレースを出力しました:\n" + tracePath.wstring() +
+                        L"\n\nchrome://tracing または Perfetto で開けます。";
+                    MessageBoxW(hWnd, msg.c_str(), L"計測トレース", MB_OK | MB_ICONINFORMATION);
+                }
+                else {
+                    MessageBoxW(hWnd, L"計測トレースの出力に失敗しました。", L"エラー", MB_OK | MB_ICONERROR);
+                }
+            }
+            return 0;
+            }
+        }
+    }
+    return CallWindowProc((WNDPROC)g_pOriginWndProc, hWnd, uMsg, wParam, lParam);
+}
+
+void CreateInstance(HMODULE hModule) {
+    if (g_pPlugin == nullptr) {
+        g_pPlugin = new CPlugin(hModule);
+
+        // 設定を読み込み
+        wchar_t dllPath[MAX_PATH];
+        GetModuleFileNameW(hModule, dllPath, MAX_PATH);
+        g_settings.Load(fs::path(dllPath));
+    }
+}
+
+void DeleteInstance() {
+    if (g_pPlugin) {
+        delete g_pPlugin;
+        g_pPlugin = nullptr;
+    }
+}
+
+// ---------------------------------------------
+
+CPlugin::CPlugin(HMODULE hModule) : m_hModule(hModule), m_isThreadRunning(false), m_hMenu(NULL),
+    m_pfnGetFrameTime(nullptr), m_backupPending(false), m_compactionDue(false), m_device(nullptr),
+    m_motionMirrorVersion(0), m_recording(false), m_pluginSaving(false), m_recordedKeys(0), m_recordedClicks(0),
+    m_recordedCameraCount(0) {}
+CPlugin::~CPlugin() {}
+
+void CPlugin::start() {
+    // MMDExport.h のエクスポート関数はMMD本体から取得する
+    m_pfnGetFrameTime = reinterpret_cast<float(*)()>(GetProcAddress(GetModuleHandleW(nullptr), "ExpGetFrameTime"));
+
+    m_ioBucket.reset();
+    m_ioBucket.configure(static_cast<uint64_t>(g_settings.ioLimitKBps) * 1024, static_cast<uint64_t>(g_settings.ioBurstKB) * 1024);
+    m_executor.start(g_settings.workerThreads > 0 ? static_cast<unsigned>(g_settings.workerThreads) : TaskExecutor::defaultWorkers());
+
+    // 前回異常終了したときの緊急保存を確認してから、今回の分を用意する
+    fs::path pluginDir = g_settings.settingsPath.parent_path();
+    checkEmergencyDumps(pluginDir);
+
+    // 前回正常に終了しなかったセッションのプロジェクト（復元の案内は初回待ちの後にワーカーで行う）
+    m_recoveryProjects = m_session.begin(pluginDir);
+    if (g_settings.emergencyArenaMB > 0) {
+        m_emergency.arm(EmergencySnapshot::dumpPathFor(pluginDir), static_cast<size_t>(g_settings.emergencyArenaMB) * 1024 * 1024);
+    }
+    if (g_settings.recordSession) beginSessionRecording(pluginDir);
+    if (!g_settings.replicaDir.empty()) {
+        // 送り終えていない分は AutoBackup_replica.queue から続ける
+        ReplicaOptions options;
+        options.bytesPerSec = static_cast<uint64_t>(g_settings.replicaLimitKBps) * 1024;
+        options.burstBytes = static_cast<uint64_t>(g_settings.ioBurstKB) * 1024;
+        options.queuePath = pluginDir / L"AutoBackup_replica.queue";
+        m_replicator.start(g_settings.replicaDir, options);
+    }
+    // 外から監視できるように公開する（作れなければ公開しないだけ）
+    if (g_settings.publishMetrics) m_live.open();
+
+    createMenu();
+    HWND hWnd = getHWND();
+    g_pOriginWndProc = GetWindowLongPtr(hWnd, GWLP_WNDPROC);
+    SetWindowLongPtr(hWnd, GWLP_WNDPROC, (LONG_PTR)pluginWndProc);
+    m_isThreadRunning = true;
+    m_thread = std::thread(&CPlugin::backupWorker, this);
+}
+
+void CPlugin::stop() {
+    if (g_pOriginWndProc) {
+        SetWindowLongPtr(getHWND(), GWLP_WNDPROC, g_pOriginWndProc);
+        g_pOriginWndProc = NULL;
+    }
+    // ワーカースレッドに止まるよう知らせる（帯域待ちのコピーは待たずに進ませる）。
+    // 長い処理は m_isThreadRunning を区切りごとに見て抜ける
+    m_isThreadRunning = false;
+    m_ioBucket.cancel();
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+    // 並列処理はワーカースレッドが抜けてから止める。先に止めると、処理中の parallelFor が取り消され、
+    // ワーカーが止まった TaskExecutor に仕事を積んでしまう
+    m_executor.stop();
+    if (m_recording) {
+        m_recording = false;
+        m_sessionTrace.close();
+    }
+    m_replicator.stop();
+    m_live.close();
+    m_emergency.disarm();
+    m_session.end();
+    m_thumbnail.onReset();
+}
+
+// MMD 内部のモデル名などは Shift-JIS
+static std::wstring SjisToWide(const std::string& s) {
+    wchar_t buf[256] = {};
+    MultiByteToWideChar(932, 0, s.c_str(), static_cast<int>(s.size()), buf, 255);
+    return buf;
+}
+
+// getMMDMainData() と同じ場所を読むが、毎フレーム呼ぶためエラー表示はしない
+static MMDMainData* peekMMDMainData() {
+    auto pointer = (MMDMainData**)((BYTE*)GetModuleHandleW(nullptr) + 0x1445F8);
+    return *pointer;
+}
+
+void CPlugin::Present(CONST RECT*, CONST RECT*, HWND, CONST RGNDATA*) {
+    // 予約がなければ何もしない。縮小の発行と、終わった分の読み戻しだけを計測する
+    uint64_t start = m_metrics.nowNs();
+    if (m_thumbnail.onPresent(m_device)) m_metrics.record(BackupStage::Thumbnail, start, m_metrics.nowNs());
+
+    start = m_metrics.nowNs();
+    MMDMainData* mmdData = peekMMDMainData();
+    if (m_pose.onPresent(mmdData ? mmdData->now_frame : 0)) m_metrics.record(BackupStage::Pose, start, m_metrics.nowNs());
+}
+
+void CPlugin::Reset(D3DPRESENT_PARAMETERS*) {
+    m_thumbnail.onReset();
+}
+
+void CPlugin::PostPresent(CONST RECT*, CONST RECT*, HWND, CONST RGNDATA*, HRESULT&) {
+    MMDMainData* mmdData = peekMMDMainData();
+    int nowFrame = mmdData ? mmdData->now_frame : 0;
+    float frameTime = m_pfnGetFrameTime ? m_pfnGetFrameTime() : 0.0f;
+    m_renderMonitor.onPresent(m_metrics.nowNs(), nowFrame, frameTime);
+}
+
+void CPlugin::KeyBoardProc(WPARAM, LPARAM lParam) {
+    // 押した瞬間だけ数える（キーリピートと離したときは除く）
+    if (m_recording && (lParam & 0xC0000000) == 0) m_recordedKeys.fetch_add(1, std::memory_order_relaxed);
+}
+
+void CPlugin::MouseProc(WPARAM wParam, const MOUSEHOOKSTRUCT*) {
+    if (m_recording && (wParam == WM_LBUTTONDOWN || wParam == WM_RBUTTONDOWN || wParam == WM_MBUTTONDOWN)) {
+        m_recordedClicks.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void CPlugin::recordCommand(UINT id) {
+    if (m_recording && !m_pluginSaving) m_sessionTrace.command(sessionMs(), id);
+}
+
+uint64_t CPlugin::sessionMs() const {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_recordStart).count());
+}
+
+void CPlugin::beginSessionRecording(const fs::path& pluginDir) {
+    time_t now = time(nullptr);
+    tm local;
+    localtime_s(&local, &now);
+    std::wstringstream name;
+    name << L"AutoBackup_" << std::put_time(&local, L"%Y%m%d_%H%M%S") << L".abtrace";
+
+    m_recordStart = std::chrono::steady_clock::now();
+    m_recordedVersions.assign(KeyframeMirror::MaxModels, 0);
+    m_recordedCounts.assign(KeyframeMirror::MaxModels, 0);
+    m_recordedCameraCount = 0;
+    m_recording = m_sessionTrace.open(pluginDir / name.str(), static_cast<int64_t>(now));
+}
+
+void CPlugin::recordSession(const KeyframeMirror::RefreshResult& refreshed) {
+    uint64_t now = sessionMs();
+    uint32_t keys = m_recordedKeys.exchange(0, std::memory_order_relaxed);
+    uint32_t clicks = m_recordedClicks.exchange(0, std::memory_order_relaxed);
+    if (keys || clicks) m_sessionTrace.input(now, keys, clicks);
+
+    // 作り直したモデルとカメラのキーフレーム数を残す（最初の1回は読み込み済みの状態）
+    if (refreshed.rebuilt > 0) {
+        for (int slot = 0; slot < KeyframeMirror::MaxModels; slot++) {
+            const ModelMirror& model = m_mirror.model(slot);
+            uint32_t count = model.loaded ? static_cast<uint32_t>(model.keyframeCount()) : 0;
+            uint32_t version = model.loaded ? model.version : 0;
+            if (version == m_recordedVersions[slot] && count == m_recordedCounts[slot]) continue;
+            m_sessionTrace.edit(now, static_cast<uint32_t>(slot), static_cast<int32_t>(count - m_recordedCounts[slot]), count);
+            m_recordedVersions[slot] = version;
+            m_recordedCounts[slot] = count;
+        }
+    }
+    if (refreshed.cameraChanged) {
+        uint32_t count = static_cast<uint32_t>(m_mirror.camera().size());
+        m_sessionTrace.edit(now, session::CameraSlot, static_cast<int32_t>(count - m_recordedCameraCount), count);
+        m_recordedCameraCount = count;
+    }
+    m_sessionTrace.flush();
+}
+
+void CPlugin::createMenu() {
+    HMENU menu = GetMenu(getHWND());
+    HMENU newMenu = CreatePopupMenu();
+    m_hMenu = newMenu;
+
+    AppendMenuW(newMenu, MF_STRING, ID_BACKUP_NOW, L"今すぐバックアップ(&B)\tCtrl+Shift+S");
+    AppendMenuW(newMenu, MF_SEPARATOR, 0, NULL);
+
+    // 自動バックアップ ON/OFF
+    AppendMenuW(newMenu, MF_STRING | (g_settings.autoBackupEnabled ? MF_CHECKED : 0),
+        ID_TOGGLE_AUTO, L"自動バックアップ(&A)");
+
+    // 成功ダイアログ表示 ON/OFF
+    AppendMenuW(newMenu, MF_STRING | (g_settings.showSuccessDialog ? MF_CHECKED : 0),
+        ID_TOGGLE_DIALOG, L"完了通知を表示(&N)");
+
+    // パックファイル ON/OFF
+    AppendMenuW(newMenu, MF_STRING | (g_settings.usePackFiles ? MF_CHECKED : 0),
+        ID_TOGGLE_PACK, L"パックファイルにまとめる(&P)");
+
+    AppendMenuW(newMenu, MF_SEPARATOR, 0, NULL);
+
+    // バックアップ間隔サブメニュー
+    HMENU intervalMenu = CreatePopupMenu();
+    AppendMenuW(intervalMenu, MF_STRING | (g_settings.intervalMinutes == 1 ? MF_CHECKED : 0), ID_INTERVAL_1, L"1分");
+    AppendMenuW(intervalMenu, MF_STRING | (g_settings.intervalMinutes == 3 ? MF_CHECKED : 0), ID_INTERVAL_3, L"3分");
+    AppendMenuW(intervalMenu, MF_STRING | (g_settings.intervalMinutes == 5 ? MF_CHECKED : 0), ID_INTERVAL_5, L"5分");
+    AppendMenuW(intervalMenu, MF_STRING | (g_settings.intervalMinutes == 10 ? MF_CHECKED : 0), ID_INTERVAL_10, L"10分");
+    AppendMenuW(intervalMenu, MF_STRING | (g_settings.intervalMinutes == 15 ? MF_CHECKED : 0), ID_INTERVAL_15, L"15分");
+    AppendMenuW(intervalMenu, MF_STRING | (g_settings.intervalMinutes == 30 ? MF_CHECKED : 0), ID_INTERVAL_30, L"30分");
+    AppendMenuW(intervalMenu, MF_STRING | (g_settings.intervalMinutes == 60 ? MF_CHECKED : 0), ID_INTERVAL_60, L"60分");
+    AppendMenuW(newMenu, MF_POPUP, (UINT_PTR)intervalMenu, L"バックアップ間隔(&I) >");
+
+    // 最大ファイル数サブメニュー
+    HMENU maxFilesMenu = CreatePopupMenu();
+    AppendMenuW(maxFilesMenu, MF_STRING | (g_settings.maxBackupFiles == 10 ? MF_CHECKED : 0), ID_MAX_FILES_10, L"10個");
+    AppendMenuW(maxFilesMenu, MF_STRING | (g_settings.maxBackupFiles == 30 ? MF_CHECKED : 0), ID_MAX_FILES_30, L"30個");
+    AppendMenuW(maxFilesMenu, MF_STRING | (g_settings.maxBackupFiles == 50 ? MF_CHECKED : 0), ID_MAX_FILES_50, L"50個");
+    AppendMenuW(maxFilesMenu, MF_STRING | (g_settings.maxBackupFiles == 100 ? MF_CHECKED : 0), ID_MAX_FILES_100, L"100個");
+    AppendMenuW(maxFilesMenu, MF_STRING | (g_settings.maxBackupFiles == 9999 ? MF_CHECKED : 0), ID_MAX_FILES_UNLIMITED, L"無制限");
+    AppendMenuW(newMenu, MF_POPUP, (UINT_PTR)maxFilesMenu, L"最大バックアップ数(&M) >");
+
+    AppendMenuW(newMenu, MF_SEPARATOR, 0, NULL);
+    AppendMenuW(newMenu, MF_STRING, ID_RESTORE_MODEL, L"選択中のモデルのキーフレームをバックアップから復元(&R)...");
+    AppendMenuW(newMenu, MF_STRING, ID_FIND_SIMILAR, L"今のシーンに似たバックアップを探す(&F)");
+    AppendMenuW(newMenu, MF_STRING, ID_DUMP_TRACE, L"計測トレースを出力(&T)");
+    AppendMenuW(newMenu, MF_STRING, ID_EMERGENCY_DRILL, L"緊急保存をテスト(&E)");
+    AppendMenuW(newMenu, MF_STRING, ID_POSE_BENCHMARK, L"ポーズ取得を計測(&G)");
+    AppendMenuW(newMenu, MF_STRING, ID_ABOUT, L"このプラグインについて(&H)");
+
+    InsertMenuW(menu, GetMenuItemCount(menu) - 1, MF_POPUP | MF_BYPOSITION, (UINT_PTR)newMenu, L"自動バックアップ(&K)");
+    DrawMenuBar(getHWND());
+}
+
+void CPlugin::updateMenu() {
+    if (!m_hMenu) return;
+
+    // メニューアイテムのチェック状態を更新
+    CheckMenuItem(m_hMenu, ID_TOGGLE_AUTO, g_settings.autoBackupEnabled ? MF_CHECKED : MF_UNCHECKED);
+    CheckMenuItem(m_hMenu, ID_TOGGLE_DIALOG, g_settings.showSuccessDialog ? MF_CHECKED : MF_UNCHECKED);
+    CheckMenuItem(m_hMenu, ID_TOGGLE_PACK, g_settings.usePackFiles ? MF_CHECKED : MF_UNCHECKED);
+
+    // メニューを再描画
+    DrawMenuBar(getHWND());
+}
+
+UINT CPlugin::getBackupMenuId() const { return ID_BACKUP_NOW; }
+UINT CPlugin::getAboutMenuId() const { return ID_ABOUT; }
+
+bool CPlugin::dumpTrace(const fs::path& path) const {
+    return m_metrics.writeChromeTrace(path);
+}
+
+void CPlugin::checkEmergencyDumps(const fs::path& pluginDir) {
+    for (const auto& dumpPath : EmergencySnapshot::findLeftovers(pluginDir)) {
+        emergency::Dump dump;
+        if (!emergency::Read(dumpPath, dump) || dump.keyframeCount() == 0) {
+            // 書き出す前に終了したものは残しても使えない
+            fs::remove(dumpPath);
+            continue;
+        }
+
+        time_t dumpTime = static_cast<time_t>(dump.time);
+        tm dumpTm;
+        localtime_s(&dumpTm, &dumpTime);
+        std::wstringstream when;
+        when << std::put_time(&dumpTm, L"%Y%m%d_%H%M%S");
+
+        std::wstringstream msg;
+        msg << L"前回 MMD が異常終了したときのキーフレームが緊急保存されています。\n\n"
+            << L"プロジェクト: " << (dump.pmmPath.empty() ? L"(未保存)" : dump.pmmPath) << L"\n"
+            << L"時刻: " << std::put_time(&dumpTm, L"%Y/%m/%d %H:%M:%S") << L"\n"
+            << L"モデル: " << dump.models.size() << L"、キーフレーム: " << dump.keyframeCount() << L"\n";
+        if (!dump.complete) msg << L"（書き出しが途中で止まっているため、一部のみです）\n";
+        msg << L"\nモデルごとの VMD として復元しますか？\n（「いいえ」を選ぶと破棄します）";
+        if (MessageBoxW(getHWND(), msg.str().c_str(), L"緊急保存からの復元", MB_YESNO | MB_ICONQUESTION) != IDYES) {
+            fs::remove(dumpPath);
+            continue;
+        }
+
+        // 元の pmm の Backup フォルダへ。未保存だった場合はプラグインのフォルダへ
+        fs::path pmmPath(dump.pmmPath);
+        fs::path outDir = dump.pmmPath.empty() ?
+            pluginDir / (L"Emergency_" + when.str()) :
+            pmmPath.parent_path() / L"Backup" / (pmmPath.stem().wstring() + L"_emergency_" + when.str());
+        std::vector<fs::path> files;
+        if (EmergencySnapshot::recover(dump, outDir, files)) {
+            fs::remove(dumpPath);
+            std::wstring done = L"VMD を " + std::to_wstring(files.size()) + L" 個復元しました:\n" + outDir.wstring() +
+                L"\n\n元のプロジェクトを開き、各モデルに読み込んでください。";
+            MessageBoxW(getHWND(), done.c_str(), L"緊急保存からの復元", MB_OK | MB_ICONINFORMATION);
+        }
+        else {
+            std::wstring failed = L"VMD の書き出しに失敗しました。\n緊急保存ファイルは残しておきます:\n" + dumpPath.wstring();
+            MessageBoxW(getHWND(), failed.c_str(), L"エラー", MB_OK | MB_ICONERROR);
+        }
+    }
+}
+
+void CPlugin::runEmergencyDrill() {
+    if (!m_emergency.armed()) {
+        MessageBoxW(getHWND(), L"緊急保存が無効です。\nAutoBackup.ini の EmergencyArenaMB を設定してください。", L"緊急保存", MB_OK | MB_ICONWARNING);
+        return;
+    }
+
+    // 異常終了時と同じ処理で書き出し、読み戻せるかと所要時間を確認する
+    fs::path testPath = g_settings.settingsPath.parent_path() / L"AutoBackup_emergency_test.dump";
+    EmergencySnapshot::DrillResult result;
+    bool ok = m_emergency.capture(testPath, result);
+    emergency::Dump dump;
+    ok = ok && emergency::Read(testPath, dump) && dump.complete;
+    fs::remove(testPath);
+
+    if (!ok) {
+        MessageBoxW(getHWND(), L"緊急保存のテストに失敗しました。", L"エラー", MB_OK | MB_ICONERROR);
+        return;
+    }
+    wchar_t msg[512];
+    swprintf_s(msg,
+        L"緊急保存のテストが完了しました。\n\n"
+        L"・所要時間: %.1f ms\n"
+        L"・サイズ: %.2f MB（領域 %d MB）\n"
+        L"・モデル: %u、キーフレーム: %u\n%s",
+        result.elapsedNs / 1e6, result.bytes / (1024.0 * 1024.0), g_settings.emergencyArenaMB,
+        static_cast<unsigned>(dump.models.size()), static_cast<unsigned>(dump.keyframeCount()),
+        result.truncated ? L"\n領域が足りず一部のモデルが途中までになりました。EmergencyArenaMB を増やしてください。" : L"");
+    MessageBoxW(getHWND(), msg, L"緊急保存", MB_OK | MB_ICONINFORMATION);
+}
+
+bool CPlugin::captureKeyframes(std::vector<uint8_t>& image) {
+    // 領域は例外時に取り合わないよう、緊急保存用とは別に確保する。
+    // 自動バックアップ（ワーカースレッド）は持ち続ける領域を使い、手動・検索（UI スレッド）はその場で確保する
+    size_t arenaBytes = (g_settings.emergencyArenaMB > 0 ? static_cast<size_t>(g_settings.emergencyArenaMB) : 64) * 1024 * 1024;
+    EmergencySnapshot::DrillResult result;
+    if (std::this_thread::get_id() == m_thread.get_id()) {
+        return m_workerCapture.reserve(arenaBytes) && m_workerCapture.capture(image, result);
+    }
+    EmergencySnapshot writer;
+    return writer.reserve(arenaBytes) && writer.capture(image, result);
+}
+
+void CPlugin::benchmarkPoseCapture() {
+    if (!m_pose.available()) {
+        MessageBoxW(getHWND(), L"MMDExport の関数が見つかりません。", L"ポーズ取得の計測", MB_OK | MB_ICONWARNING);
+        return;
+    }
+
+    // メニューの処理は描画と同じスレッドなので、ここから Exp* を呼んでよい
+    const int iterations = 100;
+    PoseFrame naive;
+    PoseFrame bulk;
+    m_pose.capture(bulk);   // 構成の数え直しと配列の確保を計測から外す
+    uint64_t start = m_metrics.nowNs();
+    for (int i = 0; i < iterations; i++) m_pose.captureNaive(naive);
+    uint64_t naiveNs = m_metrics.nowNs() - start;
+    start = m_metrics.nowNs();
+    for (int i = 0; i < iterations; i++) m_pose.capture(bulk);
+    uint64_t bulkNs = m_metrics.nowNs() - start;
+
+    // チェックポイントの大きさと量子化の誤差
+    std::vector<uint8_t> encoded;
+    start = m_metrics.nowNs();
+    pose::EncodeCheckpoint(bulk, encoded);
+    uint64_t encodeNs = m_metrics.nowNs() - start;
+    PoseFrame decoded;
+    float matrixError = 0;
+    float morphError = 0;
+    if (pose::DecodeCheckpoint(encoded.data(), encoded.size(), decoded)) {
+        for (size_t i = 0; i < bulk.boneMatrices.size(); i++) {
+            matrixError = (std::max)(matrixError, std::fabs(bulk.boneMatrices[i] - decoded.boneMatrices[i]));
+        }
+        for (size_t i = 0; i < bulk.morphWeights.size(); i++) {
+            morphError = (std::max)(morphError, std::fabs(bulk.morphWeights[i] - decoded.morphWeights[i]));
+        }
+    }
+
+    wchar_t msg[768];
+    swprintf_s(msg,
+        L"ポーズ取得の計測（%d 回の平均）\n\n"
+        L"・モデル: %u、ボーン: %u、モーフ: %u\n"
+        L"・1要素ずつ取得: %.3f ms/フレーム\n"
+        L"・まとめて取得: %.3f ms/フレーム\n\n"
+        L"チェックポイント (.pose):\n"
+        L"・サイズ: %.1f KB（量子化前 %.1f KB）\n"
+        L"・変換: %.3f ms\n"
+        L"・最大誤差: 行列の要素 %.5f、モーフ値 %.5f",
+        iterations,
+        static_cast<unsigned>(bulk.modelCount()), static_cast<unsigned>(bulk.boneCount()), static_cast<unsigned>(bulk.morphWeights.size()),
+        naiveNs / 1e6 / iterations, bulkNs / 1e6 / iterations,
+        encoded.size() / 1024.0, bulk.rawBytes() / 1024.0, encodeNs / 1e6,
+        matrixError, morphError);
+    MessageBoxW(getHWND(), msg, L"ポーズ取得の計測", MB_OK | MB_ICONINFORMATION);
+}
+
+void CPlugin::backupMotion() {
+    // 開いているプロジェクトの隣の Backup に置く（未保存のプロジェクトは対象外）
+    MMDMainData* mmdData = peekMMDMainData();
+    if (!mmdData) return;
+    wchar_t pmmPath[256];
+    memcpy(pmmPath, mmdData->pmm_path, sizeof(pmmPath));
+    pmmPath[255] = L'\0';
+    if (pmmPath[0] == L'\0') return;
+    fs::path currentPmmPath(pmmPath);
+
+    // 写しが前回から変わっていなければ、取り込むまでもなく同じ内容になる
+    if (m_motionMirrorVersion != 0 && m_mirror.version() == m_motionMirrorVersion) return;
+
+    StageTimer timer(m_metrics, BackupStage::Motion);
+    size_t arenaMB = g_settings.emergencyArenaMB > 0 ? static_cast<size_t>(g_settings.emergencyArenaMB) : 64;
+    EmergencySnapshot::DrillResult captured;
+    if (!m_workerCapture.reserve(arenaMB * 1024 * 1024) || !m_workerCapture.capture(m_motionImage, captured)) return;
+
+    MotionStore store(currentPmmPath.parent_path() / L"Backup", currentPmmPath.stem().wstring());
+    MotionStore::Result result;
+    if (!store.add(m_motionImage, static_cast<int64_t>(time(nullptr)), m_executor, result)) return;
+    m_motionMirrorVersion = m_mirror.version();
+    if (result.added && g_settings.maxBackupFiles < 9999) store.applyRetention(g_settings.maxBackupFiles);
+}
+
+// 復元の前に、トラックを先頭（フレーム 0）のキーフレームだけにする。MMD の VMD 読み込みは今のキーフレームに
+// 重ねるだけなので、残しておくとバックアップの後に打ったキーフレームが残ってしまう。
+// 外したキーフレームはフレーム番号と前後のつながりだけを 0 にする（値や表示・IK のポインタには触れない）
+static const uint32_t kMaxChainSteps = 1 << 22;
+
+static void unlinkKey(MMDModelData::BoneKeyFrame& k) { k.frame_number = 0; k.pre_index = 0; k.next_index = 0; }
+static void unlinkKey(MMDModelData::MorphKeyFrame& k) { k.frame_number = 0; k.pre_index = 0; k.next_index = 0; }
+static void unlinkKey(MMDModelData::ConfigurationKeyFrame& k) { k.frame_number = 0; k.pre_index = 0; k.next_index = 0; }
+static void unlinkKey(CameraKeyFrameData& k) { k.frame_no = 0; k.pre_index = 0; k.next_index = 0; }
+
+// 外しながら進むので、つながりが輪になっていても止まる
+template <typename Key>
+static void truncateTrack(Key* keys, int head, int limit) {
+    int index = keys[head].next_index;
+    keys[head].next_index = 0;
+    for (uint32_t step = 0; step < kMaxChainSteps && index > 0 && index < limit; step++) {
+        Key& k = keys[index];
+        index = k.next_index;
+        unlinkKey(k);
+    }
+}
+
+// 以下の2つは C++ オブジェクトを持たない関数にして SEH で保護する
+static bool guardedTruncateModel(MMDModelData* model) {
+    __try {
+        for (int b = 0; b < model->bone_count && b < 0x10000; b++) truncateTrack(model->bone_keyframe, b, INT_MAX);
+        for (int m = 0; m < model->morph_count && m < 0x10000; m++) truncateTrack(model->morph_keyframe, m, INT_MAX);
+        truncateTrack(model->configuration_keyframe, 0, INT_MAX);
+        return true;
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return false;
+    }
+}
+
+static bool guardedTruncateCamera(MMDMainData* data) {
+    __try {
+        truncateTrack(data->camera_key_frame, 0, 10000);
+        return true;
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return false;
+    }
+}
+
+// バックアップの .kfs から選択中のモデル（またはカメラ）のキーフレームを取り出して置き換える。
+// 今のキーフレームを先頭だけにしてから、取り出したものを VMD にして MMD 自身に読み込ませる
+// （キーフレームの領域の確保は MMD に任せる）
+void CPlugin::restoreSelectedModel() {
+    MMDMainData* mmdData = mmp::getMMDMainData();
+    fs::path currentPmmPath = getCurrentPmmPath();
+    if (!mmdData || currentPmmPath.empty()) {
+        MessageBoxW(getHWND(), L"PMMファイルが保存されていないか、見つかりません。", L"エラー", MB_OK | MB_ICONWARNING);
+        return;
+    }
+
+    // カメラ・照明・アクセサリを操作中ならカメラ、そうでなければ選択中のモデルが対象
+    bool camera = mmdData->is_camera_select != 0;
+    MMDModelData* model = nullptr;
+    int slot = mmdData->select_model;
+    if (!camera) {
+        if (slot >= 0 && slot < 255) model = mmdData->model_data[slot];
+        if (!model) {
+            MessageBoxW(getHWND(), L"キーフレームを復元するモデルを選択してください。", L"バックアップから復元", MB_OK | MB_ICONWARNING);
+            return;
+        }
+    }
+
+    std::wstring initialDir = (currentPmmPath.parent_path() / L"Backup").wstring();
+    wchar_t file[MAX_PATH] = {};
+    OPENFILENAMEW ofn = {};
+    ofn.lStructSize = sizeof(ofn);
+    ofn.hwndOwner = getHWND();
+    ofn.lpstrFilter = L"バックアップのキーフレーム (*.kfs)\0*.kfs\0";
+    ofn.lpstrFile = file;
+    ofn.nMaxFile = MAX_PATH;
+    ofn.lpstrInitialDir = initialDir.c_str();
+    ofn.lpstrTitle = L"キーフレームを取り出すバックアップを選択";
+    ofn.Flags = OFN_FILEMUSTEXIST | OFN_PATHMUSTEXIST | OFN_NOCHANGEDIR;
+    if (!GetOpenFileNameW(&ofn)) return;
+    fs::path kfsPath(file);
+
+    // 目次だけを読み、対象のセクションだけを読み込む（他のモデルの分には触れない）
+    auto start = std::chrono::steady_clock::now();
+    std::vector<emergency::SectionInfo> sections;
+    if (!emergency::ReadDirectory(kfsPath, sections)) {
+        MessageBoxW(getHWND(), L"キーフレームの読み込みに失敗しました。", L"エラー", MB_OK | MB_ICONERROR);
+        return;
+    }
+    std::string modelName = model ? std::string(model->name_jp, strnlen(model->name_jp, sizeof(model->name_jp))) : std::string();
+    const emergency::SectionInfo* found = nullptr;
+    for (const auto& section : sections) {
+        if (camera ? section.kind == emergency::SectionCamera :
+            section.kind == emergency::SectionModel && section.filePath == model->file_path) {
+            found = &section;
+            break;
+        }
+    }
+    // モデルのファイルを移動した場合は名前で探す
+    for (size_t i = 0; !found && !camera && i < sections.size(); i++) {
+        if (sections[i].kind == emergency::SectionModel && sections[i].name == modelName) found = &sections[i];
+    }
+
+    std::wstring wname = camera ? L"カメラ" : SjisToWide(modelName);
+    if (!found) {
+        std::wstring msg = L"このバックアップには「" + wname + L"」のキーフレームがありません。";
+        MessageBoxW(getHWND(), msg.c_str(), L"バックアップから復元", MB_OK | MB_ICONWARNING);
+        return;
+    }
+    emergency::Dump dump;
+    if (!emergency::ReadSection(kfsPath, *found, dump) || (!camera && dump.models.empty())) {
+        MessageBoxW(getHWND(), L"キーフレームの読み込みに失敗しました。", L"エラー", MB_OK | MB_ICONERROR);
+        return;
+    }
+    const VmdMotion& motion = camera ? dump.camera : dump.models.front().motion;
+    size_t keyframes = motion.cameras.size() + motion.bones.size() + motion.morphs.size() + motion.showIk.size();
+
+    // MMD 自身の読み込み処理を使うため、一時的な VMD にしてドロップする
+    wchar_t tempDir[MAX_PATH];
+    GetTempPathW(MAX_PATH, tempDir);
+    fs::path vmdPath = fs::path(tempDir) / L"AutoBackup_restore.vmd";
+    if (!WriteVmd(vmdPath, motion)) {
+        MessageBoxW(getHWND(), L"VMD の書き出しに失敗しました。", L"エラー", MB_OK | MB_ICONERROR);
+        return;
+    }
+    double elapsedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    wchar_t msg[1024];
+    swprintf_s(msg,
+        L"「%s」のキーフレームを、バックアップ時の内容に置き換えます。\n\n"
+        L"・バックアップ: %s\n"
+        L"・キーフレーム: %u%s\n"
+        L"・読み込み: %.1f ms\n\n"
+        L"今の「%s」のキーフレームは、バックアップの後に打ったものも含めてすべて消えます。\n"
+        L"ほかのモデル%sは変更されません。\n"
+        L"この操作は MMD の「元に戻す」では戻せません。\n\n"
+        L"置き換えますか？",
+        wname.c_str(), kfsPath.stem().c_str(), static_cast<unsigned>(keyframes),
+        (found->flags & emergency::SectionTruncated) ? L"（保存時に途中まで）" : L"", elapsedMs,
+        wname.c_str(), camera ? L"" : L"とカメラ");
+    if (MessageBoxW(getHWND(), msg, L"バックアップから復元", MB_YESNO | MB_ICONWARNING | MB_DEFBUTTON2) != IDYES) return;
+
+    // 確認している間に選択が変わったり、モデルが削除されたりしていないか確かめる
+    if ((mmdData->is_camera_select != 0) != camera || (!camera && (mmdData->select_model != slot || mmdData->model_data[slot] != model))) {
+        MessageBoxW(getHWND(), L"選択中のモデルが変わったため、中止しました。", L"バックアップから復元", MB_OK | MB_ICONWARNING);
+        return;
+    }
+    if (!(camera ? guardedTruncateCamera(mmdData) : guardedTruncateModel(model))) {
+        MessageBoxW(getHWND(), L"今のキーフレームを消せませんでした。", L"エラー", MB_OK | MB_ICONERROR);
+        return;
+    }
+    // MMD はモーションを今のフレームを 0 として読み込むので、読み込む間だけフレーム 0 にする
+    int nowFrame = mmdData->now_frame;
+    mmdData->now_frame = 0;
+    bool opened = openInMmd(vmdPath, true);
+    mmdData->now_frame = nowFrame;
+    if (!opened) {
+        MessageBoxW(getHWND(), L"キーフレームの復元に失敗しました。", L"エラー", MB_OK | MB_ICONERROR);
+    }
+}
+
+void CPlugin::findSimilarBackups() {
+    fs::path currentPmmPath = getCurrentPmmPath();
+    if (currentPmmPath.empty()) {
+        MessageBoxW(getHWND(), L"PMMファイルが保存されていないか、見つかりません。", L"エラー", MB_OK | MB_ICONWARNING);
+        return;
+    }
+
+    // 今のシーンはバックアップ時と同じ方法で要約する（ファイルには書かない）
+    std::vector<uint8_t> image;
+    SceneSketch live;
+    bool captured = captureKeyframes(image) && SketchImage(image.data(), image.size(), live);
+    BackupCatalog catalog(currentPmmPath.parent_path() / L"Backup", currentPmmPath.stem().wstring());
+    if (!captured || !catalog.load()) {
+        MessageBoxW(getHWND(), L"シーンまたはバックアップ一覧の読み込みに失敗しました。", L"エラー", MB_OK | MB_ICONERROR);
+        return;
+    }
+
+    // 一覧のスケッチだけで並べる（バックアップ本体は開かない）
+    auto start = std::chrono::steady_clock::now();
+    std::vector<CatalogMatch> matches = catalog.rankBySimilarity(live);
+    double elapsedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (matches.empty()) {
+        MessageBoxW(getHWND(), L"比較できるバックアップがありません。\n（KeyframeSnapshots=1 で作成したバックアップが対象です）", L"似ているバックアップ", MB_OK | MB_ICONINFORMATION);
+        return;
+    }
+
+    std::wstringstream msg;
+    msg << L"今のシーンに似ているバックアップ（" << matches.size() << L" 件中、"
+        << std::fixed << std::setprecision(2) << elapsedMs << L" ms）:\n\n";
+    for (size_t i = 0; i < matches.size() && i < 10; i++) {
+        const CatalogMatch& m = matches[i];
+        msg << std::setprecision(1) << std::setw(5) << m.similarity * 100 << L"%  " << Utf8ToWide(m.entry->name);
+        std::vector<std::string> differing = SketchDifferingModels(live, m.entry->sketch);
+        if (!differing.empty()) {
+            msg << L"\n        違うモデル: ";
+            for (size_t j = 0; j < differing.size() && j < 4; j++) {
+                msg << (j ? L"、" : L"") << (differing[j] == VmdCameraModelName ? std::wstring(L"カメラ") : SjisToWide(differing[j]));
+            }
+            if (differing.size() > 4) msg << L" ほか " << differing.size() - 4;
+        }
+        msg << L"\n";
+    }
+    MessageBoxW(getHWND(), msg.str().c_str(), L"似ているバックアップ", MB_OK | MB_ICONINFORMATION);
+}
+
+fs::path CPlugin::getCurrentPmmPath() {
+    std::wstring path;
+    getCurrentPmmPath(path);
+    return fs::path(path);
+}
+
+bool CPlugin::getCurrentPmmPath(std::wstring& out) {
+    // ウィンドウタイトルからPMMファイルパスを取得
+    wchar_t windowTitle[MAX_PATH];
+    int length = GetWindowTextW(getHWND(), windowTitle, MAX_PATH);
+    const wchar_t* title = windowTitle;
+    const wchar_t* titleEnd = title + (std::max)(length, 0);
+    const wchar_t* startPos = std::find(title, titleEnd, L'[');
+    const wchar_t* endPos = std::find(title, titleEnd, L']');
+
+    if (startPos == titleEnd || endPos == titleEnd || startPos >= endPos) {
+        // タイトルから取得できない場合はMMDMainDataから取得
+        auto mmdData = mmp::getMMDMainData();
+        if (mmdData && mmdData->pmm_path[0] != L'\0') {
+            out.assign(mmdData->pmm_path);
+            return true;
+        }
+        out.clear();
+        return false;
+    }
+
+    out.assign(startPos + 1, endPos);
+    return true;
+}
+
+void CPlugin::compactPacks() {
+    fs::path currentPmmPath = getCurrentPmmPath();
+    if (currentPmmPath.empty()) return;
+
+    StageTimer timer(m_metrics, BackupStage::Compaction);
+    PackStore store(currentPmmPath.parent_path() / L"Backup", currentPmmPath.stem().wstring());
+    store.compact(0.5, &m_ioBucket);
+}
+
+bool CPlugin::isIdle() {
+    // 再生中・動画出力中は避ける
+    if (m_renderMonitor.isBusy(m_metrics.nowNs())) return false;
+
+    // キーフレームを編集している間も避ける（写しの更新で検出する）
+    if (std::chrono::steady_clock::now() - m_lastKeyframeEdit < std::chrono::seconds(60)) return false;
+
+    // MMDがアクティブなら、しばらく入力が無いときだけ
+    if (GetForegroundWindow() != getHWND()) return true;
+    LASTINPUTINFO info = { sizeof(info) };
+    return GetLastInputInfo(&info) && GetTickCount() - info.dwTime >= 60 * 1000;
+}
+
+void CPlugin::recompressColdBackups() {
+    fs::path currentPmmPath = getCurrentPmmPath();
+    if (currentPmmPath.empty()) return;
+    fs::path backupDir = currentPmmPath.parent_path() / L"Backup";
+    if (!fs::exists(backupDir)) return;
+
+    // 次の自動バックアップの時刻になったら、それを優先して中断する（済んだ分は残る）
+    auto deadline = m_lastBackupTime + std::chrono::minutes(g_settings.intervalMinutes);
+    auto keepGoing = [this, deadline]() {
+        return m_isThreadRunning && std::chrono::steady_clock::now() < deadline && isIdle();
+    };
+
+    uint64_t start = m_metrics.nowNs();
+    int64_t olderThan = static_cast<int64_t>(time(nullptr)) - static_cast<int64_t>(g_settings.coldTierHours) * 3600;
+    PackStore store(backupDir, currentPmmPath.stem().wstring());
+    if (store.recompress(olderThan, lz::HighLevel, &m_ioBucket, keepGoing, &m_executor) > 0) {
+        m_metrics.record(BackupStage::Recompress, start, m_metrics.nowNs());
+        // 元の無圧縮レコードは不要領域になるので詰め直す
+        m_compactionDue = true;
+    }
+}
+
+bool CPlugin::PluginHost::requestSave() {
+    // 現在の状態を保存（Ctrl+S相当）
+    m_plugin.m_pluginSaving = true;
+    SendMessage(getHWND(), WM_COMMAND, 57603, 0);  // ID_FILE_SAVE
+    m_plugin.m_pluginSaving = false;
+    return true;
+}
+
+void CPlugin::PluginHost::waitSaved() {
+    Sleep(300);  // 保存完了を待つ
+}
+
+void CPlugin::PluginHost::stored(const fs::path& backupDir, const std::wstring& name) {
+    // 次の表示でビューポートを縮小して読み戻し、保存はワーカースレッドで行う
+    if (g_settings.thumbnails) {
+        BuildPath(m_job.thumbPath, backupDir, name, L".thumb.bmp");
+        m_plugin.m_thumbnail.request(m_job.thumbPath);
+    }
+    if (g_settings.poseCheckpoints) m_plugin.m_pose.request(backupDir / (name + L".pose"));
+}
+
+bool CPlugin::PluginHost::captureKeyframes(std::vector<uint8_t>& image, int64_t) {
+    return m_plugin.captureKeyframes(image);
+}
+
+void CPlugin::triggerSave(bool forceDialog) {
+    StageTimer totalTimer(m_metrics, BackupStage::Total);
+    uint64_t cycleStart = m_metrics.nowNs();
+    // 自動バックアップ（ワーカースレッド）の分は持ち続けて使い回す。手動は UI スレッドなのでその場で作る
+    bool automatic = std::this_thread::get_id() == m_thread.get_id();
+    SaveJob manual;
+    SaveJob& job = automatic ? m_autoSave : manual;
+
+    if (!getCurrentPmmPath(job.pmmPath) || !NativeExists(job.pmmPath)) {
+        MessageBoxW(getHWND(), L"PMMファイルが保存されていないか、見つかりません。\n先に名前を付けて保存してください。", L"エラー", MB_OK | MB_ICONWARNING);
+        return;
+    }
+
+    // バックアップ中のフレーム時間を別集計する
+    m_renderMonitor.beginBackup();
+
+    BackupPolicy policy;
+    policy.usePackFiles = g_settings.usePackFiles;
+    policy.maxBackupFiles = g_settings.maxBackupFiles;
+    if (!job.engine || job.engine->pmmPath().native() != job.pmmPath ||
+        job.engine->policy().usePackFiles != policy.usePackFiles || job.engine->policy().maxBackupFiles != policy.maxBackupFiles) {
+        job.engine.reset(new BackupEngine(job.pmmPath, policy));
+        m_live.setProject(WideToUtf8(job.engine->stem()));
+    }
+    BackupEngine& engine = *job.engine;
+    int64_t now = static_cast<int64_t>(time(nullptr));
+
+    // 保存 → 格納 → キーフレーム → 一覧 → 世代整理（BackupTool simulate と同じ手順）。
+    // 自動バックアップのみ帯域を制限する。手動はUIスレッドなので待たせない
+    PluginHost host(*this, job);
+    TokenBucket* bucket = automatic ? &m_ioBucket : nullptr;
+    if (job.cycle.run(host, engine, now, bucket, g_settings.keyframeSnapshots, m_metrics)) {
+        const BackupCycleResult& result = job.cycle.result();
+        // 異常終了時に探すプロジェクトとして覚えておく
+        m_session.setProject(job.pmmPath);
+        // パックの詰め直しはワーカースレッドで行う
+        if (result.compactionDue) m_compactionDue = true;
+
+        // 複製は専用のスレッドで行う（ここでは頼むだけで待たない）
+        if (m_replicator.running()) m_replicator.enqueue(engine.backupDir(), engine.stem());
+
+        m_renderMonitor.endBackup();
+        m_live.backupFinished(now, m_metrics.nowNs() - cycleStart, result.storedBytes, engine.storedBytes());
+
+        // 成功メッセージ（設定または強制表示）
+        if (g_settings.showSuccessDialog || forceDialog) {
+            std::wstring msg = L"バックアップを作成しました:\n" + job.cycle.savedName();
+            MessageBoxW(getHWND(), msg.c_str(), L"バックアップ完了", MB_OK | MB_ICONINFORMATION);
+        }
+
+        // 最後のバックアップ時刻を更新
+        m_lastBackupTime = std::chrono::steady_clock::now();
+
+    }
+    else {
+        m_renderMonitor.endBackup();
+        m_live.backupFailed();
+        MessageBoxW(getHWND(), L"バックアップに失敗しました。", L"エラー", MB_OK | MB_ICONERROR);
+    }
+}
+
+void CPlugin::offerRecovery() {
+    for (const auto& project : m_recoveryProjects) {
+        if (!m_isThreadRunning) return;
+
+        // 一覧から探す（Backup フォルダは走査しない）
+        BackupCatalog catalog(project.parent_path() / L"Backup", project.stem().wstring());
+        if (!catalog.load()) continue;
+        const CatalogEntry* newest = catalog.newestValid();
+        if (!newest) continue;
+
+        time_t backupTime = static_cast<time_t>(newest->time);
+        tm backupTm;
+        localtime_s(&backupTm, &backupTime);
+        std::wstringstream stamp;
+        stamp << std::put_time(&backupTm, L"%Y%m%d_%H%M%S");
+        fs::path restored = project.parent_path() / (project.stem().wstring() + L"_recovered_" + stamp.str() + L".pmm");
+
+        std::wstringstream msg;
+        msg << L"前回の MMD は正常に終了しませんでした。\n\n"
+            << L"プロジェクト: " << project.wstring() << L"\n"
+            << L"最新のバックアップ: " << Utf8ToWide(newest->name)
+            << L" (" << std::put_time(&backupTm, L"%Y/%m/%d %H:%M:%S") << L")\n\n"
+            << L"このバックアップを開きますか？\n"
+            << L"（" << restored.filename().wstring() << L" として元のフォルダに復元してから開きます）";
+        if (MessageBoxW(getHWND(), msg.str().c_str(), L"バックアップからの復元", MB_YESNO | MB_ICONQUESTION) != IDYES) continue;
+
+        if (!restoreSnapshot(catalog, *newest, restored) || !openInMmd(restored)) {
+            MessageBoxW(getHWND(), L"バックアップの復元に失敗しました。", L"エラー", MB_OK | MB_ICONERROR);
+        }
+        // MMD で開けるプロジェクトは1つなので、最初に復元したところで終える
+        return;
+    }
+}
+
+bool CPlugin::restoreSnapshot(const BackupCatalog& catalog, const CatalogEntry& entry, const fs::path& restored) {
+    fs::path restoredEmm = restored;
+    restoredEmm.replace_extension(L".emm");
+    fs::path source = catalog.backupDir() / Utf8ToWide(entry.location);
+
+    if (entry.storage == CatalogStorage::Pack) {
+        PackFile pack(source);
+        if (!pack.load()) return false;
+        const PackEntry* packed = pack.find(entry.name);
+        return packed && pack.extract(*packed, restored, restoredEmm, nullptr, &m_executor);
+    }
+
+    if (!CopyFileThrottled(source, restored, nullptr)) return false;
+    fs::path sourceEmm = source;
+    sourceEmm.replace_extension(L".emm");
+    if (fs::exists(sourceEmm)) CopyFileThrottled(sourceEmm, restoredEmm, nullptr);
+    return true;
+}
+
+bool CPlugin::openInMmd(const fs::path& filePath, bool wait) {
+    // ファイルをウィンドウにドロップしたのと同じ扱いで開かせる
+    // （pmm は編集中の内容の保存確認も MMD が行う。vmd は選択中のモデルかカメラに読み込まれる）
+    std::wstring path = filePath.wstring();
+    size_t bytes = sizeof(DROPFILES) + (path.size() + 2) * sizeof(wchar_t);
+    HGLOBAL hDrop = GlobalAlloc(GHND, bytes);
+    if (!hDrop) return false;
+    DROPFILES* drop = static_cast<DROPFILES*>(GlobalLock(hDrop));
+    drop->pFiles = sizeof(DROPFILES);
+    drop->fWide = TRUE;
+    memcpy(reinterpret_cast<BYTE*>(drop) + sizeof(DROPFILES), path.c_str(), path.size() * sizeof(wchar_t));
+    GlobalUnlock(hDrop);
+    // hDrop は MMD が DragFinish で解放する
+    if (wait) {
+        SendMessageW(getHWND(), WM_DROPFILES, reinterpret_cast<WPARAM>(hDrop), 0);
+        return true;
+    }
+    if (!PostMessageW(getHWND(), WM_DROPFILES, reinterpret_cast<WPARAM>(hDrop), 0)) {
+        GlobalFree(hDrop);
+        return false;
+    }
+    return true;
+}
+
+void CPlugin::backupWorker() {
+    // 初回は少し待つ
+    std::this_thread::sleep_for(std::chrono::seconds(10));
+
+    // 前回が異常終了だった場合は最新のバックアップを案内する（起動を遅らせないようここで行う）
+    if (m_isThreadRunning) offerRecovery();
+
+    m_lastBackupTime = std::chrono::steady_clock::now();
+
+    while (m_isThreadRunning) {
+        // 1秒ごとにチェック（延期中は停止をすぐ検出できるよう短く）
+        std::this_thread::sleep_for(m_backupPending ? std::chrono::milliseconds(100) : std::chrono::milliseconds(1000));
+
+        if (!m_isThreadRunning) break;
+
+        // 生きている印を兼ねて、複製と帯域制限の状態を公開する
+        m_live.heartbeat(m_replicator.queued(), m_ioBucket.throttledNs(), m_replicator.bytesSent(), m_replicator.failures());
+
+        // 開いているプロジェクトを起動中の印に記録する（タイトルの取得は UI スレッドへの送信になるので MMD のメモリから読む）
+        if (MMDMainData* mmdData = peekMMDMainData()) {
+            wchar_t pmmPath[256];
+            memcpy(pmmPath, mmdData->pmm_path, sizeof(pmmPath));
+            pmmPath[255] = L'\0';
+            if (pmmPath[0] != L'\0') {
+                m_workerPmmPath.assign(pmmPath);
+                m_session.setProject(m_workerPmmPath);
+            }
+        }
+
+        // キーフレームの写しを更新する。変わらないモデルは指紋を比べるだけ
+        {
+            uint64_t start = m_metrics.nowNs();
+            KeyframeMirror::RefreshResult refreshed = m_mirror.refresh();
+            if (refreshed.changed()) {
+                m_lastKeyframeEdit = std::chrono::steady_clock::now();
+                m_metrics.record(BackupStage::Mirror, start, m_metrics.nowNs());
+            }
+            if (m_recording) recordSession(refreshed);
+        }
+
+        // 読み戻し済みのサムネイルを縮小して保存する
+        if (m_thumbnail.take(m_thumbImage, m_thumbPath)) m_thumbnail.save(m_thumbImage, m_thumbPath);
+        {
+            PoseFrame pose;
+            fs::path posePath;
+            if (m_pose.take(pose, posePath)) PoseCapture::save(pose, posePath);
+        }
+
+        // 世代整理で空いたパックの領域を詰め直す（再生中は避ける）
+        if (m_compactionDue && !m_renderMonitor.isBusy(m_metrics.nowNs())) {
+            m_compactionDue = false;
+            BackgroundIoScope lowPriority(g_settings.lowPriorityIo);
+            compactPacks();
+        }
+
+        // 古いバックアップの再圧縮（パック使用時、MMDが操作されていない間だけ。10分ごとに確認）
+        if (g_settings.usePackFiles && g_settings.coldTierHours > 0 && !m_backupPending &&
+            std::chrono::steady_clock::now() >= m_nextColdCheck && isIdle()) {
+            m_nextColdCheck = std::chrono::steady_clock::now() + std::chrono::minutes(10);
+            BackgroundIoScope lowPriority(g_settings.lowPriorityIo);
+            recompressColdBackups();
+        }
+
+        // 自動バックアップが無効なら何もしない
+        if (!g_settings.autoBackupEnabled) continue;
+
+        // モーションだけのバックアップ（再生中・延期中は避ける）
+        if (g_settings.motionIntervalSeconds > 0 && !m_backupPending &&
+            std::chrono::steady_clock::now() - m_lastMotionBackup >= std::chrono::seconds(g_settings.motionIntervalSeconds) &&
+            !m_renderMonitor.isBusy(m_metrics.nowNs())) {
+            m_lastMotionBackup = std::chrono::steady_clock::now();
+            BackgroundIoScope lowPriority(g_settings.lowPriorityIo);
+            backupMotion();
+        }
+
+        // 経過時間をチェック
+        auto now = std::chrono::steady_clock::now();
+        auto elapsed = std::chrono::duration_cast<std::chrono::minutes>(now - m_lastBackupTime);
+
+        if (elapsed.count() >= g_settings.intervalMinutes || m_backupPending) {
+            // 再生中・動画出力中はフレーム落ちを避けるため延期する
+            if (m_renderMonitor.isBusy(m_metrics.nowNs())) {
+                m_backupPending = true;
+                continue;
+            }
+
+            // 延期していたバックアップは停止後すぐに実行する
+            if (m_backupPending) {
+                m_backupPending = false;
+                if (getCurrentPmmPath(m_workerPmmPath) && NativeExists(m_workerPmmPath)) {
+                    BackgroundIoScope lowPriority(g_settings.lowPriorityIo);
+                    triggerSave(false);
+                }
+                continue;
+            }
+
+            // MMDウィンドウがアクティブな場合のみバックアップ
+            if (GetForegroundWindow() == getHWND()) {
+                if (getCurrentPmmPath(m_workerPmmPath) && NativeExists(m_workerPmmPath)) {
+                    BackgroundIoScope lowPriority(g_settings.lowPriorityIo);
+                    triggerSave(false);  // 自動バックアップは設定に従う
+                }
+            }
+            else {
+                // アクティブでない場合も時間をリセット（次回アクティブ時に即バックアップしないように）
+                m_lastBackupTime = now;
+            }
+        }
+    }
+}
+
+// --- プラグインのエクスポート ---
+MMD_PLUGIN_API int version() {
+    return 3;
+}
+
+MMD_PLUGIN_API MMDPluginDLL3* create3(IDirect3DDevice9* device) {
+    if (g_pPlugin) g_pPlugin->setDevice(device);
+    return g_pPlugin;
+}
+
 MMD_PLUGIN_API void destroy3(MMDPluginDLL3*) {}
\ No newline at end of file
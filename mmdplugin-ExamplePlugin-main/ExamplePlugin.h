@@ -1,46 +1,195 @@
-﻿#pragma once
-#include "stdafx.h"
-#include <thread>
-#include <atomic>
-#include <chrono>
-#include <experimental/filesystem>
-
-namespace fs = std::experimental::filesystem;
-
-// MMDPlugin.h が提供する mmp 名前空間を利用する
-using namespace mmp;
-
-class CPlugin : public MMDPluginDLL3 {
-public:
-    CPlugin(HMODULE hModule);
-    ~CPlugin();
-
-    const char* getPluginTitle() const override { return "AutoBackup Plugin"; }
-    void start() override;
-    void stop() override;
-
-    // パブリックメソッド
-    void triggerSave();
-    void openBackupFolder();
-    void showSettings();
-    UINT getBackupMenuId() const;
-    UINT getAboutMenuId() const;
-
-private:
-    void createMenu();
-    fs::path getCurrentPmmPath();
-    void cleanupOldBackups(const fs::path& backupDir);
-
-    HMODULE m_hModule;
-    HMENU m_hMenu;  // メニューハンドル
-    UINT m_nBackupNowMenuId;
-    UINT m_nAboutMenuId;
-
-    // バックグラウンド処理用
-    std::thread m_thread;
-    std::atomic<bool> m_isThreadRunning;
-    void backupWorker();
-
-    // 最後のバックアップ時刻
-    std::chrono::steady_clock::time_point m_lastBackupTime;
+﻿#pragma once
+#include "stdafx.h"
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <experimental/filesystem>
+#include "BackupMetrics.h"
+#include "RenderMonitor.h"
+#include "BackupIo.h"
+#include "BackupPack.h"
+#include "EmergencySnapshot.h"
+#include "SessionMarker.h"
+#include "BackupCatalog.h"
+#include "BackupEngine.h"
+#include "BackupCycle.h"
+#include "ThumbnailCapture.h"
+#include "PoseCapture.h"
+#include "KeyframeMirror.h"
+#include "SessionTrace.h"
+#include "BackupReplica.h"
+#include "TaskExecutor.h"
+#include "LiveMetrics.h"
+
+namespace fs = std::experimental::filesystem;
+
+// MMDPlugin.h が提供する mmp 名前空間を利用する
+using namespace mmp;
+
+class CPlugin : public MMDPluginDLL3 {
+public:
+    CPlugin(HMODULE hModule);
+    ~CPlugin();
+
+    const char* getPluginTitle() const override { return "AutoBackup Plugin"; }
+    void start() override;
+    void stop() override;
+
+    // 表示前のバックバッファからサムネイルを取る
+    void Present(CONST RECT* pSourceRect, CONST RECT* pDestRect, HWND hDestWindow, CONST RGNDATA* pDirtyRegion) override;
+    // デバイスのリセット前に D3DPOOL_DEFAULT のリソースを手放す
+    void Reset(D3DPRESENT_PARAMETERS* pPresentationParameters) override;
+    // 描画フレームごとに再生・出力状態を更新する
+    void PostPresent(CONST RECT* pSourceRect, CONST RECT* pDestRect, HWND hDestWindow, CONST RGNDATA* pDirtyRegion, HRESULT& res) override;
+    // 編集セッションの記録用に入力を数える
+    void KeyBoardProc(WPARAM wParam, LPARAM lParam) override;
+    void MouseProc(WPARAM wParam, const MOUSEHOOKSTRUCT* param) override;
+
+    // パブリックメソッド
+    void setDevice(IDirect3DDevice9* device) { m_device = device; }
+    void triggerSave(bool forceDialog = false);
+    void updateMenu();
+    void openBackupFolder();
+    void showSettings();
+    UINT getBackupMenuId() const;
+    UINT getAboutMenuId() const;
+
+    // 計測
+    const BackupMetrics& getMetrics() const { return m_metrics; }
+    const RenderMonitor& getRenderMonitor() const { return m_renderMonitor; }
+    const TokenBucket& getIoBucket() const { return m_ioBucket; }
+    const BackupReplicator& getReplicator() const { return m_replicator; }
+    const TaskExecutor& getExecutor() const { return m_executor; }
+    const LiveMetricsPublisher& getLiveMetrics() const { return m_live; }
+    bool dumpTrace(const fs::path& path) const;
+    void recordCommand(UINT id);
+
+    // 緊急保存
+    void runEmergencyDrill();
+
+    // 選択中のモデル（またはカメラ）のキーフレームを、バックアップ時の内容に置き換える
+    void restoreSelectedModel();
+    // 今のシーンとキーフレームが似ているバックアップを一覧のスケッチから探す
+    void findSimilarBackups();
+    // 評価済みポーズの取得を、1要素ずつ取る場合と比べて計測する
+    void benchmarkPoseCapture();
+
+private:
+    void createMenu();
+    fs::path getCurrentPmmPath();
+    // out を使い回す版。見つからなければ false
+    bool getCurrentPmmPath(std::wstring& out);
+    void compactPacks();
+    void recompressColdBackups();
+    void checkEmergencyDumps(const fs::path& pluginDir);
+    void offerRecovery();
+    bool restoreSnapshot(const BackupCatalog& catalog, const CatalogEntry& entry, const fs::path& restored);
+    // wait なら MMD が読み込み終えるまで待つ
+    bool openInMmd(const fs::path& filePath, bool wait = false);
+    // 緊急保存と同じ形式で今のキーフレームを image に書き出す
+    bool captureKeyframes(std::vector<uint8_t>& image);
+    void backupMotion();
+    bool isIdle();  // 再生中でなく、MMDが操作されていない
+    void beginSessionRecording(const fs::path& pluginDir);
+    void recordSession(const KeyframeMirror::RefreshResult& refreshed);
+    uint64_t sessionMs() const;
+
+    HMODULE m_hModule;
+    HMENU m_hMenu;  // メニューハンドル
+    UINT m_nBackupNowMenuId;
+    UINT m_nAboutMenuId;
+
+    // バックグラウンド処理用
+    std::thread m_thread;
+    std::atomic<bool> m_isThreadRunning;
+    void backupWorker();
+    // ワーカーが毎秒使うもの（確保し直さないよう使い回す）
+    std::wstring m_workerPmmPath;
+    thumb::Image m_thumbImage;
+    NativePath m_thumbPath;
+
+    // 最後のバックアップ時刻
+    std::chrono::steady_clock::time_point m_lastBackupTime;
+
+    // 段階ごとの所要時間
+    BackupMetrics m_metrics;
+
+    // 再生・動画出力の検出
+    RenderMonitor m_renderMonitor;
+    float (*m_pfnGetFrameTime)();
+    std::atomic<bool> m_backupPending;  // 再生中のため延期したバックアップがある
+
+    // 自動バックアップの読み書き帯域
+    TokenBucket m_ioBucket;
+
+    // キーフレームの書き出し・圧縮・復元を並列に行うワーカー
+    TaskExecutor m_executor;
+
+    // 世代整理でパックに不要領域ができた
+    std::atomic<bool> m_compactionDue;
+
+    // triggerSave 1回分で使うもの。自動バックアップの分は持ち続けて使い回し、温まった後は確保しない
+    struct SaveJob {
+        std::wstring pmmPath;
+        std::unique_ptr<BackupEngine> engine;   // プロジェクトか設定が変わったら作り直す
+        BackupCycle cycle;
+        NativePath thumbPath;                   // サムネイルの保存先
+    };
+    SaveJob m_autoSave;
+
+    // BackupCycle から MMD を操作する（保存の依頼、サムネイル・ポーズの予約、キーフレームの書き出し）
+    class PluginHost : public BackupHost {
+    public:
+        PluginHost(CPlugin& plugin, SaveJob& job) : m_plugin(plugin), m_job(job) {}
+        bool requestSave() override;
+        void waitSaved() override;
+        void stored(const fs::path& backupDir, const std::wstring& name) override;
+        bool captureKeyframes(std::vector<uint8_t>& image, int64_t now) override;
+
+    private:
+        CPlugin& m_plugin;
+        SaveJob& m_job;
+    };
+
+    // 古いバックアップの再圧縮を次に確認する時刻
+    std::chrono::steady_clock::time_point m_nextColdCheck;
+
+    // 異常終了時の緊急保存
+    EmergencySnapshot m_emergency;
+
+    // 異常終了の検出と、起動後の復元の案内
+    SessionMarker m_session;
+    std::vector<fs::path> m_recoveryProjects;
+
+    // バックアップのサムネイル
+    IDirect3DDevice9* m_device;
+    ThumbnailCapture m_thumbnail;
+
+    // ワーカースレッドでのキーフレームの取り込み（モーションだけのバックアップと自動バックアップで
+    // 領域を使い回す。同じスレッドで順に使うので取り合わない）
+    EmergencySnapshot m_workerCapture;
+    std::vector<uint8_t> m_motionImage;
+    std::chrono::steady_clock::time_point m_lastMotionBackup;
+
+    // 評価済みポーズのチェックポイント
+    PoseCapture m_pose;
+
+    // キーフレームの写し（ワーカースレッドだけが更新・参照する）
+    KeyframeMirror m_mirror;
+    std::chrono::steady_clock::time_point m_lastKeyframeEdit;
+    uint64_t m_motionMirrorVersion;     // 最後にモーションをバックアップしたときの写しの版
+
+    // 編集セッションの記録（RecordSession=1 のとき）
+    session::TraceWriter m_sessionTrace;
+    BackupReplicator m_replicator;
+    // 外部監視用の公開（PublishMetrics=1 のとき）
+    LiveMetricsPublisher m_live;
+    std::atomic<bool> m_recording;
+    std::atomic<bool> m_pluginSaving;       // triggerSave が送る保存要求は記録しない
+    std::atomic<uint32_t> m_recordedKeys;   // 次の記録までにたまった入力
+    std::atomic<uint32_t> m_recordedClicks;
+    std::chrono::steady_clock::time_point m_recordStart;
+    std::vector<uint32_t> m_recordedVersions;   // スロットごとに最後に記録した写しの版とキーフレーム数
+    std::vector<uint32_t> m_recordedCounts;
+    uint32_t m_recordedCameraCount;
 };
\ No newline at end of file
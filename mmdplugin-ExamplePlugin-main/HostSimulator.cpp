@@ -0,0 +1,241 @@
+﻿#include "HostSimulator.h"
+#include "EmergencyDump.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+
+namespace {
+    // MMD の既定の補間（直線）
+    const uint8_t kLinear[4] = { 20, 20, 107, 107 };
+}
+
+// EmergencySnapshot が MMD のメモリから読むのと同じものを、シミュレータの中身から書く
+class HostSimulator::DumpScene : public emergency::Scene {
+public:
+    explicit DumpScene(const HostSimulator& host) : m_host(host) {
+        std::wstring path = host.m_pmmPath.wstring();
+        for (wchar_t c : path) m_path.push_back(static_cast<uint16_t>(c));
+    }
+
+    bool begin(int32_t& nowFrame, const uint16_t*& path, uint16_t& pathLen) override {
+        nowFrame = m_host.m_nowFrame;
+        path = m_path.data();
+        pathLen = static_cast<uint16_t>(m_path.size());
+        return true;
+    }
+
+    void camera(emergency::ArenaWriter& w, emergency::Progress& p) override {
+        emergency::BeginPhase(w, p, 1);
+        for (const auto& it : m_host.m_camera) {
+            w.i32(it.first);
+            w.f32(it.second.distance);
+            for (float v : it.second.pos) w.f32(v);
+            for (float v : it.second.rot) w.f32(v);
+            w.raw(it.second.curve, sizeof(it.second.curve));
+            w.i32(1);
+            w.i32(30);
+            if (!emergency::EndTrack(w, p)) return;
+        }
+        p.phase = 4;
+    }
+
+    bool hasModel(int slot) override {
+        return static_cast<size_t>(slot) < m_host.m_models.size();
+    }
+
+    void model(int slot, int, emergency::ArenaWriter& w, emergency::Progress& p) override {
+        const Model& model = m_host.m_models[slot];
+        p.phase = 0;
+        w.cstr(model.name.c_str(), model.name.size());
+        w.u16(static_cast<uint16_t>(model.path.size()));
+        for (wchar_t c : model.path) w.u16(static_cast<uint16_t>(c));
+
+        emergency::BeginPhase(w, p, 1);
+        for (size_t i = 0; i < model.bones.size(); i++) {
+            w.cstr(model.boneNames[i].c_str(), model.boneNames[i].size());
+            w.u32(static_cast<uint32_t>(model.bones[i].size()));
+            for (const auto& it : model.bones[i]) {
+                w.i32(it.first);
+                for (float v : it.second.pos) w.f32(v);
+                for (float v : it.second.rot) w.f32(v);
+                w.raw(it.second.curve, sizeof(it.second.curve));
+            }
+            if (!emergency::EndTrack(w, p)) return;
+        }
+
+        emergency::BeginPhase(w, p, 2);
+        for (size_t i = 0; i < model.morphs.size(); i++) {
+            w.cstr(model.morphNames[i].c_str(), model.morphNames[i].size());
+            w.u32(static_cast<uint32_t>(model.morphs[i].size()));
+            for (const auto& it : model.morphs[i]) {
+                w.i32(it.first);
+                w.f32(it.second);
+            }
+            if (!emergency::EndTrack(w, p)) return;
+        }
+
+        // 表示・IK は 0 フレームの1つだけ
+        emergency::BeginPhase(w, p, 3);
+        w.i32(0);
+        w.u8(1);
+        w.u32(0);
+        if (!emergency::EndTrack(w, p)) return;
+        p.phase = 4;
+    }
+
+private:
+    const HostSimulator& m_host;
+    std::vector<uint16_t> m_path;
+};
+
+HostSimulator::HostSimulator(const fs::path& pmmPath, const SimulatorSettings& settings)
+    : m_pmmPath(pmmPath), m_settings(settings), m_rng(settings.seed), m_nowFrame(0) {
+    for (int m = 0; m < m_settings.models; m++) {
+        Model model;
+        model.name = "model" + std::to_string(m);
+        model.path = L"UserFile\\Model\\model" + std::to_wstring(m) + L".pmx";
+        for (int b = 0; b < m_settings.bones; b++) {
+            model.boneNames.push_back("bone" + std::to_string(b));
+            // 読み込んだ直後のモデルと同じく、全ボーンに 0 フレームのキーフレームがある
+            BoneKey key = {};
+            key.rot[3] = 1.0f;
+            for (int i = 0; i < 16; i++) key.curve[i] = kLinear[i / 4];
+            std::map<int32_t, BoneKey> track;
+            track[0] = key;
+            model.bones.push_back(track);
+        }
+        for (int i = 0; i < m_settings.morphs; i++) {
+            model.morphNames.push_back("morph" + std::to_string(i));
+            std::map<int32_t, float> track;
+            track[0] = 0.0f;
+            model.morphs.push_back(track);
+        }
+        m_models.push_back(model);
+    }
+    CameraKey camera = {};
+    camera.distance = -45.0f;
+    camera.pos[1] = 10.0f;
+    for (int i = 0; i < 24; i++) camera.curve[i] = kLinear[(i / 6) % 4];
+    m_camera[0] = camera;
+    m_scene.reset(new DumpScene(*this));
+}
+
+HostSimulator::~HostSimulator() {}
+
+size_t HostSimulator::keyframeCount() const {
+    // 表示・IK のキーフレームはモデルごとに1つ
+    size_t count = m_camera.size() + m_models.size();
+    for (const auto& model : m_models) {
+        for (const auto& track : model.bones) count += track.size();
+        for (const auto& track : model.morphs) count += track.size();
+    }
+    return count;
+}
+
+void HostSimulator::step() {
+    // 再生位置の近くに打つ。カメラ 5%、モーフ 15%、残りはボーン
+    std::uniform_int_distribution<int> kind(0, 99);
+    for (int e = 0; e < m_settings.editsPerStep && !m_models.empty(); e++) {
+        int k = kind(m_rng);
+        if (k < 5) editCamera();
+        else editModel(m_models[m_rng() % m_models.size()], k < 20);
+    }
+    m_nowFrame += 15;
+}
+
+void HostSimulator::edit(int model, int count) {
+    std::uniform_int_distribution<int> kind(0, 99);
+    for (int e = 0; e < count; e++) {
+        if (model < 0 || m_models.empty()) editCamera();
+        else editModel(m_models[model % m_models.size()], kind(m_rng) < 16);
+    }
+    m_nowFrame++;
+}
+
+void HostSimulator::editCamera() {
+    std::uniform_int_distribution<int> frameOffset(0, 30);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    CameraKey key = m_camera.rbegin()->second;
+    key.distance += unit(m_rng);
+    for (float& v : key.pos) v += unit(m_rng) * 0.5f;
+    for (float& v : key.rot) v += unit(m_rng) * 0.05f;
+    m_camera[m_nowFrame + frameOffset(m_rng)] = key;
+}
+
+void HostSimulator::editModel(Model& model, bool morph) {
+    std::uniform_int_distribution<int> frameOffset(0, 30);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    int32_t frame = m_nowFrame + frameOffset(m_rng);
+    if (morph && !model.morphs.empty()) {
+        model.morphs[m_rng() % model.morphs.size()][frame] = (unit(m_rng) + 1.0f) * 0.5f;
+        return;
+    }
+    if (model.bones.empty()) return;
+
+    // 少数のボーンへ集中して打つ（実際の作業に近い偏り）
+    size_t hot = (std::min)(model.bones.size(), static_cast<size_t>(24));
+    size_t b = (m_rng() % 4 == 0) ? m_rng() % model.bones.size() : m_rng() % hot;
+    auto& track = model.bones[b];
+    BoneKey key = track.rbegin()->second;
+    if (b == 0) {
+        for (float& v : key.pos) v += unit(m_rng);
+    }
+    // 小さく回して正規化する
+    float len = 0.0f;
+    for (float& v : key.rot) {
+        v += unit(m_rng) * 0.1f;
+        len += v * v;
+    }
+    len = std::sqrt(len);
+    for (float& v : key.rot) v /= len;
+    track[frame] = key;
+}
+
+bool HostSimulator::save() const {
+    char magic[30] = "Polygon Movie maker 0002";
+    std::vector<uint8_t> data(magic, magic + sizeof(magic));
+    writeScene(data, 0);
+
+    // 同じ PMM を複数のプロセスから保存することがある（BackupTool stress）ので、一時ファイルは分ける
+    fs::path tmp = m_pmmPath;
+    tmp += L"." + std::to_wstring(m_settings.seed) + L".tmp";
+    {
+        std::ofstream out(tmp.c_str(), std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) return false;
+        out.write(reinterpret_cast<const char*>(data.data()), data.size());
+        if (!out) return false;
+    }
+    std::error_code ec;
+    fs::rename(tmp, m_pmmPath, ec);
+    return !ec;
+}
+
+void HostSimulator::snapshot(std::vector<uint8_t>& kfs, int64_t time) const {
+    kfs.clear();
+    writeScene(kfs, time);
+}
+
+emergency::Scene& HostSimulator::dumpScene() const {
+    return *m_scene;
+}
+
+size_t HostSimulator::dumpArenaBytes() const {
+    // 一番大きいセクション + ヘッダ。ディレクトリ（最大256件）もこの領域で組み立てる
+    size_t largest = 4 + m_camera.size() * 64;
+    for (const auto& model : m_models) {
+        size_t size = 2 + model.name.size() + 2 + model.path.size() * 2 + 4 + 4 + 4 + (4 + 1 + 4);
+        for (size_t i = 0; i < model.bones.size(); i++) size += 2 + model.boneNames[i].size() + 4 + model.bones[i].size() * 48;
+        for (size_t i = 0; i < model.morphs.size(); i++) size += 2 + model.morphNames[i].size() + 4 + model.morphs[i].size() * 8;
+        largest = (std::max)(largest, size);
+    }
+    return (std::max)(emergency::SectionHeaderSize + largest + 4096, static_cast<size_t>(64 * 1024));
+}
+
+void HostSimulator::writeScene(std::vector<uint8_t>& out, int64_t time) const {
+    // プラグインの緊急保存と同じ書き出し（out の末尾に追加する）
+    size_t need = dumpArenaBytes();
+    if (m_arena.size() < need) m_arena.resize(need);
+    m_writer.attach(m_arena.data(), m_arena.size());
+    emergency::MemorySink sink(out);
+    m_writer.write(sink, *m_scene, time, nullptr, nullptr);
+}
@@ -0,0 +1,89 @@
+﻿#pragma once
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <experimental/filesystem>
+#include "EmergencyWriter.h"
+
+namespace fs = std::experimental::filesystem;
+
+// MMD の代わりに合成したシーンを編集・保存する（BackupTool simulate 用）
+//
+// プラグイン本体は mmd_plugin.h（d3d9・MMD のメモリ配置）に依存するので MMD の外では動かせない。
+// ここではバックアップの経路で MMD から受け取るもの（上書き保存された PMM と、緊急保存と同じ形式の
+// キーフレーム）だけを作り、BackupEngine 以降を MMD 無しで繰り返し通せるようにする。
+//   step():     決まった乱数でキーフレームを追加・変更する（アニメーターの編集の代わり）
+//   edit():     指定したモデル（負ならカメラ）に count 回の編集をする（記録したセッションの再生用）
+//   save():     PMM を書く（Ctrl+S の代わり）。中身はヘッダと現在のキーフレームで、編集に応じて変わる
+//   snapshot(): EmergencySnapshot::capture と同じ形式の .kfs を作る。書き出しも同じ emergency::DumpWriter を通す
+// 同じ設定と seed なら、何度動かしても同じ内容になる。
+
+struct SimulatorSettings {
+    int models = 3;
+    int bones = 120;            // モデルごとのボーン数
+    int morphs = 40;            // モデルごとのモーフ数
+    int editsPerStep = 200;     // step() 1回あたりのキーフレームの編集数
+    uint32_t seed = 1;
+};
+
+class HostSimulator {
+public:
+    HostSimulator(const fs::path& pmmPath, const SimulatorSettings& settings);
+    ~HostSimulator();
+
+    const fs::path& pmmPath() const { return m_pmmPath; }
+    int32_t nowFrame() const { return m_nowFrame; }
+    size_t keyframeCount() const;
+
+    void step();
+    void edit(int model, int count);
+    bool save() const;
+    void snapshot(std::vector<uint8_t>& kfs, int64_t time) const;
+
+    // 緊急保存の書き出し元としてのシーン（BackupTool crashcheck で CrashGuard に渡す）。
+    // 書き出しの間はヒープを使わない
+    emergency::Scene& dumpScene() const;
+    // 1セクションの書き出しに要る領域の大きさ
+    size_t dumpArenaBytes() const;
+
+private:
+    struct BoneKey {
+        float pos[3];
+        float rot[4];
+        uint8_t curve[16];
+    };
+    struct CameraKey {
+        float distance;
+        float pos[3];
+        float rot[3];
+        uint8_t curve[24];
+    };
+    struct Model {
+        std::string name;
+        std::wstring path;
+        std::vector<std::string> boneNames;
+        std::vector<std::map<int32_t, BoneKey>> bones;
+        std::vector<std::string> morphNames;
+        std::vector<std::map<int32_t, float>> morphs;
+    };
+
+    void editCamera();
+    void editModel(Model& model, bool morph);
+    void writeScene(std::vector<uint8_t>& out, int64_t time) const;
+
+    class DumpScene;
+
+    fs::path m_pmmPath;
+    SimulatorSettings m_settings;
+    std::mt19937 m_rng;
+    int32_t m_nowFrame;
+    std::vector<Model> m_models;
+    std::map<int32_t, CameraKey> m_camera;
+    std::unique_ptr<DumpScene> m_scene;
+    // snapshot()・save() の書き出し用。大きさは dumpArenaBytes() に合わせて伸ばすだけ
+    mutable std::vector<uint8_t> m_arena;
+    mutable emergency::DumpWriter m_writer;
+};
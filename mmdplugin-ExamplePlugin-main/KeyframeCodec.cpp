@@ -0,0 +1,859 @@
+﻿#include "KeyframeCodec.h"
+#include "BackupFormat.h"
+#include "EmergencyDump.h"
+#include "LzCodec.h"
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define KFC_SSE2 1
+#endif
+
+#if defined(_M_X64) || defined(__x86_64__)
+#include <tmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define KFC_SSSE3_TARGET
+#else
+#include <cpuid.h>
+#define KFC_SSSE3_TARGET __attribute__((target("ssse3")))
+#endif
+#define KFC_SSSE3 1
+#endif
+
+namespace kfc {
+
+namespace {
+    enum SectionMode : uint8_t {
+        ModeRaw = 0,
+        ModeColumns = 1,
+        ModeLz = 2,         // 列に分けられなかったもの（版 1 では LZ の方が小さかったものも）
+    };
+
+    // キーフレーム1件の並び: frame(i32), 4バイトの値 before 個, 補間 curve バイト, 4バイトの値 after 個
+    struct Layout {
+        int before;
+        int curve;
+        int after;
+
+        int words() const { return before + after; }
+        size_t recordSize() const { return 4 + static_cast<size_t>(words()) * 4 + static_cast<size_t>(curve); }
+    };
+    // 補間の長さ（0, 16, 24）で区別する（splitTrack / joinTrack）
+    constexpr Layout kBoneLayout = { 7, 16, 0 };      // xyz, クォータニオン, 補間 x1 y1 x2 y2
+    constexpr Layout kMorphLayout = { 1, 0, 0 };      // 値
+    constexpr Layout kCameraLayout = { 7, 24, 2 };    // 距離, xyz, rxyz, 補間, パース, 視野角
+    const int kMaxWords = 9;
+    const int kMaxCurve = 24;
+    const uint32_t kMaxTracks = 0x10000;
+
+    // 同じ並びのトラックが続く区間（ボーン、モーフ、カメラ）
+    struct Group {
+        Layout layout;
+        size_t records;     // 区間全体のキーフレーム数
+        size_t wordStart;   // 列の先頭（列 w は wordStart + w * records から records 個）
+        size_t curveStart;
+        size_t next;        // 次に書く（読む）キーフレーム
+        // 版 2 から、トラックの先頭のキーフレームは直前のトラックの先頭との XOR にする
+        // （動かしていないボーンは初期姿勢のままで、どのトラックも同じ値から始まる）。版 1 はどれも 0 との XOR
+        bool chain;
+        uint32_t firstWord[kMaxWords];
+        uint8_t firstCurve[kMaxCurve];
+    };
+
+    Group makeGroup(const Layout& layout, bool chain = true) {
+        Group g = {};
+        g.layout = layout;
+        g.chain = chain;
+        return g;
+    }
+
+    // セクション本体を列に分けたもの（セクションをまたいで使い回す）
+    struct Columns {
+        std::vector<uint8_t> meta;      // 名前・件数など、キーフレーム以外
+        std::vector<uint8_t> allMeta;   // 全セクションの meta と末尾の残り（まとめて1回だけ LZ にする）
+        std::vector<uint8_t> body;      // セクションの並び（allMeta の後ろに置くので別に作る）
+        std::vector<uint8_t> frames;    // フレーム番号の差分の差分
+        std::vector<uint32_t> words;
+        std::vector<uint8_t> curves;
+        std::vector<uint8_t> packed;
+        lz::Compressor lz;
+        size_t tail = 0;                // 本体のうち、ここから後ろはそのまま持つ
+
+        void clear() {
+            meta.clear();
+            frames.clear();
+            words.clear();
+            curves.clear();
+            tail = 0;
+        }
+    };
+
+    void putVarint(std::vector<uint8_t>& out, uint64_t v) {
+        while (v >= 0x80) {
+            out.push_back(static_cast<uint8_t>(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back(static_cast<uint8_t>(v));
+    }
+
+    bool getVarint(const uint8_t*& p, const uint8_t* end, uint64_t& v) {
+        v = 0;
+        for (int shift = 0; shift < 64 && p < end; shift += 7) {
+            uint8_t b = *p++;
+            v |= static_cast<uint64_t>(b & 0x7F) << shift;
+            if (!(b & 0x80)) return true;
+        }
+        return false;
+    }
+
+    uint32_t zigzag(int32_t v) { return (static_cast<uint32_t>(v) << 1) ^ static_cast<uint32_t>(v >> 31); }
+    int32_t unzigzag(uint32_t v) { return static_cast<int32_t>(v >> 1) ^ -static_cast<int32_t>(v & 1); }
+    int32_t wrapSub(int32_t a, int32_t b) { return static_cast<int32_t>(static_cast<uint32_t>(a) - static_cast<uint32_t>(b)); }
+    int32_t wrapAdd(int32_t a, int32_t b) { return static_cast<int32_t>(static_cast<uint32_t>(a) + static_cast<uint32_t>(b)); }
+
+    // 補間は 8 バイト単位（16 / 24 バイト）なので 64bit ずつ XOR する
+    void xorCurve(uint8_t* dst, const uint8_t* a, uint8_t* prev, int size) {
+        for (int b = 0; b < size; b += 8) {
+            uint64_t x, y;
+            memcpy(&x, a + b, 8);
+            memcpy(&y, prev + b, 8);
+            y ^= x;
+            memcpy(dst + b, &y, 8);
+            memcpy(prev + b, &x, 8);
+        }
+    }
+
+    void unxorCurve(uint8_t* dst, const uint8_t* delta, uint8_t* prev, int size) {
+        for (int b = 0; b < size; b += 8) {
+            uint64_t x, y;
+            memcpy(&x, delta + b, 8);
+            memcpy(&y, prev + b, 8);
+            y ^= x;
+            memcpy(dst + b, &y, 8);
+            memcpy(prev + b, &y, 8);
+        }
+    }
+
+    void putBlock(std::vector<uint8_t>& out, const void* data, size_t size) {
+        putVarint(out, size);
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        out.insert(out.end(), p, p + size);
+    }
+
+    bool getSize(ByteReader& r, uint64_t& v) {
+        v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            uint8_t b = r.u8();
+            if (!r.ok()) return false;
+            v |= static_cast<uint64_t>(b & 0x7F) << shift;
+            if (!(b & 0x80)) return true;
+        }
+        return false;
+    }
+
+    bool getBlock(ByteReader& r, const uint8_t*& p, size_t& size) {
+        uint64_t v;
+        if (!getSize(r, v) || v > r.remaining()) return false;
+        size = static_cast<size_t>(v);
+        p = r.skip(size);
+        return p != nullptr;
+    }
+
+    // 列に分けられない部分は LZ で持つ。縮まなければそのまま
+    void putOpaque(std::vector<uint8_t>& out, const uint8_t* data, size_t size, Columns& c) {
+        c.packed.clear();
+        if (size > 0 && c.lz.compress(data, size, c.packed, lz::FastLevel) < size) {
+            out.push_back(ModeLz);
+            putBlock(out, c.packed.data(), c.packed.size());
+            return;
+        }
+        out.push_back(ModeRaw);
+        out.insert(out.end(), data, data + size);
+    }
+
+    bool getOpaque(ByteReader& r, uint8_t mode, uint8_t* dst, size_t size) {
+        if (mode == ModeRaw) {
+            const uint8_t* p = r.skip(size);
+            if (!p) return false;
+            memcpy(dst, p, size);
+            return true;
+        }
+        const uint8_t* p;
+        size_t n;
+        return mode == ModeLz && getBlock(r, p, n) && lz::decompress(p, n, dst, size);
+    }
+
+    // 16バイトのうち 0 でないバイトのビット
+    uint32_t nonZeroMask(const uint8_t* p, size_t n) {
+#ifdef KFC_SSE2
+        if (n == 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            return ~static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()))) & 0xFFFF;
+        }
+#endif
+        uint32_t m = 0;
+        for (size_t i = 0; i < n; i++) m |= static_cast<uint32_t>(p[i] != 0) << i;
+        return m;
+    }
+
+    // 8バイト分のマスク（0 でないバイトのビット）ごとの、詰めた側での並び
+    struct ZeroTable {
+        uint8_t index[256][8];  // j バイト目が詰めた側の何バイト目か。0 のバイトは次の 0 でないバイトと同じ位置
+        uint8_t count[256];
+        uint64_t keep[256];     // 0 でないバイトだけ 0xFF
+        ZeroTable() {
+            for (uint32_t m = 0; m < 256; m++) {
+                uint8_t n = 0;
+                keep[m] = 0;
+                for (int j = 0; j < 8; j++) {
+                    index[m][j] = n;
+                    if ((m >> j) & 1) {
+                        n++;
+                        keep[m] |= 0xFFull << (j * 8);
+                    }
+                }
+                count[m] = n;
+            }
+        }
+    };
+
+    const ZeroTable& zeroTable() {
+        static const ZeroTable table;
+        return table;
+    }
+
+    // 8バイトのうち 0 でないものを o に詰める。0 のバイトも書くが、後の 0 でないバイトか次の書き込みで上書きされる
+    // （o から 8 バイトは書ける必要がある）
+    inline uint8_t* packHalf(uint8_t* o, const uint8_t* s, uint32_t m, const ZeroTable& t) {
+        const uint8_t* index = t.index[m];
+        for (int j = 0; j < 8; j++) o[index[j]] = s[j];
+        return o + t.count[m];
+    }
+
+    // packHalf の逆。読む位置が互いに依存しないので並べて読める（s から 8 バイトは読める必要がある）
+    inline const uint8_t* unpackHalf(uint8_t* d, const uint8_t* s, uint32_t m, const ZeroTable& t) {
+        const uint8_t* index = t.index[m];
+        uint64_t v = 0;
+        for (int j = 0; j < 8; j++) v |= static_cast<uint64_t>(s[index[j]]) << (j * 8);
+        v &= t.keep[m];
+        memcpy(d, &v, 8);
+        return s + t.count[m];
+    }
+
+#ifdef KFC_SSSE3
+    bool hasSsse3() {
+        int ecx;
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 1);
+        ecx = info[2];
+#else
+        unsigned a, b, c, d;
+        if (!__get_cpuid(1, &a, &b, &c, &d)) return false;
+        ecx = static_cast<int>(c);
+#endif
+        return (ecx & (1 << 9)) != 0;
+    }
+
+    const bool g_hasSsse3 = hasSsse3();
+
+    // unpackZeros の 128 バイト分を、ブロックごとに pshufb 1回で戻す。
+    // 読むのは多くても 8 * (2 + 16) バイトなので、src からそれだけ読める必要がある
+    KFC_SSSE3_TARGET const uint8_t* unpackGroupShuffle(uint8_t* dst, const uint8_t* src, uint32_t bits, const ZeroTable& t) {
+        for (int b = 0; b < 8; b++, dst += 16) {
+            if (!((bits >> b) & 1)) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_setzero_si128());
+                continue;
+            }
+            uint32_t lo = src[0];
+            uint32_t hi = src[1];
+            src += 2;
+            // 後ろ半分の位置は前半分で詰めた数だけずれる
+            __m128i index = _mm_unpacklo_epi64(
+                _mm_loadl_epi64(reinterpret_cast<const __m128i*>(t.index[lo])),
+                _mm_add_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(t.index[hi])), _mm_set1_epi8(static_cast<char>(t.count[lo]))));
+            __m128i keep = _mm_unpacklo_epi64(
+                _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&t.keep[lo])),
+                _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&t.keep[hi])));
+            __m128i v = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src)), index);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_and_si128(v, keep));
+            src += t.count[lo] + t.count[hi];
+        }
+        return src;
+    }
+#endif
+
+    // 0 のバイトを省く。128バイトごとに、0 でないブロック（16バイト）のビット(1バイト)と、
+    // 0 でないブロックごとのマスク(2バイト) + 0 でないバイト
+    void packZeros(const uint8_t* src, size_t n, std::vector<uint8_t>& out) {
+        const ZeroTable& table = zeroTable();
+        out.resize((n + 127) / 128 + (n + 15) / 16 * 2 + n);
+        uint8_t* o = out.data();
+        for (size_t i = 0; i < n; i += 128) {
+            uint8_t* blocks = o++;
+            uint32_t bits = 0;
+            for (int b = 0; b < 8 && i + b * 16 < n; b++) {
+                size_t at = i + b * 16;
+                size_t len = n - at < 16 ? n - at : 16;
+                uint32_t m = nonZeroMask(src + at, len);
+                if (m == 0) continue;
+                bits |= 1u << b;
+                o[0] = static_cast<uint8_t>(m);
+                o[1] = static_cast<uint8_t>(m >> 8);
+                o += 2;
+                if (m == 0xFFFF) {
+                    memcpy(o, src + at, 16);
+                    o += 16;
+                }
+                else if (len == 16) {
+                    o = packHalf(o, src + at, m & 0xFF, table);
+                    o = packHalf(o, src + at + 8, m >> 8, table);
+                }
+                else {
+                    // 分岐せずに書き、0 でないときだけ進める
+                    for (size_t j = 0; j < len; j++) {
+                        *o = src[at + j];
+                        o += (m >> j) & 1;
+                    }
+                }
+            }
+            *blocks = static_cast<uint8_t>(bits);
+        }
+        out.resize(static_cast<size_t>(o - out.data()));
+    }
+
+    bool unpackZeros(const uint8_t* src, size_t size, uint8_t* dst, size_t n) {
+        const ZeroTable& table = zeroTable();
+        const uint8_t* end = src + size;
+        for (size_t i = 0; i < n; i += 128) {
+            if (src == end) return false;
+            uint32_t bits = *src++;
+            if (bits == 0) {
+                memset(dst + i, 0, n - i < 128 ? n - i : 128);
+                continue;
+            }
+#ifdef KFC_SSSE3
+            if (g_hasSsse3 && n - i >= 128 && end - src >= 8 * 18) {
+                src = unpackGroupShuffle(dst + i, src, bits, table);
+                continue;
+            }
+#endif
+            for (int b = 0; b < 8 && i + b * 16 < n; b++) {
+                size_t at = i + b * 16;
+                size_t len = n - at < 16 ? n - at : 16;
+                if (!((bits >> b) & 1)) {
+                    memset(dst + at, 0, len);
+                    continue;
+                }
+                if (end - src < 2) return false;
+                uint32_t m = static_cast<uint32_t>(src[0]) | (static_cast<uint32_t>(src[1]) << 8);
+                src += 2;
+                if (m == 0xFFFF && len == 16) {
+                    if (end - src < 16) return false;
+                    memcpy(dst + at, src, 16);
+                    src += 16;
+                }
+                else if (len == 16 && end - src >= 16) {
+                    src = unpackHalf(dst + at, src, m & 0xFF, table);
+                    src = unpackHalf(dst + at + 8, src, m >> 8, table);
+                }
+                else {
+                    for (size_t j = 0; j < len; j++) {
+                        if ((m >> j) & 1) {
+                            if (src == end) return false;
+                            dst[at + j] = *src++;
+                        }
+                        else {
+                            dst[at + j] = 0;
+                        }
+                    }
+                }
+            }
+        }
+        return src == end;
+    }
+
+    // トラックの先頭のキーフレームを、次のトラックの先頭の XOR の相手として残す
+    inline void keepFirst(Group& g, const uint32_t* words, size_t wordBytes, const uint8_t* curve, int curveBytes) {
+        if (!g.chain) return;
+        memcpy(g.firstWord, words, wordBytes);
+        memcpy(g.firstCurve, curve, static_cast<size_t>(curveBytes));
+    }
+
+    // 1トラック分のキーフレームを列へ分ける。値はトラック内の直前との XOR にする。
+    // 並びは3種類しかないので定数にして、列と補間のループを開く
+    template <int Before, int Curve, int After>
+    void splitRecords(const uint8_t* p, uint32_t count, Group& g, Columns& c) {
+        const int Words = Before + After;
+        const size_t recordSize = 4 + Words * 4 + Curve;
+        const size_t stride = g.records;
+        int32_t prevFrame = 0;
+        int32_t prevDelta = 0;
+        uint32_t prevWord[Words];
+        uint8_t prevCurve[Curve > 0 ? Curve : 1];
+        memcpy(prevWord, g.firstWord, sizeof(prevWord));
+        memcpy(prevCurve, g.firstCurve, sizeof(prevCurve));
+        uint32_t* words = c.words.data() + g.wordStart + g.next;
+        uint8_t* curves = c.curves.data() + g.curveStart + g.next * Curve;
+
+        for (uint32_t i = 0; i < count; i++, p += recordSize) {
+            int32_t frame;
+            memcpy(&frame, p, 4);
+            int32_t delta = wrapSub(frame, prevFrame);
+            putVarint(c.frames, zigzag(wrapSub(delta, prevDelta)));
+            prevFrame = frame;
+            prevDelta = delta;
+
+            const uint8_t* v = p + 4;
+            for (int w = 0; w < Words; w++) {
+                if (Curve > 0 && w == Before) {
+                    xorCurve(curves, v, prevCurve, Curve);
+                    curves += Curve;
+                    v += Curve;
+                }
+                uint32_t x;
+                memcpy(&x, v, 4);
+                words[w * stride + i] = x ^ prevWord[w];
+                prevWord[w] = x;
+                v += 4;
+            }
+            if (Curve > 0 && After == 0) {
+                xorCurve(curves, v, prevCurve, Curve);
+                curves += Curve;
+            }
+            if (i == 0) keepFirst(g, prevWord, sizeof(prevWord), prevCurve, Curve);
+        }
+        g.next += count;
+    }
+
+    // splitRecords の逆。o に元の並びで書く
+    template <int Before, int Curve, int After>
+    bool joinRecords(uint8_t*& o, uint32_t count, Group& g, const uint8_t*& frames, const uint8_t* framesEnd, const Columns& c) {
+        const int Words = Before + After;
+        const size_t stride = g.records;
+        int32_t prevFrame = 0;
+        int32_t prevDelta = 0;
+        uint32_t prevWord[Words];
+        uint8_t prevCurve[Curve > 0 ? Curve : 1];
+        memcpy(prevWord, g.firstWord, sizeof(prevWord));
+        memcpy(prevCurve, g.firstCurve, sizeof(prevCurve));
+        const uint32_t* words = c.words.data() + g.wordStart + g.next;
+        const uint8_t* curves = c.curves.data() + g.curveStart + g.next * Curve;
+
+        for (uint32_t i = 0; i < count; i++) {
+            // 等間隔に打ったキーフレームなら差分の差分は 0 で、ほとんどが1バイト
+            uint32_t zz;
+            if (frames != framesEnd && *frames < 0x80) {
+                zz = *frames++;
+            }
+            else {
+                uint64_t v;
+                if (!getVarint(frames, framesEnd, v) || v > 0xFFFFFFFFull) return false;
+                zz = static_cast<uint32_t>(v);
+            }
+            prevDelta = wrapAdd(prevDelta, unzigzag(zz));
+            prevFrame = wrapAdd(prevFrame, prevDelta);
+            memcpy(o, &prevFrame, 4);
+            o += 4;
+
+            for (int w = 0; w < Words; w++) {
+                if (Curve > 0 && w == Before) {
+                    unxorCurve(o, curves, prevCurve, Curve);
+                    curves += Curve;
+                    o += Curve;
+                }
+                prevWord[w] ^= words[w * stride + i];
+                memcpy(o, &prevWord[w], 4);
+                o += 4;
+            }
+            if (Curve > 0 && After == 0) {
+                unxorCurve(o, curves, prevCurve, Curve);
+                curves += Curve;
+                o += Curve;
+            }
+            if (i == 0) keepFirst(g, prevWord, sizeof(prevWord), prevCurve, Curve);
+        }
+        g.next += count;
+        return true;
+    }
+
+    void splitTrack(const uint8_t* p, uint32_t count, Group& g, Columns& c) {
+        if (g.layout.curve == kBoneLayout.curve) splitRecords<kBoneLayout.before, kBoneLayout.curve, kBoneLayout.after>(p, count, g, c);
+        else if (g.layout.curve == kCameraLayout.curve) splitRecords<kCameraLayout.before, kCameraLayout.curve, kCameraLayout.after>(p, count, g, c);
+        else splitRecords<kMorphLayout.before, kMorphLayout.curve, kMorphLayout.after>(p, count, g, c);
+    }
+
+    bool joinTrack(uint8_t*& o, uint32_t count, Group& g, const uint8_t*& frames, const uint8_t* framesEnd, const Columns& c) {
+        if (g.layout.curve == kBoneLayout.curve) return joinRecords<kBoneLayout.before, kBoneLayout.curve, kBoneLayout.after>(o, count, g, frames, framesEnd, c);
+        if (g.layout.curve == kCameraLayout.curve) return joinRecords<kCameraLayout.before, kCameraLayout.curve, kCameraLayout.after>(o, count, g, frames, framesEnd, c);
+        return joinRecords<kMorphLayout.before, kMorphLayout.curve, kMorphLayout.after>(o, count, g, frames, framesEnd, c);
+    }
+
+    // トラックの並び（トラック数, { 名前, 件数, キーフレーム... }...）を確かめ、キーフレーム以外を meta に写す
+    bool countTracks(ByteReader& r, ByteWriter& meta, Group& g) {
+        const size_t recordSize = g.layout.recordSize();
+        uint32_t tracks = r.u32();
+        if (!r.ok() || tracks > kMaxTracks) return false;
+        meta.u32(tracks);
+        for (uint32_t t = 0; t < tracks; t++) {
+            uint16_t n = r.u16();
+            const uint8_t* name = r.skip(n);
+            uint32_t count = r.u32();
+            if (!r.ok() || count > r.remaining() / recordSize) return false;
+            r.skip(count * recordSize);
+            meta.u16(n);
+            meta.raw(name, n);
+            meta.u32(count);
+            g.records += count;
+        }
+        return true;
+    }
+
+    void splitTracks(ByteReader& r, Group& g, Columns& c) {
+        const size_t recordSize = g.layout.recordSize();
+        uint32_t tracks = r.u32();
+        for (uint32_t t = 0; t < tracks; t++) {
+            r.skip(r.u16());
+            uint32_t count = r.u32();
+            splitTrack(r.skip(count * recordSize), count, g, c);
+        }
+    }
+
+    void allocate(Columns& c, Group* groups, int count) {
+        size_t words = 0;
+        size_t curves = 0;
+        for (int i = 0; i < count; i++) {
+            groups[i].wordStart = words;
+            groups[i].curveStart = curves;
+            words += groups[i].records * groups[i].layout.words();
+            curves += groups[i].records * groups[i].layout.curve;
+        }
+        c.words.resize(words);
+        c.curves.resize(curves);
+    }
+
+    bool splitCamera(const uint8_t* body, size_t size, Columns& c) {
+        ByteReader r(body, size);
+        uint32_t count = r.u32();
+        if (!r.ok() || count > r.remaining() / kCameraLayout.recordSize()) return false;
+        ByteWriter(c.meta).u32(count);
+        Group g = makeGroup(kCameraLayout);
+        g.records = count;
+        allocate(c, &g, 1);
+        c.frames.reserve(count);
+        splitTrack(r.skip(count * kCameraLayout.recordSize()), count, g, c);
+        c.tail = r.pos();
+        return true;
+    }
+
+    bool splitModel(const uint8_t* body, size_t size, Columns& c) {
+        ByteReader r(body, size);
+        ByteWriter meta(c.meta);
+        // 名前とパス
+        uint16_t nameLen = r.u16();
+        r.skip(nameLen);
+        uint16_t pathLen = r.u16();
+        r.skip(pathLen * 2u);
+        if (!r.ok()) return false;
+        size_t tracksPos = r.pos();
+        meta.raw(body, tracksPos);
+
+        // 1回目: 並びを確かめて件数を数える。表示・IK は少ないのでそのまま持つ
+        Group groups[2] = { makeGroup(kBoneLayout), makeGroup(kMorphLayout) };
+        if (!countTracks(r, meta, groups[0]) || !countTracks(r, meta, groups[1])) return false;
+        c.tail = r.pos();
+        allocate(c, groups, 2);
+        c.frames.reserve(groups[0].records + groups[1].records);
+
+        // 2回目: 列に分ける
+        ByteReader tracks(body + tracksPos, size - tracksPos);
+        splitTracks(tracks, groups[0], c);
+        splitTracks(tracks, groups[1], c);
+        return true;
+    }
+
+    // 列に分けたセクションの meta は allMeta へ回し、ここには大きさだけを書く。
+    // 読めないセクションは LZ で持つ（縮まなければそのまま）
+    void encodeSection(uint32_t kind, const uint8_t* body, size_t size, Columns& c, std::vector<uint8_t>& out) {
+        c.clear();
+        bool split = false;
+        if (kind == emergency::SectionCamera) split = splitCamera(body, size, c);
+        else if (kind == emergency::SectionModel) split = splitModel(body, size, c);
+        if (!split) {
+            putOpaque(out, body, size, c);
+            return;
+        }
+        out.push_back(ModeColumns);
+        putVarint(out, c.meta.size());
+        c.allMeta.insert(c.allMeta.end(), c.meta.begin(), c.meta.end());
+        // 等間隔なら差分の差分はほとんど 0 なので、フレーム番号も 0 を省く（省いて大きくなるならそのまま）
+        putVarint(out, c.frames.size());
+        packZeros(c.frames.data(), c.frames.size(), c.packed);
+        const bool packFrames = c.packed.size() < c.frames.size();
+        out.push_back(packFrames ? ModeColumns : ModeRaw);
+        if (packFrames) putBlock(out, c.packed.data(), c.packed.size());
+        else putBlock(out, c.frames.data(), c.frames.size());
+        packZeros(reinterpret_cast<const uint8_t*>(c.words.data()), c.words.size() * 4, c.packed);
+        putBlock(out, c.packed.data(), c.packed.size());
+        packZeros(c.curves.data(), c.curves.size(), c.packed);
+        putBlock(out, c.packed.data(), c.packed.size());
+        putBlock(out, body + c.tail, size - c.tail);
+    }
+
+    // meta からトラックの並びを読み、件数を数える（joinModel の1回目）
+    bool countMeta(ByteReader& m, Group& g, size_t bodySize) {
+        const size_t recordSize = g.layout.recordSize();
+        uint32_t tracks = m.u32();
+        if (!m.ok() || tracks > kMaxTracks) return false;
+        for (uint32_t t = 0; t < tracks; t++) {
+            m.skip(m.u16());
+            uint32_t count = m.u32();
+            if (!m.ok() || count > bodySize / recordSize) return false;
+            g.records += count;
+        }
+        return g.records <= bodySize / recordSize;
+    }
+
+    // meta のトラックの並びを写しながら、キーフレームを元に戻す
+    bool joinTracks(ByteReader& m, const uint8_t* meta, uint8_t*& o, Group& g, const uint8_t*& frames, const uint8_t* framesEnd, const Columns& c) {
+        size_t head = m.pos();
+        uint32_t tracks = m.u32();
+        memcpy(o, meta + head, 4);
+        o += 4;
+        for (uint32_t t = 0; t < tracks; t++) {
+            head = m.pos();
+            m.skip(m.u16());
+            uint32_t count = m.u32();
+            memcpy(o, meta + head, m.pos() - head);
+            o += m.pos() - head;
+            if (!joinTrack(o, count, g, frames, framesEnd, c)) return false;
+        }
+        return true;
+    }
+
+    // 版 2 では meta を allMeta から順に切り出す
+    bool decodeSection(uint32_t version, uint32_t kind, ByteReader& r, ByteReader& allMeta, size_t bodySize, uint8_t* o, Columns& c) {
+        uint8_t mode = r.u8();
+        if (!r.ok()) return false;
+        if (mode != ModeColumns) return getOpaque(r, mode, o, bodySize);
+
+        const uint8_t* meta;
+        const uint8_t* frames;
+        const uint8_t* words;
+        const uint8_t* curves;
+        const uint8_t* tail;
+        size_t metaSize, framesSize, wordsSize, curvesSize, tailSize;
+        if (version >= 2) {
+            uint64_t n;
+            if (!getSize(r, n) || n > allMeta.remaining()) return false;
+            metaSize = static_cast<size_t>(n);
+            meta = allMeta.skip(metaSize);
+            // キーフレーム1件に少なくとも1バイト
+            if (!getSize(r, n) || n > bodySize) return false;
+            uint8_t framesMode = r.u8();
+            if (!r.ok() || !getBlock(r, frames, framesSize)) return false;
+            if (framesMode == ModeColumns) {
+                c.frames.resize(static_cast<size_t>(n));
+                if (!unpackZeros(frames, framesSize, c.frames.data(), c.frames.size())) return false;
+                frames = c.frames.data();
+                framesSize = c.frames.size();
+            }
+            else if (framesMode != ModeRaw || framesSize != n) {
+                return false;
+            }
+        }
+        else if (!getBlock(r, meta, metaSize) || !getBlock(r, frames, framesSize)) {
+            return false;
+        }
+        if (!getBlock(r, words, wordsSize) ||
+            !getBlock(r, curves, curvesSize) || !getBlock(r, tail, tailSize)) return false;
+
+        // 1回目: 件数を数え、元の本体の大きさと合うか確かめる
+        const bool chain = version >= 2;
+        Group groups[2] = { makeGroup(kCameraLayout, chain), makeGroup(kMorphLayout, chain) };
+        int groupCount = 1;
+        size_t headSize = 0;
+        ByteReader m(meta, metaSize);
+        if (kind == emergency::SectionCamera) {
+            groups[0].records = m.u32();
+            if (!m.ok() || groups[0].records > bodySize / kCameraLayout.recordSize()) return false;
+        }
+        else if (kind == emergency::SectionModel) {
+            groups[0] = makeGroup(kBoneLayout, chain);
+            groupCount = 2;
+            m.skip(m.u16());
+            m.skip(m.u16() * 2u);
+            headSize = m.pos();
+            if (!m.ok() || !countMeta(m, groups[0], bodySize) || !countMeta(m, groups[1], bodySize)) return false;
+        }
+        else {
+            return false;
+        }
+        if (m.remaining() != 0) return false;
+        uint64_t expected = metaSize + tailSize;
+        for (int i = 0; i < groupCount; i++) expected += static_cast<uint64_t>(groups[i].records) * groups[i].layout.recordSize();
+        if (expected != bodySize) return false;
+
+        // 列はすべて unpackZeros で埋まるので、前のセクションの中身は消さない（frames も c にある）
+        allocate(c, groups, groupCount);
+        if (!unpackZeros(words, wordsSize, reinterpret_cast<uint8_t*>(c.words.data()), c.words.size() * 4) ||
+            !unpackZeros(curves, curvesSize, c.curves.data(), c.curves.size())) return false;
+
+        // 2回目: 元の並びに戻す
+        const uint8_t* framesEnd = frames + framesSize;
+        ByteReader m2(meta, metaSize);
+        if (kind == emergency::SectionCamera) {
+            uint32_t count = m2.u32();
+            memcpy(o, meta, 4);
+            o += 4;
+            if (!joinTrack(o, count, groups[0], frames, framesEnd, c)) return false;
+        }
+        else {
+            memcpy(o, meta, headSize);
+            o += headSize;
+            m2.skip(headSize);
+            for (int i = 0; i < groupCount; i++) {
+                if (!joinTracks(m2, meta, o, groups[i], frames, framesEnd, c)) return false;
+            }
+        }
+        if (frames != framesEnd) return false;
+        memcpy(o, tail, tailSize);
+        return true;
+    }
+
+    bool decodeImage(const uint8_t* data, size_t size, std::vector<uint8_t>& kfs) {
+        ByteReader r(data, size);
+        if (r.u32() != Magic) return false;
+        uint32_t version = r.u32();
+        if (version < 1 || version > Version) return false;
+        uint64_t rawSize = r.u64();
+        uint32_t crc = r.u32();
+        uint32_t headerSize = r.u32();
+        // 0 のバイトを省いても 1/128 より小さくはならないので、壊れたサイズで大きく確保しないようにする
+        if (!r.ok() || rawSize > 0xFFFFFFFFull || rawSize / 128 > size || headerSize > rawSize) return false;
+        const uint8_t* header = r.skip(headerSize);
+        if (!header) return false;
+
+        kfs.resize(static_cast<size_t>(rawSize));
+        uint8_t* o = kfs.data();
+        uint8_t* end = o + kfs.size();
+        memcpy(o, header, headerSize);
+        o += headerSize;
+
+        // 版 2: meta と末尾の残りをまとめたもの
+        Columns c;
+        if (version >= 2) {
+            uint64_t n;
+            if (!getSize(r, n) || n > rawSize) return false;
+            uint8_t mode = r.u8();
+            c.allMeta.resize(static_cast<size_t>(n));
+            if (!r.ok() || !getOpaque(r, mode, c.allMeta.data(), c.allMeta.size())) return false;
+        }
+        ByteReader allMeta(c.allMeta.data(), c.allMeta.size());
+
+        uint32_t sections = r.u32();
+        for (uint32_t i = 0; i < sections; i++) {
+            const uint8_t* sh = r.skip(emergency::SectionHeaderSize);
+            if (!sh || static_cast<size_t>(end - o) < emergency::SectionHeaderSize) return false;
+            uint32_t kind;
+            uint64_t bodySize;
+            memcpy(&kind, sh + 4, 4);
+            memcpy(&bodySize, sh + 16, 8);
+            memcpy(o, sh, emergency::SectionHeaderSize);
+            o += emergency::SectionHeaderSize;
+            if (bodySize > static_cast<uint64_t>(end - o)) return false;
+            if (!decodeSection(version, kind, r, allMeta, static_cast<size_t>(bodySize), o, c)) return false;
+            o += bodySize;
+        }
+
+        uint64_t tailSize = r.u64();
+        if (!r.ok() || tailSize != static_cast<uint64_t>(end - o)) return false;
+        if (version >= 2) {
+            if (allMeta.remaining() != tailSize || r.remaining() != 0) return false;
+            memcpy(o, allMeta.skip(static_cast<size_t>(tailSize)), static_cast<size_t>(tailSize));
+        }
+        else {
+            uint8_t tailMode = r.u8();
+            if (!r.ok() || !getOpaque(r, tailMode, o, static_cast<size_t>(tailSize)) || r.remaining() != 0) return false;
+        }
+        return Crc32(kfs.data(), kfs.size()) == crc;
+    }
+}
+
+bool IsEncoded(const uint8_t* data, size_t size) {
+    uint32_t magic;
+    if (size < sizeof(magic)) return false;
+    memcpy(&magic, data, sizeof(magic));
+    return magic == Magic;
+}
+
+struct Encoder::Buffers {
+    Columns columns;
+};
+
+Encoder::Encoder() : m_buffers(new Buffers()) {}
+Encoder::~Encoder() {}
+
+bool Encode(const uint8_t* kfs, size_t size, std::vector<uint8_t>& out) {
+    Encoder encoder;
+    return encoder.encode(kfs, size, out);
+}
+
+bool Encoder::encode(const uint8_t* kfs, size_t size, std::vector<uint8_t>& out) {
+    out.clear();
+    ByteReader h(kfs, size);
+    if (h.u32() != emergency::FileMagic) return false;
+    h.skip(emergency::HeaderSize - 4);
+    uint16_t pathLen = h.u16();
+    h.skip(pathLen * 2u);
+    if (!h.ok()) return false;
+    const size_t headerSize = h.pos();
+
+    // セクションは先頭から辿る（ディレクトリはそのまま残りに入る）。
+    // meta と残りは allMeta に集めて最後に1回だけ LZ にし、セクションの並びより前に置く
+    Columns& c = m_buffers->columns;
+    c.allMeta.clear();
+    c.body.clear();
+    ByteWriter b(c.body);
+    uint32_t sections = 0;
+    size_t pos = headerSize;
+    while (size - pos >= emergency::SectionHeaderSize) {
+        ByteReader s(kfs + pos, emergency::SectionHeaderSize);
+        uint32_t magic = s.u32();
+        uint32_t kind = s.u32();
+        s.u32();
+        s.u32();
+        uint64_t bodySize = s.u64();
+        if (magic != emergency::SectionMagic || bodySize > size - pos - emergency::SectionHeaderSize) break;
+        b.raw(kfs + pos, emergency::SectionHeaderSize);
+        pos += emergency::SectionHeaderSize;
+        encodeSection(kind, kfs + pos, static_cast<size_t>(bodySize), c, c.body);
+        pos += static_cast<size_t>(bodySize);
+        sections++;
+    }
+    c.allMeta.insert(c.allMeta.end(), kfs + pos, kfs + size);
+
+    out.reserve(size / 2);
+    ByteWriter w(out);
+    w.u32(Magic);
+    w.u32(Version);
+    w.u64(size);
+    w.u32(Crc32(kfs, size));
+    w.u32(static_cast<uint32_t>(headerSize));
+    w.raw(kfs, headerSize);
+    putVarint(out, c.allMeta.size());
+    putOpaque(out, c.allMeta.data(), c.allMeta.size(), c);
+    w.u32(sections);
+    w.raw(c.body.data(), c.body.size());
+    w.u64(size - pos);
+    return true;
+}
+
+bool Decode(const uint8_t* data, size_t size, std::vector<uint8_t>& kfs) {
+    if (decodeImage(data, size, kfs)) return true;
+    kfs.clear();
+    return false;
+}
+
+}
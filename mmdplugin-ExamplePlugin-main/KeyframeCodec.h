@@ -0,0 +1,49 @@
+﻿#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// キーフレームの保存（.kfs、緊急保存と同じ形式）専用の可逆圧縮
+//
+// .kfs の大半はボーン・カメラのキーフレームの float と、増えていくフレーム番号で、
+// 汎用の LZ では一致がほとんど見つからない。そこでセクションの本体をトラックごとに読み、
+//   フレーム番号: トラック内の差分の差分（zigzag の可変長整数）
+//   float・整数:  列ごとに並べ、同じトラックの直前の値との XOR（トラックの先頭は直前のトラックの先頭との XOR）
+//   補間:        直前のキーフレームとの XOR
+// にしてから、0 のバイトを省く（128バイトごとのブロックのビットと、16バイトごとのマスク + 0 以外のバイト）。
+// 値がほとんど変わらない列や、動かないボーンの位置はほぼマスクだけになる。
+// 名前などキーフレーム以外（meta）と末尾の残り（ディレクトリなど）は全セクション分をまとめて1回だけ LZ にする。
+// 読めないセクション（途中で切れたものなど）はセクションごとに LZ で持つ。
+// 保存のたびに通るので、列に分ける1回の走査と 0 を省く走査だけで済ませ、LZ と比べて選ぶことはしない
+// （BackupTool codeccheck で、lz-fast より大きくも遅くもないことを確かめる）。
+//
+//   magic, version, 元のサイズ(u64), 元の CRC32, ヘッダのサイズ, ヘッダ,
+//   meta と残りのサイズ, 方式(u8), meta と残り,
+//   セクション数, { セクションのヘッダ(24バイト), 方式(u8), 本体 }..., 残りのサイズ(u64)
+//
+// 版 1（LZ の方が小さいセクションを LZ で持ち、meta はセクションごと、トラックの先頭は 0 との XOR）も読める。
+// 展開すると元の .kfs とバイト単位で一致する（CRC32 で確かめる）。
+
+namespace kfc {
+    const uint32_t Magic = 0x5A4B4241;     // "ABKZ"
+    const uint32_t Version = 2;
+
+    bool IsEncoded(const uint8_t* data, size_t size);
+
+    // kfs が .kfs でなければ false（out は空）
+    bool Encode(const uint8_t* kfs, size_t size, std::vector<uint8_t>& out);
+
+    // Encode と同じ。列に分ける作業領域と LZ の表を持ち続けるので、同じ構成のシーンなら2回目からは確保しない
+    class Encoder {
+    public:
+        Encoder();
+        ~Encoder();
+        bool encode(const uint8_t* kfs, size_t size, std::vector<uint8_t>& out);
+
+    private:
+        struct Buffers;
+        std::unique_ptr<Buffers> m_buffers;
+    };
+    bool Decode(const uint8_t* data, size_t size, std::vector<uint8_t>& kfs);
+}
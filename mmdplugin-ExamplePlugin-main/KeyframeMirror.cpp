@@ -0,0 +1,306 @@
+﻿#include "stdafx.h"
+#include "KeyframeMirror.h"
+#include <cstring>
+
+namespace {
+    const uint32_t kMaxChainSteps = 1 << 22;
+    const int kMaxTracks = 0x10000;
+
+    class Hasher {
+    public:
+        Hasher() : m_h(1469598103934665603ull) {}
+        void raw(const void* data, size_t size) {
+            const uint8_t* p = static_cast<const uint8_t*>(data);
+            for (size_t i = 0; i < size; i++) {
+                m_h ^= p[i];
+                m_h *= 1099511628211ull;
+            }
+        }
+        template <typename T> void pod(const T& v) { raw(&v, sizeof(v)); }
+        uint64_t value() const { return m_h; }
+
+    private:
+        uint64_t m_h;
+    };
+
+    // 選択状態などの表示用の欄は混ぜず、保存される内容だけをハッシュする
+    void hashBoneKey(Hasher& h, const mmp::MMDModelData::BoneKeyFrame& k) {
+        h.pod(k.frame_number);
+        h.pod(k.next_index);
+        h.raw(k.interpolation_curve_x1, 16);
+        h.pod(k.x); h.pod(k.y); h.pod(k.z);
+        h.raw(k.rotation_q, sizeof(k.rotation_q));
+    }
+
+    void hashMorphKey(Hasher& h, const mmp::MMDModelData::MorphKeyFrame& k) {
+        h.pod(k.frame_number);
+        h.pod(k.next_index);
+        h.pod(k.value);
+    }
+
+    void fingerprintBody(const mmp::MMDModelData* model, ModelFingerprint& fp) {
+        fp.boneCount = model->bone_count;
+        fp.morphCount = model->morph_count;
+        fp.lastFrame = model->last_frame_number;
+        if (fp.boneCount < 0 || fp.boneCount > kMaxTracks || fp.morphCount < 0 || fp.morphCount > kMaxTracks) {
+            fp.boneCount = -1;
+            return;
+        }
+        Hasher h;
+        h.raw(model->name_jp, sizeof(model->name_jp));
+        h.raw(model->file_path, sizeof(model->file_path));
+        for (int b = 0; b < fp.boneCount; b++) hashBoneKey(h, model->bone_keyframe[b]);
+        for (int m = 0; m < fp.morphCount; m++) hashMorphKey(h, model->morph_keyframe[m]);
+        fp.heads = h.value();
+    }
+
+    // out が null のときはハッシュだけを求める。ボーン・モーフの配列は呼び出し側で数を合わせておく
+    void walkModelBody(const mmp::MMDModelData* model, int pmdIndex, char* (*morphName)(int, int), ModelMirror* out, uint64_t& hash) {
+        Hasher h;
+        int boneCount = model->bone_count;
+        for (int b = 0; b < boneCount && b < kMaxTracks; b++) {
+            BoneTrack* track = out ? &out->bones[b] : nullptr;
+            if (track) track->name.assign(model->bone_current_data[b].name_jp, strnlen(model->bone_current_data[b].name_jp, sizeof(model->bone_current_data[b].name_jp)));
+            int index = b;
+            int prevFrame = -1;
+            for (uint32_t step = 0; step < kMaxChainSteps; step++) {
+                const mmp::MMDModelData::BoneKeyFrame& k = model->bone_keyframe[index];
+                if (k.frame_number <= prevFrame) break;
+                hashBoneKey(h, k);
+                if (track) {
+                    track->frames.push_back(k.frame_number);
+                    track->x.push_back(k.x);
+                    track->y.push_back(k.y);
+                    track->z.push_back(k.z);
+                    track->qx.push_back(k.rotation_q[0]);
+                    track->qy.push_back(k.rotation_q[1]);
+                    track->qz.push_back(k.rotation_q[2]);
+                    track->qw.push_back(k.rotation_q[3]);
+                    const uint8_t* curve = reinterpret_cast<const uint8_t*>(k.interpolation_curve_x1);
+                    track->curves.insert(track->curves.end(), curve, curve + 16);
+                }
+                prevFrame = k.frame_number;
+                if (k.next_index <= 0) break;
+                index = k.next_index;
+            }
+        }
+
+        int morphCount = model->morph_count;
+        for (int m = 0; m < morphCount && m < kMaxTracks; m++) {
+            MorphTrack* track = out ? &out->morphs[m] : nullptr;
+            if (track) {
+                const char* name = morphName ? morphName(pmdIndex, m) : nullptr;
+                track->name.assign(name ? name : "", name ? strnlen(name, 20) : 0);
+            }
+            int index = m;
+            int prevFrame = -1;
+            for (uint32_t step = 0; step < kMaxChainSteps; step++) {
+                const mmp::MMDModelData::MorphKeyFrame& k = model->morph_keyframe[index];
+                if (k.frame_number <= prevFrame) break;
+                hashMorphKey(h, k);
+                if (track) {
+                    track->frames.push_back(k.frame_number);
+                    track->weights.push_back(k.value);
+                }
+                prevFrame = k.frame_number;
+                if (k.next_index <= 0) break;
+                index = k.next_index;
+            }
+        }
+
+        if (out) {
+            out->name.assign(model->name_jp, strnlen(model->name_jp, sizeof(model->name_jp)));
+            out->filePath.assign(model->file_path, wcsnlen(model->file_path, 256));
+        }
+        hash = h.value();
+    }
+
+    void walkCameraBody(const mmp::MMDMainData* data, CameraTrack& out, uint64_t& hash) {
+        Hasher h;
+        const mmp::CameraKeyFrameData* keys = data->camera_key_frame;
+        int index = 0;
+        int prevFrame = -1;
+        for (uint32_t step = 0; step < kMaxChainSteps && index >= 0 && index < 10000; step++) {
+            const mmp::CameraKeyFrameData& k = keys[index];
+            if (k.frame_no <= prevFrame) break;
+            h.pod(k.frame_no);
+            h.pod(k.length);
+            h.pod(k.xyz);
+            h.pod(k.rxyz);
+            h.raw(k.hokan1_x, 24);
+            h.pod(k.is_perspective);
+            h.pod(k.view_angle);
+            out.frames.push_back(k.frame_no);
+            out.distance.push_back(k.length);
+            out.x.push_back(k.xyz.x);
+            out.y.push_back(k.xyz.y);
+            out.z.push_back(k.xyz.z);
+            out.rx.push_back(k.rxyz.x);
+            out.ry.push_back(k.rxyz.y);
+            out.rz.push_back(k.rxyz.z);
+            const uint8_t* curve = reinterpret_cast<const uint8_t*>(k.hokan1_x);
+            out.curves.insert(out.curves.end(), curve, curve + 24);
+            out.viewAngle.push_back(k.view_angle);
+            out.perspective.push_back(static_cast<uint8_t>(k.is_perspective != 0));
+            prevFrame = k.frame_no;
+            if (k.next_index == 0) break;
+            index = k.next_index;
+        }
+        hash = h.value();
+    }
+
+    // 以下は C++ オブジェクトを持たない関数にして SEH で保護する（編集中の MMD のメモリを読むため）
+    bool guardedFingerprint(const mmp::MMDModelData* model, ModelFingerprint& fp) {
+        __try {
+            fingerprintBody(model, fp);
+            return fp.boneCount >= 0;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            return false;
+        }
+    }
+
+    bool guardedWalkModel(const mmp::MMDModelData* model, int pmdIndex, char* (*morphName)(int, int), ModelMirror* out, uint64_t& hash) {
+        __try {
+            walkModelBody(model, pmdIndex, morphName, out, hash);
+            return true;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            return false;
+        }
+    }
+
+    bool guardedWalkCamera(const mmp::MMDMainData* data, CameraTrack& out, uint64_t& hash) {
+        __try {
+            walkCameraBody(data, out, hash);
+            return true;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            return false;
+        }
+    }
+
+    mmp::MMDMainData* guardedMainData() {
+        __try {
+            return *reinterpret_cast<mmp::MMDMainData**>(reinterpret_cast<BYTE*>(GetModuleHandleW(nullptr)) + 0x1445F8);
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            return nullptr;
+        }
+    }
+
+    mmp::MMDModelData* guardedModelPointer(const mmp::MMDMainData* data, int slot) {
+        __try {
+            return data->model_data[slot];
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            return nullptr;
+        }
+    }
+
+    // 容量は残したまま空にする（作り直しで確保し直さないように）
+    void clearTrack(BoneTrack& t) {
+        t.frames.clear();
+        t.x.clear(); t.y.clear(); t.z.clear();
+        t.qx.clear(); t.qy.clear(); t.qz.clear(); t.qw.clear();
+        t.curves.clear();
+    }
+
+    void clearTrack(MorphTrack& t) {
+        t.frames.clear();
+        t.weights.clear();
+    }
+
+    void clearTrack(CameraTrack& t) {
+        t.frames.clear();
+        t.distance.clear();
+        t.x.clear(); t.y.clear(); t.z.clear();
+        t.rx.clear(); t.ry.clear(); t.rz.clear();
+        t.curves.clear();
+        t.viewAngle.clear();
+        t.perspective.clear();
+    }
+}
+
+size_t ModelMirror::keyframeCount() const {
+    size_t n = 0;
+    for (const auto& b : bones) n += b.size();
+    for (const auto& m : morphs) n += m.size();
+    return n;
+}
+
+KeyframeMirror::KeyframeMirror()
+    : m_models(MaxModels), m_cameraHash(0), m_version(0), m_verifyCursor(0),
+    m_pfnGetMorphName(reinterpret_cast<char* (*)(int, int)>(GetProcAddress(GetModuleHandleW(nullptr), "ExpGetPmdMorphName"))) {}
+
+bool KeyframeMirror::rebuildModel(const mmp::MMDModelData* data, int pmdIndex, ModelMirror& mirror) {
+    mirror.bones.resize(static_cast<size_t>(mirror.fingerprint.boneCount));
+    mirror.morphs.resize(static_cast<size_t>(mirror.fingerprint.morphCount));
+    for (auto& t : mirror.bones) clearTrack(t);
+    for (auto& t : mirror.morphs) clearTrack(t);
+    uint64_t hash = 0;
+    if (!guardedWalkModel(data, pmdIndex, m_pfnGetMorphName, &mirror, hash)) return false;
+    mirror.loaded = true;
+    mirror.contentHash = hash;
+    mirror.version++;
+    return true;
+}
+
+KeyframeMirror::RefreshResult KeyframeMirror::refresh() {
+    RefreshResult result;
+    mmp::MMDMainData* data = guardedMainData();
+    if (!data) return result;
+
+    // カメラは連結が短いので毎回辿る
+    clearTrack(m_cameraScratch);
+    uint64_t cameraHash = 0;
+    if (guardedWalkCamera(data, m_cameraScratch, cameraHash) && cameraHash != m_cameraHash) {
+        std::swap(m_camera, m_cameraScratch);
+        m_cameraHash = cameraHash;
+        result.cameraChanged = true;
+    }
+
+    // 今回全体を辿って確かめるモデル
+    int verifySlot = -1;
+    for (int i = 0; i < MaxModels; i++) {
+        int slot = (m_verifyCursor + i) % MaxModels;
+        if (m_models[slot].loaded) {
+            verifySlot = slot;
+            m_verifyCursor = slot + 1;
+            break;
+        }
+    }
+
+    // ExpGetPmd* の番号は読み込まれているモデルを詰めた順
+    int pmdIndex = 0;
+    for (int slot = 0; slot < MaxModels; slot++) {
+        mmp::MMDModelData* model = guardedModelPointer(data, slot);
+        ModelMirror& mirror = m_models[slot];
+        if (!model) {
+            if (mirror.loaded) {
+                mirror = ModelMirror();
+                result.rebuilt++;
+            }
+            continue;
+        }
+        result.models++;
+
+        ModelFingerprint fp;
+        if (guardedFingerprint(model, fp)) {
+            bool stale = !mirror.loaded || fp != mirror.fingerprint;
+            if (!stale && slot == verifySlot) {
+                uint64_t hash = 0;
+                stale = guardedWalkModel(model, pmdIndex, nullptr, nullptr, hash) && hash != mirror.contentHash;
+            }
+            if (stale) {
+                mirror.fingerprint = fp;
+                if (rebuildModel(model, pmdIndex, mirror)) result.rebuilt++;
+                else mirror.loaded = false;
+            }
+        }
+        pmdIndex++;
+    }
+
+    if (result.changed()) m_version++;
+    return result;
+}
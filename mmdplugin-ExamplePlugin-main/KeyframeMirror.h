@@ -0,0 +1,103 @@
+﻿#pragma once
+#include "stdafx.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// MMD のキーフレームをプラグイン側で列ごとの配列に写したもの
+//
+// MMD 内部のキーフレームはヒープ上の配列に pre_index / next_index の連結で散らばっているので、
+// 辿るたびにキャッシュが効かない。ここではボーン・モーフごとにフレーム番号・位置・回転を
+// それぞれ連続した配列に持ち、読む側（変更の検出やバックアップ）は MMD のメモリを辿らずに済む。
+//
+// refresh() はモデルごとに安い指紋（ボーン数・モーフ数・last_frame_number・各トラック先頭の
+// キーフレーム）だけを比べ、変わったモデルだけを作り直す。指紋に表れない変更（連結の途中の値だけを
+// 書き換えた場合）は、毎回1モデルずつ全体を辿って確かめることで、モデル数回の refresh() 以内に拾う。
+// refresh() と読み出しは同じスレッドから行うこと。
+
+struct BoneTrack {
+    std::string name;               // Shift-JIS
+    std::vector<int32_t> frames;
+    std::vector<float> x, y, z;
+    std::vector<float> qx, qy, qz, qw;
+    std::vector<uint8_t> curves;    // 補間 x1, y1, x2, y2 を16バイトずつ
+
+    size_t size() const { return frames.size(); }
+};
+
+struct MorphTrack {
+    std::string name;               // Shift-JIS
+    std::vector<int32_t> frames;
+    std::vector<float> weights;
+
+    size_t size() const { return frames.size(); }
+};
+
+struct CameraTrack {
+    std::vector<int32_t> frames;
+    std::vector<float> distance;
+    std::vector<float> x, y, z;
+    std::vector<float> rx, ry, rz;
+    std::vector<uint8_t> curves;    // MMD 内部の並びの補間を24バイトずつ
+    std::vector<int32_t> viewAngle;
+    std::vector<uint8_t> perspective;
+
+    size_t size() const { return frames.size(); }
+};
+
+struct ModelFingerprint {
+    int32_t boneCount = -1;
+    int32_t morphCount = -1;
+    int32_t lastFrame = -1;
+    uint64_t heads = 0;             // 各トラックの先頭キーフレームのハッシュ
+
+    bool operator==(const ModelFingerprint& o) const {
+        return boneCount == o.boneCount && morphCount == o.morphCount && lastFrame == o.lastFrame && heads == o.heads;
+    }
+    bool operator!=(const ModelFingerprint& o) const { return !(*this == o); }
+};
+
+struct ModelMirror {
+    bool loaded = false;
+    std::string name;               // Shift-JIS
+    std::wstring filePath;
+    ModelFingerprint fingerprint;
+    uint64_t contentHash = 0;       // 全キーフレームのハッシュ
+    uint32_t version = 0;           // 作り直すたびに増える
+    std::vector<BoneTrack> bones;
+    std::vector<MorphTrack> morphs;
+
+    size_t keyframeCount() const;
+};
+
+class KeyframeMirror {
+public:
+    static const int MaxModels = 255;
+
+    struct RefreshResult {
+        uint32_t models = 0;        // 読み込まれているモデル
+        uint32_t rebuilt = 0;       // 作り直したモデル（追加・削除を含む）
+        bool cameraChanged = false;
+        bool changed() const { return rebuilt > 0 || cameraChanged; }
+    };
+
+    KeyframeMirror();
+
+    RefreshResult refresh();
+
+    // 何か変わるたびに増える（変更の有無だけを知りたい読み手用）
+    uint64_t version() const { return m_version; }
+    const ModelMirror& model(int slot) const { return m_models[slot]; }
+    const CameraTrack& camera() const { return m_camera; }
+
+private:
+    bool rebuildModel(const mmp::MMDModelData* data, int pmdIndex, ModelMirror& mirror);
+
+    std::vector<ModelMirror> m_models;
+    CameraTrack m_camera;
+    CameraTrack m_cameraScratch;
+    uint64_t m_cameraHash;
+    uint64_t m_version;
+    int m_verifyCursor;
+    char* (*m_pfnGetMorphName)(int, int);
+};
@@ -0,0 +1,402 @@
+﻿#include "LiveMetrics.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// 共有メモリ上の atomic はプロセスをまたいで使うので、ロックを使わない実装でなければならない
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "64-bit atomics must be lock-free");
+
+namespace {
+    struct Header {
+        std::atomic<uint64_t> format;
+        std::atomic<uint64_t> geometry;
+        uint64_t reserved[6];
+    };
+
+    const size_t kSegmentSize = sizeof(Header) + static_cast<size_t>(live::SlotCount) * live::SlotBytes;
+    const uint64_t kFormat = static_cast<uint64_t>(live::Magic) << 32 | live::Version;
+    const uint64_t kGeometry = static_cast<uint64_t>(live::SlotCount) << 32 | live::SlotBytes << 16 | live::FieldCount;
+
+#ifdef _WIN32
+    const wchar_t* kSegmentName = L"Local\\AutoBackup.Metrics";
+#else
+    const char* kSegmentName = "/AutoBackup.Metrics";
+#endif
+
+    int64_t unixMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    uint64_t currentPid() {
+#ifdef _WIN32
+        return GetCurrentProcessId();
+#else
+        return static_cast<uint64_t>(getpid());
+#endif
+    }
+
+    // スロットの持ち主がまだ動いているか。確かめられないときは動いているものとして扱う
+    bool processAlive(uint64_t pid) {
+#ifdef _WIN32
+        if (pid > MAXDWORD) return false;
+        HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, static_cast<DWORD>(pid));
+        // 開けないのは、無いか（ERROR_INVALID_PARAMETER）、権限が無いか（別のユーザー・昇格したプロセス）
+        if (!process) return GetLastError() == ERROR_ACCESS_DENIED;
+        DWORD code = 0;
+        bool alive = !GetExitCodeProcess(process, &code) || code == STILL_ACTIVE;
+        CloseHandle(process);
+        return alive;
+#else
+        if (pid > static_cast<uint64_t>(INT_MAX)) return false;
+        // シグナルは送らず、存在と権限だけを確かめる。EPERM は別のユーザーのプロセスがいるということ
+        return kill(static_cast<pid_t>(pid), 0) == 0 || errno == EPERM;
+#endif
+    }
+
+    // 形式とスロットの大きさが読める範囲か。FieldCount が多いのは新しい版が作ったもの
+    bool compatible(const Header* header, uint32_t& fieldCount) {
+        if (header->format.load(std::memory_order_acquire) != kFormat) return false;
+        uint64_t geometry = header->geometry.load(std::memory_order_relaxed);
+        if ((geometry >> 32) != live::SlotCount || ((geometry >> 16) & 0xFFFF) != live::SlotBytes) return false;
+        fieldCount = static_cast<uint32_t>(geometry & 0xFFFF);
+        if (fieldCount > live::MaxFields) return false;
+        return true;
+    }
+}
+
+struct LiveMetricsPublisher::Slot {
+    std::atomic<uint64_t> sequence;
+    std::atomic<uint64_t> owner;
+    std::atomic<uint64_t> values[live::MaxFields];
+    std::atomic<uint64_t> project[live::ProjectBytes / 8];
+};
+
+static_assert(sizeof(LiveMetricsPublisher::Slot) == live::SlotBytes, "unexpected slot layout");
+static_assert(sizeof(Header) == 64, "unexpected header layout");
+
+namespace {
+    LiveMetricsPublisher::Slot* slotAt(void* view, uint32_t index) {
+        return reinterpret_cast<LiveMetricsPublisher::Slot*>(static_cast<uint8_t*>(view) + sizeof(Header)) + index;
+    }
+}
+
+const char* live::FieldName(Field field) {
+    switch (field) {
+    case UpdatedMs: return "updatedMs";
+    case StartedMs: return "startedMs";
+    case LastBackupTime: return "lastBackupTime";
+    case LastBackupNs: return "lastBackupNs";
+    case Backups: return "backups";
+    case Failures: return "failures";
+    case BytesWritten: return "bytesWritten";
+    case SourceBytes: return "sourceBytes";
+    case QueueDepth: return "queueDepth";
+    case ThrottledNs: return "throttledNs";
+    case ReplicatedBytes: return "replicatedBytes";
+    case ReplicaFailures: return "replicaFailures";
+    default: return "unknown";
+    }
+}
+
+// --- LiveMetricsPublisher ---
+
+LiveMetricsPublisher::LiveMetricsPublisher()
+    : m_view(nullptr),
+#ifdef _WIN32
+    m_mapping(nullptr),
+#endif
+    m_slot(nullptr), m_pid(0), m_index(0), m_fieldCount(0) {}
+
+LiveMetricsPublisher::~LiveMetricsPublisher() {
+    close();
+}
+
+bool LiveMetricsPublisher::open() {
+    close();
+#ifdef _WIN32
+    // ページファイルを裏付けにした名前付きの共有メモリ。最後のハンドルが閉じると消える（中身は 0 で始まる）
+    m_mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, static_cast<DWORD>(kSegmentSize), kSegmentName);
+    if (!m_mapping) return false;
+    m_view = MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, kSegmentSize);
+#else
+    int fd = shm_open(kSegmentName, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    struct stat st;
+    bool sized = fstat(fd, &st) == 0 &&
+        (static_cast<size_t>(st.st_size) >= kSegmentSize || ftruncate(fd, static_cast<off_t>(kSegmentSize)) == 0);
+    void* view = sized ? mmap(nullptr, kSegmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    m_view = view == MAP_FAILED ? nullptr : view;
+#endif
+    if (!m_view) {
+        close();
+        return false;
+    }
+
+    // 最初に開いた側が大きさ・形式の順に書く（format が見えたときには geometry も見える）
+    Header* header = static_cast<Header*>(m_view);
+    uint64_t expected = 0;
+    header->geometry.compare_exchange_strong(expected, kGeometry);
+    expected = 0;
+    if (!header->format.compare_exchange_strong(expected, kFormat, std::memory_order_release) && expected != kFormat) {
+        close();
+        return false;
+    }
+    if (!compatible(header, m_fieldCount)) {
+        close();
+        return false;
+    }
+    m_fieldCount = (std::min)(m_fieldCount, static_cast<uint32_t>(live::FieldCount));
+
+    // 空きか、更新が止まって久しく持ち主も終わっているスロットを取る。
+    // 止まっているだけの持ち主（長い保存の最中など）のものは、いくら古くても取らない
+    m_pid = currentPid();
+    int64_t now = unixMs();
+    for (uint32_t i = 0; i < live::SlotCount && !m_slot; i++) {
+        Slot* s = slotAt(m_view, i);
+        uint64_t owner = s->owner.load();
+        if (owner != 0) {
+            if (now - static_cast<int64_t>(s->values[live::UpdatedMs].load()) < live::StaleMs) continue;
+            if (processAlive(owner)) continue;
+        }
+        if (!s->owner.compare_exchange_strong(owner, m_pid)) continue;
+        // 書き込み中に落ちたプロセスのものなら sequence が奇数のまま残っている
+        uint64_t sequence = s->sequence.load();
+        if (sequence & 1) s->sequence.store(sequence + 1);
+        m_slot = s;
+        m_index = i;
+    }
+    if (!m_slot) {
+        close();
+        return false;
+    }
+
+    uint64_t sequence;
+    if (!beginWrite(sequence)) {
+        close();
+        return false;
+    }
+    for (uint32_t f = 0; f < live::MaxFields; f++) m_slot->values[f].store(0, std::memory_order_relaxed);
+    for (auto& word : m_slot->project) word.store(0, std::memory_order_relaxed);
+    set(live::StartedMs, static_cast<uint64_t>(now));
+    set(live::UpdatedMs, static_cast<uint64_t>(now));
+    endWrite(sequence);
+    return true;
+}
+
+void LiveMetricsPublisher::close() {
+    if (m_slot) {
+        // 他に取られていたら、それはもう相手のもの
+        uint64_t pid = m_pid;
+        m_slot->owner.compare_exchange_strong(pid, 0);
+        m_slot = nullptr;
+    }
+#ifdef _WIN32
+    if (m_view) UnmapViewOfFile(m_view);
+    if (m_mapping) CloseHandle(m_mapping);
+    m_mapping = nullptr;
+#else
+    if (m_view) munmap(m_view, kSegmentSize);
+#endif
+    m_view = nullptr;
+}
+
+bool LiveMetricsPublisher::active() const {
+    return m_slot && owned();
+}
+
+bool LiveMetricsPublisher::owned() const {
+    return m_slot->owner.load(std::memory_order_relaxed) == m_pid;
+}
+
+bool LiveMetricsPublisher::beginWrite(uint64_t& sequence) {
+    // 止まっている間に取られていたら（別の PID 名前空間から死んだと見なされた場合など）もう書かない
+    if (!owned()) return false;
+    // 偶数から奇数にできた1人だけが書く。相手も数個のストアで終わるので、待つとしても一瞬
+    uint64_t current = m_slot->sequence.load(std::memory_order_relaxed);
+    for (;;) {
+        if (current & 1) {
+            std::this_thread::yield();
+            current = m_slot->sequence.load(std::memory_order_relaxed);
+            continue;
+        }
+        if (m_slot->sequence.compare_exchange_weak(current, current + 1, std::memory_order_acquire, std::memory_order_relaxed)) break;
+    }
+    sequence = current + 1;
+    // 取られたのが最初の確認と sequence を取るまでの間なら、何も書かずに返す
+    if (!owned()) {
+        endWrite(sequence);
+        return false;
+    }
+    return true;
+}
+
+void LiveMetricsPublisher::endWrite(uint64_t sequence) {
+    m_slot->sequence.store(sequence + 1, std::memory_order_release);
+}
+
+void LiveMetricsPublisher::set(live::Field field, uint64_t value) {
+    if (field < m_fieldCount) m_slot->values[field].store(value, std::memory_order_relaxed);
+}
+
+void LiveMetricsPublisher::setProject(const std::string& utf8) {
+    if (!m_slot) return;
+    char text[live::ProjectBytes] = {};
+    memcpy(text, utf8.data(), (std::min)(utf8.size(), sizeof(text) - 1));
+    uint64_t sequence;
+    if (!beginWrite(sequence)) return;
+    for (size_t i = 0; i < live::ProjectBytes / 8; i++) {
+        uint64_t word;
+        memcpy(&word, text + i * 8, 8);
+        m_slot->project[i].store(word, std::memory_order_relaxed);
+    }
+    set(live::UpdatedMs, static_cast<uint64_t>(unixMs()));
+    endWrite(sequence);
+}
+
+void LiveMetricsPublisher::backupFinished(int64_t time, uint64_t durationNs, uint64_t sourceBytes, uint64_t writtenBytes) {
+    if (!m_slot) return;
+    uint64_t now = static_cast<uint64_t>(unixMs());
+    uint64_t sequence;
+    if (!beginWrite(sequence)) return;
+    // 書いている間は他に書き手がいないので、足し込みも load / store でよい
+    std::atomic<uint64_t>* v = m_slot->values;
+    set(live::LastBackupTime, static_cast<uint64_t>(time));
+    set(live::LastBackupNs, durationNs);
+    set(live::Backups, v[live::Backups].load(std::memory_order_relaxed) + 1);
+    set(live::BytesWritten, v[live::BytesWritten].load(std::memory_order_relaxed) + writtenBytes);
+    set(live::SourceBytes, v[live::SourceBytes].load(std::memory_order_relaxed) + sourceBytes);
+    set(live::UpdatedMs, now);
+    endWrite(sequence);
+}
+
+void LiveMetricsPublisher::backupFailed() {
+    if (!m_slot) return;
+    uint64_t now = static_cast<uint64_t>(unixMs());
+    uint64_t sequence;
+    if (!beginWrite(sequence)) return;
+    set(live::Failures, m_slot->values[live::Failures].load(std::memory_order_relaxed) + 1);
+    set(live::UpdatedMs, now);
+    endWrite(sequence);
+}
+
+void LiveMetricsPublisher::heartbeat(uint64_t queueDepth, uint64_t throttledNs, uint64_t replicatedBytes, uint64_t replicaFailures) {
+    if (!m_slot) return;
+    uint64_t now = static_cast<uint64_t>(unixMs());
+    uint64_t sequence;
+    if (!beginWrite(sequence)) return;
+    set(live::QueueDepth, queueDepth);
+    set(live::ThrottledNs, throttledNs);
+    set(live::ReplicatedBytes, replicatedBytes);
+    set(live::ReplicaFailures, replicaFailures);
+    set(live::UpdatedMs, now);
+    endWrite(sequence);
+}
+
+// --- LiveMetricsReader ---
+
+LiveMetricsReader::LiveMetricsReader()
+    : m_view(nullptr),
+#ifdef _WIN32
+    m_mapping(nullptr),
+#endif
+    m_fieldCount(0) {}
+
+LiveMetricsReader::~LiveMetricsReader() {
+    close();
+}
+
+bool LiveMetricsReader::open(std::string& error) {
+    close();
+#ifdef _WIN32
+    m_mapping = OpenFileMappingW(FILE_MAP_READ, FALSE, kSegmentName);
+    if (!m_mapping) {
+        error = "no AutoBackup instance is publishing metrics in this session";
+        return false;
+    }
+    m_view = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, kSegmentSize);
+#else
+    int fd = shm_open(kSegmentName, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+        error = errno == ENOENT ? "no AutoBackup instance has published metrics on this machine" : "cannot open the metrics segment";
+        return false;
+    }
+    struct stat st;
+    void* view = fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= kSegmentSize
+        ? mmap(nullptr, kSegmentSize, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    m_view = view == MAP_FAILED ? nullptr : view;
+#endif
+    if (!m_view) {
+        close();
+        error = "cannot map the metrics segment";
+        return false;
+    }
+    if (!compatible(static_cast<const Header*>(m_view), m_fieldCount)) {
+        close();
+        error = "the metrics segment has an unknown layout (written by a different version)";
+        return false;
+    }
+    return true;
+}
+
+void LiveMetricsReader::close() {
+#ifdef _WIN32
+    if (m_view) UnmapViewOfFile(m_view);
+    if (m_mapping) CloseHandle(m_mapping);
+    m_mapping = nullptr;
+#else
+    if (m_view) munmap(m_view, kSegmentSize);
+#endif
+    m_view = nullptr;
+}
+
+void LiveMetricsReader::read(std::vector<live::Snapshot>& out) const {
+    out.clear();
+    if (!m_view) return;
+    uint32_t fields = (std::min)(m_fieldCount, static_cast<uint32_t>(live::FieldCount));
+    for (uint32_t i = 0; i < live::SlotCount; i++) {
+        const LiveMetricsPublisher::Slot* s = slotAt(m_view, i);
+        if (s->owner.load(std::memory_order_relaxed) == 0) continue;
+
+        live::Snapshot snap;
+        char text[live::ProjectBytes + 1] = {};
+        bool consistent = false;
+        for (int attempt = 0; attempt < 1000 && !consistent; attempt++) {
+            uint64_t before = s->sequence.load(std::memory_order_acquire);
+            if (before & 1) {
+                std::this_thread::yield();
+                continue;
+            }
+            snap.pid = s->owner.load(std::memory_order_relaxed);
+            for (uint32_t f = 0; f < fields; f++) snap.values[f] = s->values[f].load(std::memory_order_relaxed);
+            for (size_t w = 0; w < live::ProjectBytes / 8; w++) {
+                uint64_t word = s->project[w].load(std::memory_order_relaxed);
+                memcpy(text + w * 8, &word, 8);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            consistent = s->sequence.load(std::memory_order_relaxed) == before;
+            snap.sequence = before;
+        }
+        // 書き続けられて読めなかったスロットは飛ばす（次に読むときには読める）
+        if (!consistent || snap.pid == 0) continue;
+        snap.slot = i;
+        snap.project = text;
+        out.push_back(snap);
+    }
+}
@@ -0,0 +1,129 @@
+﻿#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// バックアップの状態を共有メモリに公開し、MMD を開かずに外から見られるようにする
+//
+// 名前付きの共有メモリ（Windows: Local\AutoBackup.Metrics、それ以外: /dev/shm/AutoBackup.Metrics）に
+// 固定個のスロットを置き、MMD（プロセス）ごとに1つを取って自分の値を書く。BackupTool watch が読む。
+//
+// 形式（すべて 64bit、リトルエンディアン）
+//   ヘッダ 64 バイト
+//     [0]  format   = Magic << 32 | Version。Version が違えば読み手は触れない（互換の無い変更のときだけ上げる）
+//     [8]  geometry = SlotCount << 32 | SlotBytes << 16 | FieldCount。最初に開いた側が書く
+//   スロット SlotBytes バイト × SlotCount
+//     [0]  sequence  書いている間だけ奇数（seqlock）。読み手は前後で同じ偶数だったときだけ採用する
+//     [8]  owner     プロセス ID。0 なら空き
+//     [16] values    Field の順に FieldCount 個
+//     [16 + MaxFields * 8] project  プロジェクト名（UTF-8、NUL 埋め、ProjectBytes バイト）
+// 項目は末尾にだけ足す（FieldCount が増えるだけなので、古い読み手は知っている分だけ読めばよい）。
+// 書き込みは CAS 1回と数個のストアだけで、ロックもシステムコールも使わない。
+// 読み手がいなくても書き手は待たず、読み手は書き込み中に当たれば読み直す。
+
+namespace live {
+    const uint32_t Magic = 0x544D4241;  // "ABMT"
+    const uint32_t Version = 1;
+    const uint32_t SlotCount = 32;
+    const uint32_t SlotBytes = 256;
+    const uint32_t MaxFields = 18;
+    const uint32_t ProjectBytes = SlotBytes - 16 - MaxFields * 8;
+
+    // 更新が止まってからこの時間が過ぎ、持ち主のプロセスも終わっているスロットは他が使ってよい
+    // （ワーカーが長い保存や複製で止まっているだけのこともあるので、時間だけでは取らない）
+    const int64_t StaleMs = 60 * 1000;
+
+    enum Field : uint32_t {
+        UpdatedMs = 0,      // 最後に書いた時刻（UNIX ミリ秒）。ワーカースレッドがおよそ1秒ごとに更新する
+        StartedMs,          // 公開を始めた時刻（UNIX ミリ秒）
+        LastBackupTime,     // 最後に成功したバックアップの時刻（UNIX 秒、0 ならまだ無い）
+        LastBackupNs,       // その所要時間（保存要求から世代整理まで）
+        Backups,            // 成功したバックアップの数
+        Failures,           // 失敗したバックアップの数
+        BytesWritten,       // バックアップで書いたバイト数（パックなら圧縮後）
+        SourceBytes,        // その元の PMM / EMM のバイト数（SourceBytes / BytesWritten が削減率）
+        QueueDepth,         // 複製の待ち（プロジェクト数）
+        ThrottledNs,        // 帯域制限で待った時間の合計
+        ReplicatedBytes,    // 複製で送ったバイト数
+        ReplicaFailures,    // 複製の連続失敗回数
+        FieldCount
+    };
+    static_assert(FieldCount <= MaxFields, "slot has no room for more fields");
+
+    const char* FieldName(Field field);
+
+    // 読み手が取り出した1スロット分
+    struct Snapshot {
+        uint32_t slot = 0;
+        uint64_t pid = 0;
+        uint64_t sequence = 0;          // 書き込みのたびに 2 ずつ増える
+        std::string project;
+        uint64_t values[FieldCount] = {};
+    };
+}
+
+// 書き手（プラグイン）。スロットを取れなかったり共有メモリを作れなかったときは何もしない
+class LiveMetricsPublisher {
+public:
+    LiveMetricsPublisher();
+    ~LiveMetricsPublisher();
+
+    LiveMetricsPublisher(const LiveMetricsPublisher&) = delete;
+    LiveMetricsPublisher& operator=(const LiveMetricsPublisher&) = delete;
+
+    bool open();
+    void close();
+    // スロットを取れていて、まだ自分のものか
+    bool active() const;
+    uint32_t slotIndex() const { return m_index; }
+
+    // プロジェクトが変わったときだけ呼ぶ
+    void setProject(const std::string& utf8);
+    void backupFinished(int64_t time, uint64_t durationNs, uint64_t sourceBytes, uint64_t writtenBytes);
+    void backupFailed();
+    // ワーカースレッドのループで呼ぶ（生きている印を兼ねる）
+    void heartbeat(uint64_t queueDepth, uint64_t throttledNs, uint64_t replicatedBytes, uint64_t replicaFailures);
+
+    struct Slot;
+
+private:
+    // 書き込みの間 sequence を奇数にする（同じプロセスの他のスレッドとも排他になる）。
+    // スロットが他に取られていたら何もせず false（取った側の値を上書きしない）
+    bool beginWrite(uint64_t& sequence);
+    bool owned() const;
+    void endWrite(uint64_t sequence);
+    void set(live::Field field, uint64_t value);
+
+    void* m_view;
+#ifdef _WIN32
+    void* m_mapping;
+#endif
+    Slot* m_slot;
+    uint64_t m_pid;
+    uint32_t m_index;
+    uint32_t m_fieldCount;  // 共有メモリを作った側の FieldCount（これより後ろには書かない）
+};
+
+// 読み手（BackupTool watch など）。読むだけで、共有メモリを作りはしない
+class LiveMetricsReader {
+public:
+    LiveMetricsReader();
+    ~LiveMetricsReader();
+
+    LiveMetricsReader(const LiveMetricsReader&) = delete;
+    LiveMetricsReader& operator=(const LiveMetricsReader&) = delete;
+
+    // まだ誰も公開していなければ false（error に理由）
+    bool open(std::string& error);
+    void close();
+
+    // 使われているスロットを読む（書き込み中なら読み直す）
+    void read(std::vector<live::Snapshot>& out) const;
+
+private:
+    void* m_view;
+#ifdef _WIN32
+    void* m_mapping;
+#endif
+    uint32_t m_fieldCount;
+};
@@ -0,0 +1,193 @@
+﻿#include "LzCodec.h"
+#include <cstring>
+
+namespace {
+    const size_t kMinMatch = 4;
+    const int kHashBits = 16;
+    const size_t kLastLiterals = 8;   // 末尾は必ずリテラルにして展開側の境界判定を簡単にする
+
+    uint32_t read32(const uint8_t* p) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return v;
+    }
+
+    uint32_t hash4(const uint8_t* p) {
+        return (read32(p) * 2654435761u) >> (32 - kHashBits);
+    }
+
+    void putLength(std::vector<uint8_t>& out, size_t len) {
+        while (len >= 255) {
+            out.push_back(255);
+            len -= 255;
+        }
+        out.push_back(static_cast<uint8_t>(len));
+    }
+
+    void putVarint(std::vector<uint8_t>& out, size_t v) {
+        while (v >= 0x80) {
+            out.push_back(static_cast<uint8_t>(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back(static_cast<uint8_t>(v));
+    }
+
+    void emitSequence(std::vector<uint8_t>& out, const uint8_t* lit, size_t litLen, size_t offset, size_t matchLen) {
+        size_t m = matchLen ? matchLen - kMinMatch : 0;
+        uint8_t token = static_cast<uint8_t>(((litLen < 15 ? litLen : 15) << 4) | (m < 15 ? m : 15));
+        out.push_back(token);
+        if (litLen >= 15) putLength(out, litLen - 15);
+        out.insert(out.end(), lit, lit + litLen);
+        if (matchLen == 0) return;
+        putVarint(out, offset);
+        if (m >= 15) putLength(out, m - 15);
+    }
+
+    // 表は Compressor のものを借りる
+    struct MatchFinder {
+        std::vector<int64_t>& head;
+        std::vector<int64_t>& prev;
+        size_t windowMask;
+        int maxChain;
+
+        MatchFinder(int level, std::vector<int64_t>& headTable, std::vector<int64_t>& prevTable)
+            : head(headTable), prev(prevTable),
+            windowMask((size_t(1) << (level >= 6 ? 20 : 16)) - 1),
+            maxChain(level <= 1 ? 4 : level >= 9 ? 512 : level * 16) {
+            head.assign(size_t(1) << kHashBits, -1);
+            prev.assign(windowMask + 1, -1);
+        }
+
+        void insert(const uint8_t* base, size_t pos) {
+            uint32_t h = hash4(base + pos);
+            prev[pos & windowMask] = head[h];
+            head[h] = static_cast<int64_t>(pos);
+        }
+
+        size_t find(const uint8_t* base, size_t pos, size_t limit, size_t& bestOffset) const {
+            size_t best = 0;
+            int64_t cand = head[hash4(base + pos)];
+            for (int chain = 0; cand >= 0 && chain < maxChain; chain++) {
+                size_t c = static_cast<size_t>(cand);
+                if (pos - c > windowMask) break;
+                if (read32(base + c) == read32(base + pos)) {
+                    size_t len = kMinMatch;
+                    while (pos + len < limit && base[c + len] == base[pos + len]) len++;
+                    if (len > best) {
+                        best = len;
+                        bestOffset = pos - c;
+                        if (pos + len >= limit) break;
+                    }
+                }
+                int64_t next = prev[c & windowMask];
+                if (next >= cand) break;
+                cand = next;
+            }
+            return best;
+        }
+    };
+}
+
+namespace lz {
+
+size_t compress(const uint8_t* src, size_t size, std::vector<uint8_t>& out, int level) {
+    Compressor compressor;
+    return compressor.compress(src, size, out, level);
+}
+
+size_t Compressor::compress(const uint8_t* src, size_t size, std::vector<uint8_t>& out, int level) {
+    size_t start = out.size();
+    if (size <= kLastLiterals + kMinMatch) {
+        emitSequence(out, src, size, 0, 0);
+        return out.size() - start;
+    }
+
+    MatchFinder mf(level, m_head, m_prev);
+    bool lazy = level >= 6;
+    size_t limit = size - kLastLiterals;
+    size_t anchor = 0;
+    size_t pos = 0;
+    while (pos + kMinMatch <= limit) {
+        size_t offset = 0;
+        size_t len = mf.find(src, pos, limit, offset);
+        if (len < kMinMatch) {
+            mf.insert(src, pos);
+            pos++;
+            continue;
+        }
+        // 1バイト先でより長く一致するならそちらを使う
+        if (lazy && pos + 1 + kMinMatch <= limit) {
+            mf.insert(src, pos);
+            size_t offset2 = 0;
+            size_t len2 = mf.find(src, pos + 1, limit, offset2);
+            if (len2 > len + 1) {
+                pos++;
+                len = len2;
+                offset = offset2;
+            }
+        }
+        emitSequence(out, src + anchor, pos - anchor, offset, len);
+        size_t end = pos + len;
+        for (; pos < end && pos + kMinMatch <= limit; pos++) mf.insert(src, pos);
+        pos = end;
+        anchor = pos;
+    }
+    emitSequence(out, src + anchor, size - anchor, 0, 0);
+    return out.size() - start;
+}
+
+bool decompress(const uint8_t* src, size_t size, uint8_t* dst, size_t rawSize) {
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + size;
+    size_t op = 0;
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t litLen = token >> 4;
+        if (litLen == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return false;
+                b = *ip++;
+                litLen += b;
+            } while (b == 255);
+        }
+        if (litLen > static_cast<size_t>(iend - ip) || litLen > rawSize - op) return false;
+        memcpy(dst + op, ip, litLen);
+        ip += litLen;
+        op += litLen;
+        if (op == rawSize) return ip == iend;
+
+        size_t offset = 0;
+        int shift = 0;
+        uint8_t b;
+        do {
+            if (ip >= iend || shift > 56) return false;
+            b = *ip++;
+            offset |= static_cast<size_t>(b & 0x7F) << shift;
+            shift += 7;
+        } while (b & 0x80);
+        size_t matchLen = (token & 15);
+        if (matchLen == 15) {
+            do {
+                if (ip >= iend) return false;
+                b = *ip++;
+                matchLen += b;
+            } while (b == 255);
+        }
+        matchLen += kMinMatch;
+        if (offset == 0 || offset > op || matchLen > rawSize - op) return false;
+        // 重なりがあり得るので前から1バイトずつ
+        const uint8_t* from = dst + op - offset;
+        uint8_t* to = dst + op;
+        if (offset >= matchLen) {
+            memcpy(to, from, matchLen);
+        }
+        else {
+            for (size_t i = 0; i < matchLen; i++) to[i] = from[i];
+        }
+        op += matchLen;
+    }
+    return op == rawSize;
+}
+
+}
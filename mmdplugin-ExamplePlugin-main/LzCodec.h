@@ -0,0 +1,36 @@
+﻿#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// 依存ライブラリなしで使える LZ77 系の圧縮
+//
+// シーケンス = トークン(上位4bit:リテラル長, 下位4bit:一致長-4) [リテラル長の延長] リテラル
+//              [距離(可変長整数) 一致長の延長]
+// 長さが 15 のときは 255 が続く限り加算する（LZ4 と同じ方式）。
+// 最後のシーケンスはリテラルのみで、展開後のサイズに達したら終わる。
+//
+// level が大きいほどハッシュチェーンを深く辿り、遅延一致も行う。
+//   1   : 高速（新しいバックアップ向け）
+//   9   : 高圧縮（古いバックアップの再圧縮向け）
+
+namespace lz {
+    const int FastLevel = 1;
+    const int HighLevel = 9;
+
+    // src を圧縮して out の末尾に追加する。追加したバイト数を返す
+    size_t compress(const uint8_t* src, size_t size, std::vector<uint8_t>& out, int level);
+
+    // compress と同じ。一致を探す表を持ち続けるので、2回目からは確保しない（表の初期化は毎回行う）
+    class Compressor {
+    public:
+        size_t compress(const uint8_t* src, size_t size, std::vector<uint8_t>& out, int level);
+
+    private:
+        std::vector<int64_t> m_head;
+        std::vector<int64_t> m_prev;
+    };
+
+    // rawSize バイトちょうどに展開できた場合のみ true
+    bool decompress(const uint8_t* src, size_t size, uint8_t* dst, size_t rawSize);
+}
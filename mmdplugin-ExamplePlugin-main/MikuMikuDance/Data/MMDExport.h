@@ -1,202 +1,202 @@
-///////////////////////////////////////////////////////////////////////////
-//   MMDExport.h  Ver.0.07  2010/10/22
-//     MikuMikuDance GNX|[g֐pwb_  
-//
-//     o͊֐̃CuFMMDExport.lib
-///////////////////////////////////////////////////////////////////////////
-#ifndef __MMDEXPORT_H__								// dh~
-#define __MMDEXPORT_H__
-
-/////////////// _EXPORT`  //////////////////
-#define		_EXPORT	__declspec(dllexport)			// MMD{̗p	(dllł̓RgAEg鎖)
-//#define	_EXPORT	__declspec(dllimport)			// dllp		(dllł̓RgAEgO)
-
-
-///////////// GNX|[g֐ ////////////////
-extern "C"{
-	_EXPORT	float			ExpGetFrameTime();				// t[Ԃ̎擾(sec) t[00secƂČݏ̎
-	_EXPORT	int				ExpGetPmdNum();					// PMDf̐
-	_EXPORT	char*			ExpGetPmdFilename(int);			// 1PMDft@C(tpX)	10`GetPmdNum-1
-	_EXPORT	int				ExpGetPmdOrder(int);			// 1PMDf`揇(1)		10`GetPmdNum-1
-	_EXPORT	int				ExpGetPmdMatNum(int);			// 1PMDf̍ގ				10`GetPmdNum-1
-	_EXPORT	D3DMATERIAL9	ExpGetPmdMaterial(int,int);		// 1PMDf̍ގ				10`GetPmdNum-1,20`GetPmdMatNum(1)-1
-	_EXPORT	int				ExpGetPmdBoneNum(int);			// 1PMDf̃{[			10`GetPmdNum-1
-	_EXPORT	char*			ExpGetPmdBoneName(int,int);		// 1PMDf̃{[			10`GetPmdNum-1,20`GetPmdBoneNum(1)-1
-	_EXPORT	D3DMATRIX		ExpGetPmdBoneWorldMat(int,int);	// 1PMDقް݂Worlds(2)	10`GetPmdNum-1,20`GetPmdBoneNum(1)-1
-	_EXPORT	int				ExpGetPmdMorphNum(int);			// 1PMDf̕\				10`GetPmdNum-1
-	_EXPORT	char*			ExpGetPmdMorphName(int,int);	// 1PMDf̕\				10`GetPmdNum-1,20`GetPmdMorphNum(1)-1
-	_EXPORT	float			ExpGetPmdMorphValue(int,int);	// 1PMDf̕\l				10`GetPmdNum-1,20`GetPmdMorphNum(1)-1
-	_EXPORT	bool			ExpGetPmdDisp(int);				// 1PMDf̕\(true:\)10`GetPmdNum-1
-	_EXPORT	int				ExpGetPmdID(int);				// 1PMDfID					10`GetPmdNum-1
-
-	_EXPORT	int				ExpGetAcsNum();					// ANZT̐
-	_EXPORT	int				ExpGetPreAcsNum();				// fOɕ`ʂANZT̐
-	_EXPORT	char*			ExpGetAcsFilename(int);			// 1̃ANZt@C(tpX)	10`GetAcsNum-1
-	_EXPORT	int				ExpGetAcsOrder(int);			// 1̃ANZ`揇(1)			10`GetAcsNum-1
-	_EXPORT	D3DMATRIX		ExpGetAcsWorldMat(int);			// 1̃ANZWorlds(2)		10`GetAcsNum-1
-	_EXPORT	float			ExpGetAcsX(int);				// 1̃ANZ̈ʒuX(قX)		10`GetAcsNum-1
-	_EXPORT	float			ExpGetAcsY(int);				// 1̃ANZ̈ʒuY(قY)		10`GetAcsNum-1
-	_EXPORT	float			ExpGetAcsZ(int);				// 1̃ANZ̈ʒuZ(قZ)		10`GetAcsNum-1
-	_EXPORT	float			ExpGetAcsRx(int);				// 1̃ANZ̉]X(قRx)	10`GetAcsNum-1
-	_EXPORT	float			ExpGetAcsRy(int);				// 1̃ANZ̉]Y(قRy)	10`GetAcsNum-1
-	_EXPORT	float			ExpGetAcsRz(int);				// 1̃ANZ̉]Z(قRz)	10`GetAcsNum-1
-	_EXPORT	float			ExpGetAcsSi(int);				// 1̃ANZ̃TCY(قSi)	10`GetAcsNum-1
-	_EXPORT	float			ExpGetAcsTr(int);				// 1̃ANZ̓x(قTr)	10`GetAcsNum-1
-	_EXPORT	bool			ExpGetAcsDisp(int);				// 1̃ANZ̕\(true:\)	10`GetAcsNum-1
-	_EXPORT	int				ExpGetAcsID(int);				// 1̃ANZID						10`GetAcsNum-1
-	_EXPORT	int				ExpGetAcsMatNum(int);			// 1̃ANZ̍ގ				10`GetAcsNum-1
-	_EXPORT	D3DMATERIAL9	ExpGetAcsMaterial(int,int);		// 1̃ANZ̍ގ					10`GetAcsNum-1,20`GetAcsMatNum(1)-1
-
-	_EXPORT	int				ExpGetCurrentObject();			// ݏ̃IuWFNg(1)
-	_EXPORT	int				ExpGetCurrentMaterial();		// ݏ̍ގ(R)
-	_EXPORT	int				ExpGetCurrentTechnic();			// ݏøƯ(0:̑ 1:ʏ`iZtVhEOFFj2:ʏ`iZtVhEONj
-															// 3:eiZtVhẾj4:GbW 5:EZtVhEpZobt@vbg
-	_EXPORT	void			ExpSetRenderRepeatCount(int);	// _O1̉񐔌JԂ(S)
-	_EXPORT	int				ExpGetRenderRepeatCount();		// _OJԂ(S)
-	_EXPORT	bool			ExpGetEnglishMode();			// pꃂ[hۂ(true:pꃂ[h false:{ꃂ[h)
-}
-
-#endif	// __MMDEXPORT_H__
-
-
-/*
-1	`揇Ԃɂ
-
-MMDł́A
-
-A.fOɕ`悳ANZT`
-B.f`
-C.fɕ`悳ANZT`
-
-̏Ԃŕ`ʂB
-
-ExpGetPmdOrder,ExpGetAcsOrder,ExpGetCurrentObject֐ł́AABCʂ̔ԍԂ邪AA̒l̂݃}CiXŕԂ
-
-)Xe[W.x negi.x ~N.pmd .pmd CgB.x CgR.x ̏ɕ`悳ꍇ
-  ExpGetPmdOrder,ExpGetAcsOrder,ExpGetCurrentObject֐̖߂l
-
-Xe[W.x		-1
-negi.x			-2
-~N.pmd	 3
-.pmd	 4
-CgB.x		 5
-CgR.x		 6
-
-ExpGetCurrentObjectł́AfEANZT`掞ȊO0Ԃ܂B
-ExpGetCurrentObjectł́AfEANZT`掞́AeCGbWCZtVhEpZobt@LlԂ܂B
-
-
-2 worldsɂ
-MMD̃J́ARcԓł݈͋̂ړāAIuWFNgړE]dlɂȂĂ܂B
-܂J̈ʒuE]ɂāAeIuWFNgworldϊsωĂ܂܂B
-GNX|[gp֐worldśAJ̈ʒuE]vf|O̒iK̒lo͂悤ɂ܂B
-ł̂ŁAD3DDevice->GetTransform(D3DTS_WORLD,&world)œworldsƂ͒lقȂ܂B
-fxŒ_vZworldsƂĂ̒lpƁAmȈʒuɕ\܂̂ŒӂĉB
-
-ExpGetPmdBoneWorldMat:ANZTfǏ]ɂȂĂꍇ́AfworldsłɊ|lƂȂ܂B
-
-
-R ExpGetCurrentMaterial̖߂lɂ
-eCGbWCZtVhEpZobt@lԂ܂B
-L̏ꍇAۂɂׂ͂Ă̍ގ͖P̃}eAŃ_O܂A
-ExpGetCurrentMaterial̖߂l͒ʏ`掞łꍇ̍ގԍԂ܂B
-
-
-S ExpSetRenderRepeatCountɂ
-ExpSetRenderRepeatCountMMD̕ϐAExRepeat̒lݒ肵܂B
-ExpGetRenderRepeatCountExRepeat̒l擾܂B
-1t[̂܂ȃV[PX͈ȉ̒ʂłB
-
-{
-	***[hs񓙐ݒ***
-	***T[tFXEZobt@̃NA***
-
-	ExRepeat=1;
-    if( SUCCEEDED( Dx3d->lpDevice->BeginScene() ) ) 
-    {
-		***ZtVhEpZobt@`***
-
-		while(ExRepeat>0){
-			ExRepeat--;
-			***fEANZT֘Ã_O***
-		}
-
-		***ʃLv`(XN[p)***
-		***{[A(\)eXvCg\(AVIo͎͏ȗ)***
-
-		Dx3d->lpDevice->EndScene();
-	}
-
-	***AVIo͏(AVIo͎)***
-	***t[̃{[vZ***
-	***ZvZ***
-	***f̒_ړ***
-	***L[͏***
-
-	Dx3d->lpDevice->Present();
-
-	***foCXXgA***
-}
-
-DirectXł͂PPresent()ɑ΂A΂BeginScene()/EndScene()gȂ
-(΂ƂɃ_O^[QbgقȂꍇ͕̑΂łǂ)AL\ɂ܂B
-
-ExpSetRenderRepeatCount()́A
-E͂߂ɁABeginScene()tbN֐Ńs[g񐔂ݒ肵Ă܂( ExpSetRenderRepeatCount(n) )
-Efx_OɕKvɉExpSetRenderRepeatCount(1)𑗐M邱ƂɂAXɂ
- ***fEANZT֘Ã_O***^[𔭐
-
-Ƃgł܂()B
-
-
-***fEANZT֘Ã_O***̃V[PX
-{
-	***wiBMPpXvCg`***
-	***wiAVIpXvCg`***
-	***W`***
-	***`()***
-	***fOɕ`ʂANZTꎮ`***
-	***nʉe`***{
-		ANZTꎮ		// ExpGetAcsOrdeȑƂ͌Ȃ
-		fꎮ
-	}
-	***fꎮ`***
-	***GbWꎮ`***
-	***fɕ`ʂANZTꎮ`***
-}
-*/
-
-
-/*
-XV
-Ver.0.08 (2013/06/30)
-EExpGetEnglishMode֐ǉ(truepꃂ[h)
-
-Ver.0.07 (2010/10/22)
-EExpGetCurrentMaterial()̃oOC
-
-Ver.0.06 (2010/10/21)
-EExpGetPmdOrder(),ExpGetCurrentObject()̃oOC
-
-Ver.0.05 (2010/10/07)
-EExpGetRenderRepeatCount֐ǉ
-E_O[vZtVhEpZobt@`ʂO
-
-Ver.0.04 (2010/10/06)
-Eȉ̊֐ǉ
-  ExpGetCurrentTechnic,ExpSetRenderRepeatCount
-EExpGetCurrentObject,ExpGetCurrentMaterial̖߂lAeEGbW`掞
- ZtVhEpZobt@vbgɂÃIuWFNgԍގԍԂdlɕύX
-EMMDj[ŃZtVhEoffExpGetCurrentObject,ExpGetCurrentMaterial̒lԂȂoOC
-
-Ver.0.03 (2010/09/29)
-Eȉ̊֐ǉ
-  ExpGetPmdBoneNum,ExpGetPmdBoneName,ExpGetPmdBoneWorldMat,ExpGetPmdMorphNum,ExpGetPmdMorphName,
-  ExpGetPmdMorphValue,ExpGetPmdDisp,ExpGetPmdID,ExpGetAcsDisp,ExpGetAcsID,ExpGetAcsMatNum,
-  ExpGetAcsMaterial,ExpGetCurrentMaterial
-EExpGetCurrentObject̖߂lAANZEfȊO0ɂȂ悤ύX
-
-Ver.0.02 (2010/09/28)
-EEXPORT`ectern "C"ň͂
-
-*/
+///////////////////////////////////////////////////////////////////////////
+//   MMDExport.h  Ver.0.07  2010/10/22
+//     MikuMikuDance GNX|[g֐pwb_  
+//
+//     o͊֐̃CuFMMDExport.lib
+///////////////////////////////////////////////////////////////////////////
+#ifndef __MMDEXPORT_H__								// dh~
+#define __MMDEXPORT_H__
+
+/////////////// _EXPORT`  //////////////////
+#define		_EXPORT	__declspec(dllexport)			// MMD{̗p	(dllł̓RgAEg鎖)
+//#define	_EXPORT	__declspec(dllimport)			// dllp		(dllł̓RgAEgO)
+
+
+///////////// GNX|[g֐ ////////////////
+extern "C"{
+	_EXPORT	float			ExpGetFrameTime();				// t[Ԃ̎擾(sec) t[00secƂČݏ̎
+	_EXPORT	int				ExpGetPmdNum();					// PMDf̐
+	_EXPORT	char*			ExpGetPmdFilename(int);			// 1PMDft@C(tpX)	10`GetPmdNum-1
+	_EXPORT	int				ExpGetPmdOrder(int);			// 1PMDf`揇(1)		10`GetPmdNum-1
+	_EXPORT	int				ExpGetPmdMatNum(int);			// 1PMDf̍ގ				10`GetPmdNum-1
+	_EXPORT	D3DMATERIAL9	ExpGetPmdMaterial(int,int);		// 1PMDf̍ގ				10`GetPmdNum-1,20`GetPmdMatNum(1)-1
+	_EXPORT	int				ExpGetPmdBoneNum(int);			// 1PMDf̃{[			10`GetPmdNum-1
+	_EXPORT	char*			ExpGetPmdBoneName(int,int);		// 1PMDf̃{[			10`GetPmdNum-1,20`GetPmdBoneNum(1)-1
+	_EXPORT	D3DMATRIX		ExpGetPmdBoneWorldMat(int,int);	// 1PMDقް݂Worlds(2)	10`GetPmdNum-1,20`GetPmdBoneNum(1)-1
+	_EXPORT	int				ExpGetPmdMorphNum(int);			// 1PMDf̕\				10`GetPmdNum-1
+	_EXPORT	char*			ExpGetPmdMorphName(int,int);	// 1PMDf̕\				10`GetPmdNum-1,20`GetPmdMorphNum(1)-1
+	_EXPORT	float			ExpGetPmdMorphValue(int,int);	// 1PMDf̕\l				10`GetPmdNum-1,20`GetPmdMorphNum(1)-1
+	_EXPORT	bool			ExpGetPmdDisp(int);				// 1PMDf̕\(true:\)10`GetPmdNum-1
+	_EXPORT	int				ExpGetPmdID(int);				// 1PMDfID					10`GetPmdNum-1
+
+	_EXPORT	int				ExpGetAcsNum();					// ANZT̐
+	_EXPORT	int				ExpGetPreAcsNum();				// fOɕ`ʂANZT̐
+	_EXPORT	char*			ExpGetAcsFilename(int);			// 1̃ANZt@C(tpX)	10`GetAcsNum-1
+	_EXPORT	int				ExpGetAcsOrder(int);			// 1̃ANZ`揇(1)			10`GetAcsNum-1
+	_EXPORT	D3DMATRIX		ExpGetAcsWorldMat(int);			// 1̃ANZWorlds(2)		10`GetAcsNum-1
+	_EXPORT	float			ExpGetAcsX(int);				// 1̃ANZ̈ʒuX(قX)		10`GetAcsNum-1
+	_EXPORT	float			ExpGetAcsY(int);				// 1̃ANZ̈ʒuY(قY)		10`GetAcsNum-1
+	_EXPORT	float			ExpGetAcsZ(int);				// 1̃ANZ̈ʒuZ(قZ)		10`GetAcsNum-1
+	_EXPORT	float			ExpGetAcsRx(int);				// 1̃ANZ̉]X(قRx)	10`GetAcsNum-1
+	_EXPORT	float			ExpGetAcsRy(int);				// 1̃ANZ̉]Y(قRy)	10`GetAcsNum-1
+	_EXPORT	float			ExpGetAcsRz(int);				// 1̃ANZ̉]Z(قRz)	10`GetAcsNum-1
+	_EXPORT	float			ExpGetAcsSi(int);				// 1̃ANZ̃TCY(قSi)	10`GetAcsNum-1
+	_EXPORT	float			ExpGetAcsTr(int);				// 1̃ANZ̓x(قTr)	10`GetAcsNum-1
+	_EXPORT	bool			ExpGetAcsDisp(int);				// 1̃ANZ̕\(true:\)	10`GetAcsNum-1
+	_EXPORT	int				ExpGetAcsID(int);				// 1̃ANZID						10`GetAcsNum-1
+	_EXPORT	int				ExpGetAcsMatNum(int);			// 1̃ANZ̍ގ				10`GetAcsNum-1
+	_EXPORT	D3DMATERIAL9	ExpGetAcsMaterial(int,int);		// 1̃ANZ̍ގ					10`GetAcsNum-1,20`GetAcsMatNum(1)-1
+
+	_EXPORT	int				ExpGetCurrentObject();			// ݏ̃IuWFNg(1)
+	_EXPORT	int				ExpGetCurrentMaterial();		// ݏ̍ގ(R)
+	_EXPORT	int				ExpGetCurrentTechnic();			// ݏøƯ(0:̑ 1:ʏ`iZtVhEOFFj2:ʏ`iZtVhEONj
+															// 3:eiZtVhẾj4:GbW 5:EZtVhEpZobt@vbg
+	_EXPORT	void			ExpSetRenderRepeatCount(int);	// _O1̉񐔌JԂ(S)
+	_EXPORT	int				ExpGetRenderRepeatCount();		// _OJԂ(S)
+	_EXPORT	bool			ExpGetEnglishMode();			// pꃂ[hۂ(true:pꃂ[h false:{ꃂ[h)
+}
+
+#endif	// __MMDEXPORT_H__
+
+
+/*
+1	`揇Ԃɂ
+
+MMDł́A
+
+A.fOɕ`悳ANZT`
+B.f`
+C.fɕ`悳ANZT`
+
+̏Ԃŕ`ʂB
+
+ExpGetPmdOrder,ExpGetAcsOrder,ExpGetCurrentObject֐ł́AABCʂ̔ԍԂ邪AA̒l̂݃}CiXŕԂ
+
+)Xe[W.x negi.x ~N.pmd .pmd CgB.x CgR.x ̏ɕ`悳ꍇ
+  ExpGetPmdOrder,ExpGetAcsOrder,ExpGetCurrentObject֐̖߂l
+
+Xe[W.x		-1
+negi.x			-2
+~N.pmd	 3
+.pmd	 4
+CgB.x		 5
+CgR.x		 6
+
+ExpGetCurrentObjectł́AfEANZT`掞ȊO0Ԃ܂B
+ExpGetCurrentObjectł́AfEANZT`掞́AeCGbWCZtVhEpZobt@LlԂ܂B
+
+
+2 worldsɂ
+MMD̃J́ARcԓł݈͋̂ړāAIuWFNgړE]dlɂȂĂ܂B
+܂J̈ʒuE]ɂāAeIuWFNgworldϊsωĂ܂܂B
+GNX|[gp֐worldśAJ̈ʒuE]vf|O̒iK̒lo͂悤ɂ܂B
+ł̂ŁAD3DDevice->GetTransform(D3DTS_WORLD,&world)œworldsƂ͒lقȂ܂B
+fxŒ_vZworldsƂĂ̒lpƁAmȈʒuɕ\܂̂ŒӂĉB
+
+ExpGetPmdBoneWorldMat:ANZTfǏ]ɂȂĂꍇ́AfworldsłɊ|lƂȂ܂B
+
+
+R ExpGetCurrentMaterial̖߂lɂ
+eCGbWCZtVhEpZobt@lԂ܂B
+L̏ꍇAۂɂׂ͂Ă̍ގ͖P̃}eAŃ_O܂A
+ExpGetCurrentMaterial̖߂l͒ʏ`掞łꍇ̍ގԍԂ܂B
+
+
+S ExpSetRenderRepeatCountɂ
+ExpSetRenderRepeatCountMMD̕ϐAExRepeat̒lݒ肵܂B
+ExpGetRenderRepeatCountExRepeat̒l擾܂B
+1t[̂܂ȃV[PX͈ȉ̒ʂłB
+
+{
+	***[hs񓙐ݒ***
+	***T[tFXEZobt@̃NA***
+
+	ExRepeat=1;
+    if( SUCCEEDED( Dx3d->lpDevice->BeginScene() ) ) 
+    {
+		***ZtVhEpZobt@`***
+
+		while(ExRepeat>0){
+			ExRepeat--;
+			***fEANZT֘Ã_O***
+		}
+
+		***ʃLv`(XN[p)***
+		***{[A(\)eXvCg\(AVIo͎͏ȗ)***
+
+		Dx3d->lpDevice->EndScene();
+	}
+
+	***AVIo͏(AVIo͎)***
+	***t[̃{[vZ***
+	***ZvZ***
+	***f̒_ړ***
+	***L[͏***
+
+	Dx3d->lpDevice->Present();
+
+	***foCXXgA***
+}
+
+DirectXł͂PPresent()ɑ΂A΂BeginScene()/EndScene()gȂ
+(΂ƂɃ_O^[QbgقȂꍇ͕̑΂łǂ)AL\ɂ܂B
+
+ExpSetRenderRepeatCount()́A
+E͂߂ɁABeginScene()tbN֐Ńs[g񐔂ݒ肵Ă܂( ExpSetRenderRepeatCount(n) )
+Efx_OɕKvɉExpSetRenderRepeatCount(1)𑗐M邱ƂɂAXɂ
+ ***fEANZT֘Ã_O***^[𔭐
+
+Ƃgł܂()B
+
+
+***fEANZT֘Ã_O***̃V[PX
+{
+	***wiBMPpXvCg`***
+	***wiAVIpXvCg`***
+	***W`***
+	***`()***
+	***fOɕ`ʂANZTꎮ`***
+	***nʉe`***{
+		ANZTꎮ		// ExpGetAcsOrdeȑƂ͌Ȃ
+		fꎮ
+	}
+	***fꎮ`***
+	***GbWꎮ`***
+	***fɕ`ʂANZTꎮ`***
+}
+*/
+
+
+/*
+XV
+Ver.0.08 (2013/06/30)
+EExpGetEnglishMode֐ǉ(truepꃂ[h)
+
+Ver.0.07 (2010/10/22)
+EExpGetCurrentMaterial()̃oOC
+
+Ver.0.06 (2010/10/21)
+EExpGetPmdOrder(),ExpGetCurrentObject()̃oOC
+
+Ver.0.05 (2010/10/07)
+EExpGetRenderRepeatCount֐ǉ
+E_O[vZtVhEpZobt@`ʂO
+
+Ver.0.04 (2010/10/06)
+Eȉ̊֐ǉ
+  ExpGetCurrentTechnic,ExpSetRenderRepeatCount
+EExpGetCurrentObject,ExpGetCurrentMaterial̖߂lAeEGbW`掞
+ ZtVhEpZobt@vbgɂÃIuWFNgԍގԍԂdlɕύX
+EMMDj[ŃZtVhEoffExpGetCurrentObject,ExpGetCurrentMaterial̒lԂȂoOC
+
+Ver.0.03 (2010/09/29)
+Eȉ̊֐ǉ
+  ExpGetPmdBoneNum,ExpGetPmdBoneName,ExpGetPmdBoneWorldMat,ExpGetPmdMorphNum,ExpGetPmdMorphName,
+  ExpGetPmdMorphValue,ExpGetPmdDisp,ExpGetPmdID,ExpGetAcsDisp,ExpGetAcsID,ExpGetAcsMatNum,
+  ExpGetAcsMaterial,ExpGetCurrentMaterial
+EExpGetCurrentObject̖߂lAANZEfȊO0ɂȂ悤ύX
+
+Ver.0.02 (2010/09/28)
+EEXPORT`ectern "C"ň͂
+
+*/
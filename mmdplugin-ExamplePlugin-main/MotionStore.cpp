@@ -0,0 +1,199 @@
+﻿#include "stdafx.h"
+#include "MotionStore.h"
+#include "BackupFormat.h"
+#include "BackupIo.h"
+#include "EmergencyDump.h"
+#include "VmdFile.h"
+#include <algorithm>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <set>
+#include <sstream>
+
+namespace {
+    uint64_t hashBytes(const uint8_t* data, size_t size) {
+        uint64_t h = 1469598103934665603ull;
+        for (size_t i = 0; i < size; i++) {
+            h ^= data[i];
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    // モデル名（Shift-JIS）をファイル名に使える形にする
+    std::wstring fileNamePart(const std::string& sjis) {
+        wchar_t buf[64] = {};
+        MultiByteToWideChar(932, 0, sjis.c_str(), static_cast<int>(sjis.size()), buf, 63);
+        std::wstring name = buf;
+        for (auto& c : name) {
+            if (c < L' ' || wcschr(L"\\/:*?\"<>|\t", c)) c = L'_';
+        }
+        return name.empty() ? L"model" : name;
+    }
+
+    std::vector<std::string> splitTabs(const std::string& line) {
+        std::vector<std::string> fields;
+        size_t start = 0;
+        for (size_t tab; (tab = line.find('\t', start)) != std::string::npos; start = tab + 1) {
+            fields.push_back(line.substr(start, tab - start));
+        }
+        fields.push_back(line.substr(start));
+        return fields;
+    }
+
+    struct Track {
+        const emergency::SectionInfo* section = nullptr;
+        std::wstring fileName;
+        bool ok = false;
+        bool written = false;
+        uint64_t bytes = 0;
+    };
+}
+
+MotionStore::MotionStore(const fs::path& backupDir, const std::wstring& stem)
+    : m_dir(backupDir / (stem + L".motion")) {}
+
+bool MotionStore::readIndex(std::vector<std::string>& lines) const {
+    lines.clear();
+    std::ifstream in((m_dir / L"index.txt").c_str(), std::ios::binary);
+    if (!in.is_open()) return false;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (!line.empty()) lines.push_back(line);
+    }
+    return true;
+}
+
+bool MotionStore::writeIndex(const std::vector<std::string>& lines) const {
+    fs::path path = m_dir / L"index.txt";
+    fs::path tmpPath = m_dir / L"index.txt.tmp";
+    {
+        std::ofstream out(tmpPath.c_str(), std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) return false;
+        for (const auto& line : lines) out << line << "\r\n";
+        if (!out) return false;
+    }
+    return ReplaceFileAtomic(tmpPath, path);
+}
+
+bool MotionStore::add(const std::vector<uint8_t>& image, int64_t time, TaskExecutor& executor, Result& result) {
+    result = Result();
+    std::vector<emergency::SectionInfo> sections;
+    if (!emergency::ReadDirectory(image.data(), image.size(), sections)) return false;
+
+    // 読み出しに失敗したセクションがあれば、欠けた世代を作らずに次の機会を待つ
+    std::vector<Track> tracks;
+    for (const auto& s : sections) {
+        if (s.flags & (emergency::SectionTruncated | emergency::SectionFaulted)) return false;
+        const uint8_t* body = image.data() + s.offset + emergency::SectionHeaderSize;
+        size_t bodySize = static_cast<size_t>(s.size - emergency::SectionHeaderSize);
+        // キーフレームのないカメラ（件数 0 だけ）は保存しない
+        if (s.kind == emergency::SectionCamera && bodySize <= sizeof(uint32_t)) continue;
+        if (s.kind != emergency::SectionCamera && s.kind != emergency::SectionModel) continue;
+        Track t;
+        t.section = &s;
+        tracks.push_back(t);
+    }
+    result.tracks = static_cast<uint32_t>(tracks.size());
+    if (tracks.empty()) return false;
+
+    std::error_code ec;
+    fs::create_directories(m_dir, ec);
+    if (!fs::exists(m_dir)) return false;
+
+    // モデルごとに、ハッシュ → 既存の確認 → VMD への変換と書き出し
+    bool finished = executor.parallelFor(tracks.size(), TaskPriority::Snapshot, [&](size_t i) {
+        Track& t = tracks[i];
+        const emergency::SectionInfo& s = *t.section;
+        const uint8_t* body = image.data() + s.offset + emergency::SectionHeaderSize;
+        size_t bodySize = static_cast<size_t>(s.size - emergency::SectionHeaderSize);
+        wchar_t hash[20];
+        swprintf_s(hash, L"%016llx", static_cast<unsigned long long>(hashBytes(body, bodySize)));
+        if (s.kind == emergency::SectionCamera) {
+            t.fileName = std::wstring(L"camera_") + hash + L".vmd";
+        }
+        else {
+            wchar_t slot[8];
+            swprintf_s(slot, L"%02u_", s.index);
+            t.fileName = slot + fileNamePart(s.name) + L"_" + hash + L".vmd";
+        }
+
+        fs::path path = m_dir / t.fileName;
+        std::error_code existsEc;
+        if (fs::exists(path, existsEc)) {
+            t.ok = true;
+            return;
+        }
+        emergency::Dump dump;
+        if (!emergency::ReadSection(image.data(), image.size(), s, dump)) return;
+        const VmdMotion& motion = s.kind == emergency::SectionCamera ? dump.camera : dump.models.front().motion;
+        fs::path tmpPath = path;
+        tmpPath += L".tmp";
+        if (!WriteVmd(tmpPath, motion) || !ReplaceFileAtomic(tmpPath, path)) {
+            std::error_code removeEc;
+            fs::remove(tmpPath, removeEc);
+            return;
+        }
+        t.ok = true;
+        t.written = true;
+        std::error_code sizeEc;
+        t.bytes = fs::file_size(path, sizeEc);
+    });
+    // 停止で取り消されたら、書けた分があっても索引には載せない
+    if (!finished) return false;
+
+    std::wstringstream files;
+    for (const auto& t : tracks) {
+        if (!t.ok) return false;
+        if (t.written) {
+            result.written++;
+            result.bytes += t.bytes;
+        }
+        files << L"\t" << t.fileName;
+    }
+
+    // 前の世代とファイルがすべて同じなら、何も変わっていない
+    std::vector<std::string> lines;
+    readIndex(lines);
+    std::string fileList = WideToUtf8(files.str());
+    if (!lines.empty()) {
+        const std::string& last = lines.back();
+        size_t tab = last.find('\t');
+        if (tab != std::string::npos && last.compare(tab, std::string::npos, fileList) == 0) return true;
+    }
+
+    time_t t = static_cast<time_t>(time);
+    tm localTm;
+    localtime_s(&localTm, &t);
+    std::wstringstream stamp;
+    stamp << std::put_time(&localTm, L"%Y%m%d_%H%M%S");
+    lines.push_back(WideToUtf8(stamp.str()) + fileList);
+    if (!writeIndex(lines)) return false;
+    result.added = true;
+    return true;
+}
+
+size_t MotionStore::applyRetention(int keep) {
+    std::vector<std::string> lines;
+    if (keep < 1 || !readIndex(lines) || lines.size() <= static_cast<size_t>(keep)) return 0;
+    size_t removed = lines.size() - static_cast<size_t>(keep);
+    lines.erase(lines.begin(), lines.begin() + removed);
+    if (!writeIndex(lines)) return 0;
+
+    // 残した世代から使われていない VMD を消す
+    std::set<std::wstring> used;
+    for (const auto& line : lines) {
+        std::vector<std::string> fields = splitTabs(line);
+        for (size_t i = 1; i < fields.size(); i++) used.insert(Utf8ToWide(fields[i]));
+    }
+    std::error_code ec;
+    for (fs::directory_iterator it(m_dir, ec), end; !ec && it != end; it.increment(ec)) {
+        const fs::path& p = it->path();
+        if (p.extension() != L".vmd" || used.count(p.filename().wstring())) continue;
+        std::error_code removeEc;
+        fs::remove(p, removeEc);
+    }
+    return removed;
+}
@@ -0,0 +1,44 @@
+﻿#pragma once
+#include "stdafx.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <experimental/filesystem>
+#include "TaskExecutor.h"
+
+namespace fs = std::experimental::filesystem;
+
+// モーションだけの軽いバックアップ（モデル・カメラごとの VMD）
+//
+//   Backup/<プロジェクト名>.motion/
+//     NN_<モデル名>_<ハッシュ>.vmd    モデル（NN はスロット番号）
+//     camera_<ハッシュ>.vmd           カメラ
+//     index.txt                       1行1世代: 時刻 TAB ファイル名 TAB ...（UTF-8）
+//
+// ファイル名のハッシュはキーフレームの中身から作るので、変わっていないモデルは既存のファイルを
+// 指すだけで書き直さない。どのモデルも変わっていなければ世代も増やさない。
+class MotionStore {
+public:
+    struct Result {
+        uint32_t tracks = 0;        // カメラ + モデル
+        uint32_t written = 0;       // 新しく書いた VMD の数
+        uint64_t bytes = 0;         // 新しく書いたバイト数
+        bool added = false;         // 世代を追加した
+    };
+
+    MotionStore(const fs::path& backupDir, const std::wstring& stem);
+
+    // image は EmergencySnapshot::capture(image) の結果。VMD への変換と書き出しはモデルごとに executor で並列に行う
+    bool add(const std::vector<uint8_t>& image, int64_t time, TaskExecutor& executor, Result& result);
+
+    // 新しい方から keep 世代だけを残し、どの世代からも使われなくなった VMD を消す。消した世代数を返す
+    size_t applyRetention(int keep);
+
+    const fs::path& dir() const { return m_dir; }
+
+private:
+    bool readIndex(std::vector<std::string>& lines) const;
+    bool writeIndex(const std::vector<std::string>& lines) const;
+
+    fs::path m_dir;
+};
@@ -0,0 +1,136 @@
+﻿#include "stdafx.h"
+#include "PoseCapture.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+PoseCapture::PoseCapture()
+    : m_resolved(false), m_pfnPmdNum(nullptr), m_pfnPmdId(nullptr), m_pfnBoneNum(nullptr), m_pfnMorphNum(nullptr),
+    m_pfnBoneWorldMat(nullptr), m_pfnMorphValue(nullptr), m_requested(false), m_hasReady(false) {}
+
+bool PoseCapture::resolve() {
+    if (!m_resolved) {
+        m_resolved = true;
+        HMODULE mmd = GetModuleHandleW(nullptr);
+        m_pfnPmdNum = reinterpret_cast<int(*)()>(GetProcAddress(mmd, "ExpGetPmdNum"));
+        m_pfnPmdId = reinterpret_cast<int(*)(int)>(GetProcAddress(mmd, "ExpGetPmdID"));
+        m_pfnBoneNum = reinterpret_cast<int(*)(int)>(GetProcAddress(mmd, "ExpGetPmdBoneNum"));
+        m_pfnMorphNum = reinterpret_cast<int(*)(int)>(GetProcAddress(mmd, "ExpGetPmdMorphNum"));
+        m_pfnBoneWorldMat = reinterpret_cast<D3DMATRIX(*)(int, int)>(GetProcAddress(mmd, "ExpGetPmdBoneWorldMat"));
+        m_pfnMorphValue = reinterpret_cast<float(*)(int, int)>(GetProcAddress(mmd, "ExpGetPmdMorphValue"));
+    }
+    return m_pfnPmdNum && m_pfnPmdId && m_pfnBoneNum && m_pfnMorphNum && m_pfnBoneWorldMat && m_pfnMorphValue;
+}
+
+bool PoseCapture::available() {
+    return resolve();
+}
+
+bool PoseCapture::layoutChanged(int models) {
+    if (m_ids.size() != static_cast<size_t>(models)) return true;
+    for (int m = 0; m < models; m++) {
+        if (m_pfnPmdId(m) != m_ids[m]) return true;
+    }
+    return false;
+}
+
+bool PoseCapture::capture(PoseFrame& frame) {
+    if (!resolve()) return false;
+    int models = m_pfnPmdNum();
+    if (models < 0) models = 0;
+
+    // 構成はモデルの読み込み・削除のときだけ数え直す
+    if (layoutChanged(models)) {
+        m_ids.resize(models);
+        m_boneStart.assign(1, 0);
+        m_morphStart.assign(1, 0);
+        for (int m = 0; m < models; m++) {
+            m_ids[m] = m_pfnPmdId(m);
+            m_boneStart.push_back(m_boneStart.back() + static_cast<uint32_t>((std::max)(0, m_pfnBoneNum(m))));
+            m_morphStart.push_back(m_morphStart.back() + static_cast<uint32_t>((std::max)(0, m_pfnMorphNum(m))));
+        }
+    }
+    frame.modelIds = m_ids;
+    frame.boneStart = m_boneStart;
+    frame.morphStart = m_morphStart;
+    frame.boneMatrices.resize(static_cast<size_t>(m_boneStart.back()) * 16);
+    frame.morphWeights.resize(m_morphStart.back());
+
+    // 全モデルの行列を1本の配列へ、モーフ値をもう1本へ続けて書く
+    float* matrices = frame.boneMatrices.data();
+    float* weights = frame.morphWeights.data();
+    for (int m = 0; m < models; m++) {
+        int bones = static_cast<int>(m_boneStart[m + 1] - m_boneStart[m]);
+        for (int b = 0; b < bones; b++) {
+            D3DMATRIX mat = m_pfnBoneWorldMat(m, b);
+            memcpy(matrices, &mat, sizeof(float) * 16);
+            matrices += 16;
+        }
+        int morphs = static_cast<int>(m_morphStart[m + 1] - m_morphStart[m]);
+        for (int i = 0; i < morphs; i++) *weights++ = m_pfnMorphValue(m, i);
+    }
+    return true;
+}
+
+bool PoseCapture::captureNaive(PoseFrame& frame) {
+    if (!resolve()) return false;
+    frame = PoseFrame();
+    frame.boneStart.push_back(0);
+    frame.morphStart.push_back(0);
+    for (int m = 0; m < m_pfnPmdNum(); m++) {
+        frame.modelIds.push_back(m_pfnPmdId(m));
+        for (int b = 0; b < m_pfnBoneNum(m); b++) {
+            D3DMATRIX mat = m_pfnBoneWorldMat(m, b);
+            for (int r = 0; r < 4; r++) {
+                for (int c = 0; c < 4; c++) frame.boneMatrices.push_back(mat.m[r][c]);
+            }
+        }
+        for (int i = 0; i < m_pfnMorphNum(m); i++) frame.morphWeights.push_back(m_pfnMorphValue(m, i));
+        frame.boneStart.push_back(static_cast<uint32_t>(frame.boneCount()));
+        frame.morphStart.push_back(static_cast<uint32_t>(frame.morphWeights.size()));
+    }
+    return true;
+}
+
+void PoseCapture::request(const fs::path& savePath) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_requestPath = savePath;
+    m_requested = true;
+}
+
+bool PoseCapture::onPresent(int32_t nowFrame) {
+    fs::path path;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_requested) return false;
+        m_requested = false;
+        path = m_requestPath;
+    }
+    // 取り込み先は使い回し、受け渡し側と入れ替える
+    if (!capture(m_frame)) return true;
+    m_frame.frame = nowFrame;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::swap(m_ready, m_frame);
+    m_readyPath = path;
+    m_hasReady = true;
+    return true;
+}
+
+bool PoseCapture::take(PoseFrame& frame, fs::path& savePath) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_hasReady) return false;
+    frame = std::move(m_ready);
+    savePath = m_readyPath;
+    m_hasReady = false;
+    return true;
+}
+
+bool PoseCapture::save(const PoseFrame& frame, const fs::path& path) {
+    std::vector<uint8_t> encoded;
+    pose::EncodeCheckpoint(frame, encoded);
+    std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) return false;
+    out.write(reinterpret_cast<const char*>(encoded.data()), static_cast<std::streamsize>(encoded.size()));
+    return static_cast<bool>(out);
+}
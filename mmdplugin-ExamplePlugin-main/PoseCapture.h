@@ -0,0 +1,55 @@
+﻿#pragma once
+#include "stdafx.h"
+#include <mutex>
+#include <experimental/filesystem>
+#include "PoseCheckpoint.h"
+
+namespace fs = std::experimental::filesystem;
+
+// MMDExport の関数で、評価済みのポーズを全モデル分まとめて取る
+//
+// MMDExport には要素ごとの取得関数しかないので、呼び出し自体は減らせない。その代わり
+// 関数は一度だけ解決し、モデルの構成（ID・ボーン数・モーフ数）は ID が変わったときだけ数え直す。
+// 出力の配列は前回の大きさを使い回すので、構成が変わらなければフレームごとの確保は起きない。
+// Exp* は描画スレッド（MMD のメインスレッド）からだけ呼ぶこと。
+class PoseCapture {
+public:
+    PoseCapture();
+
+    bool available();
+    bool capture(PoseFrame& frame);
+    // 比較用: 毎フレーム数を問い合わせ、配列を作り直す素朴な取り方
+    bool captureNaive(PoseFrame& frame);
+
+    // バックアップと同じ名前の .pose に保存するよう予約する（ThumbnailCapture と同じ受け渡し）
+    void request(const fs::path& savePath);
+    bool onPresent(int32_t nowFrame);   // 予約があれば取る。取ったら true
+    bool take(PoseFrame& frame, fs::path& savePath);
+
+    static bool save(const PoseFrame& frame, const fs::path& path);
+
+private:
+    bool resolve();
+    bool layoutChanged(int models);
+
+    bool m_resolved;
+    int (*m_pfnPmdNum)();
+    int (*m_pfnPmdId)(int);
+    int (*m_pfnBoneNum)(int);
+    int (*m_pfnMorphNum)(int);
+    D3DMATRIX (*m_pfnBoneWorldMat)(int, int);
+    float (*m_pfnMorphValue)(int, int);
+
+    // 前回の構成
+    std::vector<int32_t> m_ids;
+    std::vector<uint32_t> m_boneStart;
+    std::vector<uint32_t> m_morphStart;
+    PoseFrame m_frame;  // 描画スレッドだけが触る
+
+    std::mutex m_mutex;
+    bool m_requested;
+    fs::path m_requestPath;
+    PoseFrame m_ready;
+    fs::path m_readyPath;
+    bool m_hasReady;
+};
@@ -0,0 +1,229 @@
+﻿#include "PoseCheckpoint.h"
+#include "BackupFormat.h"
+#include <algorithm>
+#include <cmath>
+
+namespace pose {
+
+namespace {
+    const float kSmallestThreeRange = 0.70710678f;     // 最大成分以外の絶対値は 1/√2 以下
+    const int kRotationBytes = 6;
+
+    uint16_t quantize16(float v, float lo, float hi) {
+        float range = hi - lo;
+        if (!(range > 0)) return 0;
+        float t = (v - lo) / range;
+        return static_cast<uint16_t>(std::lround(std::min(std::max(t, 0.0f), 1.0f) * 65535.0f));
+    }
+
+    float dequantize16(uint16_t q, float lo, float hi) {
+        return lo + (hi - lo) * (q / 65535.0f);
+    }
+
+    void encodeRotation(const float q[4], uint8_t out[kRotationBytes]) {
+        int largest = 0;
+        for (int i = 1; i < 4; i++) {
+            if (std::fabs(q[i]) > std::fabs(q[largest])) largest = i;
+        }
+        // q と -q は同じ回転なので、最大成分が正になる向きにそろえる
+        float sign = q[largest] < 0 ? -1.0f : 1.0f;
+        uint64_t bits = static_cast<uint64_t>(largest);
+        int shift = 2;
+        for (int i = 0; i < 4; i++) {
+            if (i == largest) continue;
+            float t = (q[i] * sign / kSmallestThreeRange + 1.0f) * 0.5f;
+            long v = std::lround(std::min(std::max(t, 0.0f), 1.0f) * 32767.0f);
+            bits |= static_cast<uint64_t>(v) << shift;
+            shift += 15;
+        }
+        for (int i = 0; i < kRotationBytes; i++) out[i] = static_cast<uint8_t>(bits >> (i * 8));
+    }
+
+    void decodeRotation(const uint8_t in[kRotationBytes], float q[4]) {
+        uint64_t bits = 0;
+        for (int i = 0; i < kRotationBytes; i++) bits |= static_cast<uint64_t>(in[i]) << (i * 8);
+        int largest = static_cast<int>(bits & 3);
+        int shift = 2;
+        float sum = 0;
+        for (int i = 0; i < 4; i++) {
+            if (i == largest) continue;
+            float t = static_cast<float>((bits >> shift) & 0x7FFF) / 32767.0f;
+            q[i] = (t * 2.0f - 1.0f) * kSmallestThreeRange;
+            sum += q[i] * q[i];
+            shift += 15;
+        }
+        q[largest] = std::sqrt(std::max(0.0f, 1.0f - sum));
+    }
+}
+
+void MatrixToQuaternion(const float m[16], float q[4]) {
+    float trace = m[0] + m[5] + m[10];
+    float x, y, z, w;
+    if (trace > 0) {
+        float s = std::sqrt(trace + 1.0f) * 2.0f;
+        w = 0.25f * s;
+        x = (m[6] - m[9]) / s;
+        y = (m[8] - m[2]) / s;
+        z = (m[1] - m[4]) / s;
+    }
+    else if (m[0] > m[5] && m[0] > m[10]) {
+        float s = std::sqrt(1.0f + m[0] - m[5] - m[10]) * 2.0f;
+        w = (m[6] - m[9]) / s;
+        x = 0.25f * s;
+        y = (m[1] + m[4]) / s;
+        z = (m[8] + m[2]) / s;
+    }
+    else if (m[5] > m[10]) {
+        float s = std::sqrt(1.0f + m[5] - m[0] - m[10]) * 2.0f;
+        w = (m[8] - m[2]) / s;
+        x = (m[1] + m[4]) / s;
+        y = 0.25f * s;
+        z = (m[6] + m[9]) / s;
+    }
+    else {
+        float s = std::sqrt(1.0f + m[10] - m[0] - m[5]) * 2.0f;
+        w = (m[1] - m[4]) / s;
+        x = (m[8] + m[2]) / s;
+        y = (m[6] + m[9]) / s;
+        z = 0.25f * s;
+    }
+    float len = std::sqrt(x * x + y * y + z * z + w * w);
+    if (!(len > 0)) len = 1;
+    q[0] = x / len;
+    q[1] = y / len;
+    q[2] = z / len;
+    q[3] = w / len;
+}
+
+void QuaternionToMatrix(const float q[4], const float t[3], float m[16]) {
+    float x = q[0], y = q[1], z = q[2], w = q[3];
+    m[0] = 1 - 2 * (y * y + z * z);
+    m[1] = 2 * (x * y + z * w);
+    m[2] = 2 * (x * z - y * w);
+    m[3] = 0;
+    m[4] = 2 * (x * y - z * w);
+    m[5] = 1 - 2 * (x * x + z * z);
+    m[6] = 2 * (y * z + x * w);
+    m[7] = 0;
+    m[8] = 2 * (x * z + y * w);
+    m[9] = 2 * (y * z - x * w);
+    m[10] = 1 - 2 * (x * x + y * y);
+    m[11] = 0;
+    m[12] = t[0];
+    m[13] = t[1];
+    m[14] = t[2];
+    m[15] = 1;
+}
+
+void EncodeCheckpoint(const PoseFrame& frame, std::vector<uint8_t>& out) {
+    out.clear();
+    ByteWriter w(out);
+    const size_t models = frame.modelCount();
+    const size_t bones = frame.boneCount();
+    w.u32(Magic);
+    w.u32(Version);
+    w.u32(static_cast<uint32_t>(frame.frame));
+    w.u32(static_cast<uint32_t>(models));
+
+    // モデルごとの範囲
+    std::vector<float> ranges(models * 8);
+    for (size_t m = 0; m < models; m++) {
+        float* r = &ranges[m * 8];
+        r[0] = r[1] = r[2] = r[6] = HUGE_VALF;
+        r[3] = r[4] = r[5] = r[7] = -HUGE_VALF;
+        for (uint32_t b = frame.boneStart[m]; b < frame.boneStart[m + 1]; b++) {
+            const float* t = &frame.boneMatrices[b * 16 + 12];
+            for (int c = 0; c < 3; c++) {
+                r[c] = std::min(r[c], t[c]);
+                r[3 + c] = std::max(r[3 + c], t[c]);
+            }
+        }
+        for (uint32_t i = frame.morphStart[m]; i < frame.morphStart[m + 1]; i++) {
+            r[6] = std::min(r[6], frame.morphWeights[i]);
+            r[7] = std::max(r[7], frame.morphWeights[i]);
+        }
+        for (int c = 0; c < 8; c++) {
+            if (!std::isfinite(r[c])) r[c] = 0;
+        }
+        w.u32(static_cast<uint32_t>(frame.modelIds[m]));
+        w.u32(frame.boneStart[m + 1] - frame.boneStart[m]);
+        w.u32(frame.morphStart[m + 1] - frame.morphStart[m]);
+        w.raw(r, sizeof(float) * 8);
+    }
+
+    // 列ごとに書く（同じ種類の値が並ぶので後段の圧縮も効きやすい）
+    for (int c = 0; c < 3; c++) {
+        for (size_t m = 0; m < models; m++) {
+            const float* r = &ranges[m * 8];
+            for (uint32_t b = frame.boneStart[m]; b < frame.boneStart[m + 1]; b++) {
+                w.u16(quantize16(frame.boneMatrices[b * 16 + 12 + c], r[c], r[3 + c]));
+            }
+        }
+    }
+    for (size_t b = 0; b < bones; b++) {
+        float q[4];
+        uint8_t packed[kRotationBytes];
+        MatrixToQuaternion(&frame.boneMatrices[b * 16], q);
+        encodeRotation(q, packed);
+        w.raw(packed, sizeof(packed));
+    }
+    for (size_t m = 0; m < models; m++) {
+        const float* r = &ranges[m * 8];
+        for (uint32_t i = frame.morphStart[m]; i < frame.morphStart[m + 1]; i++) {
+            w.u16(quantize16(frame.morphWeights[i], r[6], r[7]));
+        }
+    }
+}
+
+bool DecodeCheckpoint(const uint8_t* data, size_t size, PoseFrame& frame) {
+    ByteReader r(data, size);
+    if (r.u32() != Magic || r.u32() != Version) return false;
+    frame.frame = static_cast<int32_t>(r.u32());
+    uint32_t models = r.u32();
+    if (!r.ok() || models > 0x10000) return false;
+
+    frame.modelIds.resize(models);
+    frame.boneStart.assign(1, 0);
+    frame.morphStart.assign(1, 0);
+    std::vector<float> ranges(static_cast<size_t>(models) * 8);
+    for (uint32_t m = 0; m < models; m++) {
+        frame.modelIds[m] = static_cast<int32_t>(r.u32());
+        uint32_t boneCount = r.u32();
+        uint32_t morphCount = r.u32();
+        r.raw(&ranges[m * 8], sizeof(float) * 8);
+        if (!r.ok() || boneCount > 0x10000 || morphCount > 0x10000) return false;
+        frame.boneStart.push_back(frame.boneStart.back() + boneCount);
+        frame.morphStart.push_back(frame.morphStart.back() + morphCount);
+    }
+    const size_t bones = frame.boneStart.back();
+    const size_t morphs = frame.morphStart.back();
+    if (r.remaining() < bones * (3 * 2 + kRotationBytes) + morphs * 2) return false;
+
+    frame.boneMatrices.resize(bones * 16);
+    frame.morphWeights.resize(morphs);
+    std::vector<float> translations(bones * 3);
+    for (int c = 0; c < 3; c++) {
+        for (uint32_t m = 0; m < models; m++) {
+            const float* range = &ranges[m * 8];
+            for (uint32_t b = frame.boneStart[m]; b < frame.boneStart[m + 1]; b++) {
+                translations[b * 3 + c] = dequantize16(r.u16(), range[c], range[3 + c]);
+            }
+        }
+    }
+    for (size_t b = 0; b < bones; b++) {
+        uint8_t packed[kRotationBytes];
+        r.raw(packed, sizeof(packed));
+        float q[4];
+        decodeRotation(packed, q);
+        QuaternionToMatrix(q, &translations[b * 3], &frame.boneMatrices[b * 16]);
+    }
+    for (uint32_t m = 0; m < models; m++) {
+        const float* range = &ranges[m * 8];
+        for (uint32_t i = frame.morphStart[m]; i < frame.morphStart[m + 1]; i++) {
+            frame.morphWeights[i] = dequantize16(r.u16(), range[6], range[7]);
+        }
+    }
+    return r.ok();
+}
+
+}
@@ -0,0 +1,40 @@
+﻿#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// 評価済みのポーズ（全モデルのボーンのワールド行列とモーフ値）
+// モデルごとの構造体ではなく、属性ごとに全モデル分を詰めた配列で持つ
+struct PoseFrame {
+    int32_t frame = 0;
+    std::vector<int32_t> modelIds;      // ExpGetPmdID
+    std::vector<uint32_t> boneStart;    // モデル m のボーンは [boneStart[m], boneStart[m + 1])。要素数はモデル数 + 1
+    std::vector<uint32_t> morphStart;   // モーフも同様
+    std::vector<float> boneMatrices;    // ボーンごとに16個（D3DMATRIX と同じ並び）
+    std::vector<float> morphWeights;
+
+    size_t modelCount() const { return modelIds.size(); }
+    size_t boneCount() const { return boneMatrices.size() / 16; }
+    size_t rawBytes() const { return (boneMatrices.size() + morphWeights.size()) * sizeof(float); }
+};
+
+// ポーズのチェックポイント（バックアップと並べて保存する .pose）
+//
+//   ヘッダ: magic, version, frame, モデル数
+//   モデル: { ID, ボーン数, モーフ数, 位置の最小(3), 最大(3), モーフ値の最小, 最大 }...
+//   以降は属性ごとの列: 位置X[全ボーン], 位置Y, 位置Z（16bit）, 回転（6バイト）, モーフ値（16bit）
+//
+// 位置はモデルごとの範囲で 16bit に、回転は最大成分を除いた3成分を 15bit ずつにする。
+// MMD のボーンは回転と移動だけなので、拡大縮小は持たない。
+
+namespace pose {
+    const uint32_t Magic = 0x53504241;     // "ABPS"
+    const uint32_t Version = 1;
+
+    void EncodeCheckpoint(const PoseFrame& frame, std::vector<uint8_t>& out);
+    bool DecodeCheckpoint(const uint8_t* data, size_t size, PoseFrame& frame);
+
+    // 行列（行ベクトル形式）とクォータニオン x, y, z, w の変換
+    void MatrixToQuaternion(const float m[16], float q[4]);
+    void QuaternionToMatrix(const float q[4], const float t[3], float m[16]);
+}
@@ -0,0 +1,91 @@
+﻿#include "RenderMonitor.h"
+#include <iomanip>
+#include <sstream>
+
+RenderMonitor::RenderMonitor()
+    : m_lastPresentNs(0), m_lastAdvanceNs(0), m_lastFrame(-1), m_lastFrameTime(-1.0f), m_stepStreak(0), m_advanceStreak(0),
+    m_inBackup(false), m_backupWorstNs(0), m_backupFrames(0), m_lastBackupWorstNs(0), m_lastBackupFrames(0) {}
+
+void RenderMonitor::onPresent(uint64_t nowNs, int nowFrame, float frameTime) {
+    uint64_t prevPresent = m_lastPresentNs.exchange(nowNs, std::memory_order_relaxed);
+    if (prevPresent != 0 && nowNs > prevPresent) {
+        uint64_t interval = nowNs - prevPresent;
+        if (m_inBackup.load(std::memory_order_relaxed)) {
+            m_backupFrameHist.record(interval);
+            m_backupFrames.fetch_add(1, std::memory_order_relaxed);
+            uint64_t cur = m_backupWorstNs.load(std::memory_order_relaxed);
+            while (interval > cur && !m_backupWorstNs.compare_exchange_weak(cur, interval, std::memory_order_relaxed)) {}
+        }
+        else {
+            m_normalFrames.record(interval);
+        }
+    }
+
+    int prevFrame = m_lastFrame.exchange(nowFrame, std::memory_order_relaxed);
+    float prevTime = m_lastFrameTime.exchange(frameTime, std::memory_order_relaxed);
+    if (prevFrame < 0) return;
+
+    // AVI出力中は描画1回ごとに必ず1フレーム進む。再生中は表示速度に合わせて0～数フレーム前へ進む。
+    // タイムラインをドラッグしたときは前後に飛ぶので、前へ少しずつ続けて進んだときだけを再生とみなす
+    bool forward = (nowFrame > prevFrame && nowFrame - prevFrame <= MaxPlayStep) ||
+        (nowFrame == prevFrame && frameTime > prevTime);
+    if (forward) {
+        uint64_t prevAdvance = m_lastAdvanceNs.exchange(nowNs, std::memory_order_relaxed);
+        if (prevAdvance != 0 && nowNs >= prevAdvance && nowNs - prevAdvance <= AdvanceGapNs) {
+            m_advanceStreak.fetch_add(1, std::memory_order_relaxed);
+        }
+        else {
+            m_advanceStreak.store(1, std::memory_order_relaxed);
+        }
+    }
+    else if (nowFrame != prevFrame || frameTime != prevTime) {
+        m_advanceStreak.store(0, std::memory_order_relaxed);
+    }
+
+    if (nowFrame == prevFrame + 1) {
+        m_stepStreak.fetch_add(1, std::memory_order_relaxed);
+    }
+    else {
+        m_stepStreak.store(0, std::memory_order_relaxed);
+    }
+}
+
+RenderMonitor::State RenderMonitor::state(uint64_t nowNs) const {
+    uint64_t lastAdvance = m_lastAdvanceNs.load(std::memory_order_relaxed);
+    if (lastAdvance == 0) return State::Idle;
+    // 描画スレッドは呼び出し側より後に時刻を読んでいることがある（その場合は今進んだところ）
+    if (lastAdvance < nowNs && nowNs - lastAdvance > IdleHoldNs) return State::Idle;
+    if (m_stepStreak.load(std::memory_order_relaxed) >= RenderStreak) return State::Rendering;
+    return m_advanceStreak.load(std::memory_order_relaxed) >= PlayStreak ? State::Playing : State::Idle;
+}
+
+void RenderMonitor::beginBackup() {
+    m_backupWorstNs.store(0, std::memory_order_relaxed);
+    m_backupFrames.store(0, std::memory_order_relaxed);
+    m_inBackup.store(true, std::memory_order_relaxed);
+}
+
+void RenderMonitor::endBackup() {
+    m_inBackup.store(false, std::memory_order_relaxed);
+    m_lastBackupWorstNs.store(m_backupWorstNs.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    m_lastBackupFrames.store(m_backupFrames.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+std::wstring RenderMonitor::summary() const {
+    std::wostringstream ss;
+    ss << std::fixed << std::setprecision(1);
+    if (m_normalFrames.count() == 0) {
+        ss << L"・描画フレームの記録がありません\n";
+        return ss.str();
+    }
+    ss << L"・通常時: 中央 " << m_normalFrames.percentileNs(0.5) / 1e6
+        << L" ms / p99 " << m_normalFrames.percentileNs(0.99) / 1e6 << L" ms\n";
+    if (m_backupFrameHist.count() > 0) {
+        ss << L"・バックアップ中: 中央 " << m_backupFrameHist.percentileNs(0.5) / 1e6
+            << L" ms / p99 " << m_backupFrameHist.percentileNs(0.99) / 1e6
+            << L" ms / 最大 " << m_backupFrameHist.maxNs() / 1e6 << L" ms\n";
+        ss << L"・直近のバックアップ: 最悪 " << m_lastBackupWorstNs.load(std::memory_order_relaxed) / 1e6
+            << L" ms (" << m_lastBackupFrames.load(std::memory_order_relaxed) << L"フレーム)\n";
+    }
+    return ss.str();
+}
@@ -0,0 +1,58 @@
+﻿#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include "BackupMetrics.h"
+
+// Present ごとの情報から再生中・動画出力中を判定し、フレーム時間を記録する
+// onPresent は描画スレッド、それ以外はワーカースレッドから呼ばれる
+class RenderMonitor {
+public:
+    enum class State : int {
+        Idle,        // 編集中・停止中
+        Playing,     // 再生中
+        Rendering    // 動画(AVI)出力中と推定
+    };
+
+    RenderMonitor();
+
+    // 1フレームごとに呼ぶ。nowFrame はMMDMainData::now_frame、frameTime は ExpGetFrameTime() の値
+    void onPresent(uint64_t nowNs, int nowFrame, float frameTime);
+
+    State state(uint64_t nowNs) const;
+    bool isBusy(uint64_t nowNs) const { return state(nowNs) != State::Idle; }
+
+    // バックアップ中のフレーム時間を別集計する
+    void beginBackup();
+    void endBackup();
+
+    std::wstring summary() const;
+
+private:
+    // フレームが進まなくなってから停止とみなすまでの時間
+    static const uint64_t IdleHoldNs = 1000000000ull;
+    // +1 フレームずつ連続で進んだ回数がこれ以上なら出力中とみなす
+    static const int RenderStreak = 60;
+    // 前へ少しずつ進んだ回数がこれ以上なら再生中とみなす（タイムラインのドラッグやジャンプは数えない）
+    static const int PlayStreak = 8;
+    // 再生とみなす1回の進み幅の上限（表示が遅いときは1回の描画で数フレーム進む）
+    static const int MaxPlayStep = 6;
+    // 進んだ間隔がこれより空いたら、続けて進んだとはみなさない
+    static const uint64_t AdvanceGapNs = 250000000ull;
+
+    std::atomic<uint64_t> m_lastPresentNs;
+    std::atomic<uint64_t> m_lastAdvanceNs;
+    std::atomic<int> m_lastFrame;
+    std::atomic<float> m_lastFrameTime;
+    std::atomic<int> m_stepStreak;
+    std::atomic<int> m_advanceStreak;
+
+    std::atomic<bool> m_inBackup;
+    std::atomic<uint64_t> m_backupWorstNs;
+    std::atomic<uint64_t> m_backupFrames;
+    std::atomic<uint64_t> m_lastBackupWorstNs;
+    std::atomic<uint64_t> m_lastBackupFrames;
+
+    LatencyHistogram m_normalFrames;
+    LatencyHistogram m_backupFrameHist;
+};
@@ -0,0 +1,394 @@
+﻿#include "SceneSketch.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace {
+    // 要素のハッシュ（FNV-1a 64）
+    class ElementHash {
+    public:
+        ElementHash() : m_h(1469598103934665603ull) {}
+        void raw(const void* data, size_t size) {
+            const uint8_t* p = static_cast<const uint8_t*>(data);
+            for (size_t i = 0; i < size; i++) {
+                m_h ^= p[i];
+                m_h *= 1099511628211ull;
+            }
+        }
+        void str(const std::string& s) { name(s.data(), s.size()); }
+        void name(const void* data, size_t size) {
+            raw(data, size);
+            raw("", 1);
+        }
+        void u32(uint32_t v) { raw(&v, sizeof(v)); }
+        // 保存・読み込みの丸め誤差で別の要素にならないよう量子化してから混ぜる
+        void f32(float v, float step) {
+            int32_t q = static_cast<int32_t>(std::lround(v / step));
+            raw(&q, sizeof(q));
+        }
+        uint64_t value() const { return m_h; }
+
+    private:
+        uint64_t m_h;
+    };
+
+    // SketchSize 個の独立なハッシュ関数の代わりに、要素のハッシュを種ごとに混ぜ直す
+    uint32_t mix(uint64_t h, uint64_t seed) {
+        uint64_t z = h + seed * 0x9E3779B97F4A7C15ull;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return static_cast<uint32_t>(z ^ (z >> 31));
+    }
+
+    // sketch の名前以外を空にしてから、要素を足していく
+    class SketchBuilder {
+    public:
+        explicit SketchBuilder(ModelSketch& sketch) : m_sketch(sketch) {
+            m_sketch.keyframes = 0;
+            m_sketch.digest = 0;
+            std::fill(std::begin(m_sketch.mins), std::end(m_sketch.mins), 0xFFFFFFFFu);
+        }
+        void add(uint64_t h) {
+            for (int i = 0; i < SketchSize; i++) {
+                uint32_t v = mix(h, static_cast<uint64_t>(i + 1));
+                if (v < m_sketch.mins[i]) m_sketch.mins[i] = v;
+            }
+            m_sketch.keyframes++;
+            m_sketch.digest += h;
+        }
+
+    private:
+        ModelSketch& m_sketch;
+    };
+
+    ModelSketch sketchMotion(const std::string& name, const VmdMotion& motion) {
+        ModelSketch sketch;
+        sketch.name = name;
+        SketchBuilder b(sketch);
+        for (const auto& f : motion.bones) {
+            ElementHash h;
+            h.u32(1);
+            h.str(f.name);
+            h.u32(f.frame);
+            for (float v : f.position) h.f32(v, 1e-3f);
+            for (float v : f.rotation) h.f32(v, 1e-4f);
+            h.raw(f.interpolation, sizeof(f.interpolation));
+            b.add(h.value());
+        }
+        for (const auto& f : motion.morphs) {
+            ElementHash h;
+            h.u32(2);
+            h.str(f.name);
+            h.u32(f.frame);
+            h.f32(f.weight, 1e-3f);
+            b.add(h.value());
+        }
+        for (const auto& f : motion.cameras) {
+            ElementHash h;
+            h.u32(3);
+            h.u32(f.frame);
+            h.f32(f.distance, 1e-3f);
+            for (float v : f.position) h.f32(v, 1e-3f);
+            for (float v : f.rotation) h.f32(v, 1e-4f);
+            h.raw(f.interpolation, sizeof(f.interpolation));
+            h.u32(f.viewAngle);
+            h.u32(f.perspectiveOff);
+            b.add(h.value());
+        }
+        for (const auto& f : motion.showIk) {
+            ElementHash h;
+            h.u32(4);
+            h.u32(f.frame);
+            h.u32(f.show);
+            b.add(h.value());
+        }
+        return sketch;
+    }
+
+    // --- SketchImage 用。emergency::Read と同じところを読み、sketchMotion と同じ要素を足す ---
+
+    // 本体を読めるセクション。読めなければ false
+    bool sectionAt(const uint8_t* data, size_t size, uint64_t offset, uint32_t& kind, ByteReader& body, uint64_t& next) {
+        if (offset + emergency::SectionHeaderSize > size) return false;
+        ByteReader h(data + offset, emergency::SectionHeaderSize);
+        if (h.u32() != emergency::SectionMagic) return false;
+        kind = h.u32();
+        h.u32();
+        h.u32();
+        uint64_t bodySize = h.u64();
+        if (bodySize > size - offset - emergency::SectionHeaderSize) return false;
+        next = offset + emergency::SectionHeaderSize + bodySize;
+        body = ByteReader(data + offset + emergency::SectionHeaderSize, static_cast<size_t>(bodySize));
+        return true;
+    }
+
+    // カメラのセクションに、最後まで読めるキーフレームが1つでもある（readCamera が1つ以上取り出す）
+    bool hasCameraFrame(ByteReader body) {
+        const size_t frameSize = 4 + 4 + 12 + 12 + 24 + 4 + 4;
+        return body.u32() > 0 && body.ok() && body.remaining() >= frameSize;
+    }
+
+    // emergency::Read と同じ順でセクションを渡す（ディレクトリがそろっていればその順、無ければ先頭から辿れるところまで）
+    template <typename Visit>
+    bool forEachSection(const uint8_t* data, size_t size, Visit visit) {
+        if (size < emergency::HeaderSize) return false;
+        ByteReader h(data, size);
+        if (h.u32() != emergency::FileMagic || h.u32() != emergency::Version) return false;
+        h.i64();
+        h.u32();
+        h.u32();
+        uint64_t dirOffset = h.u64();
+        uint32_t sectionCount = h.u32();
+        h.u32();
+        h.u64();
+        h.skip(static_cast<size_t>(h.u16()) * 2);   // pmm のパス
+        if (!h.ok()) return false;
+        uint64_t firstSection = h.pos();
+
+        uint32_t kind = 0;
+        ByteReader body(nullptr, 0);
+        uint64_t next = 0;
+        if (dirOffset >= firstSection && dirOffset + 8 <= size) {
+            ByteReader d(data + dirOffset, static_cast<size_t>(size - dirOffset));
+            if (d.u32() == emergency::DirMagic && d.u32() == sectionCount) {
+                // すべてのセクションが読めるときだけディレクトリを使う
+                ByteReader check = d;
+                bool ok = true;
+                for (uint32_t i = 0; i < sectionCount && ok; i++) {
+                    check.skip(8);
+                    uint64_t offset = check.u64();
+                    check.skip(12);
+                    ok = check.ok() && sectionAt(data, size, offset, kind, body, next);
+                }
+                if (ok) {
+                    for (uint32_t i = 0; i < sectionCount; i++) {
+                        d.skip(8);
+                        uint64_t offset = d.u64();
+                        d.skip(12);
+                        sectionAt(data, size, offset, kind, body, next);
+                        visit(kind, body);
+                    }
+                    return true;
+                }
+            }
+        }
+
+        bool any = false;
+        uint64_t pos = firstSection;
+        while (sectionAt(data, size, pos, kind, body, next)) {
+            if (kind == emergency::SectionModel || (kind == emergency::SectionCamera && hasCameraFrame(body))) any = true;
+            visit(kind, body);
+            pos = next;
+        }
+        return any;
+    }
+
+    void sketchCameraSection(ByteReader& r, SketchBuilder& b) {
+        uint32_t count = r.u32();
+        for (uint32_t i = 0; i < count && r.ok(); i++) {
+            uint32_t frame = r.u32();
+            float distance = r.f32();
+            float position[3];
+            float rotation[3];
+            for (float& v : position) v = r.f32();
+            for (float& v : rotation) v = r.f32();
+            uint8_t hokan[4][6];
+            r.raw(hokan, sizeof(hokan));
+            uint8_t interpolation[24];
+            for (int c = 0; c < 6; c++) {
+                interpolation[c * 4 + 0] = hokan[0][c];
+                interpolation[c * 4 + 1] = hokan[2][c];
+                interpolation[c * 4 + 2] = hokan[1][c];
+                interpolation[c * 4 + 3] = hokan[3][c];
+            }
+            uint32_t perspectiveOff = r.u32() ? 0 : 1;
+            uint32_t viewAngle = r.u32();
+            if (!r.ok()) break;
+            ElementHash h;
+            h.u32(3);
+            h.u32(frame);
+            h.f32(distance, 1e-3f);
+            for (float v : position) h.f32(v, 1e-3f);
+            for (float v : rotation) h.f32(v, 1e-4f);
+            h.raw(interpolation, sizeof(interpolation));
+            h.u32(viewAngle);
+            h.u32(perspectiveOff);
+            b.add(h.value());
+        }
+    }
+
+    // 名前とパスの後から
+    void sketchModelSection(ByteReader& r, SketchBuilder& b) {
+        uint32_t boneCount = r.u32();
+        for (uint32_t t = 0; t < boneCount && r.ok(); t++) {
+            uint16_t nameSize = r.u16();
+            const uint8_t* name = r.skip(nameSize);
+            if (!name) nameSize = 0;
+            uint32_t count = r.u32();
+            for (uint32_t i = 0; i < count && r.ok(); i++) {
+                uint32_t frame = r.u32();
+                float position[3];
+                float rotation[4];
+                for (float& v : position) v = r.f32();
+                for (float& v : rotation) v = r.f32();
+                uint8_t curve[4][4];
+                r.raw(curve, sizeof(curve));
+                if (!r.ok()) break;
+                uint8_t interpolation[64];
+                VmdMakeBoneInterpolation(curve[0], curve[1], curve[2], curve[3], interpolation);
+                ElementHash h;
+                h.u32(1);
+                h.name(name, nameSize);
+                h.u32(frame);
+                for (float v : position) h.f32(v, 1e-3f);
+                for (float v : rotation) h.f32(v, 1e-4f);
+                h.raw(interpolation, sizeof(interpolation));
+                b.add(h.value());
+            }
+        }
+
+        uint32_t morphCount = r.u32();
+        for (uint32_t t = 0; t < morphCount && r.ok(); t++) {
+            uint16_t nameSize = r.u16();
+            const uint8_t* name = r.skip(nameSize);
+            if (!name) nameSize = 0;
+            uint32_t count = r.u32();
+            for (uint32_t i = 0; i < count && r.ok(); i++) {
+                uint32_t frame = r.u32();
+                float weight = r.f32();
+                if (!r.ok()) break;
+                ElementHash h;
+                h.u32(2);
+                h.name(name, nameSize);
+                h.u32(frame);
+                h.f32(weight, 1e-3f);
+                b.add(h.value());
+            }
+        }
+
+        uint32_t configCount = r.u32();
+        for (uint32_t i = 0; i < configCount && r.ok(); i++) {
+            uint32_t frame = r.u32();
+            uint32_t show = r.u8();
+            r.skip(r.u32());
+            if (!r.ok()) break;
+            ElementHash h;
+            h.u32(4);
+            h.u32(frame);
+            h.u32(show);
+            b.add(h.value());
+        }
+    }
+
+    double modelSimilarity(const ModelSketch& a, const ModelSketch& b) {
+        if (a.keyframes == b.keyframes && a.digest == b.digest) return 1.0;
+        int same = 0;
+        for (int i = 0; i < SketchSize; i++) {
+            if (a.mins[i] == b.mins[i]) same++;
+        }
+        // 少しだけ違う場合は MinHash がすべて一致することがあるが、内容が違うものは 100% にしない
+        return std::min(static_cast<double>(same), SketchSize - 0.5) / SketchSize;
+    }
+
+    const ModelSketch* findModel(const SceneSketch& s, const std::string& name) {
+        for (const auto& m : s.models) {
+            if (m.name == name) return &m;
+        }
+        return nullptr;
+    }
+}
+
+void SceneSketch::write(ByteWriter& w) const {
+    w.u16(static_cast<uint16_t>(models.size()));
+    for (const auto& m : models) {
+        w.str(m.name);
+        w.u32(m.keyframes);
+        w.u64(m.digest);
+        w.raw(m.mins, sizeof(m.mins));
+    }
+}
+
+bool SceneSketch::read(ByteReader& r) {
+    models.clear();
+    uint16_t count = r.u16();
+    for (uint16_t i = 0; i < count && r.ok(); i++) {
+        ModelSketch m;
+        m.name = r.str();
+        m.keyframes = r.u32();
+        m.digest = r.u64();
+        r.raw(m.mins, sizeof(m.mins));
+        if (r.ok()) models.push_back(m);
+    }
+    return r.ok();
+}
+
+SceneSketch SketchScene(const emergency::Dump& dump) {
+    SceneSketch s;
+    if (!dump.camera.cameras.empty()) s.models.push_back(sketchMotion(VmdCameraModelName, dump.camera));
+    for (const auto& model : dump.models) s.models.push_back(sketchMotion(model.name, model.motion));
+    return s;
+}
+
+bool SketchImage(const uint8_t* image, size_t size, SceneSketch& out) {
+    // SketchScene と同じくカメラを先頭に置くので、先にカメラの有無とモデルの数を調べる
+    bool camera = false;
+    size_t modelCount = 0;
+    bool ok = forEachSection(image, size, [&](uint32_t kind, ByteReader body) {
+        if (kind == emergency::SectionCamera && hasCameraFrame(body)) camera = true;
+        else if (kind == emergency::SectionModel) modelCount++;
+    });
+    if (!ok) {
+        out.models.clear();
+        return false;
+    }
+
+    size_t first = camera ? 1 : 0;
+    out.models.resize(first + modelCount);
+    if (camera) {
+        out.models[0].name = VmdCameraModelName;
+        SketchBuilder b(out.models[0]);
+        forEachSection(image, size, [&](uint32_t kind, ByteReader body) {
+            if (kind == emergency::SectionCamera) sketchCameraSection(body, b);
+        });
+    }
+    size_t next = first;
+    forEachSection(image, size, [&](uint32_t kind, ByteReader body) {
+        if (kind != emergency::SectionModel) return;
+        ModelSketch& sketch = out.models[next++];
+        uint16_t nameSize = body.u16();
+        const uint8_t* name = body.skip(nameSize);
+        if (name) sketch.name.assign(reinterpret_cast<const char*>(name), nameSize);
+        else sketch.name.clear();
+        body.skip(static_cast<size_t>(body.u16()) * 2);     // パス
+        SketchBuilder b(sketch);
+        sketchModelSection(body, b);
+    });
+    return true;
+}
+
+double SketchSimilarity(const SceneSketch& a, const SceneSketch& b) {
+    double weighted = 0;
+    double total = 0;
+    for (const auto& ma : a.models) {
+        const ModelSketch* mb = findModel(b, ma.name);
+        double w = std::max<double>(1.0, std::max(ma.keyframes, mb ? mb->keyframes : 0u));
+        total += w;
+        if (mb) weighted += w * modelSimilarity(ma, *mb);
+    }
+    for (const auto& mb : b.models) {
+        if (!findModel(a, mb.name)) total += std::max<double>(1.0, mb.keyframes);
+    }
+    return total > 0 ? weighted / total : 1.0;
+}
+
+std::vector<std::string> SketchDifferingModels(const SceneSketch& a, const SceneSketch& b, double threshold) {
+    std::vector<std::string> names;
+    for (const auto& ma : a.models) {
+        const ModelSketch* mb = findModel(b, ma.name);
+        if (!mb || modelSimilarity(ma, *mb) < threshold) names.push_back(ma.name);
+    }
+    for (const auto& mb : b.models) {
+        if (!findModel(a, mb.name)) names.push_back(mb.name);
+    }
+    return names;
+}
@@ -0,0 +1,40 @@
+﻿#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "BackupFormat.h"
+#include "EmergencyDump.h"
+
+// シーンの類似度を見積もるための小さな要約（MinHash）
+//
+// モデルごと（とカメラ）に、キーフレーム1つ1つ（トラック名・フレーム・値・補間）を
+// 要素とする集合の MinHash を SketchSize 個だけ持つ。2つのスケッチで一致する値の割合が
+// 集合の Jaccard 係数の推定値になるので、バックアップ本体を開かずに比較できる。
+
+const int SketchSize = 32;
+
+struct ModelSketch {
+    std::string name;           // モデル名（Shift-JIS）。カメラは VmdCameraModelName
+    uint32_t keyframes = 0;
+    uint64_t digest = 0;        // 要素のハッシュの和（順序によらない。一致すれば同じ内容とみなす）
+    uint32_t mins[SketchSize];
+};
+
+struct SceneSketch {
+    std::vector<ModelSketch> models;
+
+    bool empty() const { return models.empty(); }
+    void write(ByteWriter& w) const;
+    bool read(ByteReader& r);
+};
+
+SceneSketch SketchScene(const emergency::Dump& dump);
+// EmergencySnapshot::capture の image から直接作る（.kfs を書いて読み戻さずに済む）。
+// Dump を作らずに image を読み、SketchScene と同じ値を out に書く。out を使い回せば、同じ構成のシーンなら確保しない
+bool SketchImage(const uint8_t* image, size_t size, SceneSketch& out);
+
+// 0～1。キーフレーム数で重み付けしたモデルごとの一致率（片方にしか無いモデルは 0 として数える）
+double SketchSimilarity(const SceneSketch& a, const SceneSketch& b);
+
+// 一致率が threshold 未満のモデル（片方にしか無いものを含む）。既定では内容が少しでも違うもの
+std::vector<std::string> SketchDifferingModels(const SceneSketch& a, const SceneSketch& b, double threshold = 1.0);
@@ -0,0 +1,78 @@
+﻿#include "stdafx.h"
+#include "SessionMarker.h"
+#include "BackupFormat.h"
+#include <ctime>
+#include <fstream>
+#include <sstream>
+
+namespace {
+    const wchar_t* kMarkerPrefix = L"AutoBackup_session_";
+    const char* kProjectKey = "project=";
+}
+
+SessionMarker::SessionMarker() : m_file(INVALID_HANDLE_VALUE), m_started(0) {}
+
+SessionMarker::~SessionMarker() {
+    end();
+}
+
+std::vector<fs::path> SessionMarker::begin(const fs::path& dir) {
+    std::vector<fs::path> projects;
+    m_path = dir / (kMarkerPrefix + std::to_wstring(GetCurrentProcessId()) + L".txt");
+
+    std::error_code ec;
+    for (fs::directory_iterator it(dir, ec), last; !ec && it != last; it.increment(ec)) {
+        const fs::path& p = it->path();
+        if (p.extension() != L".txt" || p.filename().wstring().find(kMarkerPrefix) != 0 || p == m_path) continue;
+        // 起動中の MMD は共有なしで開いているので、開けなければ使用中
+        HANDLE h = CreateFileW(p.c_str(), GENERIC_READ, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (h == INVALID_HANDLE_VALUE) continue;
+        CloseHandle(h);
+
+        std::ifstream in(p.c_str());
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.compare(0, strlen(kProjectKey), kProjectKey) != 0) continue;
+            std::wstring project = Utf8ToWide(line.substr(strlen(kProjectKey)));
+            if (!project.empty()) projects.push_back(project);
+        }
+        in.close();
+        fs::remove(p, ec);
+    }
+
+    m_started = static_cast<int64_t>(time(nullptr));
+    m_file = CreateFileW(m_path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    write();
+    return projects;
+}
+
+void SessionMarker::setProject(const std::wstring& pmmPath) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (pmmPath == m_project) return;
+    m_project = pmmPath;
+    write();
+}
+
+bool SessionMarker::write() {
+    if (m_file == INVALID_HANDLE_VALUE) return false;
+    std::ostringstream ss;
+    ss << "AutoBackup session\n"
+        << "pid=" << GetCurrentProcessId() << "\n"
+        << "started=" << m_started << "\n"
+        << kProjectKey << WideToUtf8(m_project) << "\n";
+    std::string text = ss.str();
+
+    LARGE_INTEGER zero = {};
+    DWORD written = 0;
+    return SetFilePointerEx(m_file, zero, nullptr, FILE_BEGIN) &&
+        WriteFile(m_file, text.data(), static_cast<DWORD>(text.size()), &written, nullptr) &&
+        SetEndOfFile(m_file);
+}
+
+void SessionMarker::end() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_file == INVALID_HANDLE_VALUE) return;
+    CloseHandle(m_file);
+    m_file = INVALID_HANDLE_VALUE;
+    DeleteFileW(m_path.c_str());
+}
@@ -0,0 +1,35 @@
+﻿#pragma once
+#include "stdafx.h"
+#include <mutex>
+#include <string>
+#include <vector>
+#include <experimental/filesystem>
+
+namespace fs = std::experimental::filesystem;
+
+// 起動中であることを示す印（AutoBackup_session_<PID>.txt）
+//
+// start() で作って共有なしで開いたままにし、stop() で削除する。
+// 起動時に他のプロセスが開いていない印が残っていれば、そのセッションは正常に終了していない。
+// 印には最後に開いていたプロジェクトを書いておき、復元の候補を探すのに使う。
+class SessionMarker {
+public:
+    SessionMarker();
+    ~SessionMarker();
+
+    // 異常終了したセッションの最後のプロジェクトを返し、古い印を片付けてから自分の印を作る
+    std::vector<fs::path> begin(const fs::path& dir);
+    // 開いているプロジェクトが変わったら呼ぶ（どのスレッドからでもよい）。変わっていなければ確保しない
+    void setProject(const std::wstring& pmmPath);
+    // 正常終了
+    void end();
+
+private:
+    bool write();
+
+    std::mutex m_mutex;
+    HANDLE m_file;
+    fs::path m_path;
+    std::wstring m_project;
+    int64_t m_started;
+};
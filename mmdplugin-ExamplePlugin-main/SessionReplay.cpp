@@ -0,0 +1,151 @@
+﻿#include "SessionReplay.h"
+#include "BackupFormat.h"
+#include "BackupPack.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <map>
+
+namespace {
+    // MMD の代わりに HostSimulator で保存し、キーフレームを書き出す
+    class SimulatorHost : public BackupHost {
+    public:
+        explicit SimulatorHost(HostSimulator& host) : m_host(host) {}
+        bool requestSave() override { return m_host.save(); }
+        bool captureKeyframes(std::vector<uint8_t>& image, int64_t now) override {
+            m_host.snapshot(image, now);
+            return true;
+        }
+
+    private:
+        HostSimulator& m_host;
+    };
+}
+
+bool RunSimulatedBackup(HostSimulator& host, BackupEngine& engine, BackupCycle& cycle, int64_t now, BackupMetrics& metrics,
+    std::string& error) {
+    StageTimer totalTimer(metrics, BackupStage::Total);
+    SimulatorHost simulator(host);
+    if (!cycle.run(simulator, engine, now, nullptr, true, metrics)) {
+        error = cycle.result().error;
+        return false;
+    }
+
+    // 要約のキーフレーム数が合わなければ、書き出しか要約のどこかで落ちている
+    size_t sketched = 0;
+    for (const auto& model : cycle.entry().sketch.models) sketched += model.keyframes;
+    if (!cycle.result().keyframes || sketched != host.keyframeCount()) {
+        error = "keyframes are incomplete: " + WideToUtf8(cycle.savedName());
+        return false;
+    }
+
+    if (cycle.result().compactionDue) {
+        StageTimer timer(metrics, BackupStage::Compaction);
+        PackStore(engine.backupDir(), engine.stem()).compact(0.5, nullptr);
+    }
+    return true;
+}
+
+bool ReplaySession(const session::Trace& trace, const fs::path& workDir, const ReplayPolicy& policy,
+    const SimulatorSettings& settings, ReplayResult& result, std::string& error) {
+    result = ReplayResult();
+    auto wallStart = std::chrono::steady_clock::now();
+
+    // 記録に出てくるモデルのスロットを、出てきた順にシミュレータのモデルへ割り当てる
+    std::map<uint32_t, int> models;
+    for (const auto& e : trace.events) {
+        if (e.kind == session::EventEdit && e.slot != session::CameraSlot && !models.count(e.slot)) {
+            int index = static_cast<int>(models.size());
+            models[e.slot] = index;
+        }
+    }
+    SimulatorSettings scene = settings;
+    scene.models = (std::max)(1, static_cast<int>(models.size()));
+
+    std::error_code ec;
+    fs::remove_all(workDir, ec);
+    fs::create_directories(workDir, ec);
+    HostSimulator host(workDir / L"replay.pmm", scene);
+    BackupEngine engine(host.pmmPath(), policy.backup);
+    BackupMetrics metrics;
+    BackupCycle cycle;
+    if (!host.save()) {
+        error = "cannot write " + WideToUtf8(host.pmmPath().wstring());
+        return false;
+    }
+
+    // 最後にバックアップか上書き保存をしてから、まだどこにも残っていない編集
+    bool uncovered = false;
+    uint64_t firstUncoveredMs = 0;
+    uint64_t uncoveredEdits = 0;
+    auto cover = [&](uint64_t timeMs) {
+        if (uncovered) {
+            result.worstLostMs = (std::max)(result.worstLostMs, timeMs - firstUncoveredMs);
+            result.worstLostEdits = (std::max)(result.worstLostEdits, uncoveredEdits);
+        }
+        uncovered = false;
+        uncoveredEdits = 0;
+    };
+
+    uint64_t lastBackupMs = 0;
+    auto backup = [&](uint64_t timeMs, bool manual) {
+        clock_t cpuStart = clock();
+        uint64_t start = metrics.nowNs();
+        if (!RunSimulatedBackup(host, engine, cycle, trace.startTime + static_cast<int64_t>(timeMs / 1000), metrics, error)) {
+            return false;
+        }
+        const BackupCycleResult& b = cycle.result();
+        result.cpuMs += (clock() - cpuStart) * 1000.0 / CLOCKS_PER_SEC;
+        double stall = (manual ? metrics.nowNs() - start : b.saveNs) / 1e6;
+        result.stallMs += stall;
+        result.stallMaxMs = (std::max)(result.stallMaxMs, stall);
+        result.bytesWritten += b.storedBytes + b.kfsBytes;
+        result.backups++;
+        lastBackupMs = timeMs;
+        cover(timeMs);
+        return true;
+    };
+    uint64_t intervalMs = static_cast<uint64_t>((std::max)(policy.intervalMinutes, 1)) * 60 * 1000;
+    auto catchUp = [&](uint64_t timeMs) {
+        while (lastBackupMs + intervalMs <= timeMs) {
+            if (!backup(lastBackupMs + intervalMs, false)) return false;
+        }
+        return true;
+    };
+
+    std::map<uint32_t, bool> seen;
+    for (const auto& e : trace.events) {
+        if (!catchUp(e.timeMs)) return false;
+        if (e.kind == session::EventCommand) {
+            if (e.command == session::CommandBackupNow) {
+                if (!backup(e.timeMs, true)) return false;
+            }
+            else if (e.command == session::CommandSave) {
+                host.save();
+                cover(e.timeMs);
+            }
+        }
+        else if (e.kind == session::EventEdit) {
+            // スロットが初めて出てきたのは読み込み（記録開始時の状態）なので作業には数えない
+            if (!seen[e.slot]) {
+                seen[e.slot] = true;
+                continue;
+            }
+            int count = (std::min)((std::max)(std::abs(e.delta), 1), 1000);
+            host.edit(e.slot == session::CameraSlot ? -1 : models[e.slot], count);
+            if (!uncovered) {
+                uncovered = true;
+                firstUncoveredMs = e.timeMs;
+            }
+            uncoveredEdits += static_cast<uint64_t>(count);
+        }
+    }
+    uint64_t endMs = trace.durationMs();
+    if (!catchUp(endMs)) return false;
+    // 記録の終わりで異常終了した場合
+    cover(endMs);
+
+    result.wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - wallStart).count();
+    return true;
+}
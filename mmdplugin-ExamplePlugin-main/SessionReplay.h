@@ -0,0 +1,43 @@
+﻿#pragma once
+#include <cstdint>
+#include <string>
+#include <experimental/filesystem>
+#include "BackupCycle.h"
+#include "BackupEngine.h"
+#include "BackupMetrics.h"
+#include "HostSimulator.h"
+#include "SessionTrace.h"
+
+namespace fs = std::experimental::filesystem;
+
+// HostSimulator の上で、triggerSave と同じ BackupCycle を1回通す（詰め直しが要ればその場で行う）。
+// BackupTool simulate / replay 共通。結果は cycle.result() に入る
+bool RunSimulatedBackup(HostSimulator& host, BackupEngine& engine, BackupCycle& cycle, int64_t now, BackupMetrics& metrics,
+    std::string& error);
+
+// 記録したセッションを、バックアップの設定ごとに仮想時間で再生する
+//
+// 編集イベントはキーフレームの増減の分だけ HostSimulator を編集し、自動バックアップは
+// backupWorker と同じく前回から intervalMinutes 経つたびに行う（MMD が前面にあるかどうかは見ない）。
+// 「今すぐバックアップ」は記録どおりに行い、MMD の上書き保存は保存だけを行う。
+// 失われうる作業は、ある瞬間に異常終了したとき、バックアップにも上書き保存にも含まれていない編集の
+// 最も古いものからの時間と、その編集の数で見る。
+struct ReplayPolicy {
+    std::string label;
+    int intervalMinutes = 5;
+    BackupPolicy backup;
+};
+
+struct ReplayResult {
+    int backups = 0;
+    uint64_t bytesWritten = 0;
+    uint64_t worstLostMs = 0;
+    uint64_t worstLostEdits = 0;
+    double cpuMs = 0;           // バックアップの処理に使った CPU 時間
+    double stallMs = 0;         // UI スレッドを止めた時間の合計（自動は保存だけ、手動は全体）
+    double stallMaxMs = 0;
+    double wallMs = 0;          // 再生にかかった実時間
+};
+
+bool ReplaySession(const session::Trace& trace, const fs::path& workDir, const ReplayPolicy& policy,
+    const SimulatorSettings& settings, ReplayResult& result, std::string& error);
@@ -0,0 +1,152 @@
+﻿#include "SessionTrace.h"
+#include "BackupFormat.h"
+#include <fstream>
+#include <iterator>
+
+namespace session {
+    namespace {
+        void putVarint(std::vector<uint8_t>& out, uint64_t v) {
+            while (v >= 0x80) {
+                out.push_back(static_cast<uint8_t>(v) | 0x80);
+                v >>= 7;
+            }
+            out.push_back(static_cast<uint8_t>(v));
+        }
+
+        bool getVarint(const uint8_t*& p, const uint8_t* end, uint64_t& v) {
+            v = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                if (p == end) return false;
+                uint8_t b = *p++;
+                v |= static_cast<uint64_t>(b & 0x7F) << shift;
+                if (!(b & 0x80)) return true;
+            }
+            return false;
+        }
+
+        uint64_t zigzag(int64_t v) { return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63); }
+        int64_t unzigzag(uint64_t v) { return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1); }
+    }
+
+    bool ReadTrace(const fs::path& path, Trace& trace) {
+        trace = Trace();
+        std::ifstream in(path.c_str(), std::ios::binary);
+        if (!in.is_open()) return false;
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+        ByteReader r(data.data(), data.size());
+        if (r.u32() != Magic || r.u32() != Version) return false;
+        trace.startTime = r.i64();
+        if (!r.ok()) return false;
+
+        const uint8_t* p = data.data() + 16;
+        const uint8_t* end = data.data() + data.size();
+        uint64_t timeMs = 0;
+        while (p < end) {
+            // 途中で切れたイベントは捨てる
+            uint64_t head, a, b, c;
+            if (!getVarint(p, end, head) || (head & 3) > EventEdit) {
+                trace.truncated = true;
+                break;
+            }
+            Event e;
+            e.timeMs = timeMs + (head >> 2);
+            e.kind = static_cast<EventKind>(head & 3);
+            bool ok;
+            if (e.kind == EventInput) {
+                ok = getVarint(p, end, a) && getVarint(p, end, b);
+                e.keys = static_cast<uint32_t>(a);
+                e.clicks = static_cast<uint32_t>(b);
+            }
+            else if (e.kind == EventCommand) {
+                ok = getVarint(p, end, a);
+                e.command = static_cast<uint32_t>(a);
+            }
+            else {
+                ok = getVarint(p, end, a) && getVarint(p, end, b) && getVarint(p, end, c);
+                e.slot = static_cast<uint32_t>(a);
+                e.delta = static_cast<int32_t>(unzigzag(b));
+                e.keyframes = static_cast<uint32_t>(c);
+            }
+            if (!ok) {
+                trace.truncated = true;
+                break;
+            }
+            timeMs = e.timeMs;
+            trace.events.push_back(e);
+        }
+        return true;
+    }
+
+    TraceWriter::TraceWriter() : m_lastMs(0) {}
+
+    bool TraceWriter::open(const fs::path& path, int64_t startTime) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::vector<uint8_t> header;
+        ByteWriter w(header);
+        w.u32(Magic);
+        w.u32(Version);
+        w.i64(startTime);
+        std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) return false;
+        out.write(reinterpret_cast<const char*>(header.data()), header.size());
+        if (!out) return false;
+        m_path = path;
+        m_pending.clear();
+        m_lastMs = 0;
+        return true;
+    }
+
+    void TraceWriter::close() {
+        flush();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_path.clear();
+    }
+
+    void TraceWriter::begin(uint64_t timeMs, EventKind kind) {
+        // 別スレッドの記録と前後しても時刻が戻らないようにする
+        if (timeMs < m_lastMs) timeMs = m_lastMs;
+        putVarint(m_pending, (timeMs - m_lastMs) << 2 | kind);
+        m_lastMs = timeMs;
+    }
+
+    void TraceWriter::input(uint64_t timeMs, uint32_t keys, uint32_t clicks) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_path.empty()) return;
+        begin(timeMs, EventInput);
+        putVarint(m_pending, keys);
+        putVarint(m_pending, clicks);
+    }
+
+    void TraceWriter::command(uint64_t timeMs, uint32_t id) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_path.empty()) return;
+        begin(timeMs, EventCommand);
+        putVarint(m_pending, id);
+    }
+
+    void TraceWriter::edit(uint64_t timeMs, uint32_t slot, int32_t delta, uint32_t keyframes) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_path.empty()) return;
+        begin(timeMs, EventEdit);
+        putVarint(m_pending, slot);
+        putVarint(m_pending, zigzag(delta));
+        putVarint(m_pending, keyframes);
+    }
+
+    bool TraceWriter::flush() {
+        std::vector<uint8_t> pending;
+        fs::path path;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_path.empty() || m_pending.empty()) return true;
+            pending.swap(m_pending);
+            path = m_path;
+        }
+        // 書き込みは UI スレッドの記録を待たせないようロックの外で行う（flush を同時に呼ぶのはワーカーか終了処理の1つだけ）
+        std::ofstream out(path.c_str(), std::ios::binary | std::ios::app);
+        if (!out.is_open()) return false;
+        out.write(reinterpret_cast<const char*>(pending.data()), pending.size());
+        return static_cast<bool>(out);
+    }
+}
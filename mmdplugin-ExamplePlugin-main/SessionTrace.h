@@ -0,0 +1,80 @@
+﻿#pragma once
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <experimental/filesystem>
+
+namespace fs = std::experimental::filesystem;
+
+// 編集セッションの記録（AutoBackup_<日時>.abtrace）
+//
+// 実際の作業の流れ（入力・コマンド・キーフレームの増減）だけを残し、BackupTool replay で
+// バックアップの設定（間隔・上限・パック）ごとに再生して比べるためのもの。シーンの中身は持たない。
+//
+//   magic, version, 開始時刻(i64, UNIX秒)
+//   イベント: varint(前のイベントからの経過ミリ秒 << 2 | 種類) + 本体
+//     入力:       varint キー入力数, varint クリック数（1秒ごとにまとめる）
+//     コマンド:   varint WM_COMMAND の ID
+//     編集:       varint スロット（カメラは CameraSlot）, zigzag varint キーフレーム数の増減, varint キーフレーム数
+//
+// 追記するだけなので、MMD が異常終了しても書けたところまでは読める。
+
+namespace session {
+    const uint32_t Magic = 0x54534241;      // "ABST"
+    const uint32_t Version = 1;
+    const uint32_t CameraSlot = 255;
+
+    const uint32_t CommandSave = 57603;         // MMD の上書き保存 (ID_FILE_SAVE)
+    const uint32_t CommandBackupNow = 40001;    // プラグインの「今すぐバックアップ」(ID_BACKUP_NOW)
+
+    enum EventKind : uint8_t {
+        EventInput = 0,
+        EventCommand = 1,
+        EventEdit = 2,
+    };
+
+    struct Event {
+        uint64_t timeMs = 0;        // 記録開始からの経過ミリ秒
+        EventKind kind = EventInput;
+        uint32_t keys = 0;          // 入力
+        uint32_t clicks = 0;
+        uint32_t command = 0;       // コマンド
+        uint32_t slot = 0;          // 編集
+        int32_t delta = 0;
+        uint32_t keyframes = 0;
+    };
+
+    struct Trace {
+        int64_t startTime = 0;
+        std::vector<Event> events;
+        bool truncated = false;     // 末尾が途中で切れていた
+
+        uint64_t durationMs() const { return events.empty() ? 0 : events.back().timeMs; }
+    };
+
+    bool ReadTrace(const fs::path& path, Trace& trace);
+
+    // イベントをメモリにためて flush() でファイルへ追記する。どのスレッドから呼んでもよい
+    class TraceWriter {
+    public:
+        TraceWriter();
+
+        bool open(const fs::path& path, int64_t startTime);
+        void close();
+        bool isOpen() const { return !m_path.empty(); }
+
+        void input(uint64_t timeMs, uint32_t keys, uint32_t clicks);
+        void command(uint64_t timeMs, uint32_t id);
+        void edit(uint64_t timeMs, uint32_t slot, int32_t delta, uint32_t keyframes);
+        bool flush();
+
+    private:
+        void begin(uint64_t timeMs, EventKind kind);
+
+        std::mutex m_mutex;
+        fs::path m_path;
+        std::vector<uint8_t> m_pending;
+        uint64_t m_lastMs;
+    };
+}
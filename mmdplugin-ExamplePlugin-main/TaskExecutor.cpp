@@ -0,0 +1,159 @@
+﻿#include "TaskExecutor.h"
+#include <algorithm>
+#include <chrono>
+
+namespace {
+    // 今のスレッドがどの TaskExecutor のどのワーカーか（積んだ仕事を自分の deque に置くため）
+    thread_local const TaskExecutor* t_owner = nullptr;
+    thread_local size_t t_queue = 0;
+
+    // parallelFor の1回分。手伝いの仕事は呼び出し元が戻った後に始まることもあるので共有で持つ
+    struct LoopState {
+        std::mutex mutex;
+        std::condition_variable idle;
+        bool closed = false;            // 呼び出し元が待ちに入った。これ以降に始まった手伝いは何もしない
+        size_t active = 0;              // 処理中の手伝いの数
+        std::atomic<size_t> next{ 0 };
+        std::atomic<size_t> done{ 0 };
+        size_t count = 0;
+        const std::function<void(size_t)>* fn = nullptr;
+    };
+
+    void runLoop(LoopState& state, const std::atomic<bool>& cancelled) {
+        for (size_t i = state.next++; i < state.count; i = state.next++) {
+            if (cancelled) {
+                state.next = state.count;
+                break;
+            }
+            (*state.fn)(i);
+            state.done++;
+        }
+    }
+}
+
+TaskExecutor::TaskExecutor() : m_workers(0), m_pending(0), m_stopping(false), m_cancelled(false) {}
+
+TaskExecutor::~TaskExecutor() {
+    stop();
+}
+
+unsigned TaskExecutor::defaultWorkers() {
+    unsigned cores = std::thread::hardware_concurrency();
+    return cores > 1 ? cores - 1 : 1;
+}
+
+void TaskExecutor::start(unsigned workers) {
+    stop();
+    m_stopping = false;
+    m_cancelled = false;
+    m_queues.clear();
+    for (unsigned i = 0; i <= workers; i++) m_queues.emplace_back(new Queue);
+    for (unsigned i = 0; i < workers; i++) m_threads.emplace_back(&TaskExecutor::workerLoop, this, static_cast<size_t>(i + 1));
+    m_workers = workers;
+}
+
+void TaskExecutor::stop() {
+    m_cancelled = true;
+    m_workers = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+        m_stopping = true;
+    }
+    m_wake.notify_all();
+    for (auto& t : m_threads) t.join();
+    m_threads.clear();
+    // 始まらなかった仕事は捨てる（parallelFor の手伝いなら呼び出し元が残りを引き受けている）
+    for (auto& q : m_queues) {
+        std::lock_guard<std::mutex> lock(q->mutex);
+        for (auto& tasks : q->tasks) tasks.clear();
+    }
+    m_pending = 0;
+}
+
+void TaskExecutor::submit(TaskPriority priority, std::function<void()> task) {
+    if (m_cancelled) return;
+    if (m_workers == 0) {
+        task();
+        return;
+    }
+    Queue& queue = *m_queues[t_owner == this ? t_queue : 0];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks[static_cast<int>(priority)].push_back(std::move(task));
+    }
+    m_pending++;
+    std::lock_guard<std::mutex> lock(m_sleepMutex);
+    m_wake.notify_one();
+}
+
+bool TaskExecutor::popFrom(Queue& queue, int priority, bool back, std::function<void()>& task) {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    auto& tasks = queue.tasks[priority];
+    if (tasks.empty()) return false;
+    if (back) {
+        task = std::move(tasks.back());
+        tasks.pop_back();
+    }
+    else {
+        task = std::move(tasks.front());
+        tasks.pop_front();
+    }
+    return true;
+}
+
+bool TaskExecutor::take(size_t self, std::function<void()>& task) {
+    size_t queues = m_queues.size();
+    for (int p = 0; p < PriorityCount; p++) {
+        // 自分の分は新しい順（キャッシュに残っている）、入口と他のワーカーの分は古い順
+        if (popFrom(*m_queues[self], p, true, task)) return true;
+        if (popFrom(*m_queues[0], p, false, task)) return true;
+        for (size_t k = 1; k < queues; k++) {
+            size_t victim = 1 + (self - 1 + k) % (queues - 1);
+            if (victim != self && popFrom(*m_queues[victim], p, false, task)) return true;
+        }
+    }
+    return false;
+}
+
+void TaskExecutor::workerLoop(size_t index) {
+    t_owner = this;
+    t_queue = index;
+    while (!m_stopping) {
+        std::function<void()> task;
+        if (take(index, task)) {
+            m_pending--;
+            task();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_sleepMutex);
+        m_wake.wait_for(lock, std::chrono::milliseconds(50), [this]() { return m_stopping || m_pending > 0; });
+    }
+    t_owner = nullptr;
+}
+
+bool TaskExecutor::parallelFor(size_t count, TaskPriority priority, const std::function<void(size_t)>& fn) {
+    if (count == 0) return !m_cancelled;
+    auto state = std::make_shared<LoopState>();
+    state->count = count;
+    state->fn = &fn;
+
+    size_t helpers = (std::min)(count - 1, static_cast<size_t>(workerCount()));
+    for (size_t h = 0; h < helpers; h++) {
+        submit(priority, [this, state]() {
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                if (state->closed) return;
+                state->active++;
+            }
+            runLoop(*state, m_cancelled);
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (--state->active == 0) state->idle.notify_all();
+        });
+    }
+    runLoop(*state, m_cancelled);
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->closed = true;
+    state->idle.wait(lock, [&]() { return state->active == 0; });
+    return state->done == count;
+}
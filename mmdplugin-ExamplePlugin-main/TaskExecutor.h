@@ -0,0 +1,81 @@
+﻿#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// バックグラウンドの並列処理をまとめて受け持つスレッドプール
+//
+// プラグインでは CPlugin が1つだけ持ち、キーフレームの書き出し・圧縮・復元などの並列処理は
+// すべてここで行う（それぞれがスレッドを作ると、MMD の描画と CPU を取り合う）。
+//   - ワーカーごとに優先度別の deque を持つ。ワーカーが積んだ仕事は自分の deque の末尾から取り、
+//     手の空いたワーカーは共有の入口か他のワーカーの deque の先頭から盗む
+//   - 優先度は Interactive（復元など、人が待っているもの）> Snapshot（バックアップ）> Maintenance
+//     （再圧縮・検証など）の順で、仕事を取るたびに高い方から探す
+//   - parallelFor は呼び出し元も処理に加わり、ワーカーが埋まっていても止まらない。
+//     ワーカーの中から呼んでもよい
+//   - stop() は取り消しを通知して積まれた仕事を捨てる。処理中の parallelFor は次の番号を取る前に
+//     抜けるので、長い処理でもすぐ戻る。start() 前（ワーカーが 0 のとき）は呼び出し元だけで処理する
+
+enum class TaskPriority : uint8_t {
+    Interactive = 0,
+    Snapshot = 1,
+    Maintenance = 2,
+};
+
+class TaskExecutor {
+public:
+    static const int PriorityCount = 3;
+
+    TaskExecutor();
+    ~TaskExecutor();
+
+    TaskExecutor(const TaskExecutor&) = delete;
+    TaskExecutor& operator=(const TaskExecutor&) = delete;
+
+    // workers 個のワーカーを起動する（呼び出し元を含めると workers + 1 並列になる）。
+    // 起動中なら止めてから起動し直す
+    void start(unsigned workers);
+    void stop();
+
+    unsigned workerCount() const { return m_workers; }
+    // 呼び出し元も含めて同時に動けるスレッドの数
+    unsigned concurrency() const { return workerCount() + 1; }
+    // stop() されたか（start() まで true のまま）。長い処理はこれを見て途中で抜ける
+    bool cancelled() const { return m_cancelled; }
+
+    // 仕事を積む。ワーカーが無ければその場で実行し、取り消し後は捨てる
+    void submit(TaskPriority priority, std::function<void()> task);
+
+    // fn(0) ... fn(count - 1) を分け合って行い、終わるまで待つ。取り消されて残りを飛ばしたら false
+    bool parallelFor(size_t count, TaskPriority priority, const std::function<void(size_t)>& fn);
+
+    // CPU の数から1を引いた数（MMD の描画に1つ残す）。最低 1
+    static unsigned defaultWorkers();
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks[PriorityCount];
+    };
+
+    void workerLoop(size_t index);
+    bool take(size_t self, std::function<void()>& task);
+    bool popFrom(Queue& queue, int priority, bool back, std::function<void()>& task);
+
+    // [0] は共有の入口、[1 + i] はワーカー i のもの
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::thread> m_threads;
+    std::atomic<unsigned> m_workers;    // 他のスレッドからも読むので m_threads とは別に持つ
+    std::atomic<size_t> m_pending;
+    std::atomic<bool> m_stopping;
+    std::atomic<bool> m_cancelled;
+    std::mutex m_sleepMutex;
+    std::condition_variable m_wake;
+};
@@ -0,0 +1,131 @@
+﻿#include "Thumbnail.h"
+#include <cstring>
+#include <utility>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define THUMB_SSE2 1
+#endif
+
+namespace thumb {
+
+namespace {
+    // 出力の x 画素目から行の終わりまで
+    void halveRow(const uint8_t* r0, const uint8_t* r1, uint8_t* d, int x, int width) {
+        for (; x < width; x++) {
+            const uint8_t* p0 = r0 + x * 8;
+            const uint8_t* p1 = r1 + x * 8;
+            for (int c = 0; c < 4; c++) {
+                d[x * 4 + c] = static_cast<uint8_t>((p0[c] + p0[c + 4] + p1[c] + p1[c + 4] + 2) >> 2);
+            }
+        }
+    }
+}
+
+void Halve(const uint8_t* src, int width, int height, size_t srcStride, Image& dst) {
+    dst.width = width / 2;
+    dst.height = height / 2;
+    dst.pixels.resize(dst.stride() * dst.height);
+
+    for (int y = 0; y < dst.height; y++) {
+        const uint8_t* r0 = src + srcStride * (y * 2);
+        const uint8_t* r1 = r0 + srcStride;
+        uint8_t* d = dst.pixels.data() + dst.stride() * y;
+        int x = 0;
+#ifdef THUMB_SSE2
+        // 入力8画素（上下2行）から出力4画素。16bit に広げて足し、+2 して 4 で割る
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i round = _mm_set1_epi16(2);
+        for (; x + 4 <= dst.width; x += 4) {
+            __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r0 + x * 8));
+            __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r0 + x * 8 + 16));
+            __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r1 + x * 8));
+            __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r1 + x * 8 + 16));
+            // 縦に足す（各レジスタは隣り合う2画素分）
+            __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+            __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+            __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+            __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+            // 横に足す（下位64bitに結果）
+            s0 = _mm_add_epi16(s0, _mm_srli_si128(s0, 8));
+            s1 = _mm_add_epi16(s1, _mm_srli_si128(s1, 8));
+            s2 = _mm_add_epi16(s2, _mm_srli_si128(s2, 8));
+            s3 = _mm_add_epi16(s3, _mm_srli_si128(s3, 8));
+            __m128i p01 = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(s0, s1), round), 2);
+            __m128i p23 = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(s2, s3), round), 2);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + x * 4), _mm_packus_epi16(p01, p23));
+        }
+#endif
+        halveRow(r0, r1, d, x, dst.width);
+    }
+}
+
+void HalveScalar(const uint8_t* src, int width, int height, size_t srcStride, Image& dst) {
+    dst.width = width / 2;
+    dst.height = height / 2;
+    dst.pixels.resize(dst.stride() * dst.height);
+    for (int y = 0; y < dst.height; y++) {
+        const uint8_t* r0 = src + srcStride * (y * 2);
+        halveRow(r0, r0 + srcStride, dst.pixels.data() + dst.stride() * y, 0, dst.width);
+    }
+}
+
+void Downscale(const uint8_t* src, int width, int height, size_t srcStride, int levels, Image& dst) {
+    Image scratch;
+    Downscale(src, width, height, srcStride, levels, dst, scratch);
+}
+
+void Downscale(const uint8_t* src, int width, int height, size_t srcStride, int levels, Image& dst, Image& scratch) {
+    if (levels <= 0) {
+        dst.width = width;
+        dst.height = height;
+        dst.pixels.resize(dst.stride() * height);
+        for (int y = 0; y < height; y++) memcpy(dst.pixels.data() + dst.stride() * y, src + srcStride * y, dst.stride());
+        return;
+    }
+    Halve(src, width, height, srcStride, dst);
+    for (int i = 1; i < levels && dst.width >= 2 && dst.height >= 2; i++) {
+        Halve(dst.pixels.data(), dst.width, dst.height, dst.stride(), scratch);
+        std::swap(dst, scratch);
+    }
+}
+
+void EncodeBmp(const Image& image, std::vector<uint8_t>& out) {
+    const uint32_t rowSize = (static_cast<uint32_t>(image.width) * 3 + 3) & ~3u;
+    const uint32_t dataSize = rowSize * static_cast<uint32_t>(image.height);
+    const uint32_t headerSize = 14 + 40;
+    out.assign(headerSize + dataSize, 0);
+
+    auto put16 = [&](size_t pos, uint16_t v) { memcpy(&out[pos], &v, 2); };
+    auto put32 = [&](size_t pos, uint32_t v) { memcpy(&out[pos], &v, 4); };
+    out[0] = 'B';
+    out[1] = 'M';
+    put32(2, headerSize + dataSize);
+    put32(10, headerSize);
+    put32(14, 40);
+    put32(18, static_cast<uint32_t>(image.width));
+    put32(22, static_cast<uint32_t>(image.height));  // 正の値は下から上
+    put16(26, 1);
+    put16(28, 24);
+    put32(34, dataSize);
+    put32(38, 2835);    // 72dpi
+    put32(42, 2835);
+
+    for (int y = 0; y < image.height; y++) {
+        const uint8_t* s = image.pixels.data() + image.stride() * (image.height - 1 - y);
+        uint8_t* d = &out[headerSize + rowSize * y];
+        for (int x = 0; x < image.width; x++) {
+            d[x * 3 + 0] = s[x * 4 + 0];
+            d[x * 3 + 1] = s[x * 4 + 1];
+            d[x * 3 + 2] = s[x * 4 + 2];
+        }
+    }
+}
+
+bool BmpWriter::write(const Image& captured, int levels, const NativePath& path) {
+    Downscale(captured.pixels.data(), captured.width, captured.height, captured.stride(), levels, m_small, m_scratch);
+    EncodeBmp(m_small, m_bmp);
+    return NativeWrite(path, m_bmp.data(), m_bmp.size());
+}
+
+}
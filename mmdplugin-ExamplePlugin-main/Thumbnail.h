@@ -0,0 +1,42 @@
+﻿#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "BackupIo.h"
+
+// サムネイル用の画像処理（D3D に依存しないので単体で試せる）
+// 画素はすべて BGRA 8bit（D3DFMT_A8R8G8B8 / X8R8G8B8 のメモリ上の並び）
+
+namespace thumb {
+    struct Image {
+        int width = 0;
+        int height = 0;
+        std::vector<uint8_t> pixels;    // 行間の詰め物なし（stride = width * 4）
+
+        size_t stride() const { return static_cast<size_t>(width) * 4; }
+    };
+
+    // 2x2 の平均で縦横半分にする。奇数の端の行・列は捨てる
+    void Halve(const uint8_t* src, int width, int height, size_t srcStride, Image& dst);
+    // Halve と同じ結果を SSE2 を使わずに出す（BackupTool thumbcheck の比較用）
+    void HalveScalar(const uint8_t* src, int width, int height, size_t srcStride, Image& dst);
+
+    // levels 回だけ半分にする（0 ならそのまま詰め直す）
+    void Downscale(const uint8_t* src, int width, int height, size_t srcStride, int levels, Image& dst);
+    // 途中の段に scratch を使う版（dst と scratch を使い回せば、同じ大きさなら確保しない）
+    void Downscale(const uint8_t* src, int width, int height, size_t srcStride, int levels, Image& dst, Image& scratch);
+
+    // 24bit の BMP にする（アルファは捨てる）
+    void EncodeBmp(const Image& image, std::vector<uint8_t>& out);
+
+    // 読み戻した画像を縮小して BMP で書く。作業領域を持ち続けるので、同じ大きさなら2回目からは確保しない
+    class BmpWriter {
+    public:
+        bool write(const Image& captured, int levels, const NativePath& path);
+
+    private:
+        Image m_small;
+        Image m_scratch;
+        std::vector<uint8_t> m_bmp;
+    };
+}
@@ -0,0 +1,152 @@
+﻿#include "stdafx.h"
+#include "ThumbnailCapture.h"
+#include <cstring>
+#include <utility>
+
+ThumbnailCapture::ThumbnailCapture()
+    : m_state(State::Idle), m_hasReady(false), m_resolve(nullptr), m_target(nullptr), m_readback(nullptr),
+    m_query(nullptr), m_backWidth(0), m_backHeight(0), m_format(D3DFMT_X8R8G8B8) {}
+
+// D3D のリソースはデバイスより先に解放する必要があるので、ここではなく onReset() で解放する
+ThumbnailCapture::~ThumbnailCapture() {}
+
+void ThumbnailCapture::request(const NativePath& savePath) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // 読み戻し中の画像は m_requestPath に保存するので、書き換えずに次の分として待たせる
+    if (m_state == State::Copying) {
+        m_queuedPath = savePath;
+        return;
+    }
+    m_requestPath = savePath;
+    m_state = State::Requested;
+}
+
+void ThumbnailCapture::release() {
+    if (m_resolve) m_resolve->Release();
+    if (m_target) m_target->Release();
+    if (m_readback) m_readback->Release();
+    if (m_query) m_query->Release();
+    m_resolve = m_target = m_readback = nullptr;
+    m_query = nullptr;
+    m_backWidth = m_backHeight = 0;
+}
+
+void ThumbnailCapture::onReset() {
+    release();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // 縮小済みの内容は失われるので、予約からやり直す
+    if (m_state == State::Copying) m_state = State::Requested;
+}
+
+bool ThumbnailCapture::ensureSurfaces(IDirect3DDevice9* device, const D3DSURFACE_DESC& backDesc) {
+    bool multisampled = backDesc.MultiSampleType != D3DMULTISAMPLE_NONE;
+    if (m_target && m_backWidth == backDesc.Width && m_backHeight == backDesc.Height && m_format == backDesc.Format &&
+        (m_resolve != nullptr) == multisampled) {
+        return true;
+    }
+    release();
+
+    UINT height = (Width * backDesc.Height + backDesc.Width / 2) / backDesc.Width;
+    if (height < 1) height = 1;
+    UINT targetWidth = Width << CpuLevels;
+    UINT targetHeight = height << CpuLevels;
+    bool ok = SUCCEEDED(device->CreateRenderTarget(targetWidth, targetHeight, backDesc.Format, D3DMULTISAMPLE_NONE, 0, FALSE, &m_target, nullptr)) &&
+        SUCCEEDED(device->CreateOffscreenPlainSurface(targetWidth, targetHeight, backDesc.Format, D3DPOOL_SYSTEMMEM, &m_readback, nullptr)) &&
+        SUCCEEDED(device->CreateQuery(D3DQUERYTYPE_EVENT, &m_query));
+    // マルチサンプルのサーフェスからは縮小コピーできないので、先に等倍で解決する
+    if (ok && multisampled) {
+        ok = SUCCEEDED(device->CreateRenderTarget(backDesc.Width, backDesc.Height, backDesc.Format, D3DMULTISAMPLE_NONE, 0, FALSE, &m_resolve, nullptr));
+    }
+    if (!ok) {
+        release();
+        return false;
+    }
+    m_backWidth = backDesc.Width;
+    m_backHeight = backDesc.Height;
+    m_format = backDesc.Format;
+    return true;
+}
+
+bool ThumbnailCapture::onPresent(IDirect3DDevice9* device) {
+    if (!device) return false;
+    State state;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        state = m_state;
+    }
+    if (state == State::Idle) return false;
+
+    if (state == State::Requested) {
+        // GPU に縮小を積んでクエリを発行するだけで、完了は待たない
+        IDirect3DSurface9* back = nullptr;
+        if (FAILED(device->GetBackBuffer(0, 0, D3DBACKBUFFER_TYPE_MONO, &back))) return true;
+        D3DSURFACE_DESC desc;
+        bool ok = SUCCEEDED(back->GetDesc(&desc)) &&
+            (desc.Format == D3DFMT_X8R8G8B8 || desc.Format == D3DFMT_A8R8G8B8) &&
+            ensureSurfaces(device, desc);
+        if (ok) {
+            IDirect3DSurface9* source = back;
+            if (m_resolve) {
+                ok = SUCCEEDED(device->StretchRect(back, nullptr, m_resolve, nullptr, D3DTEXF_NONE));
+                source = m_resolve;
+            }
+            ok = ok && SUCCEEDED(device->StretchRect(source, nullptr, m_target, nullptr, D3DTEXF_LINEAR)) &&
+                SUCCEEDED(m_query->Issue(D3DISSUE_END));
+        }
+        back->Release();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_state = ok ? State::Copying : State::Idle;
+        return true;
+    }
+
+    // 縮小が終わるまでは毎フレーム確認だけする（D3DGETDATA_FLUSH を付けないので待たない）
+    HRESULT hr = m_query->GetData(nullptr, 0, 0);
+    if (hr == S_FALSE) return false;
+
+    thumb::Image& image = m_copy;
+    bool ok = SUCCEEDED(hr) && SUCCEEDED(device->GetRenderTargetData(m_target, m_readback));
+    D3DSURFACE_DESC desc;
+    D3DLOCKED_RECT locked;
+    if (ok && SUCCEEDED(m_readback->GetDesc(&desc)) && SUCCEEDED(m_readback->LockRect(&locked, nullptr, D3DLOCK_READONLY))) {
+        image.width = static_cast<int>(desc.Width);
+        image.height = static_cast<int>(desc.Height);
+        image.pixels.resize(image.stride() * image.height);
+        for (int y = 0; y < image.height; y++) {
+            memcpy(image.pixels.data() + image.stride() * y, static_cast<const uint8_t*>(locked.pBits) + static_cast<size_t>(locked.Pitch) * y, image.stride());
+        }
+        m_readback->UnlockRect();
+    }
+    else {
+        ok = false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (ok) {
+        std::swap(m_ready, m_copy);
+        m_readyPath = m_requestPath;
+        m_hasReady = true;
+    }
+    if (!m_queuedPath.empty()) {
+        m_requestPath = m_queuedPath;
+        m_queuedPath.clear();
+        m_state = State::Requested;
+    }
+    else {
+        m_state = State::Idle;
+    }
+    return true;
+}
+
+bool ThumbnailCapture::take(thumb::Image& image, NativePath& savePath) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_hasReady) return false;
+    std::swap(image, m_ready);
+    savePath = m_readyPath;
+    m_hasReady = false;
+    return true;
+}
+
+bool ThumbnailCapture::save(const thumb::Image& captured, const NativePath& path) {
+    return m_writer.write(captured, CpuLevels, path);
+}
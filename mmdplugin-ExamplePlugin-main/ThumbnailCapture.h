@@ -0,0 +1,63 @@
+﻿#pragma once
+#include "stdafx.h"
+#include <mutex>
+#include "Thumbnail.h"
+
+// バックアップのサムネイルをビューポートから取る
+//
+// request() の後の Present で、バックバッファを縮小用のレンダーターゲットへ StretchRect し、
+// イベントクエリを発行するだけで戻る。以降の Present でクエリが終わっていたら（待たずに確認する）
+// GetRenderTargetData でシステムメモリへ読み戻す。GPU の完了を待たないのでフレームは止まらない。
+// 最後の縮小と書き出しは take() で受け取ったワーカースレッドが行う。
+// 画像のバッファは描画スレッドとワーカースレッドの間で交換して使い回し、温まった後は確保しない。
+class ThumbnailCapture {
+public:
+    // 出力の幅。GPU ではこの 1 << CpuLevels 倍まで縮め、残りは CPU で 2x2 平均を重ねる
+    static const int Width = 192;
+    static const int CpuLevels = 2;
+
+    ThumbnailCapture();
+    ~ThumbnailCapture();
+
+    // 次の Present で取り、savePath に保存するよう予約する（どのスレッドからでもよい）。
+    // 読み戻し中なら、それが終わってから取る（待てるのは1つで、新しい予約で置き換える）
+    void request(const NativePath& savePath);
+
+    // 描画スレッドから毎フレーム呼ぶ。何か D3D の処理をしたら true
+    bool onPresent(IDirect3DDevice9* device);
+    // デバイスのリセット前に D3DPOOL_DEFAULT のリソースを解放する
+    void onReset();
+
+    // 読み戻し済みの画像があれば受け取る（縮小前）。image の元の中身は次の読み戻しに使う
+    bool take(thumb::Image& image, NativePath& savePath);
+
+    // 縮小して BMP で保存する（take() と同じワーカースレッドから呼ぶ）
+    bool save(const thumb::Image& captured, const NativePath& path);
+
+private:
+    enum class State { Idle, Requested, Copying };
+
+    bool ensureSurfaces(IDirect3DDevice9* device, const D3DSURFACE_DESC& backDesc);
+    void release();
+
+    std::mutex m_mutex;
+    State m_state;
+    NativePath m_requestPath;   // 取っている最中の画像の保存先
+    NativePath m_queuedPath;    // 読み戻し中に来た次の予約
+    NativePath m_readyPath;
+    thumb::Image m_ready;
+    bool m_hasReady;
+
+    // ワーカースレッドだけが触る
+    thumb::BmpWriter m_writer;
+
+    // 描画スレッドだけが触る
+    IDirect3DSurface9* m_resolve;   // マルチサンプルのバックバッファを解決する等倍のターゲット
+    IDirect3DSurface9* m_target;    // 縮小先
+    IDirect3DSurface9* m_readback;  // システムメモリ
+    IDirect3DQuery9* m_query;
+    thumb::Image m_copy;            // 読み戻し先。m_ready と交換する
+    UINT m_backWidth;
+    UINT m_backHeight;
+    D3DFORMAT m_format;
+};
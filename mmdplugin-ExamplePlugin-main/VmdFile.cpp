@@ -0,0 +1,90 @@
+﻿#include "VmdFile.h"
+#include "BackupFormat.h"
+#include <fstream>
+
+const char* const VmdCameraModelName = "\x83\x4A\x83\x81\x83\x89\x81\x45\x8F\xC6\x96\xBE";
+
+namespace {
+    // 固定長の名前欄。途中で切れる場合も2バイト文字の途中では切らない
+    void fixedName(ByteWriter& w, const std::string& name, size_t size) {
+        size_t n = 0;
+        while (n < name.size() && name[n] != '\0') {
+            uint8_t c = static_cast<uint8_t>(name[n]);
+            size_t len = ((c >= 0x81 && c <= 0x9F) || (c >= 0xE0 && c <= 0xFC)) ? 2 : 1;
+            if (n + len > size) break;
+            n += len;
+        }
+        w.raw(name.data(), n);
+        for (size_t i = n; i < size; i++) w.u8(0);
+    }
+}
+
+void VmdMakeBoneInterpolation(const uint8_t x1[4], const uint8_t y1[4], const uint8_t x2[4], const uint8_t y2[4], uint8_t out[64]) {
+    // 1行目は X,Y,Z,回転 の順に x1, y1, x2, y2。残りの3行は MMD と同じく1バイトずつずらした複製
+    uint8_t row[16];
+    for (int i = 0; i < 4; i++) {
+        row[i] = x1[i];
+        row[4 + i] = y1[i];
+        row[8 + i] = x2[i];
+        row[12 + i] = y2[i];
+    }
+    const uint8_t pad[3] = { 1, 0, 0 };
+    for (int k = 0; k < 4; k++) {
+        for (int j = 0; j < 16; j++) {
+            out[k * 16 + j] = j + k < 16 ? row[j + k] : pad[j + k - 16];
+        }
+    }
+}
+
+bool WriteVmd(const fs::path& path, const VmdMotion& motion) {
+    std::vector<uint8_t> data;
+    ByteWriter w(data);
+    fixedName(w, "Vocaloid Motion Data 0002", 30);
+    fixedName(w, motion.modelName, 20);
+
+    w.u32(static_cast<uint32_t>(motion.bones.size()));
+    for (const auto& f : motion.bones) {
+        fixedName(w, f.name, 15);
+        w.u32(f.frame);
+        for (float v : f.position) w.f32(v);
+        for (float v : f.rotation) w.f32(v);
+        w.raw(f.interpolation, sizeof(f.interpolation));
+    }
+
+    w.u32(static_cast<uint32_t>(motion.morphs.size()));
+    for (const auto& f : motion.morphs) {
+        fixedName(w, f.name, 15);
+        w.u32(f.frame);
+        w.f32(f.weight);
+    }
+
+    w.u32(static_cast<uint32_t>(motion.cameras.size()));
+    for (const auto& f : motion.cameras) {
+        w.u32(f.frame);
+        w.f32(f.distance);
+        for (float v : f.position) w.f32(v);
+        for (float v : f.rotation) w.f32(v);
+        w.raw(f.interpolation, sizeof(f.interpolation));
+        w.u32(f.viewAngle);
+        w.u8(f.perspectiveOff);
+    }
+
+    w.u32(0);   // 照明
+    w.u32(0);   // セルフ影
+
+    w.u32(static_cast<uint32_t>(motion.showIk.size()));
+    for (const auto& f : motion.showIk) {
+        w.u32(f.frame);
+        w.u8(f.show);
+        w.u32(static_cast<uint32_t>(f.ik.size()));
+        for (const auto& ik : f.ik) {
+            fixedName(w, ik.name, 20);
+            w.u8(ik.enabled);
+        }
+    }
+
+    std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) return false;
+    out.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+    return static_cast<bool>(out);
+}
@@ -0,0 +1,61 @@
+﻿#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <experimental/filesystem>
+
+namespace fs = std::experimental::filesystem;
+
+// VMD（モーションデータ）の書き出し
+// 名前はすべて MMD 内部と同じ Shift-JIS のバイト列のまま扱う
+
+struct VmdBoneFrame {
+    std::string name;           // 最大15バイト
+    uint32_t frame = 0;
+    float position[3] = {};
+    float rotation[4] = { 0, 0, 0, 1 };  // クォータニオン x, y, z, w
+    uint8_t interpolation[64] = {};
+};
+
+struct VmdMorphFrame {
+    std::string name;           // 最大15バイト
+    uint32_t frame = 0;
+    float weight = 0;
+};
+
+struct VmdCameraFrame {
+    uint32_t frame = 0;
+    float distance = 0;
+    float position[3] = {};
+    float rotation[3] = {};
+    uint8_t interpolation[24] = {};     // x, y, z, 回転, 距離, 視野角 の順に (ax, bx, ay, by)
+    uint32_t viewAngle = 30;
+    uint8_t perspectiveOff = 0;         // 0=パースON
+};
+
+struct VmdIkState {
+    std::string name;           // 最大20バイト
+    uint8_t enabled = 1;
+};
+
+struct VmdShowIkFrame {
+    uint32_t frame = 0;
+    uint8_t show = 1;
+    std::vector<VmdIkState> ik;
+};
+
+struct VmdMotion {
+    std::string modelName;      // 最大20バイト。カメラは VmdCameraModelName
+    std::vector<VmdBoneFrame> bones;
+    std::vector<VmdMorphFrame> morphs;
+    std::vector<VmdCameraFrame> cameras;
+    std::vector<VmdShowIkFrame> showIk;
+};
+
+// カメラ・照明用のモデル名（Shift-JIS で "カメラ・照明"）
+extern const char* const VmdCameraModelName;
+
+// MMD 内部の4点（X, Y, Z, 回転 ごとの x1, y1, x2, y2）から VMD の64バイト補間データを作る
+void VmdMakeBoneInterpolation(const uint8_t x1[4], const uint8_t y1[4], const uint8_t x2[4], const uint8_t y2[4], uint8_t out[64]);
+
+bool WriteVmd(const fs::path& path, const VmdMotion& motion);